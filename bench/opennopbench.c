@@ -0,0 +1,884 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+#include <netinet/ip.h> // for tcpmagic and TCP options
+#include <netinet/tcp.h> // for tcpmagic and TCP options
+#include <linux/types.h>
+
+#include "opennopd.h"
+#include "sessionmanager.h"
+#include "queuemanager.h"
+#include "memorymanager.h"
+#include "compression.h"
+#include "codec.h"
+#include "csum.h"
+#include "tcpoptions.h"
+#include "worker.h"
+#include "ipc.h"
+#include "rcu.h"
+
+#define BENCHRUNS 5 // Runs of each case, the median is reported.
+#define BENCHMAXRUNS 101
+#define BENCHMILLISECONDS 100 // Shortest run of a case.
+#define BENCHSESSIONS 262144 // Most sessions in the table.
+#define BENCHMINSESSIONS 1024 // Fewest sessions in the table, each fill is 4 times the last.
+#define BENCHWORKERS 4 // Workers the session table is sharded for.
+#define BENCHLOOKUPS 65536 // Lookups cycle through this many sessions, must be a power of 2.
+#define BENCHPRODUCERS 4 // Most threads queueing packets at once.
+#define BENCHINFLIGHT 256 // Packets each producer has queued or waiting to be returned.
+#define BENCHBURST 256 // Buffers taken before any is returned.
+#define BENCHMSS 1460 // Payload of a full packet.
+#define BENCHCORPUS (4 * 1024 * 1024) // Bytes of each generated corpus.
+#define BENCHMAXRESULTS 256
+
+/*
+ * The daemon's globals, opennopd.c is not linked in.
+ * Logs go to syslog so only the results go to stdout.
+ */
+int servicestate = RUNNING;
+int isdaemon = true;
+
+/*
+ * One measured case.
+ * params holds the JSON members that tell cases of a benchmark apart.
+ */
+struct bench_result {
+	const char *name;
+	char params[160];
+	__u64 operations; // Operations in each run.
+	double nsperop; // Median of the runs.
+	double mbps; // Megabytes a second, 0 if the case has no bytes.
+	double ratio; // Compressed size to original size, 0 if it does not apply.
+};
+
+typedef void (*bench_function)(void *data, __u64 operations);
+
+struct tuple {
+	__u32 largerip;
+	__u16 largerport;
+	__u32 smallerip;
+	__u16 smallerport;
+};
+
+struct session_bench {
+	struct tuple *tuples;
+	__u32 lookups[BENCHLOOKUPS]; // Indexes into tuples.
+};
+
+struct queue_bench {
+	struct packet_head queue; // Packets from the producers to the consumer.
+	struct packet_head returns[BENCHPRODUCERS]; // Packets back to each producer.
+	int producers;
+};
+
+struct queue_producer {
+	struct queue_bench *bench;
+	pthread_t thread;
+	int index;
+	__u64 operations;
+};
+
+struct packet_bench {
+	__u8 *packet;
+	__u8 *original;
+	int length;
+};
+
+struct corpus {
+	char *name;
+	__u8 *data;
+	size_t size;
+};
+
+static struct bench_result results[BENCHMAXRESULTS];
+static int numresults = 0;
+static int benchruns = BENCHRUNS;
+static int benchms = BENCHMILLISECONDS;
+static volatile __u64 bench_sink = 0; // Keeps results the compiler could throw away.
+
+static void print_usage(char *name) {
+	printf("Usage: %s [-r runs] [-t milliseconds] [-s sessions] [-w workers] [-o output.json] [corpus ...]\n", name);
+	printf("  Options:\n");
+	printf("      -r Runs of each case, the median is reported, default %i.\n", BENCHRUNS);
+	printf("      -t Shortest run of a case in milliseconds, default %i.\n", BENCHMILLISECONDS);
+	printf("      -s Most sessions in the table, default %i.\n", BENCHSESSIONS);
+	printf("      -w Workers the session table is sharded for, default %i.\n", BENCHWORKERS);
+	printf("      -o Write the JSON results to a file instead of stdout.\n");
+	printf("      -h Show this help screen.\n");
+	printf("  Files given are compressed in %i byte packets, text and random\n", BENCHMSS);
+	printf("  data are generated when none are.\n");
+	printf("\n");
+}
+
+static __u64 bench_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((__u64)now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+static __u64 bench_random(__u64 *state) {
+	*state ^= *state << 13;
+	*state ^= *state >> 7;
+	*state ^= *state << 17;
+	return *state;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+
+	return (x > y) - (x < y);
+}
+
+static struct bench_result *new_result(const char *name) {
+	struct bench_result *result;
+
+	if (numresults == BENCHMAXRESULTS) {
+		fprintf(stderr, "Bench: Too many results.\n");
+		exit(EXIT_FAILURE);
+	}
+	result = &results[numresults++];
+	memset(result, 0, sizeof(struct bench_result));
+	result->name = name;
+	return result;
+}
+
+/*
+ * Doubles the operations until a run takes benchms and
+ * saves the median time per operation of benchruns runs that long.
+ */
+static void measure(struct bench_result *result, bench_function function, void *data) {
+	double samples[BENCHMAXRUNS];
+	__u64 operations = 1;
+	__u64 start;
+	int i;
+
+	do {
+		operations *= 2;
+		start = bench_now();
+		function(data, operations);
+	} while ((bench_now() - start < (__u64)benchms * 1000000ULL) && (operations < (1ULL << 40)));
+
+	for (i = 0; i < benchruns; i++) {
+		start = bench_now();
+		function(data, operations);
+		samples[i] = (double)(bench_now() - start) / operations;
+	}
+	qsort(samples, benchruns, sizeof(double), compare_doubles);
+	result->operations = operations;
+	result->nsperop = samples[benchruns / 2];
+}
+
+/*
+ * An IPv4 TCP packet with no options from port 40000 to 80.
+ */
+static int build_packet(__u8 *packet, const __u8 *payload, int payloadlength) {
+	struct iphdr *iph = (struct iphdr *)packet;
+	struct tcphdr *tcph = (struct tcphdr *)(packet + sizeof(struct iphdr));
+	int length = sizeof(struct iphdr) + sizeof(struct tcphdr) + payloadlength;
+
+	memset(packet, 0, sizeof(struct iphdr) + sizeof(struct tcphdr));
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->tot_len = htons(length);
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_TCP;
+	iph->saddr = inet_addr("10.0.1.2");
+	iph->daddr = inet_addr("10.0.2.2");
+	tcph->source = htons(40000);
+	tcph->dest = htons(80);
+	tcph->seq = htonl(1000);
+	tcph->ack_seq = htonl(2000);
+	tcph->doff = 5;
+	tcph->ack = 1;
+	tcph->psh = 1;
+	tcph->window = htons(65535);
+	memcpy(packet + sizeof(struct iphdr) + sizeof(struct tcphdr), payload, payloadlength);
+	checksum(packet);
+	return length;
+}
+
+static int payload_length(const __u8 *packet) {
+	const struct iphdr *iph = (const struct iphdr *)packet;
+	const struct tcphdr *tcph = (const struct tcphdr *)(packet + iph->ihl * 4);
+
+	return ntohs(iph->tot_len) - (iph->ihl * 4) - (tcph->doff * 4);
+}
+
+static const __u8 *payload_data(const __u8 *packet) {
+	const struct iphdr *iph = (const struct iphdr *)packet;
+	const struct tcphdr *tcph = (const struct tcphdr *)(packet + iph->ihl * 4);
+
+	return packet + (iph->ihl * 4) + (tcph->doff * 4);
+}
+
+static void bench_sessionhash(void *data, __u64 operations) {
+	struct session_bench *bench = data;
+	struct tuple *thistuple;
+	__u32 hash = 0;
+	__u64 i;
+
+	for (i = 0; i < operations; i++) {
+		thistuple = &bench->tuples[bench->lookups[i & (BENCHLOOKUPS - 1)]];
+		hash ^= sessionhash(thistuple->largerip, thistuple->largerport,
+				thistuple->smallerip, thistuple->smallerport);
+	}
+	bench_sink += hash;
+}
+
+static void bench_getsession(void *data, __u64 operations) {
+	struct session_bench *bench = data;
+	struct tuple *thistuple;
+	__u64 found = 0;
+	__u64 i;
+
+	for (i = 0; i < operations; i++) {
+		thistuple = &bench->tuples[bench->lookups[i & (BENCHLOOKUPS - 1)]];
+
+		if (getsession(thistuple->largerip, thistuple->largerport,
+				thistuple->smallerip, thistuple->smallerport) != NULL) {
+			found++;
+		}
+	}
+	bench_sink += found;
+}
+
+/*
+ * Looks sessions up in a table filled to 4 times more sessions each step.
+ * Misses use tuples past the ones that were inserted.
+ */
+static void run_session_benchmarks(__u32 maxsessions) {
+	struct session_bench *bench;
+	struct bench_result *result;
+	__u64 seed = 0x9e3779b97f4a7c15ULL;
+	__u32 inserted = 0;
+	__u32 fill, i;
+
+	bench = calloc(1, sizeof(struct session_bench));
+	bench->tuples = calloc(maxsessions + BENCHLOOKUPS, sizeof(struct tuple));
+
+	if ((bench == NULL) || (bench->tuples == NULL)) {
+		fprintf(stderr, "Bench: Couldn't allocate the session tuples.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < maxsessions + BENCHLOOKUPS; i++) {
+		sort_sockets(&bench->tuples[i].largerip, &bench->tuples[i].largerport,
+				&bench->tuples[i].smallerip, &bench->tuples[i].smallerport,
+				(__u32)bench_random(&seed), (__u16)bench_random(&seed),
+				(__u32)bench_random(&seed), (__u16)bench_random(&seed));
+	}
+
+	for (i = 0; i < BENCHLOOKUPS; i++) {
+		bench->lookups[i] = bench_random(&seed) % maxsessions;
+	}
+	result = new_result("sessionhash");
+	measure(result, bench_sessionhash, bench);
+
+	for (fill = BENCHMINSESSIONS; fill <= maxsessions; fill *= 4) {
+
+		for (; inserted < fill; inserted++) {
+
+			if (insertsession(bench->tuples[inserted].largerip, bench->tuples[inserted].largerport,
+					bench->tuples[inserted].smallerip, bench->tuples[inserted].smallerport) == NULL) {
+				fprintf(stderr, "Bench: Couldn't insert session %u.\n", inserted);
+				exit(EXIT_FAILURE);
+			}
+			rcu_quiescent_state(); // Lets tables replaced by a grow be freed.
+		}
+
+		for (i = 0; i < BENCHLOOKUPS; i++) {
+			bench->lookups[i] = bench_random(&seed) % fill;
+		}
+		result = new_result("getsession");
+		snprintf(result->params, sizeof(result->params), "\"sessions\": %u, \"lookup\": \"hit\"", fill);
+		measure(result, bench_getsession, bench);
+
+		for (i = 0; i < BENCHLOOKUPS; i++) {
+			bench->lookups[i] = maxsessions + i;
+		}
+		result = new_result("getsession");
+		snprintf(result->params, sizeof(result->params), "\"sessions\": %u, \"lookup\": \"miss\"", fill);
+		measure(result, bench_getsession, bench);
+	}
+}
+
+static void *queue_producer_function(void *data) {
+	struct queue_producer *producer = data;
+	struct queue_bench *bench = producer->bench;
+	struct packet *thispacket;
+	__u64 i = 0;
+
+	while (i < producer->operations) {
+		thispacket = dequeue_packet(&bench->returns[producer->index], true);
+
+		if (thispacket != NULL) {
+			queue_packet(&bench->queue, thispacket);
+			i++;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Each producer queues packets to one consumer that sends them back.
+ * Every packet is queued and dequeued twice, once each way.
+ */
+static void bench_queue(void *data, __u64 operations) {
+	struct queue_bench *bench = data;
+	struct queue_producer producers[BENCHPRODUCERS];
+	struct packet *thispacket;
+	__u64 i = 0;
+	int p;
+
+	for (p = 0; p < bench->producers; p++) {
+		producers[p].bench = bench;
+		producers[p].index = p;
+		producers[p].operations = operations / bench->producers;
+
+		if (p == 0) {
+			producers[p].operations += operations % bench->producers;
+		}
+		pthread_create(&producers[p].thread, NULL, queue_producer_function, &producers[p]);
+	}
+
+	while (i < operations) {
+		thispacket = dequeue_packet(&bench->queue, true);
+
+		if (thispacket != NULL) {
+			queue_packet(&bench->returns[thispacket->id], thispacket);
+			i++;
+		}
+	}
+
+	for (p = 0; p < bench->producers; p++) {
+		pthread_join(producers[p].thread, NULL);
+	}
+}
+
+static void initialize_queue(struct packet_head *queue) {
+	memset(queue, 0, sizeof(struct packet_head));
+	pthread_cond_init(&queue->signal, NULL);
+	pthread_mutex_init(&queue->lock, NULL);
+}
+
+static void run_queue_benchmarks(void) {
+	struct queue_bench *bench;
+	struct bench_result *result;
+	struct packet *packets;
+	int producers, p, i;
+
+	bench = calloc(1, sizeof(struct queue_bench));
+	packets = aligned_alloc(64, sizeof(struct packet) * BENCHPRODUCERS * BENCHINFLIGHT);
+
+	if ((bench == NULL) || (packets == NULL)) {
+		fprintf(stderr, "Bench: Couldn't allocate the queued packets.\n");
+		exit(EXIT_FAILURE);
+	}
+	memset(packets, 0, sizeof(struct packet) * BENCHPRODUCERS * BENCHINFLIGHT);
+	initialize_queue(&bench->queue);
+
+	for (p = 0; p < BENCHPRODUCERS; p++) {
+		initialize_queue(&bench->returns[p]);
+
+		for (i = 0; i < BENCHINFLIGHT; i++) {
+			packets[(p * BENCHINFLIGHT) + i].id = p; // The producer it goes back to.
+			queue_packet(&bench->returns[p], &packets[(p * BENCHINFLIGHT) + i]);
+		}
+	}
+
+	for (producers = 1; producers <= BENCHPRODUCERS; producers *= 2) {
+		bench->producers = producers;
+		result = new_result("queue_packet_dequeue_packet");
+		snprintf(result->params, sizeof(result->params), "\"producers\": %i, \"inflight\": %i",
+				producers, BENCHINFLIGHT);
+		measure(result, bench_queue, bench);
+	}
+}
+
+static void bench_buffer_pair(void *data, __u64 operations) {
+	__u64 i;
+
+	(void)data;
+
+	for (i = 0; i < operations; i++) {
+		put_freepacket_buffer(get_freepacket_buffer());
+	}
+}
+
+/*
+ * Taking more buffers than two magazines hold moves them from and to the pool.
+ */
+static void bench_buffer_burst(void *data, __u64 operations) {
+	struct packet *burst[BENCHBURST];
+	__u64 i;
+	int n, j;
+
+	(void)data;
+
+	for (i = 0; i < operations; i += n) {
+		n = (operations - i < BENCHBURST) ? (int)(operations - i) : BENCHBURST;
+
+		for (j = 0; j < n; j++) {
+			burst[j] = get_freepacket_buffer();
+		}
+
+		for (j = 0; j < n; j++) {
+			put_freepacket_buffer(burst[j]);
+		}
+	}
+}
+
+static void run_buffer_benchmarks(void) {
+	struct bench_result *result;
+	struct packet *thispacket;
+
+	/*
+	 * The memory manager thread fills the pool after it starts.
+	 */
+	while ((thispacket = get_freepacket_buffer()) == NULL) {
+		usleep(1000);
+	}
+	put_freepacket_buffer(thispacket);
+
+	result = new_result("get_put_freepacket_buffer");
+	snprintf(result->params, sizeof(result->params), "\"burst\": 1");
+	measure(result, bench_buffer_pair, NULL);
+
+	result = new_result("get_put_freepacket_buffer");
+	snprintf(result->params, sizeof(result->params), "\"burst\": %i", BENCHBURST);
+	measure(result, bench_buffer_burst, NULL);
+	release_packet_magazine();
+}
+
+static void bench_checksum(void *data, __u64 operations) {
+	struct packet_bench *bench = data;
+	__u64 i;
+
+	for (i = 0; i < operations; i++) {
+		checksum(bench->packet);
+	}
+	bench_sink += ((struct iphdr *)bench->packet)->check;
+}
+
+static void bench_packet_copy(void *data, __u64 operations) {
+	struct packet_bench *bench = data;
+	__u64 i;
+
+	for (i = 0; i < operations; i++) {
+		memcpy(bench->packet, bench->original, bench->length);
+		__asm__ volatile ("" : : "r" (bench->packet) : "memory");
+	}
+}
+
+static void bench_get_nod_header_data(void *data, __u64 operations) {
+	struct packet_bench *bench = data;
+	__u64 found = 0;
+	__u64 i;
+
+	for (i = 0; i < operations; i++) {
+
+		if (get_nod_header_data(bench->packet, ONOP).data != NULL) {
+			found++;
+		}
+	}
+	bench_sink += found;
+}
+
+static void bench_update_nod_header_data(void *data, __u64 operations) {
+	struct packet_bench *bench = data;
+	__u64 i;
+
+	for (i = 0; i < operations; i++) {
+		set_nod_header_data(bench->packet, ONOP, get_opennop_id(), OPENNOP_IPC_ID_LENGTH);
+	}
+}
+
+/*
+ * Includes copying the untagged packet, see packet_copy.
+ */
+static void bench_add_nod_header_data(void *data, __u64 operations) {
+	struct packet_bench *bench = data;
+	__u64 i;
+
+	for (i = 0; i < operations; i++) {
+		memcpy(bench->packet, bench->original, bench->length);
+		set_nod_header_data(bench->packet, ONOP, get_opennop_id(), OPENNOP_IPC_ID_LENGTH);
+	}
+}
+
+static void run_packet_benchmarks(void) {
+	static const int sizes[] = { 0, 512, BENCHMSS };
+	struct packet_bench bench;
+	struct bench_result *result;
+	__u8 payload[BENCHMSS];
+	__u64 seed = 1;
+	unsigned int i;
+
+	bench.packet = aligned_alloc(64, BUFSIZE);
+	bench.original = aligned_alloc(64, BUFSIZE);
+
+	if ((bench.packet == NULL) || (bench.original == NULL)) {
+		fprintf(stderr, "Bench: Couldn't allocate the packets.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < BENCHMSS; i++) {
+		payload[i] = (__u8)bench_random(&seed);
+	}
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		bench.length = build_packet(bench.packet, payload, sizes[i]);
+		result = new_result("checksum");
+		snprintf(result->params, sizeof(result->params), "\"payload\": %i", sizes[i]);
+		measure(result, bench_checksum, &bench);
+		result->mbps = bench.length * 1000.0 / result->nsperop;
+	}
+
+	bench.length = build_packet(bench.original, payload, BENCHMSS);
+	memcpy(bench.packet, bench.original, bench.length);
+	result = new_result("packet_copy");
+	snprintf(result->params, sizeof(result->params), "\"payload\": %i", BENCHMSS);
+	measure(result, bench_packet_copy, &bench);
+
+	result = new_result("set_nod_header_data");
+	snprintf(result->params, sizeof(result->params), "\"payload\": %i, \"header\": \"add\"", BENCHMSS);
+	measure(result, bench_add_nod_header_data, &bench);
+
+	result = new_result("set_nod_header_data");
+	snprintf(result->params, sizeof(result->params), "\"payload\": %i, \"header\": \"update\"", BENCHMSS);
+	measure(result, bench_update_nod_header_data, &bench);
+
+	result = new_result("get_nod_header_data");
+	snprintf(result->params, sizeof(result->params), "\"payload\": %i", BENCHMSS);
+	measure(result, bench_get_nod_header_data, &bench);
+
+	free(bench.packet);
+	free(bench.original);
+}
+
+/*
+ * Compresses the corpus packet by packet and decompresses it again
+ * the way two accelerators would, the round trip must give back the data.
+ * Like the workers only packets with the compression option are decompressed.
+ */
+static void run_compression_benchmark(struct corpus *thiscorpus, const struct codec *thiscodec, int stream) {
+	struct bench_result *compressresult, *decompressresult;
+	struct compression_context context;
+	struct endpoint compressor, decompressor;
+	double compressns[BENCHMAXRUNS], decompressns[BENCHMAXRUNS];
+	__u8 *packets, *lzbuffer, *thispacket;
+	__u64 start, compressedbytes = 0;
+	size_t offset;
+	int numpackets, length, run, i;
+
+	numpackets = (thiscorpus->size + BENCHMSS - 1) / BENCHMSS;
+	packets = aligned_alloc(64, (size_t)numpackets * BUFSIZE);
+	lzbuffer = malloc(LZBUFSIZE);
+
+	if ((packets == NULL) || (lzbuffer == NULL)) {
+		fprintf(stderr, "Bench: Couldn't allocate the %s packets.\n", thiscorpus->name);
+		exit(EXIT_FAILURE);
+	}
+	memset(&context, 0, sizeof(context));
+	set_compression_codec(thiscodec->id, thiscodec->level);
+	set_compression_streaming(stream);
+
+	for (run = 0; run < benchruns; run++) {
+		memset(&compressor, 0, sizeof(compressor));
+		memset(&decompressor, 0, sizeof(decompressor));
+
+		for (i = 0, offset = 0; i < numpackets; i++, offset += BENCHMSS) {
+			length = (thiscorpus->size - offset < BENCHMSS) ? (int)(thiscorpus->size - offset) : BENCHMSS;
+			build_packet(packets + ((size_t)i * BUFSIZE), thiscorpus->data + offset, length);
+		}
+
+		start = bench_now();
+
+		for (i = 0; i < numpackets; i++) {
+			tcp_compress(packets + ((size_t)i * BUFSIZE), lzbuffer, &context, NULL, &compressor, false);
+		}
+		compressns[run] = bench_now() - start;
+
+		if (run == 0) {
+
+			for (i = 0; i < numpackets; i++) {
+				compressedbytes += payload_length(packets + ((size_t)i * BUFSIZE));
+			}
+		}
+		start = bench_now();
+
+		for (i = 0; i < numpackets; i++) {
+
+			thispacket = packets + ((size_t)i * BUFSIZE);
+
+			if ((__get_tcp_option(thispacket, COMPRESSIONOPTION) != 0) &&
+					(tcp_decompress(thispacket, lzbuffer, &context, NULL, &decompressor) == 0)) {
+				fprintf(stderr, "Bench: %s could not decompress packet %i of %s.\n",
+						thiscodec->name, i, thiscorpus->name);
+				exit(EXIT_FAILURE);
+			}
+		}
+		decompressns[run] = bench_now() - start;
+
+		for (i = 0, offset = 0; (run == 0) && (i < numpackets); i++, offset += BENCHMSS) {
+			thispacket = packets + ((size_t)i * BUFSIZE);
+			length = (thiscorpus->size - offset < BENCHMSS) ? (int)(thiscorpus->size - offset) : BENCHMSS;
+
+			if ((payload_length(thispacket) != length) ||
+					(memcmp(payload_data(thispacket), thiscorpus->data + offset, length) != 0)) {
+				fprintf(stderr, "Bench: %s changed packet %i of %s.\n", thiscodec->name, i, thiscorpus->name);
+				exit(EXIT_FAILURE);
+			}
+		}
+		release_compression_stream(&compressor);
+		release_compression_stream(&decompressor);
+	}
+	qsort(compressns, benchruns, sizeof(double), compare_doubles);
+	qsort(decompressns, benchruns, sizeof(double), compare_doubles);
+
+	compressresult = new_result("tcp_compress");
+	decompressresult = new_result("tcp_decompress");
+	snprintf(compressresult->params, sizeof(compressresult->params),
+			"\"corpus\": \"%s\", \"codec\": \"%s\", \"stream\": %s",
+			thiscorpus->name, thiscodec->name, (stream == true) ? "true" : "false");
+	strcpy(decompressresult->params, compressresult->params);
+	compressresult->operations = numpackets;
+	compressresult->nsperop = compressns[benchruns / 2] / numpackets;
+	compressresult->mbps = thiscorpus->size * 1000.0 / compressns[benchruns / 2];
+	compressresult->ratio = (double)compressedbytes / thiscorpus->size;
+	decompressresult->operations = numpackets;
+	decompressresult->nsperop = decompressns[benchruns / 2] / numpackets;
+	decompressresult->mbps = thiscorpus->size * 1000.0 / decompressns[benchruns / 2];
+	decompressresult->ratio = compressresult->ratio;
+
+	release_compression_context(&context);
+	free(packets);
+	free(lzbuffer);
+}
+
+static void run_compression_benchmarks(struct corpus *corpora, int numcorpora) {
+	const struct codec *thiscodec;
+	int i, id;
+
+	for (i = 0; i < numcorpora; i++) {
+
+		for (id = 0; id < MAXCODECS; id++) {
+			thiscodec = get_codec(id);
+
+			if (thiscodec != NULL) {
+				run_compression_benchmark(&corpora[i], thiscodec, false);
+				run_compression_benchmark(&corpora[i], thiscodec, true);
+			}
+		}
+	}
+}
+
+/*
+ * Text made of common words compresses about as well as markup or logs,
+ * random data checks how quickly incompressible payloads are passed over.
+ */
+static void generate_corpora(struct corpus *corpora) {
+	static const char *words[] = {
+		"the", "of", "and", "to", "in", "is", "that", "for", "it", "as",
+		"was", "with", "be", "by", "on", "not", "he", "this", "are", "or",
+		"session", "packet", "network", "accelerator", "compression", "data",
+		"server", "client", "request", "response", "</td>", "<div class=\"row\">",
+		"GET /index.html HTTP/1.1\r\n", "Content-Length: ", "2016-05-02 ", "INFO ",
+	};
+	__u64 seed = 42;
+	size_t i = 0, length;
+	const char *word;
+
+	corpora[0].name = "text";
+	corpora[0].size = BENCHCORPUS;
+	corpora[0].data = malloc(BENCHCORPUS);
+	corpora[1].name = "random";
+	corpora[1].size = BENCHCORPUS;
+	corpora[1].data = malloc(BENCHCORPUS);
+
+	if ((corpora[0].data == NULL) || (corpora[1].data == NULL)) {
+		fprintf(stderr, "Bench: Couldn't allocate the corpus.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	while (i < BENCHCORPUS) {
+		word = words[bench_random(&seed) % (sizeof(words) / sizeof(words[0]))];
+		length = strlen(word);
+
+		if (length > BENCHCORPUS - i - 1) {
+			length = BENCHCORPUS - i - 1;
+		}
+		memcpy(corpora[0].data + i, word, length);
+		i += length;
+		corpora[0].data[i++] = (bench_random(&seed) % 12 == 0) ? '\n' : ' ';
+	}
+
+	for (i = 0; i < BENCHCORPUS; i++) {
+		corpora[1].data[i] = (__u8)bench_random(&seed);
+	}
+}
+
+static int read_corpus(char *path, struct corpus *thiscorpus) {
+	FILE *input;
+	long size;
+
+	input = fopen(path, "rb");
+
+	if (input == NULL) {
+		perror(path);
+		return -1;
+	}
+	fseek(input, 0, SEEK_END);
+	size = ftell(input);
+	fseek(input, 0, SEEK_SET);
+
+	if (size <= 0) {
+		fprintf(stderr, "Bench: %s is empty.\n", path);
+		fclose(input);
+		return -1;
+	}
+	thiscorpus->name = basename(path);
+	thiscorpus->size = size;
+	thiscorpus->data = malloc(size);
+
+	if ((thiscorpus->data == NULL) || (fread(thiscorpus->data, 1, size, input) != (size_t)size)) {
+		fprintf(stderr, "Bench: Couldn't read %s.\n", path);
+		fclose(input);
+		return -1;
+	}
+	fclose(input);
+	return 0;
+}
+
+static void print_results(FILE *output) {
+	struct bench_result *result;
+	int i;
+
+	fprintf(output, "{\n");
+	fprintf(output, "  \"version\": \"%s\",\n", VERSION);
+	fprintf(output, "  \"runs\": %i,\n", benchruns);
+	fprintf(output, "  \"milliseconds\": %i,\n", benchms);
+	fprintf(output, "  \"results\": [\n");
+
+	for (i = 0; i < numresults; i++) {
+		result = &results[i];
+		fprintf(output, "    {\"name\": \"%s\", \"params\": {%s}, \"operations\": %llu, \"ns_per_op\": %.2f",
+				result->name, result->params, (unsigned long long)result->operations, result->nsperop);
+
+		if (result->mbps > 0) {
+			fprintf(output, ", \"mbps\": %.1f", result->mbps);
+		}
+
+		if (result->ratio > 0) {
+			fprintf(output, ", \"ratio\": %.4f", result->ratio);
+		}
+		fprintf(output, "}%s\n", (i < numresults - 1) ? "," : "");
+	}
+	fprintf(output, "  ]\n");
+	fprintf(output, "}\n");
+}
+
+int main(int argc, char *argv[]) {
+	pthread_t t_memorymanager;
+	struct corpus *corpora;
+	FILE *output = stdout;
+	char *outputpath = NULL;
+	__u32 maxsessions = BENCHSESSIONS;
+	int numworkers = BENCHWORKERS;
+	int numcorpora, i, c;
+
+	while ((c = getopt(argc, argv, "r:t:s:w:o:h")) != -1) {
+		switch (c) {
+		case 'r':
+			benchruns = atoi(optarg);
+			break;
+		case 't':
+			benchms = atoi(optarg);
+			break;
+		case 's':
+			maxsessions = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			numworkers = atoi(optarg);
+			break;
+		case 'o':
+			outputpath = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			exit((c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if ((benchruns < 1) || (benchruns > BENCHMAXRUNS) || (benchms < 1) ||
+			(maxsessions < BENCHMINSESSIONS) || (numworkers < 1) || (numworkers > MAXWORKERS)) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	numcorpora = (optind < argc) ? argc - optind : 2;
+	corpora = calloc(numcorpora, sizeof(struct corpus));
+
+	if (corpora == NULL) {
+		fprintf(stderr, "Bench: Couldn't allocate the corpus.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (optind < argc) {
+
+		for (i = 0; i < numcorpora; i++) {
+
+			if (read_corpus(argv[optind + i], &corpora[i]) < 0) {
+				exit(EXIT_FAILURE);
+			}
+		}
+	} else {
+		generate_corpora(corpora);
+	}
+
+	if (outputpath != NULL) {
+		output = fopen(outputpath, "w");
+
+		if (output == NULL) {
+			perror(outputpath);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/*
+	 * Only the parts of the daemon the primitives need,
+	 * no workers are started.
+	 */
+	generate_opennopid();
+	set_workers(numworkers);
+	pthread_create(&t_memorymanager, NULL, memorymanager_function, (void *) NULL);
+	initialize_sessiontable();
+	rcu_register_thread();
+
+	run_session_benchmarks(maxsessions);
+	run_queue_benchmarks();
+	run_buffer_benchmarks();
+	run_packet_benchmarks();
+	run_compression_benchmarks(corpora, numcorpora);
+
+	print_results(output);
+
+	if (output != stdout) {
+		fclose(output);
+	}
+
+	/*
+	 * The memory manager is not stopped, exit() ends it.
+	 */
+	exit(EXIT_SUCCESS);
+}
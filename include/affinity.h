@@ -0,0 +1,33 @@
+#ifndef AFFINITY_H_
+#define AFFINITY_H_
+#define _GNU_SOURCE
+
+#include <pthread.h>
+
+#include <linux/types.h>
+
+#define MAXAFFINITYCPUS 1024 // Highest CPU number that can be pinned to.
+#define MAXNUMANODES 8 // Nodes that get their own packet buffers.
+#define AFFINITYNONE -1 // Thread is not pinned.
+
+/*
+ * Threads are pinned in the order the CPUs are listed.
+ * The first CPU is shared by the counters and memory manager threads,
+ * the fetchers take the next ones and then each worker takes two,
+ * one for optimization and one for deoptimization.
+ * If there are more threads than CPUs they wrap around the list
+ * after the first CPU.
+ */
+int set_cpu_affinity(const char *cpulist);
+int get_housekeeping_cpu(void);
+int get_fetcher_cpu(int i);
+int get_processor_cpu(int worker, int deoptimization);
+int get_cpu_node(int cpu);
+int get_processor_node(int worker, int deoptimization);
+int get_local_node(void);
+int get_numa_nodes(void);
+int create_pinned_thread(pthread_t *thread, int cpu, void *(*function)(void *), void *arg);
+
+struct commandresult cli_show_affinity(int client_fd, char **parameters, int numparameters, void *data);
+
+#endif /*AFFINITY_H_*/
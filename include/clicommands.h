@@ -38,7 +38,7 @@ struct commandresult execute_commands(struct command_head *mode, void *data, int
 int register_command(struct command_head *mode, const char *command_name, t_commandfunction handler_function, bool, bool);
 int cli_prompt(int client_fd);
 int cli_mode_prompt(int client_fd, struct command_head *mode);
-void bytestostringbps(char *output, __u32 count);
+void bytestostringbps(char *output, __u64 count);
 int cli_send_feedback(int client_fd, char *msg);
 void init_cli_global_mode();
 void initializetestmode();
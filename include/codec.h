@@ -0,0 +1,43 @@
+#ifndef CODEC_H_
+#define CODEC_H_
+#define _GNU_SOURCE
+
+#include <stddef.h>
+
+#include <linux/types.h>
+
+#define CODEC_QUICKLZ 0 // QuickLZ, the codec used by older accelerators.
+#define CODEC_LZ4 1
+#define CODEC_ZSTD 2
+#define MAXCODECS 3 // Codec IDs must fit in the 6 codec bits of the compression option.
+
+#define LZ4HISTORY (64 * 1024) // Bytes of history kept by an LZ4 stream.
+#define ZSTDWINDOWLOG 17 // Window of a zstd stream is 128 KB.
+
+/*
+ * Functions a compression library provides to OpenNOP.
+ * A state keeps the history of one stream in one direction.
+ * reset starts the history over so the data can be decompressed
+ * by a state that has not seen any earlier data.
+ * compress and decompress return 0 when they fail.
+ */
+struct codec {
+	const char *name;
+	__u8 id; // Sent to the peer in the compression option.
+	int level; // Level used when none is configured.
+	int minlevel;
+	int maxlevel;
+	void *(*new_state)(int compressing);
+	void (*free_state)(void *state, int compressing);
+	size_t (*state_size)(void *state, int compressing);
+	size_t (*compress)(void *state, const __u8 *source, size_t size,
+			__u8 *destination, size_t capacity, int level, int reset);
+	size_t (*decompress)(void *state, const __u8 *source, size_t size,
+			__u8 *destination, size_t capacity, int reset);
+	size_t (*bound)(size_t size);
+};
+
+const struct codec *get_codec(__u8 id);
+const struct codec *find_codec(const char *name);
+
+#endif /*CODEC_H_*/
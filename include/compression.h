@@ -4,12 +4,108 @@
 
 #include <linux/types.h>
 
-#include "quicklz.h"
+#include "codec.h"
+#include "packet.h"
+#include "session.h"
+
+/*
+ * Older accelerators send the compression option with 1 byte of value 1 for QuickLZ.
+ * Other codecs send 2 bytes of flags and stream packets send the
+ * flags and 2 more bytes with the position of the packet in the stream.
+ * Only neighbors that said they support a codec or streams are sent them.
+ */
+#define COMPRESSIONOPTION 31 // TCP option that flags compressed packets.
+#define COMPRESSIONSTREAM 0x8000 // Packet was compressed with the session stream.
+#define COMPRESSIONRESET 0x4000 // Stream was restarted with this packet.
+#define COMPRESSIONCODEC 0x3f00 // Codec that compressed this packet.
+#define COMPRESSIONCODECSHIFT 8
+#define COMPRESSIONSEQUENCE 0xffff // Position of a stream packet, sent after the flags.
+#define COMPRESSIONSEQUENCESHIFT 16
+#define COMPRESSIONDESYNCS 64 // Streams that lost sync waiting to be reported to their peers.
+#define COMPRESSIONPEERS 4 // Neighbors each worker keeps the features and codec of.
+#define COMPRESSIONSTREAMMEMORY 64 // Default megabytes used for compression streams.
+#define LZBUFSIZE (BUFSIZE + 400) // Size of the buffer data is compressed into.
+#define MAXCODECPORTS 64 // Maximum number of ports with their own codec.
+#define ENTROPYSAMPLES 256 // Bytes sampled to guess if a payload compresses.
+#define ENTROPYMAXCOLLISIONS 192 // Fewer sampled byte pairs match in random data.
+#define INCOMPRESSIBLEBACKOFF 7 // Longest streak counted, skips up to 63 packets.
+
+/*
+ * Compression history for the data sent from one endpoint of a session.
+ * Both accelerators must process the packets of a stream in the same order.
+ * The compressing side restarts the stream when TCP sequence numbers show a
+ * retransmission or when the peer reports it lost sync over IPC.
+ * The decompressing side drops packets until it sees that restart
+ * when a packet of the stream is missing.
+ */
+struct compression_stream {
+	const struct codec *compresscodec; // Codec of state_compress.
+	void *state_compress; // Allocated on the compressing side.
+	int level; // Level state_compress compresses at.
+	const struct codec *decompresscodec; // Codec of state_decompress.
+	void *state_decompress; // Allocated on the decompressing side.
+	size_t memory; // Bytes used by both states.
+	__u16 sequence; // Sequence of the next packet in this stream.
+	int synchronized; // Decompression history matches the peer.
+	int reported; // Peer was asked to restart the stream since it lost sync.
+	int reset; // Restart the stream with the next packet.
+	__u32 resets; // Times the stream was restarted.
+};
+
+/*
+ * What a neighbor can decompress and the codec set for it
+ * as they were when the neighbor generation last changed.
+ */
+struct compression_peer {
+	char id[OPENNOP_IPC_ID_LENGTH];
+	__u32 generation; // Neighbor generation + 1 it was looked up in, 0 if the slot is unused.
+	__u32 features; // See OPENNOP_FEATURE_STREAM.
+	int codec; // Codec set for the neighbor, -1 if none.
+	int level;
+};
+
+/*
+ * Codec states of one worker thread for packets compressed without a stream
+ * and the neighbors it compressed for, so the neighbor list is only
+ * walked when one of them changes.
+ */
+struct compression_context {
+	void *state_compress[MAXCODECS];
+	void *state_decompress[MAXCODECS];
+	struct compression_peer peers[COMPRESSIONPEERS];
+	int nextpeer; // Slot a new neighbor replaces.
+};
+
+/*
+ * Codec used for sessions to or from a TCP port.
+ */
+struct codec_port {
+	__u16 port; // Host byte order, 0 is an unused slot.
+	__u8 codec;
+	int level;
+};
 
 struct commandresult cli_show_compression(int client_fd, char **parameters, int numparameters, void *data);
 struct commandresult cli_compression_enable(int client_fd, char **parameters, int numparameters, void *data);
 struct commandresult cli_compression_disable(int client_fd, char **parameters, int numparameters, void *data);
-unsigned int tcp_compress(__u8 *ippacket, __u8 *lzbuffer, qlz_state_compress *state_compress);
-unsigned int tcp_decompress(__u8 *ippacket, __u8 *lzbuffer, qlz_state_decompress *state_decompress);
+struct commandresult cli_compression_streaming_enable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_compression_streaming_disable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_compression_streaming_memory(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_compression_codec_default(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_compression_codec_port(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_no_compression_codec_port(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_compression_codec_neighbor(int client_fd, char **parameters, int numparameters, void *data);
+struct compression_peer *get_compression_peer(struct compression_context *context,
+		struct session *thissession, struct endpoint *source);
+unsigned int tcp_compress(__u8 *ippacket, __u8 *lzbuffer, struct compression_context *context,
+		struct session *thissession, struct endpoint *source, int resync);
+unsigned int tcp_decompress(__u8 *ippacket, __u8 *lzbuffer, struct compression_context *context,
+		struct session *thissession, struct endpoint *source);
+void release_compression_stream(struct endpoint *thisendpoint);
+void release_compression_context(struct compression_context *context);
+void set_compression_streaming(int enabled);
+void set_compression_codec(__u8 codec, int level);
+int compression_get_desyncs(char *peerid, struct ipc_stream_id *streams, int max);
+void compression_restart(struct ipc_stream_id *streams, int count);
 
 #endif /*COMPRESSION_H_*/
@@ -5,6 +5,11 @@
 #include <sys/time.h>
 #include <linux/types.h>
 
+#define MAXCOUNTERS 8 // Counters in one set.
+#define COUNTERHISTORY 128 // Snapshots kept of each set, must be a power of 2.
+#define COUNTERINTERVAL 1 // Seconds between the snapshots the counters thread takes.
+#define COUNTERWINDOW 5 // Seconds the rates shown by default are averaged over.
+
 typedef void *t_counterdata;
 typedef void (*t_counterfunction)(t_counterdata);
 
@@ -21,11 +26,64 @@ struct counter {
 	t_counterdata data; //Points to the metric structure.
 };
 
+/*
+ * The values of a set of counters at one moment.
+ */
+struct counter_snapshot {
+	__u64 taken; // CLOCK_MONOTONIC nanoseconds.
+	__u64 values[MAXCOUNTERS];
+};
+
+/*
+ * 64-bit counters that only one thread writes and never reset.
+ * The writer takes no lock and uses no atomic read-modify-write,
+ * sequence is odd while it updates so readers can copy every
+ * counter of the set as they were at one moment.
+ * The counters thread keeps a snapshot every COUNTERINTERVAL
+ * seconds so rates can be taken over any window the history covers.
+ */
+struct counters {
+	__u32 sequence;
+	__u64 values[MAXCOUNTERS];
+
+	__u32 historysequence __attribute__ ((aligned(64))); // Odd while a snapshot is added.
+	__u32 nexthistory; // Slot the next snapshot goes in.
+	struct counter_snapshot history[COUNTERHISTORY];
+};
+
+/*
+ * Updates made by the thread that owns the counters.
+ * Updates of several counters that belong together go between
+ * counters_begin() and counters_end().
+ */
+static inline void counters_begin(struct counters *set) {
+	__atomic_store_n(&set->sequence, set->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void counter_add(struct counters *set, int counter, __u64 value) {
+	__atomic_store_n(&set->values[counter], set->values[counter] + value, __ATOMIC_RELAXED);
+}
+
+static inline void counters_end(struct counters *set) {
+	__atomic_store_n(&set->sequence, set->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static inline void counters_add(struct counters *set, int counter, __u64 value) {
+	counters_begin(set);
+	counter_add(set, counter, value);
+	counters_end(set);
+}
+
 void *counters_function(void *dummyPtr);
-int calculate_ppsbps(__u32 previouscount, __u32 currentcount);
 int register_counter(t_counterfunction, t_counterdata); //Adds a counter record to the counters head list.
 int un_register_counter(t_counterfunction, t_counterdata); //Will remove a counter record.
 struct counter* allocate_counter();
 void execute_counters();
+void counters_snapshot(struct counters *set, struct counter_snapshot *snapshot);
+void counters_record(struct counters *set);
+int counters_history(struct counters *set, __u32 seconds, struct counter_snapshot *snapshot);
+__u64 counter_delta(struct counter_snapshot *older, struct counter_snapshot *newer, int counter);
+__u64 counter_rate(struct counters *set, int counter, __u32 seconds);
 
 #endif /*COUNTERS_H_*/
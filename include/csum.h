@@ -2,8 +2,23 @@
 #define CSUM_H_
 #define _GNU_SOURCE
 
+#include <linux/types.h>
+
+/*
+ * What a TCP header looked like before an edit.
+ */
+struct header_edit {
+	__u16 tot_len; // IP length in network order.
+	__u64 sum; // Sum of the TCP header and its pseudo header length.
+};
+
+__u64 csum_add(const void *buff, int len, __u64 sum);
+__u16 csum_fold(__u64 sum);
+void csum_replace2(__u16 *check, __u16 old, __u16 new);
 unsigned short tcp_sum_calc(unsigned short len_tcp, unsigned short *src_addr, unsigned short *dest_addr, unsigned short *buff);
 unsigned short ip_sum_calc(unsigned short len_ip_header, unsigned short *buff);
 void checksum(unsigned char *packet);
+void begin_header_edit(__u8 *ippacket, struct header_edit *edit);
+void end_header_edit(__u8 *ippacket, struct header_edit *edit);
 
 #endif /*CSUM_H_*/
@@ -0,0 +1,68 @@
+#ifndef DEDUP_H_
+#define DEDUP_H_
+#define _GNU_SOURCE
+
+#include <pthread.h>
+
+#include <linux/types.h>
+
+#include "ipc.h"
+
+#define DEDUPOPTION 32 // TCP option that flags deduplicated packets.
+#define DEDUPLEARN 1 // Payload is unchanged but its chunks were stored.
+#define DEDUPENCODED 2 // Payload is made of literals and chunk references.
+#define DEDUPLITERAL 0x00 // Record tag followed by a 2 byte length and the bytes.
+#define DEDUPREFERENCE 0x01 // Record tag followed by an 8 byte fingerprint.
+#define DEDUPMINCHUNK 64 // Smaller chunks are never stored or referenced.
+#define DEDUPMAXCHUNK 512 // Chunks are cut here if no boundary was found.
+#define DEDUPBOUNDARY 0xfe00000000000000ULL // Gear hash bits that end a chunk, 128 byte average.
+#define DEDUPMEMORY 32 // Default megabytes for each direction of each peer.
+#define DEDUPMAXPEERS 16 // Maximum number of accelerators with a chunk store.
+#define DEDUPLOCKS 256 // Locks shared by the slots of one store.
+#define DEDUPMAPSIZE 64 // Fingerprints reported in one IPC message.
+
+/*
+ * A chunk of payload and the fingerprint it is stored and referenced by.
+ */
+struct dedup_chunk {
+	__u64 fingerprint; // 0 marks an empty slot.
+	__u16 length;
+	__u8 data[DEDUPMAXCHUNK];
+};
+
+/*
+ * Direct mapped chunk store.
+ * A chunk always goes in the slot picked by its fingerprint so
+ * both peers keep the same chunks without agreeing on an order.
+ */
+struct dedup_store {
+	struct dedup_chunk *chunks;
+	__u32 mask; // Number of slots - 1.
+	pthread_mutex_t locks[DEDUPLOCKS];
+};
+
+/*
+ * Chunks shared with one remote accelerator.
+ * Fingerprints missing from received are reported back so the
+ * peer stops referencing them.
+ */
+struct dedup_peer {
+	char id[OPENNOP_IPC_ID_LENGTH]; // Accelerator ID of the peer.
+	struct dedup_store sent; // Chunks sent to the peer.
+	struct dedup_store received; // Chunks received from the peer.
+	__u64 misses[DEDUPMAPSIZE]; // Fingerprints not found in received.
+	__u16 nummisses;
+	pthread_mutex_t lock; // Lock for misses.
+};
+
+void initialize_dedup();
+unsigned int dedup_encode(__u8 *ippacket, __u8 *buffer, char *peerid, int resync);
+unsigned int dedup_decode(__u8 *ippacket, __u8 *buffer, char *peerid);
+int dedup_get_misses(char *peerid, __u64 *fingerprints, int max);
+void dedup_forget(char *peerid, __u64 *fingerprints, int count);
+struct commandresult cli_show_dedup(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_dedup_enable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_dedup_disable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_dedup_memory(int client_fd, char **parameters, int numparameters, void *data);
+
+#endif /*DEDUP_H_*/
@@ -6,41 +6,36 @@
 
 #include <libnetfilter_queue/libnetfilter_queue.h> // for access to Netfilter Queue
 #include "counters.h"
-
-struct fetchercounters {
-	/*
-	 * number of packets processed.
-	 * used for pps calculation. can roll.
-	 * should increment at end of main loop after each packet is finished processing.
-	 */
-	__u32 packets;
-	__u32 packetsprevious;
-	__u32 pps; // Where the calculated pps are stored.
-
-	/*
-	 * number of bytes entering process.
-	 * used for bps calculation. can roll.
-	 * should increment as beginning of main loop after packet is received from queue.
-	 */
-	__u32 bytesin;
-	__u32 bytesinprevious;
-	__u32 bpsin; // Where the calculated bps are stored.
-
-	/*
-	 * Stores when the counters were last updated.
-	 */
-	struct timeval updated;
-
-	/*
-	 * When something reads/writes to this counter it should use the lock.
-	 */
-	pthread_mutex_t lock;
-};
+#include "latency.h"
+#include "verdict.h"
+
+#define FETCHERBATCH 32 // Maximum number of messages received with one recvmmsg().
+#define FETCHERMSGSIZE (BUFSIZE + 256) // Packet plus the netlink and nfqueue headers.
+#define MAXFETCHERS 32 // Maximum number of Netfilter Queues that can be fetched from.
+
+/*
+ * Counters of a fetcher, see struct counters.
+ */
+#define FETCHERPACKETS 0 // Packets handled.
+#define FETCHERBYTESIN 1 // Bytes of the packets received.
+#define FETCHERRXBATCHES 2 // Calls to recvmmsg().
+#define FETCHERRXMESSAGES 3 // Messages they returned.
+#define FETCHERVERDICTBATCHES 4 // Verdict batches sent.
+#define FETCHERVERDICTS 5 // Verdicts sent in them.
+#define FETCHERBYPASSEVENTS 6 // Times this fetcher found a processor backlog over the high mark.
+#define FETCHERBYPASSED 7 // Packets accepted because their processor was backed up.
 
 struct fetcher {
 	pthread_t t_fetcher;
-	struct fetchercounters metrics;
+	struct counters metrics; // Only written by this thread.
+	struct latency_histogram latency; // Time until a packet was queued for a worker.
+	struct nfq_handle *h; // Netfilter Queue library handle.
+	struct nfq_q_handle *qh; // The Queue Handle to the Netfilter Queue.
+	int fd; // Netlink socket used to receive packets and send verdicts.
+	u_int16_t queuenum; // Netfilter Queue number this fetcher is bound to.
+	struct verdict_batch verdicts; // Verdicts issued by the fetcher itself.
 	int state; // Marks this thread as active. 1=running, 0=stopping, -1=stopped.
+	int dispatching; // Set while received packets are handed to the workers.
 	pthread_mutex_t lock; // Lock for the fetcher when changing state.
 };
 
@@ -51,7 +46,17 @@ void *fetcher_function(void *dummyPtr);
 void fetcher_graceful_exit();
 void create_fetcher();
 void rejoin_fetcher();
+int get_fetchers(void);
+struct latency_histogram *get_fetcher_latency(int i);
+void get_fetcher_bypass_counters(__u64 *events, __u64 *packets);
+void pause_fetchers(void);
+void resume_fetchers(void);
+void set_fetchers(int desirednumfetchers);
 struct commandresult cli_show_fetcher(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_fetcher_batching_enable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_fetcher_batching_disable(int client_fd, char **parameters, int numparameters, void *data);
+int get_fetcher_batching(void);
+void set_fetcher_batching(int enabled);
 void counter_updatefetchermetrics(t_counterdata data);
 
 #endif /*FETCHER_H_*/
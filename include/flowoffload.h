@@ -0,0 +1,24 @@
+#ifndef FLOWOFFLOAD_H_
+#define FLOWOFFLOAD_H_
+#define _GNU_SOURCE
+
+#include <linux/types.h>
+
+#include "session.h"
+
+/*
+ * Must match the command and attributes in opennopdrv/opennop_netlink.h.
+ */
+#define FLOWOFFLOADCMD 3 // OPENNOP_CMD_OFFLOAD
+#define FLOWOFFLOADLARGERIP 2 // OPENNOP_A_LARGERIP
+#define FLOWOFFLOADLARGERPORT 3 // OPENNOP_A_LARGERPORT
+#define FLOWOFFLOADSMALLERIP 4 // OPENNOP_A_SMALLERIP
+#define FLOWOFFLOADSMALLERPORT 5 // OPENNOP_A_SMALLERPORT
+#define FLOWOFFLOADRETRY 60 // Seconds before a thread tries the kernel module again.
+
+int offload_session(struct session *thissession, __u32 pending);
+struct commandresult cli_flow_offload_enable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_flow_offload_disable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_show_flow_offload(int client_fd, char **parameters, int numparameters, void *data);
+
+#endif /*FLOWOFFLOAD_H_*/
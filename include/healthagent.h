@@ -2,6 +2,9 @@
 #define HEALTHAGENT_H_
 #define _GNU_SOURCE
 
+int create_nl_socket(int protocol, int groups);
+int sendto_fd(int s, const char *buf, int bufLen);
+int get_family_id(int sd);
 void *healthagent_function (void *dummyPtr);
 
 #endif /*HEALTHAGENT_H_*/
@@ -21,7 +21,12 @@
 #define IPC_MAX_MESSAGE_SIZE	1024				/** Largest size the IPC messages can be */
 #define OPENNOPD_IPC_PORT 		5000				/** Random number for now */
 #define	OPENNOPD_IPC_SOCK		"\0opennopd.ipc"	/** '\0' makes this sock hidden */
-#define OPENNOP_IPC_HELLO		10000				/** Timeout for epoll */
+#define OPENNOP_IPC_HELLO		10000				/** Time between hello messages */
+#define OPENNOP_IPC_TICK		100					/** Timeout for epoll, reports to neighbors wait at most this long */
+
+#define OPENNOP_FEATURE_STREAM		0x00000001		/** Decompresses stream packets */
+#define OPENNOP_FEATURE_DEDUP		0x00000002		/** Decodes deduplicated packets */
+#define OPENNOP_FEATURE_CODEC(id)	(0x00000100 << (id))	/** Decompresses this codec */
 
 typedef enum {
     DOWN,			// Remote system not functioning or authorized.
@@ -55,6 +60,9 @@ struct neighbor {
     char key[OPENNOP_IPC_KEY_LENGTH]; // Encryption key used by this neighbor.
     time_t hellotimer; // Last hello message send or attempted.
     time_t timer; // Remote timer.
+    int codec; // Codec for data sent to this neighbor, -1 for the default.
+    int codeclevel; // Level used with that codec.
+    __u32 features; // What this neighbor said it can decompress, 0 for older ones.
 };
 
 #define OPENNOP_DEFAULT_HEADER_LENGTH	8
@@ -85,14 +93,45 @@ struct opennop_message_header {
 struct opennop_hello_message{
 	struct opennop_message_header header;
 	char id[OPENNOP_IPC_ID_LENGTH];
+	__u32 features;			/** Big endian, older accelerators do not send it */
 };
 
 struct ipc_message_i_see_you{
 	struct opennop_message_header header;
 	char id[OPENNOP_IPC_ID_LENGTH];
-	/*
-	 * Additional data would go here.
-	 */
+	__u32 features;			/** Big endian, older accelerators do not send it */
+};
+
+/**
+ * Fingerprints of dedup chunks that were referenced but not found.
+ * The receiver stops referencing them.
+ */
+struct ipc_message_dedup_map{
+	struct opennop_message_header header;
+	__u16 count;			/** Fingerprints in this message */
+	__u16 reserved;
+	__u64 fingerprints[];	/** Big endian */
+};
+
+/**
+ * Compression stream of a session, addresses and ports as they are in the packets.
+ */
+struct ipc_stream_id{
+	__u32 saddr;			/** Endpoint the stream compresses data from */
+	__u32 daddr;
+	__u16 source;
+	__u16 dest;
+};
+
+/**
+ * Streams the receiver lost sync with.
+ * The sender restarts them with their next packet.
+ */
+struct ipc_message_stream_restart{
+	struct opennop_message_header header;
+	__u16 count;			/** Streams in this message */
+	__u16 reserved;
+	struct ipc_stream_id streams[];
 };
 
 typedef enum {
@@ -118,16 +157,24 @@ typedef enum {
     OPENNOP_IPC_I_SEE_YOU,
     OPENNOP_IPC_AUTH_ERR,
     OPENNOP_IPC_BAD_ID,
-    OPENNOP_IPC_DEDUP_MAP
+    OPENNOP_IPC_DEDUP_MAP,
+    OPENNOP_IPC_STREAM_RESTART
 } OPENNOP_IPC_MSG_TYPE;
 
 void start_ipc();
 void rejoin_ipc();
 //int verify_neighbor_in_domain(__u32 neighborIP);
 int verify_neighbor_in_domain(char *neighborid);
+__u32 get_neighbor_generation();
 __u8 *get_opennop_id();
 int compare_opennopid(char *first_opennopid, char *second_opennopid);
 int check_opennopid(char *opennopid);
 int save_opennopid(char *source, char *destination);
+int set_neighbor_codec(__u32 neighborIP, int codec, int level);
+int get_neighbor_codec(char *neighborid, int *level);
+__u32 get_neighbor_features(char *neighborid);
+__u32 get_local_features();
+int add_static_neighbor(__u32 neighborIP, char *neighborid);
+void generate_opennopid();
 
 #endif
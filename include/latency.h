@@ -0,0 +1,107 @@
+#ifndef LATENCY_H_
+#define LATENCY_H_
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <time.h>
+
+#include <linux/types.h>
+
+#define LATENCYSUBBITS 3 // Each power of 2 is split in 8 buckets so a bucket is within 12.5%.
+#define LATENCYSUBBUCKETS (1 << LATENCYSUBBITS)
+#define LATENCYMAXBITS 40 // Longest time kept apart is 2^40 ns, about 18 minutes.
+#define LATENCYBUCKETS ((LATENCYMAXBITS - LATENCYSUBBITS + 1) * LATENCYSUBBUCKETS)
+
+/*
+ * Stages a packet is timed through by the processor that handles it.
+ * The fetcher keeps its own histogram of the time until it queued the packet.
+ */
+#define LATENCYQUEUE 0 // Received by the fetcher until taken from the processor queue.
+#define LATENCYCODEC 1 // Compression or decompression and dedup.
+#define LATENCYPROCESS 2 // Taken from the queue until its verdict was set.
+#define LATENCYTOTAL 3 // Received by the fetcher until its verdict was set.
+#define LATENCYSTAGES 4
+
+/*
+ * Log-bucketed histogram of nanoseconds.
+ * Times under LATENCYSUBBUCKETS ns get a bucket each, longer
+ * ones go in one of LATENCYSUBBUCKETS buckets of their power of 2.
+ * Only the thread that owns it writes to it so no lock is needed.
+ */
+struct latency_histogram {
+	__u64 counts[LATENCYBUCKETS];
+	__u64 max;
+};
+
+struct latency_stats {
+	struct latency_histogram stages[LATENCYSTAGES];
+};
+
+extern int latency;
+
+static inline __u64 latency_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((__u64)now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+/*
+ * Time a stage starts, 0 if packets are not being timed.
+ */
+static inline __u64 latency_start(void) {
+	return (latency == true) ? latency_now() : 0;
+}
+
+static inline int latency_bucket(__u64 ns) {
+	int bits;
+
+	if (ns < LATENCYSUBBUCKETS) {
+		return ns;
+	}
+	bits = 63 - __builtin_clzll(ns);
+
+	if (bits >= LATENCYMAXBITS) {
+		return LATENCYBUCKETS - 1;
+	}
+	return ((bits - LATENCYSUBBITS + 1) * LATENCYSUBBUCKETS) +
+			((ns >> (bits - LATENCYSUBBITS)) & (LATENCYSUBBUCKETS - 1));
+}
+
+/*
+ * Called by the thread that owns the histogram.
+ */
+static inline void latency_record(struct latency_histogram *histogram, __u64 ns) {
+	int bucket = latency_bucket(ns);
+
+	__atomic_store_n(&histogram->counts[bucket], histogram->counts[bucket] + 1, __ATOMIC_RELAXED);
+
+	if (ns > histogram->max) {
+		__atomic_store_n(&histogram->max, ns, __ATOMIC_RELAXED);
+	}
+}
+
+/*
+ * Records the time since a stage started and returns the time now.
+ * Nothing is recorded if the stage was not timed.
+ */
+static inline __u64 latency_since(struct latency_histogram *histogram, __u64 started) {
+	__u64 now;
+
+	if (started == 0) {
+		return 0;
+	}
+	now = latency_now();
+	latency_record(histogram, now - started);
+	return now;
+}
+
+void latency_merge(struct latency_histogram *total, struct latency_histogram *histogram);
+__u64 latency_count(struct latency_histogram *histogram);
+__u64 latency_percentile(struct latency_histogram *histogram, __u64 count, __u32 permyriad);
+
+struct commandresult cli_show_latency(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_latency_enable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_latency_disable(int client_fd, char **parameters, int numparameters, void *data);
+
+#endif /*LATENCY_H_*/
@@ -1,15 +1,69 @@
 #ifndef MEMORYMANAGER_H_
 #define MEMORYMANAGER_H_
 
+#include <linux/types.h>
+
 #include "queuemanager.h"
 #include "packet.h"
 
+#define MAGAZINESIZE 64 // Packet buffers moved between a thread and the pool at once.
+#define MAXMAGAZINES 512 // Maximum number of threads with their own packet buffers.
+#define PACKETSLABSIZE (2 * 1024 * 1024) // Bytes in one packet slab, the size of a huge page.
+#define PACKETREFILLRETRY 1 // Seconds to wait before trying again after a refill got no buffers.
+
+/*
+ * A contiguous region that packet buffers are carved from.
+ * Slabs are never freed because their buffers move between
+ * the pool and the threads for the life of the daemon.
+ */
+struct packet_slab {
+    struct packet_slab *next; // Next slab in the arena.
+    struct packet *buffers; // First buffer of this slab.
+    size_t size; // Bytes mapped for this slab.
+    u_int32_t capacity; // Buffers that fit in this slab.
+    u_int32_t used; // Buffers carved from this slab so far.
+    int hugepages; // This slab is backed by huge pages.
+    int node; // NUMA node the slab's pages are bound to.
+};
+
+/*
+ * Packet buffers of one node kept by one thread.
+ * Buffers are taken from and returned to loaded without a lock.
+ * When loaded is empty it is swapped with full or refilled from the pool
+ * and when it is full it is swapped with full or full is spilled to the pool.
+ */
+struct packet_magazine {
+    struct packet_head loaded; // Buffers this thread allocates from and frees to.
+    struct packet_head full; // A full magazine kept in reserve.
+    int inuse; // A running thread owns this magazine.
+    int node; // NUMA node of the buffers in this magazine.
+
+    /*
+     * Requests served from the magazine and requests that needed the pool.
+     * can roll.
+     */
+    __u32 hits;
+    __u32 misses;
+    __u32 refills; // Times buffers were moved from the pool.
+    __u32 spills; // Times buffers were moved to the pool.
+};
+
 void *memorymanager_function(void *dummyPtr);
 
-int allocatefreepacketbuffers(struct packet_head *queue, int bufferstoallocate);
+int allocatefreepacketbuffers(struct packet_head *queue, int bufferstoallocate, int node);
 
 struct packet *get_freepacket_buffer(void);
 
+struct packet *get_freepacket_buffer_on(int node);
+
 int put_freepacket_buffer(struct packet *thispacket);
 
+void release_packet_magazine(void);
+
+void set_maxpacketbuffers(int desiredmaxpacketbuffers);
+
+void set_packethugepages(int enabled);
+
+struct commandresult cli_show_packetbuffers(int client_fd, char **parameters, int numparameters, void *data);
+
 #endif /*MEMORYMANAGER_H_*/
@@ -12,6 +12,8 @@
 
 #define BUFSIZE 2048 // Size of buffer used to store IP packets.
 
+struct fetcher;
+
 /* Structure used for the head of a packet queue.. */
 struct packet_head
 {
@@ -22,18 +24,28 @@ struct packet_head
     pthread_mutex_t lock; // Lock for this queue.
 };
 
+/*
+ * Packet buffers are carved from slabs by the memory manager.
+ * Each buffer starts on its own cache line and the header fields
+ * fit in that first line ahead of the data.
+ */
 struct packet
 {
     struct packet_head *head; // Points to the head of this list.
     struct packet *next; // Points to the next packet.
     struct packet *prev; // Points to the previous packet.
     struct nfq_q_handle *hq; // The Queue Handle to the Netfilter Queue.
+    struct fetcher *fetcher; // The fetcher that received this packet.
     u_int32_t id; // The ID of this packet in the Netfilter Queue.
+    u_int32_t node; // NUMA node of the slab this buffer was carved from.
+    __u64 received; // When the fetcher received it, 0 if it is not timed.
+    struct session *session; // Session counting this packet as queued, only used by its worker.
     unsigned char data[BUFSIZE]; // Stores the actual IP packet.
-};
+} __attribute__ ((aligned(64)));
 
-struct packet *newpacket(void);
+void init_packet(struct packet *thispacket);
 
-int save_packet(struct packet *thispacket,struct nfq_q_handle *hq, u_int32_t id, int ret, __u8 *originalpacket, struct session *thissession);
+int save_packet(struct packet *thispacket, struct fetcher *thisfetcher, struct nfq_q_handle *hq, u_int32_t id, int ret, __u8 *originalpacket, struct session *thissession);
+void release_packet_session(struct packet *thispacket);
 
 #endif /*PACKET_H_*/
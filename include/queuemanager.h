@@ -10,6 +10,19 @@
 #include "session.h"
 #include "packet.h"
 
+#define PACKETRINGSIZE 1024 // Slots in a packet ring must be a power of 2.
+
+/*
+ * Bounded lock-free queue with exactly one producer and one consumer.
+ * head is only written by the consumer and tail only by the producer
+ * so they are kept on separate cache lines.
+ */
+struct packet_ring {
+	u_int32_t head __attribute__ ((aligned(64))); // Next slot the consumer will read.
+	u_int32_t tail __attribute__ ((aligned(64))); // Next slot the producer will write.
+	struct packet *slots[PACKETRINGSIZE] __attribute__ ((aligned(64)));
+};
+
 int queue_packet(struct packet_head *queue, struct packet *thispacket);
 
 struct packet *dequeue_packet(struct packet_head *queue, int signal);
@@ -17,4 +30,16 @@ struct packet *dequeue_packet(struct packet_head *queue, int signal);
 u_int32_t move_queued_packets(struct packet_head *fromqueue,
 		struct packet_head *toqueue);
 
+u_int32_t move_some_queued_packets(struct packet_head *fromqueue,
+		struct packet_head *toqueue, u_int32_t max);
+
+void initialize_packet_ring(struct packet_ring *ring);
+
+int ring_queue_packet(struct packet_ring *ring, struct packet *thispacket);
+
+u_int32_t ring_dequeue_packets(struct packet_ring *ring,
+		struct packet **packets, u_int32_t max);
+
+u_int32_t ring_qlen(struct packet_ring *ring);
+
 #endif /*QUEUEMANAGER_H_*/
@@ -0,0 +1,35 @@
+#ifndef RCU_H_
+#define RCU_H_
+#define _GNU_SOURCE
+
+#include <linux/types.h>
+
+#define RCUMAXTHREADS 128 // Threads that can read RCU protected data at once.
+#define RCUBATCH 256 // Retired objects that start a reclaim pass.
+
+/*
+ * Put inside an object that is freed with call_rcu().
+ */
+struct rcu_head {
+	struct rcu_head *next;
+	__u64 epoch; // Epoch the object was retired in.
+	void (*func)(struct rcu_head *head);
+};
+
+/*
+ * Quiescent state based reclamation.
+ * A registered thread may use anything it found through RCU protected
+ * pointers until it calls rcu_quiescent_state() or rcu_thread_offline().
+ * Objects are freed once every online thread has done one of those
+ * since the object was unlinked, so readers never lock or wait.
+ */
+void rcu_register_thread();
+void rcu_unregister_thread();
+void rcu_quiescent_state();
+void rcu_thread_offline();
+void rcu_thread_online();
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head));
+void rcu_reclaim();
+__u32 rcu_pending();
+
+#endif /*RCU_H_*/
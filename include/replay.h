@@ -0,0 +1,51 @@
+#ifndef REPLAY_H_
+#define REPLAY_H_
+#define _GNU_SOURCE
+
+#include <stdio.h>
+
+#include <linux/types.h>
+#include <libnetfilter_queue/libnetfilter_queue.h>
+
+#include "fetcher.h"
+#include "packet.h"
+
+#define REPLAYWINDOW 1024 // Packets handed to the pipeline that have no verdict yet.
+#define REPLAYHEADROOM 64 // Room left in a buffer for the options a packet gets.
+#define LINKTYPE_ETHERNET 1
+#define LINKTYPE_RAW 101
+#define LINKTYPE_LINUX_SLL 113
+#define LINKTYPE_IPV4 228
+
+/*
+ * A packet read from the input capture.
+ */
+struct replay_record {
+	u_int32_t tssec;
+	u_int32_t tsusec;
+	u_int32_t len;
+	unsigned char *data; // The IP packet, the link header is removed.
+};
+
+/*
+ * What the stub Netfilter Queue saw.
+ * Latencies are in nanoseconds and indexed by packet ID - 1.
+ */
+struct replay_results {
+	__u64 packets;
+	__u64 bytesin;
+	__u64 bytesout;
+	__u64 accepted;
+	__u64 dropped;
+	__u64 rewritten; // Accepted with a payload that was changed.
+	__u64 *fetcherns; // Time spent in fetcher_callback().
+	__u64 *totalns; // Time from calling fetcher_callback() to the verdict.
+};
+
+void replay_initialize(__u64 numpackets, FILE *output);
+void replay_packet(struct fetcher *thisfetcher, struct replay_record *thisrecord);
+void replay_drain(void);
+struct replay_results *replay_get_results(void);
+__u64 replay_now(void);
+
+#endif /*REPLAY_H_*/
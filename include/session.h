@@ -4,6 +4,9 @@
 #include <sys/types.h>
 #include <linux/types.h>
 #include "ipc.h"
+#include "rcu.h"
+
+struct compression_stream;
 
 /* Structure used for the head of a session list. */
 struct session_head {
@@ -13,32 +16,95 @@ struct session_head {
 	pthread_mutex_t lock; // Lock for this session bucket.
 };
 
+/*
+ * The session hashtable.
+ * Readers keep using a table that was replaced until their next
+ * quiescent state so growing links the sessions into the new table
+ * with the other next pointer and leaves the old lists alone.
+ */
+struct session_table {
+	struct rcu_head rcu;
+	__u32 mask; // Number of buckets - 1.
+	int link; // Which next pointer of the sessions the lists use.
+	__u32 shard; // Shard the table belongs to.
+	struct session_head buckets[];
+};
+
+/*
+ * A slice of the sessions picked by the hash, one for each worker started.
+ * Each shard grows on its own so inserts and removals of one
+ * worker never wait on or share a cache line with another's.
+ */
+struct session_shard {
+	struct session_table *table;
+	struct session_table *retiringtable; // Replaced table readers might still use.
+	__u32 count; // Sessions in the table.
+	__u32 resizes; // Times the table has grown.
+	__u32 maxbuckets; // The table stops growing here.
+	pthread_rwlock_t lock; // Held for writing while the table grows.
+} __attribute__ ((aligned(64)));
+
+/*
+ * The fields matched and updated for every packet come first
+ * and the compression stream last so a session keeps both
+ * endpoints in its first cache line, see struct session.
+ */
 struct endpoint {
 	__u32 address;
 	__u16 port;
-	__u32 previoussequence;
+	__u8 incompressible; // Packets in a row that did not compress.
+	__u8 skipcompression; // Packets to send before trying to compress again.
+	char accelerator[OPENNOP_IPC_ID_LENGTH];
 	__u32 sequence;
 	__u32 nextsequence;
-	char accelerator[OPENNOP_IPC_ID_LENGTH];
+	__u32 previoussequence;
+	struct compression_stream *stream; // Compression history of data sent from this endpoint.
 };
 
-/* Structure used to store TCP session info. */
+/*
+ * Structure used to store TCP session info.
+ * The first cache line holds everything a packet of an established
+ * session reads: the resolved roles, the addresses and ports,
+ * the accelerator IDs, the sequence numbers and the session state.
+ * The list pointers and the rest are only used when the session
+ * is looked past, added, removed or compressed.
+ * Sessions come from slabs so they never share a cache line.
+ */
 struct session {
-	struct session_head *head; // Points to the head of this list.
-	struct session *next; // Points to the next session in the list.
+	__u16 role[2]; // What workers do with packets from larger and smaller, see session_role().
+	__u8 state; // Stores the TCP session state.
+	__u8 queue; // Worker that owns the session, moves when its worker is retired.
+	__u8 deadcounter; // Stores how many counts the session has been idle.
+	__u8 shard; // Shard the session is in, never changes.
+	struct endpoint larger;
+	struct endpoint smaller; // Stream pointer is the first field past the first cache line.
+
+	__u32 hash; // Picks the bucket, kept so the table can grow without rehashing.
+	__u32 queued; // Packets waiting for the worker or for their verdict to be sent, see bypass_packet().
+	struct session *next[2]; // Points to the next session in the list, see session_table.
 	struct session *prev; // Points to the previous session in the list.
+	struct session_head *head; // Points to the head of this list.
 	__u32 *client; // Points to the client IP Address.
 	__u32 *server; // Points to the server IP Address.
-	struct endpoint larger;
 	__u32 largerIPStartSEQ; // Stores the starting SEQ number.
 	__u32 largerIPNextAck;
-	struct endpoint smaller;
 	__u32 smallerIPStartSEQ; // Stores the starting SEQ number.
 	__u32 smallerIPNextAck;
-	__u8 deadcounter; // Stores how many counts the session has been idle.
-	__u8 state; // Stores the TCP session state.
-	__u8 queue; // What worker queue the packets for this session go to.
-};
+	struct rcu_head rcu; // Frees the session once no thread can be using it.
+	struct session *timernext; // Next session in the same idle timer slot.
+	struct session *timerprev;
+	__u32 timerslot; // Idle timer slot the session is in, see sessioncleanup.h.
+} __attribute__ ((aligned(64)));
 
+/*
+ * A region sessions are carved from.
+ * Slabs are never freed, free sessions are kept for new ones.
+ */
+struct session_slab {
+	struct session_slab *next; // Next slab in the arena.
+	struct session *sessions; // First session of this slab.
+	__u32 capacity; // Sessions that fit in this slab.
+	__u32 used; // Sessions carved from this slab so far.
+};
 
 #endif /*SESSION_H_*/
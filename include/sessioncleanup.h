@@ -2,15 +2,33 @@
 #define SESSIONCLEANUP_H_
 #define _GNU_SOURCE
 
+#include <pthread.h>
+
 #include <linux/types.h>
 
 #include "session.h"
 
+#define SESSIONTIMERSLOTS 64 // Idle timer slots, one per second, more than cleanup_timer.
+#define SESSIONTIMERNONE 0xffffffff // timerslot of a session that is in no slot.
+#define KEEPALIVEBATCH 64 // Keepalives sent with one system call.
+#define KEEPALIVESIZE 128 // Room for the IP and TCP headers of a keepalive.
+
+/*
+ * Sessions due to be checked for idle time in the same second.
+ */
+struct session_timer_slot {
+	struct session *next; // Points to the first session in the slot.
+	pthread_mutex_t lock; // Lock for this slot.
+};
+
 void sendkeepalive
 (__u32 saddr, __u16 source, __u32 seq,
 __u32 daddr, __u16 dest, __u32 ack_seq
 );
 
+void initialize_session_timers();
+void add_session_timer(struct session *thissession);
+void remove_session_timer(struct session *thissession);
 void start_dead_session_detection();
 void rejoin_dead_session_detection();
 
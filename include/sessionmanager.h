@@ -9,8 +9,19 @@
 
 #include "session.h"
 
-#define SESSIONBUCKETS 65536 // Number of buckets in the hash table for sessoin.
-__u16 sessionhash(__u32 largerIP, __u16 largerIPPort, __u32 smallerIP,
+#define SESSIONBUCKETS 65536 // Number of buckets the session shards start with together.
+#define SESSIONMINBUCKETS 1024 // Fewest buckets a shard starts with.
+#define SESSIONMAXBUCKETS (1 << 24) // The shards stop growing here together.
+#define SESSIONLOADFACTOR 2 // The table doubles when there are more sessions per bucket.
+#define SESSIONSLABSIZE (2 * 1024 * 1024) // Bytes in one session slab, the size of a huge page.
+#define SESSIONCACHESIZE 64 // Free sessions a thread moves to or from the slabs at once.
+
+#define SESSION_ROLE_UNKNOWN 0 // Not worked out yet or an accelerator ID changed.
+#define SESSION_ROLE_OPTIMIZE 1 // First accelerator and the other end has one too.
+#define SESSION_ROLE_PASSTHROUGH 2 // First accelerator but the other end has none.
+#define SESSION_ROLE_DEOPTIMIZE 3 // A neighbor optimized the data for this accelerator.
+#define SESSION_ROLE_RELAY 4 // A neighbor optimized the data for another accelerator.
+__u32 sessionhash(__u32 largerIP, __u16 largerIPPort, __u32 smallerIP,
 		__u16 smallerIPPort);
 void freemem(struct session_head *currentlist);
 struct session *insertsession(__u32 largerIP, __u16 largerIPPort,
@@ -23,13 +34,23 @@ void sort_sockets(__u32 *largerIP, __u16 *largerIPPort, __u32 *smallerIP,
 		__u16 dest);
 void initialize_sessiontable();
 void clear_sessiontable();
-struct session_head *getsessionhead(int i);
+__u32 get_sessionshards();
+struct session_head *getsessionhead(__u32 shard, __u32 i);
+struct session *getnextsession(struct session *currentsession);
+__u32 get_sessiontable_size(__u32 shard);
+__u32 move_worker_sessions(__u8 from, __u8 to);
+void lock_sessiontable();
+void unlock_sessiontable();
 struct commandresult cli_show_sessionss(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_show_sessiontable(int client_fd, char **parameters, int numparameters, void *data);
 int updateseq(__u32 largerIP, struct iphdr *iph, struct tcphdr *tcph,
 		struct session *thissession);
 int sourceisclient(__u32 largerIP, struct iphdr *iph, struct session *thisession);
 //int saveacceleratorid(__u32 largerIP, __u32 acceleratorID, struct iphdr *iph, struct session *thissession);
 int saveacceleratorid(__u32 largerIP, char *acceleratorID, struct iphdr *iph, struct session *thissession);
+int cached_direction_role(struct session *thissession, int direction);
+int cached_session_role(__u32 largerIP, struct iphdr *iph, struct session *thissession, char *remoteID);
+int session_role(__u32 largerIP, struct iphdr *iph, struct session *thissession, char *remoteID);
 
 
 #endif /*SESSIONMANAGER_H_*/
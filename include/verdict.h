@@ -0,0 +1,56 @@
+#ifndef VERDICT_H_
+#define VERDICT_H_
+#define _GNU_SOURCE
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <linux/types.h>
+#include <libnetfilter_queue/libnetfilter_queue.h> // for access to Netfilter Queue
+
+#include "packet.h"
+#include "counters.h"
+
+#define VERDICTBATCH 64 // Maximum number of verdicts sent with one sendmsg().
+
+/*
+ * One pre-built netlink verdict message.
+ * Every member is 4 byte aligned so the message needs no padding
+ * before the payload attribute data that follows it.
+ */
+struct verdict_msg {
+	struct nlmsghdr nlh;
+	struct nfgenmsg nfg;
+	struct nfattr verdictattr;
+	struct nfqnl_msg_verdict_hdr verdicthdr;
+	struct nfattr payloadattr;
+};
+
+/*
+ * Verdicts waiting to be sent to a Netfilter Queue.
+ * Each thread that issues verdicts owns one of these so no lock is needed.
+ * All pending verdicts are sent to the kernel with a single sendmsg().
+ */
+struct verdict_batch {
+	int fd; // Netlink socket the pending verdicts will be sent on.
+	u_int32_t count; // Number of verdicts pending.
+	u_int32_t iovlen; // Number of iovecs used by the pending verdicts.
+	struct verdict_msg msgs[VERDICTBATCH];
+	struct packet *packets[VERDICTBATCH]; // Packet buffers released after the batch is sent.
+	struct iovec iov[VERDICTBATCH * 3];
+	u_int32_t firstiov[VERDICTBATCH]; // First iovec of each verdict.
+	struct counters *metrics; // Counters of the thread that owns the batch, NULL if it keeps none.
+	int batchescounter; // Counts the batches sent.
+	int verdictscounter; // Counts the verdicts sent in them.
+};
+
+void initialize_verdict_batch(struct verdict_batch *batch, struct counters *metrics,
+		int batchescounter, int verdictscounter);
+int add_verdict(struct verdict_batch *batch, int fd, u_int16_t queuenum,
+		u_int32_t id, u_int32_t verdict, u_int32_t data_len,
+		unsigned char *data, struct packet *thispacket);
+int set_packet_verdict(struct verdict_batch *batch, struct packet *thispacket,
+		u_int32_t verdict, u_int32_t data_len, unsigned char *data);
+int flush_verdicts(struct verdict_batch *batch);
+
+#endif /*VERDICT_H_*/
@@ -13,41 +13,30 @@
 #include <netinet/tcp.h> // for tcpmagic and TCP options
 
 #include "packet.h"
+#include "queuemanager.h"
 #include "counters.h"
+#include "latency.h"
+#include "verdict.h"
 
 #define MAXWORKERS 255 // Maximum number of workers to process packets.
-struct workercounters {
-    /*
-     * number of packets processed.
-     * used for pps calculation. can roll.
-     * should increment at end of main loop after each packet is finished processing.
-     */
-    __u32 packets;
-    __u32 packetsprevious;
-    __u32 pps; // Where the calculated pps are stored.
+#define WORKERBATCH 32 // Maximum number of packets taken from the rings at once.
+#define WORKERSPINMIN 64 // Fewest times a worker polls the rings before sleeping.
+#define WORKERSPINMAX 8192 // Most times a worker polls the rings before sleeping.
+#define WORKERSCALEUPPPS 50000 // Average pps of a worker that adds workers.
+#define WORKERSCALEDOWNPPS 10000 // Average pps of a worker that can remove one.
+#define WORKERSCALEQLEN 512 // Packets waiting for one processor that add a worker.
+#define WORKERSCALEQUIETCHECKS 6 // Counter updates in a row under the lower limit before a worker is removed.
+#define WORKERBYPASSHIGH 4096 // Packets waiting for a processor that start the bypass.
+#define WORKERBYPASSLOW 1024 // Packets waiting for a processor that end the bypass.
 
-    /*
-     * number of bytes entering process.
-     * used for bps calculation. can roll.
-     * should increment as beginning of main loop after packet is received from queue.
-     */
-    __u32 bytesin;
-    __u32 bytesinprevious;
-    __u32 bpsin; // Where the calculated bps are stored.
-    __u32 bytesout;
-    __u32 bytesoutprevious;
-    __u32 bpsout; // Where the calculated bps are stored.
-
-    /*
-     * Stores when the counters were last updated.
-     */
-    struct timeval updated;
-
-    /*
-     * When something reads/writes to this counter it should use the lock.
-     */
-    pthread_mutex_t lock;
-};
+/*
+ * Counters of a processor, see struct counters.
+ */
+#define WORKERPACKETS 0 // Packets processed.
+#define WORKERBYTESIN 1 // Bytes of the packets taken from the queue.
+#define WORKERBYTESOUT 2 // Bytes of the packets accepted.
+#define WORKERVERDICTBATCHES 3 // Verdict batches sent.
+#define WORKERVERDICTS 4 // Verdicts sent in them.
 
 /*
  * This structure is a member of the worker structure.
@@ -58,9 +47,20 @@ struct workercounters {
 struct processor {
     pthread_t t_processor;
     int state; // Marks this thread as active. 1=running, 0=stopping, -1=stopped.
-    struct workercounters metrics;
-    struct packet_head queue;
+    struct counters metrics; // Only written by this thread.
+    struct latency_stats latency; // Only written by this thread.
+    struct packet_head queue; // Used when a ring is full or the packet has no fetcher.
+    struct packet_ring *rings; // One ring for each fetcher.
+    int numrings;
+    int sleeping; // Set while the thread waits on the queue signal.
+    u_int32_t spin; // How many times to poll the rings before sleeping.
+    struct packet *batch[WORKERBATCH]; // Packets taken from the rings not yet processed.
+    u_int32_t batchlen;
+    u_int32_t batchnext;
+    u_int32_t nextring; // Ring the next refill starts from so every fetcher gets a turn.
+    struct verdict_batch verdicts; // Verdicts waiting to be sent by this thread.
     __u8 *lzbuffer; // Buffer used for QuickLZ.
+    int bypassing; // The fetchers accept packets they can instead of queueing them, see FETCHERBYPASSED.
 };
 
 /* Structure contains the worker threads, queue, and status. */
@@ -68,13 +68,19 @@ struct worker {
     struct processor optimization; //Thread that will do all optimizations(input).  Coming from LAN.
     struct processor deoptimization; //Thread that will undo optimizations(output).  Coming from WAN.
     u_int32_t sessions; // Number of sessions assigned to the worker.
-    pthread_mutex_t lock; // Lock for this worker when adding sessions.
+    pthread_mutex_t lock; // Lock for this worker when changing its state.
 };
 
 void *worker_thread(void *dummyPtr);
 unsigned char get_workers(void);
 void set_workers(unsigned char desirednumworkers);
+unsigned char resize_workers(unsigned char desirednumworkers);
+void autoscale_workers(void);
+int bypass_packet(__u8 queue, int deoptimize, __u32 largerIP, struct iphdr *iph,
+                  struct tcphdr *tcph, struct session *thissession, char *remoteID, int *started);
 u_int32_t get_worker_sessions(int i);
+struct latency_stats *get_processor_latency(int worker, int deoptimization);
+void get_worker_verdict_counters(__u64 *batches, __u64 *verdicts);
 void create_worker(int i);
 void rejoin_worker(int i);
 void initialize_worker_processor(struct processor *thisprocessor);
@@ -87,6 +93,16 @@ int optimize_packet(__u8 queue, struct packet *thispacket);
 int deoptimize_packet(__u8 queue, struct packet *thispacket);
 void shutdown_workers();
 struct commandresult cli_show_workers(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_worker_count(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_worker_autoscale_enable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_worker_autoscale_disable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_worker_autoscale_range(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_worker_autoscale_pps(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_show_worker_autoscale(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_worker_bypass_enable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_worker_bypass_disable(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_worker_bypass_watermarks(int client_fd, char **parameters, int numparameters, void *data);
+struct commandresult cli_show_worker_bypass(int client_fd, char **parameters, int numparameters, void *data);
 void counter_updateworkermetrics(t_counterdata metric);
 struct session *closingsession(struct tcphdr *tcph, struct session *thissession);
 
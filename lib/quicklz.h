@@ -28,8 +28,8 @@
 
 	// If > 0, zero out both states prior to first call to qlz_compress() or qlz_decompress() 
 	// and decompress packets in the same order as they were compressed
-	#define QLZ_STREAMING_BUFFER 0
-	//#define QLZ_STREAMING_BUFFER 100000
+	//#define QLZ_STREAMING_BUFFER 0
+	#define QLZ_STREAMING_BUFFER 100000
 	//#define QLZ_STREAMING_BUFFER 1000000
 
 	// Guarantees that decompression of corrupted data cannot crash. Decreases decompression
@@ -0,0 +1,278 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <linux/types.h>
+
+#include "affinity.h"
+#include "fetcher.h"
+#include "worker.h"
+#include "logger.h"
+#include "climanager.h"
+
+static int affinitycpus[MAXAFFINITYCPUS]; // CPUs to pin to in the order they were listed.
+static int numaffinitycpus = 0; // 0 when no threads are pinned.
+static unsigned char cpunodes[MAXAFFINITYCPUS]; // NUMA node of each CPU.
+static int numanodes = 1;
+static __thread int localnode = AFFINITYNONE; // Node of the calling thread once it is known.
+
+/*
+ * Reads a list like "0-3,8,10-11" into cpus.
+ * Returns how many CPUs were read or -1 if the list is not valid.
+ */
+static int parse_cpulist(const char *cpulist, int *cpus, int maxcpus) {
+	const char *next = cpulist;
+	char *end;
+	long first, last;
+	int count = 0;
+
+	while (*next != '\0') {
+
+		if (isdigit((unsigned char)*next) == 0) {
+			return -1;
+		}
+		first = strtol(next, &end, 10);
+		last = first;
+
+		if (*end == '-') {
+			next = end + 1;
+
+			if (isdigit((unsigned char)*next) == 0) {
+				return -1;
+			}
+			last = strtol(next, &end, 10);
+		}
+
+		if ((last < first) || (last >= MAXAFFINITYCPUS)) {
+			return -1;
+		}
+
+		for (; (first <= last) && (count < maxcpus); first++) {
+			cpus[count++] = (int)first;
+		}
+
+		if (*end == ',') {
+			end++;
+		} else if ((*end != '\0') && (*end != '\n')) {
+			return -1;
+		} else {
+			break;
+		}
+		next = end;
+	}
+	return count;
+}
+
+/*
+ * Finds the node of every CPU from sysfs.
+ * Nodes past MAXNUMANODES share buffers with a lower node.
+ */
+static void read_cpu_nodes(void) {
+	DIR *nodes;
+	struct dirent *entry;
+	FILE *file;
+	char path[300];
+	char cpulist[1024];
+	int cpus[MAXAFFINITYCPUS];
+	int count, node, i;
+
+	memset(cpunodes, 0, sizeof(cpunodes));
+	numanodes = 1;
+	nodes = opendir("/sys/devices/system/node");
+
+	if (nodes == NULL) {
+		return;
+	}
+
+	while ((entry = readdir(nodes)) != NULL) {
+
+		if ((strncmp(entry->d_name, "node", 4) != 0) ||
+				(isdigit((unsigned char)entry->d_name[4]) == 0)) {
+			continue;
+		}
+		node = atoi(&entry->d_name[4]) % MAXNUMANODES;
+		snprintf(path, sizeof(path), "/sys/devices/system/node/%s/cpulist", entry->d_name);
+		file = fopen(path, "r");
+
+		if (file == NULL) {
+			continue;
+		}
+
+		if (fgets(cpulist, sizeof(cpulist), file) != NULL) {
+			count = parse_cpulist(cpulist, cpus, MAXAFFINITYCPUS);
+
+			for (i = 0; i < count; i++) {
+				cpunodes[cpus[i]] = node;
+			}
+		}
+		fclose(file);
+
+		if (node >= numanodes) {
+			numanodes = node + 1;
+		}
+	}
+	closedir(nodes);
+}
+
+/*
+ * Sets the CPUs threads are pinned to.
+ * Must be called before any thread is created.
+ * Returns -1 if the list is not valid.
+ */
+int set_cpu_affinity(const char *cpulist) {
+	int count;
+
+	count = parse_cpulist(cpulist, affinitycpus, MAXAFFINITYCPUS);
+
+	if (count <= 0) {
+		numaffinitycpus = 0;
+		return -1;
+	}
+	numaffinitycpus = count;
+	read_cpu_nodes();
+	return 0;
+}
+
+/*
+ * Maps a thread's place in the pinning order to its CPU.
+ */
+static int get_affinity_cpu(int slot) {
+
+	if (numaffinitycpus == 0) {
+		return AFFINITYNONE;
+	}
+
+	if ((slot == 0) || (numaffinitycpus == 1)) {
+		return affinitycpus[0];
+	}
+	return affinitycpus[1 + ((slot - 1) % (numaffinitycpus - 1))];
+}
+
+int get_housekeeping_cpu(void) {
+	return get_affinity_cpu(0);
+}
+
+int get_fetcher_cpu(int i) {
+	return get_affinity_cpu(1 + i);
+}
+
+int get_processor_cpu(int worker, int deoptimization) {
+	return get_affinity_cpu(1 + get_fetchers() + (worker * 2) + (deoptimization ? 1 : 0));
+}
+
+int get_cpu_node(int cpu) {
+
+	if ((cpu < 0) || (cpu >= MAXAFFINITYCPUS)) {
+		return 0;
+	}
+	return cpunodes[cpu];
+}
+
+/*
+ * Node the buffers of a worker's packets should come from.
+ */
+int get_processor_node(int worker, int deoptimization) {
+
+	if (numanodes == 1) {
+		return 0;
+	}
+	return get_cpu_node(get_processor_cpu(worker, deoptimization));
+}
+
+/*
+ * Node of the calling thread.
+ * Only pinned threads stay on one node so the first answer is kept.
+ */
+int get_local_node(void) {
+	int cpu;
+
+	if (numanodes == 1) {
+		return 0;
+	}
+
+	if (localnode == AFFINITYNONE) {
+		cpu = sched_getcpu();
+		localnode = get_cpu_node(cpu);
+	}
+	return localnode;
+}
+
+int get_numa_nodes(void) {
+	return numanodes;
+}
+
+/*
+ * Creates a thread that only runs on cpu.
+ * With AFFINITYNONE the thread is created the normal way.
+ */
+int create_pinned_thread(pthread_t *thread, int cpu, void *(*function)(void *), void *arg) {
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	int result;
+
+	if (cpu == AFFINITYNONE) {
+		return pthread_create(thread, NULL, function, arg);
+	}
+
+	pthread_attr_init(&attr);
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+	pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+	result = pthread_create(thread, &attr, function, arg);
+	pthread_attr_destroy(&attr);
+
+	return result;
+}
+
+struct commandresult cli_show_affinity(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result  = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	int i;
+
+	if (numaffinitycpus == 0) {
+		sprintf(msg, "Threads are not pinned.\n");
+		cli_send_feedback(client_fd, msg);
+
+	} else {
+		sprintf(msg, "numa nodes: %i\n", numanodes);
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg, "------------------------------------------\n");
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg, "| thread                 |  cpu  | node  |\n");
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg, "------------------------------------------\n");
+		cli_send_feedback(client_fd, msg);
+		sprintf(msg, "| %-23s| %-6i| %-6i|\n", "counters/memory",
+				get_housekeeping_cpu(), get_cpu_node(get_housekeeping_cpu()));
+		cli_send_feedback(client_fd, msg);
+
+		for (i = 0; i < get_fetchers(); i++) {
+			sprintf(msg, "| fetcher %-15i| %-6i| %-6i|\n", i,
+					get_fetcher_cpu(i), get_cpu_node(get_fetcher_cpu(i)));
+			cli_send_feedback(client_fd, msg);
+		}
+
+		for (i = 0; i < get_workers(); i++) {
+			sprintf(msg, "| worker %-3i optimize    | %-6i| %-6i|\n", i,
+					get_processor_cpu(i, false), get_processor_node(i, false));
+			cli_send_feedback(client_fd, msg);
+			sprintf(msg, "| worker %-3i deoptimize  | %-6i| %-6i|\n", i,
+					get_processor_cpu(i, true), get_processor_node(i, true));
+			cli_send_feedback(client_fd, msg);
+		}
+		sprintf(msg, "------------------------------------------\n");
+		cli_send_feedback(client_fd, msg);
+	}
+
+	result.finished = 0;
+	result.mode = NULL;
+	result.data = NULL;
+
+	return result;
+}
@@ -0,0 +1,356 @@
+#if defined(HAVE_CONFIG_H)
+#include "config.h"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "codec.h"
+#include "quicklz.h"
+
+#if defined(HAVE_LZ4)
+#include <lz4.h>
+#endif
+
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
+
+#include "packet.h"
+
+/*
+ * QuickLZ keeps its history inside the state.
+ * A full stream counter makes it compress the data on its own
+ * and start the history over.
+ */
+static void *quicklz_new_state(int compressing) {
+
+	if (compressing == true) {
+		return calloc(1, sizeof(qlz_state_compress));
+	}
+	return calloc(1, sizeof(qlz_state_decompress));
+}
+
+static void quicklz_free_state(void *state, int compressing) {
+	(void)compressing;
+	free(state);
+}
+
+static size_t quicklz_state_size(void *state, int compressing) {
+	(void)state;
+
+	if (compressing == true) {
+		return sizeof(qlz_state_compress);
+	}
+	return sizeof(qlz_state_decompress);
+}
+
+static size_t quicklz_compress(void *state, const __u8 *source, size_t size,
+		__u8 *destination, size_t capacity, int level, int reset) {
+	qlz_state_compress *state_compress = (qlz_state_compress *) state;
+
+	(void)level;
+
+	if (capacity < size + 400) {
+		return 0;
+	}
+
+	if (reset == true) {
+		state_compress->stream_counter = QLZ_STREAMING_BUFFER;
+	}
+	return qlz_compress(source, (char *) destination, size, state_compress);
+}
+
+static size_t quicklz_decompress(void *state, const __u8 *source, size_t size,
+		__u8 *destination, size_t capacity, int reset) {
+	qlz_state_decompress *state_decompress = (qlz_state_decompress *) state;
+
+	/*
+	 * Check the QuickLZ header before trusting it.
+	 */
+	if ((size < 3) || (qlz_size_compressed((const char *) source) != size) ||
+			(qlz_size_decompressed((const char *) source) > capacity)) {
+		return 0;
+	}
+
+	if (reset == true) {
+		state_decompress->stream_counter = QLZ_STREAMING_BUFFER;
+	}
+	return qlz_decompress((const char *) source, destination, state_decompress);
+}
+
+static size_t quicklz_bound(size_t size) {
+	return size + 400;
+}
+
+#if defined(HAVE_LZ4)
+/*
+ * LZ4 needs the data it refers back to left in place.
+ * Packets are copied into a ring that always holds the last
+ * LZ4HISTORY bytes and both sides wrap it at the same point.
+ */
+struct lz4_state {
+	LZ4_stream_t *stream; // Used by the compressing side.
+	LZ4_streamDecode_t *streamdecode; // Used by the decompressing side.
+	size_t offset; // Where the next packet goes in the ring.
+	char ring[LZ4HISTORY + BUFSIZE];
+};
+
+static void *lz4_new_state(int compressing) {
+	struct lz4_state *state = calloc(1, sizeof(struct lz4_state));
+
+	if (state == NULL) {
+		return NULL;
+	}
+
+	if (compressing == true) {
+		state->stream = LZ4_createStream();
+	} else {
+		state->streamdecode = LZ4_createStreamDecode();
+	}
+
+	if ((state->stream == NULL) && (state->streamdecode == NULL)) {
+		free(state);
+		return NULL;
+	}
+	return state;
+}
+
+static void lz4_free_state(void *state, int compressing) {
+	struct lz4_state *thisstate = (struct lz4_state *) state;
+
+	(void)compressing;
+
+	if (thisstate->stream != NULL) {
+		LZ4_freeStream(thisstate->stream);
+	}
+
+	if (thisstate->streamdecode != NULL) {
+		LZ4_freeStreamDecode(thisstate->streamdecode);
+	}
+	free(thisstate);
+}
+
+static size_t lz4_state_size(void *state, int compressing) {
+	(void)state;
+	(void)compressing;
+	return sizeof(struct lz4_state);
+}
+
+/*
+ * Both sides wrap when a full packet might not fit
+ * because the decompressing side does not know the size yet.
+ */
+static char *lz4_ring_slot(struct lz4_state *state, int reset) {
+
+	if ((reset == true) || (state->offset + BUFSIZE > sizeof(state->ring))) {
+		state->offset = 0;
+	}
+	return state->ring + state->offset;
+}
+
+static size_t lz4_compress(void *state, const __u8 *source, size_t size,
+		__u8 *destination, size_t capacity, int level, int reset) {
+	struct lz4_state *thisstate = (struct lz4_state *) state;
+	char *slot;
+	int newsize;
+
+	if (size > BUFSIZE) {
+		return 0;
+	}
+
+	if (reset == true) {
+		LZ4_resetStream_fast(thisstate->stream);
+	}
+	slot = lz4_ring_slot(thisstate, reset);
+	memcpy(slot, source, size);
+	newsize = LZ4_compress_fast_continue(thisstate->stream, slot,
+			(char *) destination, (int) size, (int) capacity, level);
+
+	if (newsize <= 0) {
+		return 0;
+	}
+	thisstate->offset += size;
+	return (size_t) newsize;
+}
+
+static size_t lz4_decompress(void *state, const __u8 *source, size_t size,
+		__u8 *destination, size_t capacity, int reset) {
+	struct lz4_state *thisstate = (struct lz4_state *) state;
+	char *slot;
+	int newsize;
+
+	if (capacity > BUFSIZE) {
+		capacity = BUFSIZE;
+	}
+
+	if (reset == true) {
+		LZ4_setStreamDecode(thisstate->streamdecode, NULL, 0);
+	}
+	slot = lz4_ring_slot(thisstate, reset);
+	newsize = LZ4_decompress_safe_continue(thisstate->streamdecode,
+			(const char *) source, slot, (int) size, (int) capacity);
+
+	if (newsize <= 0) {
+		return 0;
+	}
+	memcpy(destination, slot, newsize);
+	thisstate->offset += newsize;
+	return (size_t) newsize;
+}
+
+static size_t lz4_bound(size_t size) {
+	return (size_t) LZ4_compressBound((int) size);
+}
+#endif
+
+#if defined(HAVE_ZSTD)
+/*
+ * zstd keeps one frame open for the whole stream and
+ * flushes a block for every packet.
+ */
+static void *zstd_new_state(int compressing) {
+
+	if (compressing == true) {
+		return ZSTD_createCCtx();
+	}
+	return ZSTD_createDCtx();
+}
+
+static void zstd_free_state(void *state, int compressing) {
+
+	if (compressing == true) {
+		ZSTD_freeCCtx((ZSTD_CCtx *) state);
+	} else {
+		ZSTD_freeDCtx((ZSTD_DCtx *) state);
+	}
+}
+
+static size_t zstd_state_size(void *state, int compressing) {
+
+	if (compressing == true) {
+		return ZSTD_sizeof_CCtx((ZSTD_CCtx *) state);
+	}
+	return ZSTD_sizeof_DCtx((ZSTD_DCtx *) state);
+}
+
+static size_t zstd_compress(void *state, const __u8 *source, size_t size,
+		__u8 *destination, size_t capacity, int level, int reset) {
+	ZSTD_CCtx *cctx = (ZSTD_CCtx *) state;
+	ZSTD_inBuffer in = { source, size, 0 };
+	ZSTD_outBuffer out = { destination, capacity, 0 };
+	size_t remaining;
+
+	if (reset == true) {
+		ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, level);
+		ZSTD_CCtx_setParameter(cctx, ZSTD_c_windowLog, ZSTDWINDOWLOG);
+	}
+	remaining = ZSTD_compressStream2(cctx, &out, &in, ZSTD_e_flush);
+
+	if ((ZSTD_isError(remaining)) || (remaining != 0) || (in.pos != size)) {
+		return 0;
+	}
+	return out.pos;
+}
+
+static size_t zstd_decompress(void *state, const __u8 *source, size_t size,
+		__u8 *destination, size_t capacity, int reset) {
+	ZSTD_DCtx *dctx = (ZSTD_DCtx *) state;
+	ZSTD_inBuffer in = { source, size, 0 };
+	ZSTD_outBuffer out = { destination, capacity, 0 };
+	size_t result;
+
+	if (reset == true) {
+		ZSTD_DCtx_reset(dctx, ZSTD_reset_session_only);
+	}
+
+	while (in.pos < in.size) {
+		result = ZSTD_decompressStream(dctx, &out, &in);
+
+		if ((ZSTD_isError(result)) || (out.pos == out.size)) {
+			return 0;
+		}
+	}
+	return out.pos;
+}
+
+static size_t zstd_bound(size_t size) {
+	return ZSTD_compressBound(size);
+}
+#endif
+
+static const struct codec codecs[] = {
+	{
+		.name = "quicklz",
+		.id = CODEC_QUICKLZ,
+		.level = 1,
+		.minlevel = 1,
+		.maxlevel = 1,
+		.new_state = quicklz_new_state,
+		.free_state = quicklz_free_state,
+		.state_size = quicklz_state_size,
+		.compress = quicklz_compress,
+		.decompress = quicklz_decompress,
+		.bound = quicklz_bound,
+	},
+#if defined(HAVE_LZ4)
+	{
+		.name = "lz4",
+		.id = CODEC_LZ4,
+		.level = 1, // LZ4 acceleration, higher is faster.
+		.minlevel = 1,
+		.maxlevel = LZ4_ACCELERATION_MAX,
+		.new_state = lz4_new_state,
+		.free_state = lz4_free_state,
+		.state_size = lz4_state_size,
+		.compress = lz4_compress,
+		.decompress = lz4_decompress,
+		.bound = lz4_bound,
+	},
+#endif
+#if defined(HAVE_ZSTD)
+	{
+		.name = "zstd",
+		.id = CODEC_ZSTD,
+		.level = 3,
+		.minlevel = 1,
+		.maxlevel = 19,
+		.new_state = zstd_new_state,
+		.free_state = zstd_free_state,
+		.state_size = zstd_state_size,
+		.compress = zstd_compress,
+		.decompress = zstd_decompress,
+		.bound = zstd_bound,
+	},
+#endif
+};
+
+/*
+ * Returns the codec with this ID or NULL if it was not built in.
+ */
+const struct codec *get_codec(__u8 id) {
+	unsigned int i;
+
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+
+		if (codecs[i].id == id) {
+			return &codecs[i];
+		}
+	}
+	return NULL;
+}
+
+const struct codec *find_codec(const char *name) {
+	unsigned int i;
+
+	for (i = 0; i < sizeof(codecs) / sizeof(codecs[0]); i++) {
+
+		if (strcmp(codecs[i].name, name) == 0) {
+			return &codecs[i];
+		}
+	}
+	return NULL;
+}
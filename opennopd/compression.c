@@ -2,21 +2,42 @@
 #include <string.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <netinet/ip.h> // for tcpmagic and TCP options
 #include <netinet/tcp.h> // for tcpmagic and TCP options
+#include <arpa/inet.h>
+
 #include "compression.h"
-#include "quicklz.h"
+#include "codec.h"
+#include "packet.h"
+#include "ipc.h"
+#include "rcu.h"
+#include "sessionmanager.h"
 #include "tcpoptions.h"
 #include "logger.h"
 #include "climanager.h"
 
 int compression = true; // Determines if opennop should compress tcp data.
+int streaming = true; // Determines if sessions to neighbors that support it keep their compression history.
+__u64 streammemory = 0; // Bytes used by compression stream states.
+__u64 maxstreammemory = (__u64)COMPRESSIONSTREAMMEMORY * 1024 * 1024; // Bytes compressing streams may use.
+__u64 incompressiblepackets = 0; // Packets sent without trying to compress them.
+__u8 defaultcodec = CODEC_QUICKLZ; // Codec used when no port or neighbor has one.
+int defaultcodeclevel = 1;
+struct codec_port codecports[MAXCODECPORTS]; // Ports with their own codec.
+static struct {
+	char peerid[OPENNOP_IPC_ID_LENGTH]; // Accelerator that compressed the stream.
+	struct ipc_stream_id stream;
+} desyncs[COMPRESSIONDESYNCS]; // Streams that lost sync not yet reported to their peers.
+static int numdesyncs = 0;
+static pthread_mutex_t desyncslock = PTHREAD_MUTEX_INITIALIZER;
 int DEBUG_COMPRESSION = false;
 
 struct commandresult cli_show_compression(int client_fd, char **parameters, int numparameters, void *data) {
 	struct commandresult result  = { 0 };
 	char msg[MAX_BUFFER_SIZE] = { 0 };
+	int i;
 
 	if (compression == true) {
 		sprintf(msg, "compression enabled\n");
@@ -25,6 +46,34 @@ struct commandresult cli_show_compression(int client_fd, char **parameters, int
 	}
 	cli_send_feedback(client_fd, msg);
 
+	if (streaming == true) {
+		sprintf(msg, "streaming enabled\n");
+	} else {
+		sprintf(msg, "streaming disabled\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+	sprintf(msg, "stream memory: %llu/%llu KB\n",
+			(unsigned long long)(__atomic_load_n(&streammemory, __ATOMIC_RELAXED) / 1024),
+			(unsigned long long)(maxstreammemory / 1024));
+	cli_send_feedback(client_fd, msg);
+
+	sprintf(msg, "incompressible packets skipped: %llu\n",
+			(unsigned long long)__atomic_load_n(&incompressiblepackets, __ATOMIC_RELAXED));
+	cli_send_feedback(client_fd, msg);
+
+	sprintf(msg, "codec: %s level %i\n", get_codec(defaultcodec)->name, defaultcodeclevel);
+	cli_send_feedback(client_fd, msg);
+
+	for (i = 0; i < MAXCODECPORTS; i++) {
+
+		if (codecports[i].port != 0) {
+			sprintf(msg, "codec port %u: %s level %i\n", codecports[i].port,
+					get_codec(codecports[i].codec)->name, codecports[i].level);
+			cli_send_feedback(client_fd, msg);
+		}
+	}
+
     result.finished = 0;
     result.mode = NULL;
     result.data = NULL;
@@ -60,14 +109,569 @@ struct commandresult cli_compression_disable(int client_fd, char **parameters, i
     return result;
 }
 
+struct commandresult cli_compression_streaming_enable(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	streaming = true;
+	sprintf(msg, "streaming enabled\n");
+	cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_compression_streaming_disable(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	streaming = false;
+	sprintf(msg, "streaming disabled\n");
+	cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+/** @brief Sets the memory compressing streams may use.
+ *
+ * Sessions that would go over the limit compress each packet on its own.
+ * Streams that already exist keep their memory.
+ *
+ * @param parameters [in] Megabytes of memory.
+ * @param numparameters [in] Should be 1.
+ */
+struct commandresult cli_compression_streaming_memory(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	char *end = NULL;
+	unsigned long megabytes = 0;
+
+	if (numparameters == 1) {
+		megabytes = strtoul(parameters[0], &end, 10);
+	}
+
+	if ((end != NULL) && (end != parameters[0]) && (*end == '\0')) {
+		maxstreammemory = (__u64)megabytes * 1024 * 1024;
+		sprintf(msg, "stream memory %s MB\n", parameters[0]);
+	} else {
+		sprintf(msg, "Usage: compression streaming memory <megabytes>\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+/*
+ * Reads the codec name and optional level at parameters[first].
+ * Returns the codec or NULL if the name or level is not valid.
+ */
+static const struct codec *parse_codec(char **parameters, int numparameters, int first, int *level) {
+	const struct codec *thiscodec = NULL;
+
+	if ((numparameters <= first) || (numparameters > first + 2)) {
+		return NULL;
+	}
+	thiscodec = find_codec(parameters[first]);
+
+	if (thiscodec == NULL) {
+		return NULL;
+	}
+	*level = thiscodec->level;
+
+	if (numparameters == first + 2) {
+		*level = atoi(parameters[first + 1]);
+
+		if ((*level < thiscodec->minlevel) || (*level > thiscodec->maxlevel)) {
+			return NULL;
+		}
+	}
+	return thiscodec;
+}
+
+static int cli_compression_codec_help(int client_fd) {
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+
+	sprintf(msg, "Usage: compression codec default <codec> [level]\n");
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg, "       compression codec port <port> <codec> [level]\n");
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg, "       compression codec neighbor <ip> <codec> [level]\n");
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg, "Codecs:");
+
+	if (get_codec(CODEC_QUICKLZ) != NULL) {
+		strcat(msg, " quicklz");
+	}
+
+	if (get_codec(CODEC_LZ4) != NULL) {
+		strcat(msg, " lz4");
+	}
+
+	if (get_codec(CODEC_ZSTD) != NULL) {
+		strcat(msg, " zstd");
+	}
+	strcat(msg, "\n");
+	cli_send_feedback(client_fd, msg);
+	return 0;
+}
+
+/** @brief Sets the codec used when no port or neighbor has one.
+ *
+ * @param parameters [in] Codec name and optional level.
+ * @param numparameters [in] Should be 1 or 2.
+ */
+struct commandresult cli_compression_codec_default(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result = { 0 };
+	const struct codec *thiscodec = NULL;
+	int level = 0;
+
+	thiscodec = parse_codec(parameters, numparameters, 0, &level);
+
+	if (thiscodec != NULL) {
+		defaultcodec = thiscodec->id;
+		defaultcodeclevel = level;
+	} else {
+		cli_compression_codec_help(client_fd);
+	}
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+/** @brief Sets the codec used for sessions to or from a port.
+ *
+ * @param parameters [in] Port, codec name and optional level.
+ * @param numparameters [in] Should be 2 or 3.
+ */
+struct commandresult cli_compression_codec_port(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result = { 0 };
+	const struct codec *thiscodec = NULL;
+	struct codec_port *slot = NULL;
+	int level = 0;
+	int port = 0;
+	int i;
+
+	thiscodec = parse_codec(parameters, numparameters, 1, &level);
+
+	if (thiscodec != NULL) {
+		port = atoi(parameters[0]);
+	}
+
+	if ((port > 0) && (port <= 65535)) {
+
+		for (i = 0; i < MAXCODECPORTS; i++) {
+
+			if (codecports[i].port == port) {
+				slot = &codecports[i];
+				break;
+			}
+
+			if ((slot == NULL) && (codecports[i].port == 0)) {
+				slot = &codecports[i];
+			}
+		}
+	}
+
+	if (slot != NULL) {
+		slot->codec = thiscodec->id;
+		slot->level = level;
+		slot->port = (__u16)port;
+	} else {
+		cli_compression_codec_help(client_fd);
+	}
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_no_compression_codec_port(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result = { 0 };
+	int port = 0;
+	int i;
+
+	if (numparameters == 1) {
+		port = atoi(parameters[0]);
+	}
+
+	for (i = 0; (port > 0) && (i < MAXCODECPORTS); i++) {
+
+		if (codecports[i].port == port) {
+			codecports[i].port = 0;
+		}
+	}
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+/** @brief Sets the codec used for sessions through a neighbor.
+ *
+ * @param parameters [in] Neighbor IP, codec name and optional level.
+ * @param numparameters [in] Should be 2 or 3.
+ */
+struct commandresult cli_compression_codec_neighbor(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	const struct codec *thiscodec = NULL;
+	__u32 neighborIP = 0;
+	int level = 0;
+
+	thiscodec = parse_codec(parameters, numparameters, 1, &level);
+
+	if ((thiscodec == NULL) || (inet_pton(AF_INET, parameters[0], &neighborIP) != 1)) {
+		cli_compression_codec_help(client_fd);
+
+	} else if (set_neighbor_codec(neighborIP, thiscodec->id, level) != 0) {
+		sprintf(msg, "No neighbor %s.\n", parameters[0]);
+		cli_send_feedback(client_fd, msg);
+	}
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+/*
+ * Gets the accelerator that data from source is sent to
+ * from the neighbors this worker has already looked up.
+ * Without a session both sides are this accelerator and NULL is returned.
+ */
+struct compression_peer *get_compression_peer(struct compression_context *context,
+		struct session *thissession, struct endpoint *source) {
+	struct endpoint *destination = NULL;
+	struct compression_peer *peer = NULL;
+	__u32 generation;
+	int i;
+
+	if (thissession == NULL) {
+		return NULL;
+	}
+	destination = (source == &thissession->larger) ? &thissession->smaller : &thissession->larger;
+	generation = get_neighbor_generation() + 1;
+
+	for (i = 0; i < COMPRESSIONPEERS; i++) {
+
+		if ((context->peers[i].generation != 0) &&
+				(compare_opennopid(context->peers[i].id, destination->accelerator) == 1)) {
+			peer = &context->peers[i];
+
+			if (peer->generation == generation) {
+				return peer;
+			}
+			break;
+		}
+	}
+
+	if (peer == NULL) {
+		peer = &context->peers[context->nextpeer];
+		context->nextpeer = (context->nextpeer + 1) % COMPRESSIONPEERS;
+		memcpy(peer->id, destination->accelerator, OPENNOP_IPC_ID_LENGTH);
+	}
+	peer->features = get_neighbor_features(destination->accelerator);
+	peer->level = 0;
+	peer->codec = get_neighbor_codec(destination->accelerator, &peer->level);
+	peer->generation = generation;
+
+	return peer;
+}
+
+/*
+ * Picks the codec for data sent from source to peer.
+ * A codec for either port of the session is used first
+ * then a codec for the neighbor the data is sent to.
+ * Peers that do not support it are sent QuickLZ.
+ */
+static const struct codec *select_codec(struct session *thissession, struct compression_peer *peer,
+		__u32 features, int *level) {
+	const struct codec *thiscodec = NULL;
+	int codecid = -1;
+	int i;
+
+	if (thissession != NULL) {
+
+		for (i = 0; (codecid < 0) && (i < MAXCODECPORTS); i++) {
+
+			if ((codecports[i].port != 0) &&
+					((codecports[i].port == ntohs(thissession->larger.port)) ||
+					(codecports[i].port == ntohs(thissession->smaller.port)))) {
+				codecid = codecports[i].codec;
+				*level = codecports[i].level;
+			}
+		}
+
+	}
+
+	if ((codecid < 0) && (peer != NULL) && (peer->codec >= 0)) {
+		codecid = peer->codec;
+		*level = peer->level;
+	}
+
+	if (codecid >= 0) {
+		thiscodec = get_codec((__u8)codecid);
+	}
+
+	if (thiscodec == NULL) {
+		thiscodec = get_codec(defaultcodec);
+		*level = defaultcodeclevel;
+	}
+
+	if ((thiscodec->id != CODEC_QUICKLZ) && ((features & OPENNOP_FEATURE_CODEC(thiscodec->id)) == 0)) {
+		thiscodec = get_codec(CODEC_QUICKLZ);
+		*level = thiscodec->level;
+	}
+	return thiscodec;
+}
+
+/*
+ * Accounts for the memory of a stream state.
+ * Only compressing streams are held to the limit because
+ * the decompressing side has to follow what its peer sends.
+ */
+static int reserve_stream_memory(size_t size, int limited) {
+
+	if (__atomic_add_fetch(&streammemory, size, __ATOMIC_RELAXED) > maxstreammemory) {
+
+		if (limited == true) {
+			__atomic_sub_fetch(&streammemory, size, __ATOMIC_RELAXED);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Replaces the state of one side of a stream with a new state of thiscodec.
+ * Returns the new state or NULL if it could not be created.
+ */
+static void *new_stream_state(struct compression_stream *stream, const struct codec *thiscodec, int compressing) {
+	const struct codec **currentcodec;
+	void **state;
+	size_t size;
+
+	if (compressing == true) {
+		currentcodec = &stream->compresscodec;
+		state = &stream->state_compress;
+	} else {
+		currentcodec = &stream->decompresscodec;
+		state = &stream->state_decompress;
+	}
+
+	if (*state != NULL) {
+		size = (*currentcodec)->state_size(*state, compressing);
+		(*currentcodec)->free_state(*state, compressing);
+		__atomic_sub_fetch(&streammemory, size, __ATOMIC_RELAXED);
+		stream->memory -= size;
+		*state = NULL;
+		*currentcodec = NULL;
+	}
+	*state = thiscodec->new_state(compressing);
+
+	if (*state == NULL) {
+		return NULL;
+	}
+	size = thiscodec->state_size(*state, compressing);
+
+	if (reserve_stream_memory(size, compressing) == false) {
+		thiscodec->free_state(*state, compressing);
+		*state = NULL;
+		return NULL;
+	}
+	stream->memory += size;
+	*currentcodec = thiscodec;
+	return *state;
+}
+
+static struct compression_stream *get_compression_stream(struct endpoint *source) {
+
+	if ((source != NULL) && (source->stream == NULL)) {
+		source->stream = calloc(1, sizeof(struct compression_stream));
+	}
+	return source->stream;
+}
+
+/*
+ * Frees the compression stream of an endpoint.
+ */
+void release_compression_stream(struct endpoint *thisendpoint) {
+	struct compression_stream *stream = thisendpoint->stream;
+
+	if (stream != NULL) {
+
+		if (stream->state_compress != NULL) {
+			stream->compresscodec->free_state(stream->state_compress, true);
+		}
+
+		if (stream->state_decompress != NULL) {
+			stream->decompresscodec->free_state(stream->state_decompress, false);
+		}
+		__atomic_sub_fetch(&streammemory, stream->memory, __ATOMIC_RELAXED);
+		free(stream);
+		thisendpoint->stream = NULL;
+	}
+}
+
+/*
+ * Gets the state a worker uses to compress or decompress
+ * packets without a stream creating it the first time.
+ */
+static void *get_context_state(struct compression_context *context, const struct codec *thiscodec, int compressing) {
+	void **state;
+
+	if (compressing == true) {
+		state = &context->state_compress[thiscodec->id];
+	} else {
+		state = &context->state_decompress[thiscodec->id];
+	}
+
+	if (*state == NULL) {
+		*state = thiscodec->new_state(compressing);
+	}
+	return *state;
+}
+
+void release_compression_context(struct compression_context *context) {
+	const struct codec *thiscodec;
+	int i;
+
+	for (i = 0; i < MAXCODECS; i++) {
+		thiscodec = get_codec(i);
+
+		if (context->state_compress[i] != NULL) {
+			thiscodec->free_state(context->state_compress[i], true);
+			context->state_compress[i] = NULL;
+		}
+
+		if (context->state_decompress[i] != NULL) {
+			thiscodec->free_state(context->state_decompress[i], false);
+			context->state_decompress[i] = NULL;
+		}
+	}
+}
+
+void set_compression_streaming(int enabled) {
+	streaming = enabled;
+}
+
+/*
+ * Sets the codec used when no port or neighbor has one.
+ */
+void set_compression_codec(__u8 codec, int level) {
+	defaultcodec = codec;
+	defaultcodeclevel = level;
+}
+
+/*
+ * Guesses if data is too random to compress by sampling its bytes.
+ * Samples of random data spread across all byte values so few pairs
+ * of them match while text and protocol headers repeat the same values.
+ * Four histograms keep the increments from waiting on each other.
+ */
+static int looks_incompressible(const __u8 *data, __u16 size) {
+	__u8 histogram[4][256];
+	unsigned int collisions = 0;
+	unsigned int stride, count, i;
+
+	if (size < ENTROPYSAMPLES) {
+		return false;
+	}
+	memset(histogram, 0, sizeof(histogram));
+	stride = size / ENTROPYSAMPLES;
+
+	for (i = 0; i < ENTROPYSAMPLES * stride; i += 4 * stride) {
+		histogram[0][data[i]]++;
+		histogram[1][data[i + stride]]++;
+		histogram[2][data[i + 2 * stride]]++;
+		histogram[3][data[i + 3 * stride]]++;
+	}
+
+	for (i = 0; i < 256; i++) {
+		count = histogram[0][i] + histogram[1][i] + histogram[2][i] + histogram[3][i];
+		collisions += count * (count - 1) / 2;
+	}
+	return collisions < ENTROPYMAXCOLLISIONS;
+}
+
+/*
+ * Counts a packet that did not compress against its endpoint.
+ * Each one in a row doubles how many packets are sent before trying again.
+ */
+static void count_incompressible(struct endpoint *source) {
+
+	if (source != NULL) {
+
+		if (source->incompressible < INCOMPRESSIBLEBACKOFF) {
+			source->incompressible++;
+		}
+		source->skipcompression = (1 << (source->incompressible - 1)) - 1;
+	}
+}
+
+/*
+ * Returns true if the data should be sent without trying to compress it.
+ * Skipped data never enters the stream history so the stream stays in sync
+ * unless the skipped packet was a retransmission.
+ */
+static int skip_compression(const __u8 *data, __u16 size, struct endpoint *source, int resync) {
+	int skip = false;
+
+	if ((source != NULL) && (source->skipcompression > 0)) {
+		source->skipcompression--;
+		skip = true;
+
+	} else if (looks_incompressible(data, size) == true) {
+		count_incompressible(source);
+		skip = true;
+	}
+
+	if (skip == true) {
+		__atomic_add_fetch(&incompressiblepackets, 1, __ATOMIC_RELAXED);
+
+		if ((resync == true) && (source != NULL) && (source->stream != NULL)) {
+			__atomic_store_n(&source->stream->reset, true, __ATOMIC_RELAXED);
+		}
+	}
+	return skip;
+}
+
 /*
  * Compresses the TCP data of an SKB.
+ * Data is compressed with the history of the source endpoint when it has a stream.
+ * resync restarts the stream because the peer may have missed a packet.
  */
-unsigned int tcp_compress(__u8 *ippacket, __u8 *lzbuffer,
-	qlz_state_compress *state_compress) {
+unsigned int tcp_compress(__u8 *ippacket, __u8 *lzbuffer, struct compression_context *context,
+	struct session *thissession, struct endpoint *source, int resync) {
 	struct iphdr *iph = NULL;
 	struct tcphdr *tcph = NULL;
+	struct compression_stream *stream = NULL;
+	const struct codec *thiscodec = NULL;
+	void *state = NULL;
+	int level = 0;
+	int reset = true;
+	__u32 features = 0; /* What the peer can decompress. */
+	struct compression_peer *peer = NULL; /* Neighbor the data is sent to. */
 	__u16 oldsize = 0, newsize = 0; /* Store old, and new size of the TCP data. */
+	__u16 flags = 0; /* Compression flags sent to the peer. */
+	__u16 sequence = 0; /* Position of the packet in its stream. */
 	__u8 *tcpdata = NULL; /* Starting location for the TCP data. */
 	char message[LOGSZ];
 
@@ -76,10 +680,9 @@ unsigned int tcp_compress(__u8 *ippacket, __u8 *lzbuffer,
 		logger(LOG_INFO, message);
 	}
 
-	// If the skb or state_compress is NULL abort compression.
-	if ((ippacket != NULL) && (NULL != state_compress) && (compression == true)) {
+	// If the skb or context is NULL abort compression.
+	if ((ippacket != NULL) && (NULL != context) && (compression == true)) {
 		iph = (struct iphdr *) ippacket; // Access ip header.
-		memset(state_compress, 0, sizeof(qlz_state_compress));
 
 		if ((iph->protocol == IPPROTO_TCP)) { // If this is not a TCP segment abort compression.
 			tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl);
@@ -94,6 +697,10 @@ unsigned int tcp_compress(__u8 *ippacket, __u8 *lzbuffer,
 				logger(LOG_INFO, message);
 			}
 
+			if ((oldsize > 0) && (skip_compression(tcpdata, oldsize, source, resync) == true)) {
+				return 1;
+			}
+
 			if (oldsize > 0) { // Only compress if there is any data.
 				newsize = (oldsize * 2);
 
@@ -104,8 +711,53 @@ unsigned int tcp_compress(__u8 *ippacket, __u8 *lzbuffer,
 						logger(LOG_INFO, message);
 					}
 
-					newsize = qlz_compress((char *) tcpdata, (char *) lzbuffer,
-							oldsize, state_compress);
+					peer = get_compression_peer(context, thissession, source);
+					features = (peer != NULL) ? peer->features : get_local_features();
+
+					if ((streaming == true) && ((features & OPENNOP_FEATURE_STREAM) != 0)) {
+						stream = get_compression_stream(source);
+					}
+
+					if (stream != NULL) {
+
+						if ((resync == true) || (__atomic_load_n(&stream->reset, __ATOMIC_RELAXED) == true) ||
+								(stream->state_compress == NULL)) {
+							/*
+							 * Restarts are where the stream can change codec.
+							 */
+							thiscodec = select_codec(thissession, peer, features, &level);
+
+							if ((thiscodec == stream->compresscodec) ||
+									(new_stream_state(stream, thiscodec, true) != NULL)) {
+								stream->level = level;
+								stream->sequence = 0;
+								__atomic_store_n(&stream->reset, false, __ATOMIC_RELAXED);
+								stream->resets++;
+								flags = COMPRESSIONRESET;
+							} else {
+								stream = NULL;
+							}
+						} else {
+							reset = false;
+						}
+					}
+
+					if (stream != NULL) {
+						thiscodec = stream->compresscodec;
+						state = stream->state_compress;
+						level = stream->level;
+						flags |= COMPRESSIONSTREAM;
+						sequence = stream->sequence;
+					} else {
+						thiscodec = select_codec(thissession, peer, features, &level);
+						state = get_context_state(context, thiscodec, true); // Compress without history.
+					}
+					flags |= thiscodec->id << COMPRESSIONCODECSHIFT;
+
+					if (state != NULL) {
+						newsize = thiscodec->compress(state, tcpdata, oldsize,
+								lzbuffer, LZBUFSIZE, level, reset);
+					}
 				} else {
 
 					if (DEBUG_COMPRESSION == true) {
@@ -122,12 +774,28 @@ unsigned int tcp_compress(__u8 *ippacket, __u8 *lzbuffer,
 					logger(LOG_INFO, message);
 				}
 
-				if (newsize < oldsize) {
+				if ((newsize > 0) && (newsize < oldsize)) {
 					memmove(tcpdata, lzbuffer, newsize); // Move compressed data to packet.
 					//pskb_trim(skb,skb->len - (oldsize - newsize)); // Remove extra space from skb.
 					iph->tot_len = htons(ntohs(iph->tot_len) - (oldsize
 							- newsize));// Fix packet length.
-					__set_tcp_option((__u8 *) iph, 31, 3, 1); // Set compression flag.
+
+					if (stream != NULL) {
+						__set_tcp_option((__u8 *) iph, COMPRESSIONOPTION, 6,
+								((__u32)flags << COMPRESSIONSEQUENCESHIFT) | sequence); // Set stream flags and sequence.
+					} else if (flags != 0) {
+						__set_tcp_option((__u8 *) iph, COMPRESSIONOPTION, 4, flags); // Set codec flags.
+					} else {
+						__set_tcp_option((__u8 *) iph, COMPRESSIONOPTION, 3, 1); // Set compression flag.
+					}
+
+					if (stream != NULL) {
+						stream->sequence++;
+					}
+
+					if (source != NULL) {
+						source->incompressible = 0;
+					}
 					tcph->seq = htonl(ntohl(tcph->seq) + 8000); // Increase SEQ number.
 
 					if (DEBUG_COMPRESSION == true) {
@@ -136,6 +804,16 @@ unsigned int tcp_compress(__u8 *ippacket, __u8 *lzbuffer,
 								oldsize, newsize);
 						logger(LOG_INFO, message);
 					}
+				} else {
+					count_incompressible(source);
+
+					if (stream != NULL) {
+						/*
+						 * The peer never sees this data in its history
+						 * so the next packet has to restart the stream.
+						 */
+						__atomic_store_n(&stream->reset, true, __ATOMIC_RELAXED);
+					}
 				}
 
 				if (DEBUG_COMPRESSION == true) {
@@ -148,14 +826,108 @@ unsigned int tcp_compress(__u8 *ippacket, __u8 *lzbuffer,
 	return 1;
 }
 
+/*
+ * Queues a stream that lost sync so the IPC thread asks its peer to restart it.
+ * A stream is only reported once until it restarts.
+ */
+static void report_desync(struct session *thissession, struct endpoint *source,
+		struct compression_stream *stream) {
+	struct endpoint *destination = NULL;
+
+	if ((thissession == NULL) || (stream->reported == true)) {
+		return;
+	}
+	destination = (source == &thissession->larger) ? &thissession->smaller : &thissession->larger;
+	pthread_mutex_lock(&desyncslock);
+
+	if (numdesyncs < COMPRESSIONDESYNCS) {
+		save_opennopid(source->accelerator, desyncs[numdesyncs].peerid);
+		desyncs[numdesyncs].stream.saddr = source->address;
+		desyncs[numdesyncs].stream.daddr = destination->address;
+		desyncs[numdesyncs].stream.source = source->port;
+		desyncs[numdesyncs].stream.dest = destination->port;
+		numdesyncs++;
+		stream->reported = true;
+	}
+	pthread_mutex_unlock(&desyncslock);
+}
+
+/*
+ * Takes the streams from a peer that lost sync.
+ * Used by the IPC thread to ask the peer to restart them.
+ */
+int compression_get_desyncs(char *peerid, struct ipc_stream_id *streams, int max) {
+	int count = 0;
+	int i, kept = 0;
+
+	pthread_mutex_lock(&desyncslock);
+
+	for (i = 0; i < numdesyncs; i++) {
+
+		if ((count < max) && (compare_opennopid(desyncs[i].peerid, peerid) == 1)) {
+			streams[count++] = desyncs[i].stream;
+		} else {
+			desyncs[kept++] = desyncs[i];
+		}
+	}
+	numdesyncs = kept;
+	pthread_mutex_unlock(&desyncslock);
+	return count;
+}
+
+/*
+ * Restarts the streams a peer lost sync with on their next packet.
+ * Called by the IPC thread so it reads the sessions as an RCU reader.
+ */
+void compression_restart(struct ipc_stream_id *streams, int count) {
+	struct session *thissession = NULL;
+	struct endpoint *source = NULL;
+	struct compression_stream *stream = NULL;
+	__u32 largerIP, smallerIP;
+	__u16 largerIPPort, smallerIPPort;
+	int i;
+
+	rcu_register_thread();
+
+	for (i = 0; i < count; i++) {
+		sort_sockets(&largerIP, &largerIPPort, &smallerIP, &smallerIPPort,
+				streams[i].saddr, streams[i].source, streams[i].daddr, streams[i].dest);
+		thissession = getsession(largerIP, largerIPPort, smallerIP, smallerIPPort);
+
+		if (thissession != NULL) {
+			if ((thissession->larger.address == streams[i].saddr) && (thissession->larger.port == streams[i].source)) {
+				source = &thissession->larger;
+			} else {
+				source = &thissession->smaller;
+			}
+			stream = __atomic_load_n(&source->stream, __ATOMIC_ACQUIRE);
+
+			if (stream != NULL) {
+				__atomic_store_n(&stream->reset, true, __ATOMIC_RELAXED);
+			}
+		}
+	}
+	rcu_unregister_thread();
+}
+
 /*
  * Decompress the TCP data of an SKB.
+ * Stream packets are decompressed with the history of the source endpoint.
+ * Returns 0 if the packet cannot be decompressed and should be dropped.
  */
-unsigned int tcp_decompress(__u8 *ippacket, __u8 *lzbuffer,
-		qlz_state_decompress *state_decompress) {
+unsigned int tcp_decompress(__u8 *ippacket, __u8 *lzbuffer, struct compression_context *context,
+		struct session *thissession, struct endpoint *source) {
 	struct iphdr *iph = NULL;
 	struct tcphdr *tcph = NULL;
+	struct compression_stream *stream = NULL;
+	const struct codec *thiscodec = NULL;
+	void *state = NULL;
+	int reset = true;
 	__u16 oldsize = 0, newsize = 0; /* Store old, and new size of the TCP data. */
+	__u64 option = 0; /* Value of the compression option. */
+	__u16 flags = 0; /* Compression flags sent by the peer. */
+	__u16 sequence = 0; /* Position of the packet in its stream. */
+	__u8 tcpoptlen = 3; /* Length of the compression option. */
 	__u8 *tcpdata = NULL; /* Starting location for the TCP data. */
 	char message[LOGSZ];
 
@@ -164,9 +936,8 @@ unsigned int tcp_decompress(__u8 *ippacket, __u8 *lzbuffer,
 		logger(LOG_INFO, message);
 	}
 
-	if ((ippacket != NULL) && (NULL != state_decompress)) { // If the skb or state_decompress is NULL abort compression.
+	if ((ippacket != NULL) && (NULL != context)) { // If the skb or context is NULL abort compression.
 		iph = (struct iphdr *) ippacket; // Access ip header.
-		memset(state_decompress, 0, sizeof(qlz_state_decompress));
 
 		if ((iph->protocol == IPPROTO_TCP)) { // If this is not a TCP segment abort compression.
 			tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl); // Access tcp header.
@@ -176,12 +947,95 @@ unsigned int tcp_decompress(__u8 *ippacket, __u8 *lzbuffer,
 			tcpdata = (__u8 *) tcph + tcph->doff * 4; // Find starting location of the TCP data.
 
 			if ((oldsize > 0) && (lzbuffer != NULL)) {
+				option = __get_tcp_option((__u8 *)iph, COMPRESSIONOPTION);
 
-				newsize = qlz_decompress((char *) tcpdata, (char *) lzbuffer,
-						state_decompress);
+				/*
+				 * Older accelerators send a 3 byte option that is always QuickLZ.
+				 */
+				if (option > 0xffff) {
+					tcpoptlen = 6;
+					flags = option >> COMPRESSIONSEQUENCESHIFT;
+					sequence = option & COMPRESSIONSEQUENCE;
+				} else if (option > 0xff) {
+					tcpoptlen = 4;
+					flags = option;
+				}
+
+				if (flags != 0) {
+					thiscodec = get_codec((flags & COMPRESSIONCODEC) >> COMPRESSIONCODECSHIFT);
+				} else {
+					thiscodec = get_codec(CODEC_QUICKLZ);
+				}
+
+				if (thiscodec == NULL) {
+					return 0;
+				}
+
+				if ((flags & COMPRESSIONSTREAM) != 0) {
+					stream = get_compression_stream(source);
+
+					if (stream == NULL) {
+						return 0;
+					}
+
+					if ((flags & COMPRESSIONRESET) != 0) {
+
+						if ((thiscodec != stream->decompresscodec) &&
+								(new_stream_state(stream, thiscodec, false) == NULL)) {
+							stream->synchronized = false;
+							return 0;
+						}
+						stream->synchronized = true;
+						stream->reported = false;
+						stream->resets++;
+
+					} else if ((stream->synchronized == false) ||
+							(thiscodec != stream->decompresscodec) ||
+							(sequence != stream->sequence)) {
+						/*
+						 * A packet of this stream was lost or reordered.
+						 * Drop until the peer restarts the stream, it is asked
+						 * to over IPC instead of waiting for a retransmission.
+						 */
+						stream->synchronized = false;
+						report_desync(thissession, source, stream);
+
+						if (DEBUG_COMPRESSION == true) {
+							sprintf(message, "[OpenNOP] Stream out of sync expected %u got %u \n",
+									stream->sequence, sequence);
+							logger(LOG_INFO, message);
+						}
+						return 0;
+					} else {
+						reset = false;
+					}
+					state = stream->state_decompress;
+				} else {
+					state = get_context_state(context, thiscodec, false); // Decompress without history.
+
+					if (state == NULL) {
+						return 0;
+					}
+				}
+
+				newsize = thiscodec->decompress(state, tcpdata, oldsize, lzbuffer,
+						BUFSIZE - (tcpdata - ippacket), reset);
+
+				if (newsize == 0) {
+
+					if (stream != NULL) {
+						stream->synchronized = false;
+						report_desync(thissession, source, stream);
+					}
+					return 0;
+				}
+
+				if (stream != NULL) {
+					stream->sequence = sequence + 1;
+				}
 				memmove(tcpdata, lzbuffer, newsize); // Move decompressed data to packet.
 				iph->tot_len = htons(ntohs(iph->tot_len) + (newsize - oldsize));// Fix packet length.
-				__set_tcp_option((__u8 *) iph, 31, 3, 0); // Set compression flag to 0.
+				__set_tcp_option((__u8 *) iph, COMPRESSIONOPTION, tcpoptlen, 0); // Set compression flag to 0.
 				tcph->seq = htonl(ntohl(tcph->seq) - 8000); // Decrease SEQ number.
 
 				if (DEBUG_COMPRESSION == true) {
@@ -1,68 +1,99 @@
 #include <netinet/ip.h> // for tcpmagic and TCP options
 #include <netinet/tcp.h> // for tcpmagic and TCP options
 #include <linux/types.h>
-#include <stdlib.h>	
+#include <stdlib.h>
+#include <string.h>
 #include "csum.h"
 
 /* Original function from http://www.bloof.de/tcp_checksumming */
 /* also from http://www.netfor2.com/tcpsum.htm */
 
-unsigned short tcp_sum_calc(unsigned short len_tcp, unsigned short *src_addr, unsigned short *dest_addr, unsigned short *buff)
+/*
+ * Adds len bytes to a one's complement sum.
+ * The one's complement sum does not depend on byte order (RFC 1071)
+ * so words are added as they are in memory and never swapped.
+ * 32 bit words go into 64 bit sums so carries are only folded at the end,
+ * and the four sums do not wait on each other so the loop can be vectorised.
+ */
+__u64 csum_add(const void *buff, int len, __u64 sum)
 {
-	struct tcphdr *tcph;
-	unsigned short prot_tcp = 6;
-	long sum = 0;
-	int i = 0;
-	tcph = (struct tcphdr *)buff;
-	
-	/* add the pseudo header */	
-	sum += ntohs(src_addr[0]);
-	sum += ntohs(src_addr[1]);
-	sum += ntohs(dest_addr[0]);
-	sum += ntohs(dest_addr[1]);
-	sum += len_tcp; // already in host format.
-	sum += prot_tcp; // already in host format.
-      
-	/* 
-	 * calculate the checksum for the tcp header and payload
-	 * len_tcp represents number of 8-bit bytes, 
-	 * we are working with 16-bit words so divide len_tcp by 2. 
-	 */
-	for(i=0;i<(len_tcp/2);i++){
-		sum += ntohs(buff[i]);
+	const __u8 *data = (const __u8 *)buff;
+	__u64 sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+	__u32 words[4];
+	__u16 last = 0;
+
+	while (len >= 16){
+		memcpy(words, data, sizeof(words));
+		sum0 += words[0];
+		sum1 += words[1];
+		sum2 += words[2];
+		sum3 += words[3];
+		data += 16;
+		len -= 16;
 	}
-	
-	/* Check if the tcp length is even or odd.  Add padding if odd. */
-	if((len_tcp % 2) == 1){
-		sum += ntohs((unsigned char)(buff[i]));	
+	sum += sum0 + sum1 + sum2 + sum3;
+
+	while (len >= 2){
+		memcpy(&last, data, 2);
+		sum += last;
+		data += 2;
+		len -= 2;
 	}
-    
-	// keep only the last 16 bits of the 32 bit calculated sum and add the carries
-	while (sum >> 16){
-		sum = (sum & 0xFFFF) + (sum >> 16);
+
+	/* Odd length, the last byte is padded with a zero byte. */
+	if (len == 1){
+		last = 0;
+		memcpy(&last, data, 1);
+		sum += last;
 	}
-	
-	// Take the bitwise complement of sum
-	sum = ~sum;
+	return sum;
+}
+
+/*
+ * Folds a sum from csum_add() down to 16 bits.
+ */
+__u16 csum_fold(__u64 sum)
+{
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFFFFFF) + (sum >> 32);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	sum = (sum & 0xFFFF) + (sum >> 16);
+	return (__u16)sum;
+}
+
+/*
+ * Updates a checksum for a 16 bit field that changed from old to new.
+ * All values are as they are stored in the packet (RFC 1624 eqn. 3).
+ */
+void csum_replace2(__u16 *check, __u16 old, __u16 new)
+{
+	__u64 sum;
+
+	sum = (__u16)~*check;
+	sum += (__u16)~old;
+	sum += new;
+	*check = ~csum_fold(sum);
+}
+
+unsigned short tcp_sum_calc(unsigned short len_tcp, unsigned short *src_addr, unsigned short *dest_addr, unsigned short *buff)
+{
+	__u64 sum = 0;
+
+	/* add the pseudo header */
+	sum = csum_add(src_addr, 4, sum);
+	sum = csum_add(dest_addr, 4, sum);
+	sum += htons(len_tcp);
+	sum += htons(IPPROTO_TCP);
+
+	/* calculate the checksum for the tcp header and payload */
+	sum = csum_add(buff, len_tcp, sum);
 
-	return htons(((unsigned short) sum));
+	// Take the bitwise complement of sum, it is already in network order.
+	return (unsigned short)~csum_fold(sum);
 }
 
 unsigned short ip_sum_calc(unsigned short len_ip_header, unsigned short *buff){
-	long sum = 0;
-	int i = 0;
-	
-	for (i=0;i<len_ip_header/2;i++){
-		sum += ntohs(buff[i]);
-	}
-	
-	while (sum >> 16){
-		sum = (sum & 0xFFFF) + (sum >> 16);
-	}
-	
-	sum = ~sum;
-	
-	return htons(((unsigned short) sum));
+	return (unsigned short)~csum_fold(csum_add(buff, len_ip_header, 0));
 }
 
 void checksum(unsigned char *packet)
@@ -70,9 +101,9 @@ void checksum(unsigned char *packet)
 	struct iphdr *iph = NULL;
 	struct tcphdr *tcph = NULL;
 	__u16 tcplen;
-	
+
 	iph = (struct iphdr *) packet;
-		
+
 		/* We only need to checksum TCP packets. */
 		if (iph->protocol == IPPROTO_TCP){
 
@@ -88,3 +119,48 @@ void checksum(unsigned char *packet)
  				(unsigned short *)iph);
 		}
 }
+
+/*
+ * Remembers what a TCP header edit can change.
+ * The TCP checksum field is summed too but it cancels out
+ * because it does not change until end_header_edit().
+ */
+void begin_header_edit(__u8 *ippacket, struct header_edit *edit)
+{
+	struct iphdr *iph = (struct iphdr *)ippacket;
+	struct tcphdr *tcph = (struct tcphdr *) (((u_int32_t *)ippacket) + iph->ihl);
+
+	edit->tot_len = iph->tot_len;
+
+	if (iph->protocol != IPPROTO_TCP){
+		edit->sum = 0;
+		return;
+	}
+	edit->sum = csum_add(tcph, tcph->doff*4,
+		htons(ntohs(iph->tot_len) - iph->ihl*4)); // Pseudo header TCP length.
+}
+
+/*
+ * Fixes the checksums after only the TCP header was edited.
+ * Options added to the header move the data by whole 32 bit words
+ * so the data still adds up to the same sum.
+ */
+void end_header_edit(__u8 *ippacket, struct header_edit *edit)
+{
+	struct iphdr *iph = (struct iphdr *)ippacket;
+	struct tcphdr *tcph = (struct tcphdr *) (((u_int32_t *)ippacket) + iph->ihl);
+	__u64 sum;
+
+	if (iph->protocol != IPPROTO_TCP){
+		return;
+	}
+	sum = (__u16)~tcph->check;
+	sum += (__u16)~csum_fold(edit->sum);
+	sum = csum_add(tcph, tcph->doff*4, sum);
+	sum += htons(ntohs(iph->tot_len) - iph->ihl*4);
+	tcph->check = ~csum_fold(sum);
+
+	if (iph->tot_len != edit->tot_len){
+		csum_replace2(&iph->check, edit->tot_len, iph->tot_len);
+	}
+}
@@ -0,0 +1,544 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <endian.h>
+#include <pthread.h>
+
+#include <netinet/ip.h> // for tcpmagic and TCP options
+#include <netinet/tcp.h> // for tcpmagic and TCP options
+
+#include "dedup.h"
+#include "ipc.h"
+#include "packet.h"
+#include "tcpoptions.h"
+#include "logger.h"
+#include "climanager.h"
+
+int dedup = false; // Determines if opennop should deduplicate tcp data.
+__u64 dedupmemory = (__u64)DEDUPMEMORY * 1024 * 1024; // Bytes for each store of a new peer.
+static __u64 gear[256]; // Random values the chunk boundaries are found with.
+static struct dedup_peer *peers[DEDUPMAXPEERS];
+static pthread_mutex_t peerslock = PTHREAD_MUTEX_INITIALIZER; // Lock for adding peers.
+
+/*
+ * Counters shown by show dedup.
+ */
+static __u64 dedupbytes = 0; // Payload bytes the encoder looked at.
+static __u64 dedupsaved = 0; // Bytes removed by references.
+static __u64 dedupreferences = 0; // Chunks sent as references.
+static __u64 dedupmisses = 0; // References the decoder did not have.
+
+/*
+ * Fills the gear table.
+ * Peers have to find the same boundaries so the values
+ * come from a fixed seed instead of a random one.
+ */
+void initialize_dedup() {
+	__u64 state = 0x6f70656e6e6f70ULL;
+	__u64 value;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		state += 0x9e3779b97f4a7c15ULL;
+		value = state;
+		value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		value = (value ^ (value >> 27)) * 0x94d049bb133111ebULL;
+		gear[i] = value ^ (value >> 31);
+	}
+}
+
+/*
+ * Returns the length of the chunk at the start of data.
+ * A chunk ends where the gear hash of the bytes before it
+ * has its top bits clear so the same content is cut the same
+ * way no matter where it starts in a packet.
+ */
+static __u16 next_chunk(const __u8 *data, __u16 size) {
+	__u64 hash = 0;
+	__u16 limit, i;
+
+	if (size <= DEDUPMINCHUNK) {
+		return size;
+	}
+	limit = (size < DEDUPMAXCHUNK) ? size : DEDUPMAXCHUNK;
+
+	for (i = 0; i < limit; i++) {
+		hash = (hash << 1) + gear[data[i]];
+
+		if ((i >= DEDUPMINCHUNK) && ((hash & DEDUPBOUNDARY) == 0)) {
+			return i + 1;
+		}
+	}
+	return limit;
+}
+
+static __u64 chunk_fingerprint(const __u8 *data, __u16 length) {
+	__u64 hash = 0x6465647570ULL ^ length;
+	__u64 word;
+	__u16 i;
+
+	for (i = 0; i + 8 <= length; i += 8) {
+		memcpy(&word, data + i, sizeof(word));
+		hash = (hash ^ le64toh(word)) * 0x9e3779b97f4a7c15ULL;
+		hash ^= hash >> 29;
+	}
+
+	for (; i < length; i++) {
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+	}
+	hash ^= hash >> 32;
+	hash *= 0xd6e8feb86659fd93ULL;
+	hash ^= hash >> 32;
+
+	if (hash == 0) { // 0 marks an empty slot.
+		hash = 1;
+	}
+	return hash;
+}
+
+static int initialize_store(struct dedup_store *store, __u64 memory) {
+	__u32 slots = 1;
+	int i;
+
+	while ((__u64)slots * 2 * sizeof(struct dedup_chunk) <= memory) {
+		slots *= 2;
+	}
+	store->chunks = calloc(slots, sizeof(struct dedup_chunk));
+
+	if (store->chunks == NULL) {
+		return -1;
+	}
+	store->mask = slots - 1;
+
+	for (i = 0; i < DEDUPLOCKS; i++) {
+		pthread_mutex_init(&store->locks[i], NULL);
+	}
+	return 0;
+}
+
+/*
+ * Stores a chunk unless its slot already holds it.
+ * Returns true if the chunk was already stored.
+ */
+static int store_learn(struct dedup_store *store, __u64 fingerprint, const __u8 *data, __u16 length) {
+	struct dedup_chunk *chunk;
+	__u32 slot = fingerprint & store->mask;
+	int found = false;
+
+	pthread_mutex_lock(&store->locks[slot % DEDUPLOCKS]);
+	chunk = &store->chunks[slot];
+
+	if ((chunk->fingerprint == fingerprint) && (chunk->length == length) &&
+			(memcmp(chunk->data, data, length) == 0)) {
+		found = true;
+	} else {
+		chunk->fingerprint = fingerprint;
+		chunk->length = length;
+		memcpy(chunk->data, data, length);
+	}
+	pthread_mutex_unlock(&store->locks[slot % DEDUPLOCKS]);
+	return found;
+}
+
+/*
+ * Copies a stored chunk to destination.
+ * Returns its length or 0 if it is not stored or does not fit.
+ */
+static __u16 store_fetch(struct dedup_store *store, __u64 fingerprint, __u8 *destination, size_t capacity) {
+	struct dedup_chunk *chunk;
+	__u32 slot = fingerprint & store->mask;
+	__u16 length = 0;
+
+	pthread_mutex_lock(&store->locks[slot % DEDUPLOCKS]);
+	chunk = &store->chunks[slot];
+
+	if ((chunk->fingerprint == fingerprint) && (chunk->length <= capacity)) {
+		length = chunk->length;
+		memcpy(destination, chunk->data, length);
+	}
+	pthread_mutex_unlock(&store->locks[slot % DEDUPLOCKS]);
+	return length;
+}
+
+static void store_forget(struct dedup_store *store, __u64 fingerprint) {
+	__u32 slot = fingerprint & store->mask;
+
+	pthread_mutex_lock(&store->locks[slot % DEDUPLOCKS]);
+
+	if (store->chunks[slot].fingerprint == fingerprint) {
+		store->chunks[slot].fingerprint = 0;
+	}
+	pthread_mutex_unlock(&store->locks[slot % DEDUPLOCKS]);
+}
+
+/*
+ * Finds the chunk stores shared with an accelerator.
+ * Peers are only added so they can be found without a lock.
+ */
+static struct dedup_peer *get_dedup_peer(char *peerid, int create) {
+	struct dedup_peer *thispeer = NULL;
+	int i;
+
+	if ((peerid == NULL) || (check_opennopid(peerid) != 1)) {
+		return NULL;
+	}
+
+	for (i = 0; i < DEDUPMAXPEERS; i++) {
+		thispeer = __atomic_load_n(&peers[i], __ATOMIC_ACQUIRE);
+
+		if ((thispeer == NULL) || (compare_opennopid(thispeer->id, peerid) == 1)) {
+			break;
+		}
+	}
+
+	if ((thispeer != NULL) || (create == false) || (i == DEDUPMAXPEERS)) {
+		return thispeer;
+	}
+	pthread_mutex_lock(&peerslock);
+
+	for (i = 0; i < DEDUPMAXPEERS; i++) {
+
+		if ((peers[i] == NULL) || (compare_opennopid(peers[i]->id, peerid) == 1)) {
+			break;
+		}
+	}
+
+	if ((i < DEDUPMAXPEERS) && (peers[i] == NULL)) {
+		thispeer = calloc(1, sizeof(struct dedup_peer));
+
+		if (thispeer != NULL) {
+			save_opennopid(peerid, thispeer->id);
+			pthread_mutex_init(&thispeer->lock, NULL);
+
+			if ((initialize_store(&thispeer->sent, dedupmemory) != 0) ||
+					(initialize_store(&thispeer->received, dedupmemory) != 0)) {
+				free(thispeer->sent.chunks);
+				free(thispeer->received.chunks);
+				free(thispeer);
+				thispeer = NULL;
+			} else {
+				__atomic_store_n(&peers[i], thispeer, __ATOMIC_RELEASE);
+			}
+		}
+	} else if (i < DEDUPMAXPEERS) {
+		thispeer = peers[i];
+	}
+	pthread_mutex_unlock(&peerslock);
+	return thispeer;
+}
+
+static void report_miss(struct dedup_peer *thispeer, __u64 fingerprint) {
+	pthread_mutex_lock(&thispeer->lock);
+
+	if (thispeer->nummisses < DEDUPMAPSIZE) {
+		thispeer->misses[thispeer->nummisses++] = fingerprint;
+	}
+	pthread_mutex_unlock(&thispeer->lock);
+	__atomic_add_fetch(&dedupmisses, 1, __ATOMIC_RELAXED);
+}
+
+static size_t put_literal(__u8 *buffer, size_t out, const __u8 *data, __u16 length) {
+
+	if (length > 0) {
+		buffer[out++] = DEDUPLITERAL;
+		buffer[out++] = length >> 8;
+		buffer[out++] = length & 0xff;
+		memcpy(buffer + out, data, length);
+		out += length;
+	}
+	return out;
+}
+
+/*
+ * Replaces chunks of the TCP data that were already sent to the peer
+ * with references to them.
+ * Every chunk is stored and the packet is flagged so the peer stores it too.
+ * A retransmission is sent without references because the peer
+ * may have missed the packet that the chunks were first sent in.
+ */
+unsigned int dedup_encode(__u8 *ippacket, __u8 *buffer, char *peerid, int resync) {
+	struct iphdr *iph = NULL;
+	struct tcphdr *tcph = NULL;
+	struct dedup_peer *thispeer = NULL;
+	__u8 *tcpdata = NULL; /* Starting location for the TCP data. */
+	__u16 size, pos = 0, literal = 0, length;
+	__u64 fingerprint;
+	size_t out = 0;
+	int references = 0;
+
+	if ((dedup == false) || (ippacket == NULL) || (buffer == NULL)) {
+		return 1;
+	}
+	iph = (struct iphdr *) ippacket;
+
+	if (iph->protocol != IPPROTO_TCP) {
+		return 1;
+	}
+	tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl);
+	size = (__u16)(ntohs(iph->tot_len) - iph->ihl * 4) - tcph->doff * 4;
+	tcpdata = (__u8 *) tcph + tcph->doff * 4;
+
+	if (size < DEDUPMINCHUNK) {
+		return 1;
+	}
+	thispeer = get_dedup_peer(peerid, true);
+
+	if (thispeer == NULL) {
+		return 1;
+	}
+
+	while (pos < size) {
+		length = next_chunk(tcpdata + pos, size - pos);
+
+		if (length >= DEDUPMINCHUNK) {
+			fingerprint = chunk_fingerprint(tcpdata + pos, length);
+
+			if ((store_learn(&thispeer->sent, fingerprint, tcpdata + pos, length) == true) &&
+					(resync == false)) {
+				out = put_literal(buffer, out, tcpdata + literal, pos - literal);
+				buffer[out++] = DEDUPREFERENCE;
+				fingerprint = htobe64(fingerprint);
+				memcpy(buffer + out, &fingerprint, sizeof(fingerprint));
+				out += sizeof(fingerprint);
+				references++;
+				pos += length;
+				literal = pos;
+				continue;
+			}
+		}
+		pos += length;
+	}
+	__atomic_add_fetch(&dedupbytes, size, __ATOMIC_RELAXED);
+
+	if (references > 0) {
+		out = put_literal(buffer, out, tcpdata + literal, size - literal);
+	}
+
+	if ((references > 0) && (out < size)) {
+		memcpy(tcpdata, buffer, out);
+		iph->tot_len = htons(ntohs(iph->tot_len) - (size - out));
+		__set_tcp_option((__u8 *) iph, DEDUPOPTION, 3, DEDUPENCODED);
+		__atomic_add_fetch(&dedupreferences, references, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&dedupsaved, size - out, __ATOMIC_RELAXED);
+	} else {
+		__set_tcp_option((__u8 *) iph, DEDUPOPTION, 3, DEDUPLEARN);
+	}
+	return 1;
+}
+
+/*
+ * Rebuilds the TCP data of a deduplicated packet and stores its chunks.
+ * Returns 0 if a referenced chunk is missing and the packet should be dropped.
+ */
+unsigned int dedup_decode(__u8 *ippacket, __u8 *buffer, char *peerid) {
+	struct iphdr *iph = NULL;
+	struct tcphdr *tcph = NULL;
+	struct dedup_peer *thispeer = NULL;
+	__u8 *tcpdata = NULL; /* Starting location for the TCP data. */
+	__u16 size, pos = 0, length;
+	__u64 fingerprint;
+	size_t out = 0, capacity;
+	__u8 flag, tag;
+
+	if ((ippacket == NULL) || (buffer == NULL)) {
+		return 0;
+	}
+	iph = (struct iphdr *) ippacket;
+
+	if (iph->protocol != IPPROTO_TCP) {
+		return 1;
+	}
+	flag = (__u8)__get_tcp_option(ippacket, DEDUPOPTION);
+
+	if (flag == 0) {
+		return 1;
+	}
+	tcph = (struct tcphdr *) (((u_int32_t *) ippacket) + iph->ihl);
+	size = (__u16)(ntohs(iph->tot_len) - iph->ihl * 4) - tcph->doff * 4;
+	tcpdata = (__u8 *) tcph + tcph->doff * 4;
+	thispeer = get_dedup_peer(peerid, true);
+
+	if (flag == DEDUPENCODED) {
+
+		if (thispeer == NULL) {
+			return 0;
+		}
+		capacity = BUFSIZE - (tcpdata - ippacket);
+
+		while (pos < size) {
+
+			tag = tcpdata[pos++];
+
+			if (tag == DEDUPLITERAL) {
+
+				if (pos + 2 > size) {
+					return 0;
+				}
+				length = (tcpdata[pos] << 8) | tcpdata[pos + 1];
+				pos += 2;
+
+				if ((length > size - pos) || (length > capacity - out)) {
+					return 0;
+				}
+				memcpy(buffer + out, tcpdata + pos, length);
+				pos += length;
+
+			} else if ((tag == DEDUPREFERENCE) && (pos + sizeof(fingerprint) <= size)) {
+				memcpy(&fingerprint, tcpdata + pos, sizeof(fingerprint));
+				fingerprint = be64toh(fingerprint);
+				pos += sizeof(fingerprint);
+				length = store_fetch(&thispeer->received, fingerprint, buffer + out, capacity - out);
+
+				if (length == 0) {
+					report_miss(thispeer, fingerprint);
+					return 0;
+				}
+			} else {
+				return 0;
+			}
+			out += length;
+		}
+		memcpy(tcpdata, buffer, out);
+		iph->tot_len = htons(ntohs(iph->tot_len) + (out - size));
+		size = out;
+	}
+
+	if (thispeer != NULL) {
+
+		for (pos = 0; pos < size; pos += length) {
+			length = next_chunk(tcpdata + pos, size - pos);
+
+			if (length >= DEDUPMINCHUNK) {
+				store_learn(&thispeer->received, chunk_fingerprint(tcpdata + pos, length),
+						tcpdata + pos, length);
+			}
+		}
+	}
+	__set_tcp_option((__u8 *) iph, DEDUPOPTION, 3, 0); // Set dedup flag to 0.
+	return 1;
+}
+
+/*
+ * Takes the fingerprints the peer referenced that were not found.
+ * Used by the IPC thread to tell the peer to stop referencing them.
+ */
+int dedup_get_misses(char *peerid, __u64 *fingerprints, int max) {
+	struct dedup_peer *thispeer = get_dedup_peer(peerid, false);
+	int count = 0;
+
+	if (thispeer != NULL) {
+		pthread_mutex_lock(&thispeer->lock);
+		count = (thispeer->nummisses < max) ? thispeer->nummisses : max;
+		memcpy(fingerprints, thispeer->misses, count * sizeof(__u64));
+		thispeer->nummisses = 0;
+		pthread_mutex_unlock(&thispeer->lock);
+	}
+	return count;
+}
+
+/*
+ * Removes chunks the peer reported missing from what was sent to it.
+ */
+void dedup_forget(char *peerid, __u64 *fingerprints, int count) {
+	struct dedup_peer *thispeer = get_dedup_peer(peerid, false);
+	int i;
+
+	for (i = 0; (thispeer != NULL) && (i < count); i++) {
+		store_forget(&thispeer->sent, fingerprints[i]);
+	}
+}
+
+struct commandresult cli_show_dedup(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result  = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	int numpeers = 0;
+
+	if (dedup == true) {
+		sprintf(msg, "dedup enabled\n");
+	} else {
+		sprintf(msg, "dedup disabled\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+	while ((numpeers < DEDUPMAXPEERS) && (__atomic_load_n(&peers[numpeers], __ATOMIC_ACQUIRE) != NULL)) {
+		numpeers++;
+	}
+	sprintf(msg, "peers: %i/%i, %llu MB per store\n", numpeers, DEDUPMAXPEERS,
+			(unsigned long long)(dedupmemory / (1024 * 1024)));
+	cli_send_feedback(client_fd, msg);
+
+	sprintf(msg, "bytes: %llu saved: %llu references: %llu misses: %llu\n",
+			(unsigned long long)__atomic_load_n(&dedupbytes, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&dedupsaved, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&dedupreferences, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&dedupmisses, __ATOMIC_RELAXED));
+	cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_dedup_enable(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	dedup = true;
+	sprintf(msg, "dedup enabled\n");
+	cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_dedup_disable(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	dedup = false;
+	sprintf(msg, "dedup disabled\n");
+	cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+/** @brief Sets the memory of each chunk store.
+ *
+ * Each peer has a store for each direction.
+ * Only peers added after the change use the new size.
+ *
+ * @param parameters [in] Megabytes of memory.
+ * @param numparameters [in] Should be 1.
+ */
+struct commandresult cli_dedup_memory(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	char *end = NULL;
+	unsigned long megabytes = 0;
+
+	if (numparameters == 1) {
+		megabytes = strtoul(parameters[0], &end, 10);
+	}
+
+	if ((end != NULL) && (end != parameters[0]) && (*end == '\0') && (megabytes > 0)) {
+		dedupmemory = (__u64)megabytes * 1024 * 1024;
+		sprintf(msg, "dedup memory %s MB\n", parameters[0]);
+	} else {
+		sprintf(msg, "Usage: dedup memory <megabytes>\n");
+	}
+	cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <netinet/tcp.h> // for TCP_ESTABLISHED
+
+#include <linux/types.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+
+#include "flowoffload.h"
+#include "healthagent.h"
+#include "sessionmanager.h"
+#include "climanager.h"
+
+int flowoffload = true; // Let the kernel module pass sessions neither end accelerates.
+
+/*
+ * Each worker has its own socket so sending never takes a lock.
+ * A thread that could not find the kernel module waits
+ * FLOWOFFLOADRETRY seconds before it looks again.
+ */
+static __thread int offloadsocket = -1;
+static __thread int offloadfamily = 0;
+static __thread time_t offloadfailed = 0;
+
+/*
+ * Counters shown by show flow offload.
+ */
+static __u64 offloadedsessions = 0; // Sessions handed to the kernel module.
+static __u64 offloaderrors = 0; // Times the kernel module could not be reached.
+
+static int open_offload_socket() {
+
+	if (offloadsocket >= 0) {
+		return offloadsocket;
+	}
+
+	if ((offloadfailed != 0) && (time(NULL) - offloadfailed < FLOWOFFLOADRETRY)) {
+		return -1;
+	}
+	offloadsocket = create_nl_socket(NETLINK_GENERIC, 0);
+
+	if (offloadsocket < 0) {
+		offloadfailed = time(NULL);
+		__atomic_add_fetch(&offloaderrors, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	offloadfamily = get_family_id(offloadsocket);
+
+	if (offloadfamily <= 0) {
+		close(offloadsocket);
+		offloadsocket = -1;
+		offloadfailed = time(NULL);
+		__atomic_add_fetch(&offloaderrors, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
+	offloadfailed = 0;
+	return offloadsocket;
+}
+
+static struct nlattr *add_offload_attribute(struct nlmsghdr *n, __u16 type, const void *value, __u16 length) {
+	struct nlattr *na;
+
+	na = (struct nlattr *)((char *)n + NLMSG_ALIGN(n->nlmsg_len));
+	na->nla_type = type;
+	na->nla_len = NLA_HDRLEN + length;
+	memcpy((char *)na + NLA_HDRLEN, value, length);
+	n->nlmsg_len = NLMSG_ALIGN(n->nlmsg_len) + NLA_ALIGN(na->nla_len);
+
+	return na;
+}
+
+/*
+ * Hands a session to the kernel module once neither end has an accelerator.
+ * The request is not acknowledged, if the module drops it the
+ * packets keep coming to a daemon that no longer has the session
+ * and they are accepted as they are.
+ * pending is how many packets of the session the caller has not sent
+ * a verdict for. While other packets of it wait in the rings or in a
+ * verdict batch the kernel would pass later packets ahead of them,
+ * so a later packet tries again, see bypass_packet().
+ *
+ * @return true if the session was handed over and can be cleared.
+ */
+int offload_session(struct session *thissession, __u32 pending) {
+	struct {
+		struct nlmsghdr n;
+		struct genlmsghdr g;
+		char buf[64];
+	} req;
+
+	if ((flowoffload == false) || (thissession->state != TCP_ESTABLISHED) ||
+			(cached_direction_role(thissession, 0) != SESSION_ROLE_PASSTHROUGH) ||
+			(cached_direction_role(thissession, 1) != SESSION_ROLE_PASSTHROUGH) ||
+			(__atomic_load_n(&thissession->queued, __ATOMIC_ACQUIRE) > pending)) {
+		return false;
+	}
+
+	if (open_offload_socket() < 0) {
+		return false;
+	}
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	req.n.nlmsg_type = offloadfamily;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_pid = getpid();
+	req.g.cmd = FLOWOFFLOADCMD;
+	req.g.version = 0x1;
+	add_offload_attribute(&req.n, FLOWOFFLOADLARGERIP, &thissession->larger.address, sizeof(__u32));
+	add_offload_attribute(&req.n, FLOWOFFLOADLARGERPORT, &thissession->larger.port, sizeof(__u16));
+	add_offload_attribute(&req.n, FLOWOFFLOADSMALLERIP, &thissession->smaller.address, sizeof(__u32));
+	add_offload_attribute(&req.n, FLOWOFFLOADSMALLERPORT, &thissession->smaller.port, sizeof(__u16));
+
+	if (sendto_fd(offloadsocket, (char *)&req, req.n.nlmsg_len) < 0) {
+		close(offloadsocket);
+		offloadsocket = -1;
+		offloadfailed = time(NULL);
+		__atomic_add_fetch(&offloaderrors, 1, __ATOMIC_RELAXED);
+		return false;
+	}
+	__atomic_add_fetch(&offloadedsessions, 1, __ATOMIC_RELAXED);
+
+	return true;
+}
+
+struct commandresult cli_flow_offload_enable(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result  = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+
+	flowoffload = true;
+	sprintf(msg, "flow offload enabled\n");
+	cli_send_feedback(client_fd, msg);
+
+	result.finished = 0;
+	result.mode = NULL;
+	result.data = NULL;
+
+	return result;
+}
+
+/*
+ * Sessions already offloaded stay in the kernel until they close or idle out.
+ */
+struct commandresult cli_flow_offload_disable(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result  = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+
+	flowoffload = false;
+	sprintf(msg, "flow offload disabled\n");
+	cli_send_feedback(client_fd, msg);
+
+	result.finished = 0;
+	result.mode = NULL;
+	result.data = NULL;
+
+	return result;
+}
+
+struct commandresult cli_show_flow_offload(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result  = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+
+	sprintf(msg, "flow offload: %s\n", (flowoffload == true) ? "enabled" : "disabled");
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg, "offloaded: %llu errors: %llu\n",
+			(unsigned long long)__atomic_load_n(&offloadedsessions, __ATOMIC_RELAXED),
+			(unsigned long long)__atomic_load_n(&offloaderrors, __ATOMIC_RELAXED));
+	cli_send_feedback(client_fd, msg);
+
+	result.finished = 0;
+	result.mode = NULL;
+	result.data = NULL;
+
+	return result;
+}
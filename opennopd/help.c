@@ -3,9 +3,15 @@
 #include "help.h"
 void PrintUsage(int argc, char * argv[]) {
 	if (argc >=1) {
-		printf("Usage: %s -h -n\n", argv[0]);
+		printf("Usage: %s -h -n -q <queues> -b <buffers> -H -c <cpus>\n", argv[0]);
 		printf("  Options:\n");
 		printf("      -n Don't fort off as a daemon.\n");
+		printf("      -q Number of Netfilter Queues to fetch from starting at queue 0.\n");
+		printf("      -b Maximum number of packet buffers.\n");
+		printf("      -H Back packet buffers with huge pages.\n");
+		printf("      -c Pin threads to a list of CPUs like 0-7,16-23.\n");
+		printf("         The first runs counters and memory, then the\n");
+		printf("         fetchers, then two for each worker.\n");
 		printf("      -t Show this help screen.\n");
 		printf("\n");
 	}
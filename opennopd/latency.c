@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <linux/types.h>
+
+#include "latency.h"
+#include "fetcher.h"
+#include "worker.h"
+#include "climanager.h"
+
+int latency = true; // Determines if packets are timed through the pipeline.
+
+static const char *latencystages[LATENCYSTAGES] = { "queue", "codec", "process", "total" };
+static const char latencyline[] =
+		"------------------------------------------------------------------------------------------\n";
+
+/*
+ * Adds the counts of a histogram another thread is writing to.
+ */
+void latency_merge(struct latency_histogram *total, struct latency_histogram *histogram) {
+	__u64 max;
+	int i;
+
+	for (i = 0; i < LATENCYBUCKETS; i++) {
+		total->counts[i] += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+	}
+	max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+
+	if (max > total->max) {
+		total->max = max;
+	}
+}
+
+__u64 latency_count(struct latency_histogram *histogram) {
+	__u64 count = 0;
+	int i;
+
+	for (i = 0; i < LATENCYBUCKETS; i++) {
+		count += histogram->counts[i];
+	}
+	return count;
+}
+
+/*
+ * Highest time of the bucket the percentile falls in.
+ * permyriad is the percentile in hundredths of a percent, 9990 is p99.9.
+ */
+__u64 latency_percentile(struct latency_histogram *histogram, __u64 count, __u32 permyriad) {
+	__u64 rank, seen = 0, highest;
+	int i, bits;
+
+	rank = ((count * permyriad) + 9999) / 10000;
+
+	if (rank == 0) {
+		rank = 1;
+	}
+
+	for (i = 0; i < LATENCYBUCKETS; i++) {
+		seen += histogram->counts[i];
+
+		if (seen >= rank) {
+			break;
+		}
+	}
+
+	if (i < LATENCYSUBBUCKETS) {
+		highest = i;
+	} else if (i >= LATENCYBUCKETS - 1) {
+		highest = histogram->max;
+	} else {
+		bits = (i / LATENCYSUBBUCKETS) + LATENCYSUBBITS - 1;
+		highest = ((__u64)(LATENCYSUBBUCKETS + (i % LATENCYSUBBUCKETS) + 1) << (bits - LATENCYSUBBITS)) - 1;
+	}
+	return (highest < histogram->max) ? highest : histogram->max;
+}
+
+static void latency_tostring(char *output, __u64 ns) {
+
+	if (ns < 1000ULL) {
+		sprintf(output, "%llu ns", ns);
+	} else if (ns < 1000000ULL) {
+		sprintf(output, "%llu.%llu us", ns / 1000ULL, (ns % 1000ULL) / 100ULL);
+	} else if (ns < 1000000000ULL) {
+		sprintf(output, "%llu.%llu ms", ns / 1000000ULL, (ns % 1000000ULL) / 100000ULL);
+	} else {
+		sprintf(output, "%llu.%llu s", ns / 1000000000ULL, (ns % 1000000000ULL) / 100000000ULL);
+	}
+}
+
+static void latency_send_row(int client_fd, const char *thread, const char *stage, struct latency_histogram *histogram) {
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	char p50[24] = "-", p99[24] = "-", p999[24] = "-", max[24] = "-";
+	__u64 count = latency_count(histogram);
+
+	if (count > 0) {
+		latency_tostring(p50, latency_percentile(histogram, count, 5000));
+		latency_tostring(p99, latency_percentile(histogram, count, 9900));
+		latency_tostring(p999, latency_percentile(histogram, count, 9990));
+		latency_tostring(max, histogram->max);
+	}
+	sprintf(msg, "| %-20s| %-8s| %-11llu| %-9s| %-9s| %-9s| %-9s|\n",
+			thread, stage, count, p50, p99, p999, max);
+	cli_send_feedback(client_fd, msg);
+}
+
+/*
+ * Sends the rows of each stage of one processor and adds them to the totals.
+ */
+static void latency_send_processor(int client_fd, const char *thread, struct latency_stats *stats, struct latency_stats *totals) {
+	struct latency_histogram histogram;
+	int i;
+
+	for (i = 0; i < LATENCYSTAGES; i++) {
+		memset(&histogram, 0, sizeof(histogram));
+		latency_merge(&histogram, &stats->stages[i]);
+		latency_merge(&totals->stages[i], &histogram);
+		latency_send_row(client_fd, thread, latencystages[i], &histogram);
+	}
+}
+
+struct commandresult cli_show_latency(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result  = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	char thread[24];
+	struct latency_histogram histogram, fetchers;
+	struct latency_stats optimization, deoptimization;
+	int i;
+
+	memset(&fetchers, 0, sizeof(fetchers));
+	memset(&optimization, 0, sizeof(optimization));
+	memset(&deoptimization, 0, sizeof(deoptimization));
+
+	if (latency == true) {
+		sprintf(msg, "latency timing enabled\n");
+	} else {
+		sprintf(msg, "latency timing disabled\n");
+	}
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg, "%s", latencyline);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg, "| %-20s| %-8s| %-11s| %-9s| %-9s| %-9s| %-9s|\n",
+			"thread", "stage", "packets", "p50", "p99", "p99.9", "max");
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg, "%s", latencyline);
+	cli_send_feedback(client_fd, msg);
+
+	for (i = 0; i < get_fetchers(); i++) {
+		memset(&histogram, 0, sizeof(histogram));
+		latency_merge(&histogram, get_fetcher_latency(i));
+		latency_merge(&fetchers, &histogram);
+		sprintf(thread, "fetcher %i", i);
+		latency_send_row(client_fd, thread, "fetcher", &histogram);
+	}
+
+	for (i = 0; i < get_workers(); i++) {
+		sprintf(thread, "worker %i optimize", i);
+		latency_send_processor(client_fd, thread, get_processor_latency(i, false), &optimization);
+		sprintf(thread, "worker %i deoptimize", i);
+		latency_send_processor(client_fd, thread, get_processor_latency(i, true), &deoptimization);
+	}
+	sprintf(msg, "%s", latencyline);
+	cli_send_feedback(client_fd, msg);
+
+	latency_send_row(client_fd, "all fetchers", "fetcher", &fetchers);
+
+	for (i = 0; i < LATENCYSTAGES; i++) {
+		latency_send_row(client_fd, "all optimize", latencystages[i], &optimization.stages[i]);
+	}
+
+	for (i = 0; i < LATENCYSTAGES; i++) {
+		latency_send_row(client_fd, "all deoptimize", latencystages[i], &deoptimization.stages[i]);
+	}
+	sprintf(msg, "%s", latencyline);
+	cli_send_feedback(client_fd, msg);
+
+	result.finished = 0;
+	result.mode = NULL;
+	result.data = NULL;
+
+	return result;
+}
+
+struct commandresult cli_latency_enable(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result  = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+
+	latency = true;
+	sprintf(msg, "latency timing enabled\n");
+	cli_send_feedback(client_fd, msg);
+
+	result.finished = 0;
+	result.mode = NULL;
+	result.data = NULL;
+
+	return result;
+}
+
+struct commandresult cli_latency_disable(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result  = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+
+	latency = false;
+	sprintf(msg, "latency timing disabled\n");
+	cli_send_feedback(client_fd, msg);
+
+	result.finished = 0;
+	result.mode = NULL;
+	result.data = NULL;
+
+	return result;
+}
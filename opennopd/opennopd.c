@@ -27,9 +27,13 @@
 #include "memorymanager.h"
 #include "climanager.h"
 #include "compression.h"
+#include "dedup.h"
 #include "version.h"
 #include "ipc.h"
 #include "wccpv2.h"
+#include "affinity.h"
+#include "flowoffload.h"
+#include "latency.h"
 
 #define DAEMON_NAME "opennopd"
 #define PID_FILE "/var/run/opennopd.pid"
@@ -68,7 +72,7 @@ int main(int argc, char *argv[]) {
     signal(SIGPIPE,SIG_IGN); // Ignore SIGPIPE on write errors.
 
     int c;
-    while ((c = getopt(argc, argv, "nh|help")) != -1) {
+    while ((c = getopt(argc, argv, "nq:b:Hc:h|help")) != -1) {
         switch (c) {
         case 'h':
             PrintUsage(argc, argv);
@@ -78,6 +82,21 @@ int main(int argc, char *argv[]) {
             daemonize = 0;
             isdaemon = false;
             break;
+        case 'q':
+            set_fetchers(atoi(optarg));
+            break;
+        case 'b':
+            set_maxpacketbuffers(atoi(optarg));
+            break;
+        case 'H':
+            set_packethugepages(true);
+            break;
+        case 'c':
+            if (set_cpu_affinity(optarg) < 0) {
+                printf("Invalid CPU list '%s'.\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
         default:
             PrintUsage(argc, argv);
             break;
@@ -186,11 +205,12 @@ int main(int argc, char *argv[]) {
      * Starting up the daemon.
      */
 
-    initialize_sessiontable();
+    initialize_dedup();
 
     if (get_workers() == 0) {
         set_workers(sysconf(_SC_NPROCESSORS_ONLN) * 2);
     }
+    initialize_sessiontable(); // One session shard for each worker.
 
     for (i = 0; i < get_workers(); i++) {
         create_worker(i);
@@ -206,9 +226,9 @@ int main(int argc, char *argv[]) {
     start_ipc();
     start_wccp();
     pthread_create(&t_cli, NULL, cli_manager_init, (void *) NULL);
-    pthread_create(&t_counters, NULL, counters_function, (void *) NULL);
-    pthread_create(&t_memorymanager, NULL, memorymanager_function,
-                   (void *) NULL);
+    create_pinned_thread(&t_counters, get_housekeeping_cpu(), counters_function, (void *) NULL);
+    create_pinned_thread(&t_memorymanager, get_housekeeping_cpu(), memorymanager_function,
+                         (void *) NULL);
 
 
     sprintf(message, "[OpenNOP]: Started all threads.\n");
@@ -219,11 +239,43 @@ int main(int argc, char *argv[]) {
      */
     register_command(NULL, "show version", cli_show_version, false, false);
     register_command(NULL, "show compression", cli_show_compression, false, false);
-    register_command(NULL, "show workers", cli_show_workers, false, false);
-    register_command(NULL, "show fetcher", cli_show_fetcher, false, false);
+    register_command(NULL, "show workers", cli_show_workers, true, false);
+    register_command(NULL, "worker count", cli_worker_count, true, false);
+    register_command(NULL, "worker autoscale enable", cli_worker_autoscale_enable, false, false);
+    register_command(NULL, "worker autoscale disable", cli_worker_autoscale_disable, false, false);
+    register_command(NULL, "worker autoscale range", cli_worker_autoscale_range, true, false);
+    register_command(NULL, "worker autoscale pps", cli_worker_autoscale_pps, true, false);
+    register_command(NULL, "show worker autoscale", cli_show_worker_autoscale, false, false);
+    register_command(NULL, "worker bypass enable", cli_worker_bypass_enable, false, false);
+    register_command(NULL, "worker bypass disable", cli_worker_bypass_disable, false, false);
+    register_command(NULL, "worker bypass watermarks", cli_worker_bypass_watermarks, true, false);
+    register_command(NULL, "show worker bypass", cli_show_worker_bypass, false, false);
+    register_command(NULL, "flow offload enable", cli_flow_offload_enable, false, false);
+    register_command(NULL, "flow offload disable", cli_flow_offload_disable, false, false);
+    register_command(NULL, "show flow offload", cli_show_flow_offload, false, false);
+    register_command(NULL, "show fetcher", cli_show_fetcher, true, false);
+    register_command(NULL, "fetcher batching enable", cli_fetcher_batching_enable, false, false);
+    register_command(NULL, "fetcher batching disable", cli_fetcher_batching_disable, false, false);
     register_command(NULL, "show sessions", cli_show_sessionss, false, false);
+    register_command(NULL, "show session table", cli_show_sessiontable, false, false);
+    register_command(NULL, "show packet buffers", cli_show_packetbuffers, false, false);
+    register_command(NULL, "show cpu affinity", cli_show_affinity, false, false);
+    register_command(NULL, "show latency", cli_show_latency, false, false);
+    register_command(NULL, "latency enable", cli_latency_enable, false, false);
+    register_command(NULL, "latency disable", cli_latency_disable, false, false);
     register_command(NULL, "compression enable", cli_compression_enable, false, false);
     register_command(NULL, "compression disable", cli_compression_disable, false, false);
+    register_command(NULL, "compression streaming enable", cli_compression_streaming_enable, false, false);
+    register_command(NULL, "compression streaming disable", cli_compression_streaming_disable, false, false);
+    register_command(NULL, "compression streaming memory", cli_compression_streaming_memory, true, false);
+    register_command(NULL, "compression codec default", cli_compression_codec_default, true, false);
+    register_command(NULL, "compression codec port", cli_compression_codec_port, true, false);
+    register_command(NULL, "no compression codec port", cli_no_compression_codec_port, true, false);
+    register_command(NULL, "compression codec neighbor", cli_compression_codec_neighbor, true, false);
+    register_command(NULL, "show dedup", cli_show_dedup, false, false);
+    register_command(NULL, "dedup enable", cli_dedup_enable, false, false);
+    register_command(NULL, "dedup disable", cli_dedup_disable, false, false);
+    register_command(NULL, "dedup memory", cli_dedup_memory, true, false);
 
     /*
      * Rejoin all threads before we exit!
@@ -6,23 +6,51 @@
 
 #include "packet.h"
 
-struct packet *newpacket(void)
+/*
+ * Clears the header of a packet buffer before it is handed out.
+ * The data is not cleared because save_packet() overwrites it.
+ */
+void init_packet(struct packet *thispacket)
 {
-    struct packet *thispacket = NULL;
-
-    thispacket = calloc(1,sizeof(struct packet)); // Allocate space for a new packet.
     thispacket->head = NULL;
     thispacket->next = NULL;
     thispacket->prev = NULL;
-
-    return thispacket;
+    thispacket->hq = NULL;
+    thispacket->fetcher = NULL;
+    thispacket->id = 0;
+    thispacket->received = 0;
+    thispacket->session = NULL;
 }
 
-int save_packet(struct packet *thispacket,struct nfq_q_handle *hq, u_int32_t id, int ret, __u8 *originalpacket, struct session *thissession)
+int save_packet(struct packet *thispacket, struct fetcher *thisfetcher, struct nfq_q_handle *hq, u_int32_t id, int ret, __u8 *originalpacket, struct session *thissession)
 {
+	thispacket->fetcher = thisfetcher; // Save the fetcher the verdict goes back through.
 	thispacket->hq = hq; // Save the queue handle.
 	thispacket->id = id; // Save this packets id.
 	memmove(thispacket->data, originalpacket, ret); // Save the packet.
+	thispacket->session = thissession;
+	__atomic_add_fetch(&thissession->queued, 1, __ATOMIC_RELAXED); // Counted before a worker can see it.
 	
 	return 0;
 }
+
+/*
+ * Called once the verdict of the packet was sent to the kernel
+ * so later packets of its session may be accepted ahead of the worker.
+ * Never takes the count below 0 in case the session was freed and
+ * reused for the same flow while the packet was queued.
+ */
+void release_packet_session(struct packet *thispacket)
+{
+	struct session *thissession = thispacket->session;
+	__u32 queued;
+
+	if (thissession != NULL) {
+		queued = __atomic_load_n(&thissession->queued, __ATOMIC_RELAXED);
+
+		while ((queued > 0) && (__atomic_compare_exchange_n(&thissession->queued, &queued, queued - 1,
+				true, __ATOMIC_RELEASE, __ATOMIC_RELAXED) == false)) {
+		}
+		thispacket->session = NULL;
+	}
+}
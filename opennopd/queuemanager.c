@@ -115,3 +115,134 @@ u_int32_t move_queued_packets(struct packet_head *fromqueue,
 
 	return qlen;
 }
+
+/*
+ * This function moves up to max packet buffers from the front of
+ * one queue to the end of another.
+ * Returns how many were moved.
+ */
+u_int32_t move_some_queued_packets(struct packet_head *fromqueue,
+		struct packet_head *toqueue, u_int32_t max) {
+	struct packet *start; // Points to the first packet being moved.
+	struct packet *end; // Points to the last packet being moved.
+	u_int32_t qlen; // How many buffers are being moved.
+
+	/*
+	 * Walk the source queue to find where the moved buffers end
+	 * then cut them from the source queue.
+	 */
+	pthread_mutex_lock(&fromqueue->lock);
+
+	if ((fromqueue->qlen == 0) || (max == 0)) {
+		pthread_mutex_unlock(&fromqueue->lock);
+		return 0;
+	}
+
+	start = fromqueue->next;
+	end = start;
+	qlen = 1;
+
+	while ((qlen < max) && (end->next != NULL)) {
+		end = end->next;
+		qlen++;
+	}
+
+	fromqueue->next = end->next;
+	fromqueue->qlen -= qlen;
+
+	if (fromqueue->qlen == 0) {
+		fromqueue->next = NULL;
+		fromqueue->prev = NULL;
+	} else {
+		fromqueue->next->prev = NULL;
+	}
+	pthread_mutex_unlock(&fromqueue->lock);
+	end->next = NULL;
+
+	/*
+	 * Add those buffers to the destination queue.
+	 */
+	pthread_mutex_lock(&toqueue->lock);
+	if (toqueue->next == NULL) {
+		toqueue->next = start;
+		toqueue->prev = end;
+		toqueue->qlen = qlen;
+	} else {
+		start->prev = toqueue->prev;
+		toqueue->prev->next = start;
+		toqueue->prev = end;
+		toqueue->qlen += qlen;
+	}
+	pthread_mutex_unlock(&toqueue->lock);
+
+	return qlen;
+}
+
+void initialize_packet_ring(struct packet_ring *ring) {
+	memset(ring, 0, sizeof(struct packet_ring));
+}
+
+/*
+ * Adds a packet to a ring.
+ * Must only be called by the one thread producing for this ring.
+ * Returns -1 if the ring is full so the caller can use a packet_head instead.
+ */
+int ring_queue_packet(struct packet_ring *ring, struct packet *thispacket) {
+	u_int32_t head, tail;
+
+	if (thispacket == NULL) {
+		return -1;
+	}
+
+	tail = ring->tail;
+	head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+	if ((tail - head) >= PACKETRINGSIZE) { // Ring is full.
+		return -1;
+	}
+
+	ring->slots[tail & (PACKETRINGSIZE - 1)] = thispacket;
+
+	/*
+	 * Publishing the new tail makes the slot visible to the consumer.
+	 */
+	__atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+	return 0;
+}
+
+/*
+ * Takes up to max packets from a ring.
+ * Must only be called by the one thread consuming this ring.
+ * Returns how many packets were taken.
+ */
+u_int32_t ring_dequeue_packets(struct packet_ring *ring,
+		struct packet **packets, u_int32_t max) {
+	u_int32_t head, tail, count, i;
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	count = tail - head;
+
+	if (count > max) {
+		count = max;
+	}
+
+	for (i = 0; i < count; i++) {
+		packets[i] = ring->slots[(head + i) & (PACKETRINGSIZE - 1)];
+	}
+
+	if (count > 0) {
+		__atomic_store_n(&ring->head, head + count, __ATOMIC_RELEASE);
+	}
+
+	return count;
+}
+
+/*
+ * Number of packets waiting in a ring.
+ * This is only a snapshot when called by other threads.
+ */
+u_int32_t ring_qlen(struct packet_ring *ring) {
+	return __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE)
+			- __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+}
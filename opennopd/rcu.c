@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#include <linux/types.h>
+
+#include "rcu.h"
+#include "logger.h"
+
+/*
+ * Each registered thread has its own cache line
+ * so reporting a quiescent state does not touch other threads.
+ */
+struct rcu_thread {
+	__u64 seen; // Last epoch this thread saw, 0 while it is offline.
+	int used; // Slot belongs to a thread.
+} __attribute__ ((aligned(64)));
+
+static struct rcu_thread rcuthreads[RCUMAXTHREADS];
+static __thread struct rcu_thread *thisthread = NULL;
+static __u64 rcuepoch = 1; // Advanced every time an object is retired.
+
+static struct rcu_head *retired = NULL; // Objects waiting for the readers.
+static __u32 numretired = 0;
+static __u32 nextreclaim = RCUBATCH; // numretired that starts the next reclaim pass.
+static pthread_mutex_t retiredlock = PTHREAD_MUTEX_INITIALIZER;
+
+void rcu_register_thread() {
+	int i;
+	int unused;
+	char message[LOGSZ];
+
+	if (thisthread != NULL) {
+		return;
+	}
+
+	for (i = 0; i < RCUMAXTHREADS; i++) {
+		unused = false;
+
+		if (__atomic_compare_exchange_n(&rcuthreads[i].used, &unused, true, false,
+				__ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+			thisthread = &rcuthreads[i];
+			rcu_thread_online();
+			return;
+		}
+	}
+
+	sprintf(message, "RCU: More than %i threads registered.\n", RCUMAXTHREADS);
+	logger(LOG_INFO, message);
+	exit(EXIT_FAILURE);
+}
+
+void rcu_unregister_thread() {
+
+	if (thisthread != NULL) {
+		rcu_thread_offline();
+		__atomic_store_n(&thisthread->used, false, __ATOMIC_RELEASE);
+		thisthread = NULL;
+	}
+}
+
+/*
+ * The thread holds no pointers it found before this call.
+ */
+void rcu_quiescent_state() {
+
+	if (thisthread != NULL) {
+		__atomic_store_n(&thisthread->seen,
+				__atomic_load_n(&rcuepoch, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * Called before a thread blocks so it does not hold up reclaiming.
+ */
+void rcu_thread_offline() {
+
+	if (thisthread != NULL) {
+		__atomic_store_n(&thisthread->seen, 0, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+ * The fence makes sure a reclaim pass either sees this thread online
+ * or finished unlinking before this thread reads anything.
+ */
+void rcu_thread_online() {
+
+	if (thisthread != NULL) {
+		__atomic_store_n(&thisthread->seen,
+				__atomic_load_n(&rcuepoch, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+/*
+ * Objects retired in an epoch are safe once every online thread has seen it.
+ */
+static __u64 rcu_safe_epoch() {
+	__u64 safe = __atomic_load_n(&rcuepoch, __ATOMIC_SEQ_CST);
+	__u64 seen;
+	int i;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	for (i = 0; i < RCUMAXTHREADS; i++) {
+
+		if (__atomic_load_n(&rcuthreads[i].used, __ATOMIC_ACQUIRE) == true) {
+			seen = __atomic_load_n(&rcuthreads[i].seen, __ATOMIC_ACQUIRE);
+
+			if ((seen != 0) && (seen < safe)) {
+				safe = seen;
+			}
+		}
+	}
+	return safe;
+}
+
+/*
+ * Frees every retired object no thread can still be using.
+ */
+void rcu_reclaim() {
+	struct rcu_head *safelist = NULL;
+	struct rcu_head **current = NULL;
+	struct rcu_head *head = NULL;
+	__u64 safe;
+
+	pthread_mutex_lock(&retiredlock);
+	safe = rcu_safe_epoch();
+	current = &retired;
+
+	while (*current != NULL) {
+		head = *current;
+
+		if (head->epoch <= safe) {
+			*current = head->next;
+			head->next = safelist;
+			safelist = head;
+			numretired--;
+		} else {
+			current = &head->next;
+		}
+	}
+	nextreclaim = numretired + RCUBATCH;
+	pthread_mutex_unlock(&retiredlock);
+
+	while (safelist != NULL) {
+		head = safelist;
+		safelist = head->next;
+		head->func(head);
+	}
+}
+
+/*
+ * Calls func for an object after it was unlinked and no reader can have it.
+ * A reclaim pass runs once RCUBATCH more objects are waiting.
+ */
+void call_rcu(struct rcu_head *head, void (*func)(struct rcu_head *head)) {
+	int reclaim = false;
+
+	head->func = func;
+	head->epoch = __atomic_add_fetch(&rcuepoch, 1, __ATOMIC_SEQ_CST);
+
+	pthread_mutex_lock(&retiredlock);
+	head->next = retired;
+	retired = head;
+	numretired++;
+
+	if (numretired >= nextreclaim) {
+		reclaim = true;
+	}
+	pthread_mutex_unlock(&retiredlock);
+
+	if (reclaim == true) {
+		rcu_reclaim();
+	}
+}
+
+__u32 rcu_pending() {
+	return __atomic_load_n(&numretired, __ATOMIC_RELAXED);
+}
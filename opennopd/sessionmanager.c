@@ -3,7 +3,11 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h> // for multi-threading
+#include <sys/mman.h>
 #include <linux/types.h>
 
 #include <arpa/inet.h>
@@ -15,27 +19,364 @@
 #include "session.h"
 #include "clicommands.h"
 #include "ipc.h"
+#include "compression.h"
+#include "rcu.h"
+#include "sessioncleanup.h"
 
-struct session_head sessiontable[SESSIONBUCKETS]; // Setup the session hashtable.
+/*
+ * Sessions are split into one shard for each worker by their hash
+ * and the worker of the shard handles all their packets.
+ * Each shard's hashtable starts with an equal part of SESSIONBUCKETS buckets
+ * and doubles when it holds more than SESSIONLOADFACTOR sessions per bucket.
+ * Lookups take no locks, see getsession().
+ * Inserts and removals hold the shard lock for reading and the bucket lock,
+ * growing the table holds it for writing while sessions are linked into the new table.
+ */
+static struct session_shard *sessionshards = NULL;
+static __u32 numsessionshards = 0;
+static __u32 sessionseed = 0; // Random so a remote host cannot pick colliding flows.
+
+/*
+ * Sessions are carved from slabs and kept on free lists instead of
+ * going back to malloc. Each thread keeps a few so the fetcher making
+ * sessions during a SYN flood mostly takes them without a lock.
+ */
+static struct session_slab *sessionslabs = NULL; // Slabs in the arena, newest first.
+static __u32 numsessionslabs = 0;
+static struct session *freesessions = NULL; // Linked by next[0].
+static __u32 numfreesessions = 0;
+static pthread_mutex_t sessionslablock = PTHREAD_MUTEX_INITIALIZER; // Lock for the slabs and freesessions.
+static __thread struct session *cachedsessions = NULL; // Free sessions of this thread.
+static __thread __u32 numcachedsessions = 0;
 
 int DEBUG_SESSIONMANAGER_INSERT = false;
 int DEBUG_SESSIONMANAGER_GET = false;
 int DEBUG_SESSIONMANAGER_REMOVE = false;
 static int DEBUG_SESSION_TRACKING = LOGGING_WARN;
 
+#define rol32(word, shift) (((word) << (shift)) | ((word) >> (32 - (shift))))
+
 /*
  * Calculates the hash of a session provided the IP addresses, and ports.
+ * This is Bob Jenkins' lookup3 final mix of the three words (jhash_3words)
+ * so every bit of the addresses and ports reaches every bit of the hash.
  */
-__u16 sessionhash(__u32 largerIP, __u16 largerIPPort, __u32 smallerIP,
+__u32 sessionhash(__u32 largerIP, __u16 largerIPPort, __u32 smallerIP,
 		__u16 smallerIPPort) {
-	__u16 hash1 = 0, hash2 = 0, hash3 = 0, hash4 = 0, hash = 0;
+	__u32 a, b, c;
+
+	a = b = c = 0xdeadbeef + (3 << 2) + sessionseed;
+	a += largerIP;
+	b += smallerIP;
+	c += ((__u32)largerIPPort << 16) | smallerIPPort;
+
+	c ^= b; c -= rol32(b, 14);
+	a ^= c; a -= rol32(c, 11);
+	b ^= a; b -= rol32(a, 25);
+	c ^= b; c -= rol32(b, 16);
+	a ^= c; a -= rol32(c, 4);
+	b ^= a; b -= rol32(a, 14);
+	c ^= b; c -= rol32(b, 24);
+	return c;
+}
+
+/*
+ * Picks the hash seed, falling back to the time if there is no /dev/urandom.
+ */
+static __u32 new_sessionseed() {
+	__u32 seed = 0;
+	FILE *urandom = fopen("/dev/urandom", "r");
+
+	if (urandom != NULL) {
+
+		if (fread(&seed, sizeof(seed), 1, urandom) != 1) {
+			seed = 0;
+		}
+		fclose(urandom);
+	}
+
+	if (seed == 0) {
+		seed = (__u32)time(NULL) ^ ((__u32)getpid() << 16);
+	}
+	return seed;
+}
+
+/*
+ * Buckets use the low bits of the hash and shards the high bits
+ * so the buckets of a shard are all used.
+ */
+static __u32 sessionshard(__u32 hash) {
+	return (__u32)(((__u64)hash * numsessionshards) >> 32);
+}
+
+/*
+ * Picks the worker of a new session from the workers running now.
+ */
+static __u8 session_worker(__u32 hash) {
+	__u32 numworkers = get_workers();
+
+	if (numworkers == 0) {
+		numworkers = 1;
+	}
+	return (__u8)(((__u64)hash * numworkers) >> 32);
+}
+
+static struct session_table *new_sessiontable(__u32 shard, __u32 numbuckets, int link) {
+	struct session_table *table = NULL;
+	__u32 i;
+
+	table = calloc(1, sizeof(struct session_table) + numbuckets * sizeof(struct session_head));
+
+	if (table != NULL) {
+		table->mask = numbuckets - 1;
+		table->link = link;
+		table->shard = shard;
 
-	hash1 = (largerIP ^ smallerIP) >> 16;
-	hash2 = (largerIP ^ smallerIP);
-	hash3 = hash1 ^ hash2;
-	hash4 = largerIPPort ^ smallerIPPort;
-	hash = hash3 ^ hash4;
-	return hash;
+		for (i = 0; i < numbuckets; i++) {
+			pthread_mutex_init(&table->buckets[i].lock, NULL);
+		}
+	}
+	return table;
+}
+
+static void free_sessiontable(struct rcu_head *head) {
+	struct session_table *table = (struct session_table *)((char *)head - offsetof(struct session_table, rcu));
+	__u32 i;
+
+	for (i = 0; i <= table->mask; i++) {
+		pthread_mutex_destroy(&table->buckets[i].lock);
+	}
+	__atomic_store_n(&sessionshards[table->shard].retiringtable, NULL, __ATOMIC_RELEASE);
+	free(table);
+}
+
+/*
+ * Maps a new slab and adds it to the front of the arena.
+ * Caller must hold the slab lock.
+ */
+static struct session_slab *new_session_slab() {
+	struct session_slab *thisslab = NULL;
+	void *region = NULL;
+
+	thisslab = calloc(1, sizeof(struct session_slab));
+
+	if (thisslab == NULL) {
+		return NULL;
+	}
+	region = mmap(NULL, SESSIONSLABSIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (region == MAP_FAILED) {
+		free(thisslab);
+		return NULL;
+	}
+	madvise(region, SESSIONSLABSIZE, MADV_HUGEPAGE);
+
+	thisslab->sessions = (struct session *)region;
+	thisslab->capacity = SESSIONSLABSIZE / sizeof(struct session);
+	thisslab->used = 0;
+	thisslab->next = sessionslabs;
+	sessionslabs = thisslab;
+	numsessionslabs++;
+	return thisslab;
+}
+
+/*
+ * Moves up to SESSIONCACHESIZE sessions to this thread's cache,
+ * from the free list first and then from the newest slab.
+ */
+static void refill_session_cache() {
+	struct session *thissession = NULL;
+
+	pthread_mutex_lock(&sessionslablock);
+
+	while ((numcachedsessions < SESSIONCACHESIZE) && (freesessions != NULL)) {
+		thissession = freesessions;
+		freesessions = thissession->next[0];
+		numfreesessions--;
+		thissession->next[0] = cachedsessions;
+		cachedsessions = thissession;
+		numcachedsessions++;
+	}
+
+	while (numcachedsessions < SESSIONCACHESIZE) {
+
+		if (((sessionslabs == NULL) || (sessionslabs->used == sessionslabs->capacity)) &&
+				(new_session_slab() == NULL)) {
+			break;
+		}
+		thissession = &sessionslabs->sessions[sessionslabs->used++];
+		thissession->next[0] = cachedsessions;
+		cachedsessions = thissession;
+		numcachedsessions++;
+	}
+	pthread_mutex_unlock(&sessionslablock);
+}
+
+/*
+ * Returns a zeroed session or NULL if no memory is left.
+ */
+static struct session *alloc_session() {
+	struct session *thissession = NULL;
+
+	if (cachedsessions == NULL) {
+		refill_session_cache();
+
+		if (cachedsessions == NULL) {
+			return NULL;
+		}
+	}
+	thissession = cachedsessions;
+	cachedsessions = thissession->next[0];
+	numcachedsessions--;
+	memset(thissession, 0, sizeof(struct session));
+	return thissession;
+}
+
+/*
+ * Keeps the session in this thread's cache.
+ * Half a full cache is given back so a thread that only frees
+ * sessions does not keep them all.
+ */
+static void put_session(struct session *thissession) {
+	struct session *lastsession = NULL;
+	struct session *keptsessions = NULL;
+	__u32 i;
+
+	thissession->next[0] = cachedsessions;
+	cachedsessions = thissession;
+	numcachedsessions++;
+
+	if (numcachedsessions >= SESSIONCACHESIZE * 2) {
+		lastsession = cachedsessions;
+
+		for (i = 1; i < SESSIONCACHESIZE; i++) {
+			lastsession = lastsession->next[0];
+		}
+		keptsessions = lastsession->next[0];
+
+		pthread_mutex_lock(&sessionslablock);
+		lastsession->next[0] = freesessions;
+		freesessions = cachedsessions;
+		numfreesessions += SESSIONCACHESIZE;
+		pthread_mutex_unlock(&sessionslablock);
+
+		cachedsessions = keptsessions;
+		numcachedsessions -= SESSIONCACHESIZE;
+	}
+}
+
+static void free_session(struct rcu_head *head) {
+	struct session *thissession = (struct session *)((char *)head - offsetof(struct session, rcu));
+
+	release_compression_stream(&thissession->larger);
+	release_compression_stream(&thissession->smaller);
+	put_session(thissession);
+}
+
+/*
+ * Adds a session to the end of a bucket.
+ * The session is complete before it is linked so a reader
+ * following the new pointer sees all of it.
+ */
+static void link_session(struct session_table *table, struct session_head *bucket,
+		struct session *thissession) {
+	int link = table->link;
+
+	thissession->head = bucket;
+	thissession->next[link] = NULL;
+	thissession->prev = bucket->prev;
+
+	if (bucket->qlen == 0) {
+		bucket->prev = thissession;
+		__atomic_store_n(&bucket->next, thissession, __ATOMIC_RELEASE);
+	} else {
+		bucket->prev = thissession;
+		__atomic_store_n(&thissession->prev->next[link], thissession, __ATOMIC_RELEASE);
+	}
+	bucket->qlen += 1;
+}
+
+/*
+ * Takes a session out of its bucket.
+ * Its own next pointer is left alone so a reader standing on it
+ * still reaches the rest of the list.
+ */
+static void unlink_session(struct session_table *table, struct session *thissession) {
+	struct session_head *bucket = thissession->head;
+	struct session *next = thissession->next[table->link];
+
+	if (thissession->prev == NULL) { // This is the first session.
+		__atomic_store_n(&bucket->next, next, __ATOMIC_RELEASE);
+	} else {
+		__atomic_store_n(&thissession->prev->next[table->link], next, __ATOMIC_RELEASE);
+	}
+
+	if (next == NULL) { // This is the last session.
+		bucket->prev = thissession->prev;
+	} else {
+		next->prev = thissession->prev;
+	}
+	bucket->qlen -= 1;
+}
+
+/*
+ * Doubles the number of buckets.
+ * The new lists use the other next pointer of the sessions so the old
+ * lists stay whole for readers that still have the old table.
+ * The old table is freed after they are done with it and the table cannot
+ * grow again before that because the next pointers would be reused.
+ */
+static void grow_sessiontable(struct session_shard *shard) {
+	struct session_table *oldtable = NULL;
+	struct session_table *newtable = NULL;
+	struct session *currentsession = NULL;
+	__u32 newbuckets;
+	__u32 i;
+	char message[LOGSZ];
+
+	pthread_rwlock_wrlock(&shard->lock);
+	oldtable = shard->table;
+
+	/*
+	 * Another thread might have grown the table while this one waited.
+	 */
+	if ((shard->count <= (oldtable->mask + 1) * SESSIONLOADFACTOR) ||
+			(oldtable->mask + 1 >= shard->maxbuckets) ||
+			(__atomic_load_n(&shard->retiringtable, __ATOMIC_ACQUIRE) != NULL)) {
+		pthread_rwlock_unlock(&shard->lock);
+		return;
+	}
+
+	newbuckets = (oldtable->mask + 1) * 2;
+	newtable = new_sessiontable(oldtable->shard, newbuckets, !oldtable->link);
+
+	if (newtable == NULL) {
+		pthread_rwlock_unlock(&shard->lock);
+		sprintf(message, "Session Manager: Could not grow session table to %u buckets.\n",
+				newbuckets);
+		logger(LOG_INFO, message);
+		return;
+	}
+
+	for (i = 0; i <= oldtable->mask; i++) {
+
+		for (currentsession = oldtable->buckets[i].next; currentsession != NULL;
+				currentsession = currentsession->next[oldtable->link]) {
+			link_session(newtable, &newtable->buckets[currentsession->hash & newtable->mask],
+					currentsession);
+		}
+	}
+
+	shard->retiringtable = oldtable;
+	__atomic_store_n(&shard->table, newtable, __ATOMIC_RELEASE);
+	shard->resizes++;
+	pthread_rwlock_unlock(&shard->lock);
+	call_rcu(&oldtable->rcu, free_sessiontable);
+
+	sprintf(message, "Session Manager: Grew session table %u to %u buckets.\n",
+			newtable->shard, newbuckets);
+	logger(LOG_INFO, message);
 }
 
 int session_accelerated(struct session *currentsession){
@@ -58,31 +399,20 @@ int session_accelerated(struct session *currentsession){
 
 /* 
  * This function frees all memory dynamically allocated for the session linked list. 
+ * Only used when exiting when no other thread is using the sessions.
  */
 void freemem(struct session_head *currentlist) {
 	struct session *currentsession = NULL;
+	struct session *nextsession = NULL;
 
-	if (currentlist->next != NULL) {
-		currentsession = currentlist->next;
-
-		while (currentlist->next != NULL) {
-
-			printf("Freeing session!\n");
-			if (currentsession->prev != NULL) { // Is there a previous session.
-				free(currentsession->prev); // Free the previous session.
-				currentsession->prev = NULL; // Assign the previous session NULL.
-			}
-
-			if (currentsession->next != NULL) { // Check if there are more sessions.
-				currentsession = currentsession->next; // Advance to the next session.
-			} else { // No more sessions.
-				free(currentsession); // Free the last session.
-				currentsession = NULL; // Set the current session as NULL.
-				currentlist->next = NULL; // Assign the list as NULL.
-				currentlist->prev = NULL; // Assign the list as NULL.
-			}
-		}
+	for (currentsession = currentlist->next; currentsession != NULL; currentsession = nextsession) {
+		printf("Freeing session!\n");
+		nextsession = getnextsession(currentsession);
+		free_session(&currentsession->rcu);
 	}
+	currentlist->next = NULL; // Assign the list as NULL.
+	currentlist->prev = NULL; // Assign the list as NULL.
+	currentlist->qlen = 0;
 	return;
 }
 
@@ -93,50 +423,38 @@ void freemem(struct session_head *currentlist) {
 struct session *insertsession(__u32 largerIP, __u16 largerIPPort,
 		__u32 smallerIP, __u16 smallerIPPort) {
 	struct session *newsession = NULL;
-	int i;
-	__u16 hash = 0;
+	struct session_shard *shard = NULL;
+	struct session_table *table = NULL;
+	struct session_head *bucket = NULL;
+	int grow = false;
 	__u8 queuenum = 0;
+	__u8 shardnum = 0;
 	char message[LOGSZ];
 
-	hash = sessionhash(largerIP, smallerIP, largerIPPort, smallerIPPort);
+	newsession = alloc_session(); // Allocate a new session.
 
-	/*
-	 * What queue will the packets for this session go to?
-	 */
-	queuenum = 0;
+	if (newsession != NULL) { // Write data to this new session.
+		newsession->hash = sessionhash(largerIP, largerIPPort, smallerIP, smallerIPPort);
 
-	for (i = 0; i < get_workers(); i++) {
+		/*
+		 * The hash picks the worker so every packet of the flow goes to it.
+		 * There are as many shards as workers at startup, the workers
+		 * running now can be more or fewer.
+		 */
+		shardnum = sessionshard(newsession->hash);
+		shard = &sessionshards[shardnum];
+		queuenum = session_worker(newsession->hash);
 
 		if (DEBUG_SESSIONMANAGER_INSERT == true) {
-			sprintf(message, "Session Manager: Queue #%d has %d sessions.\n",
-					i, get_worker_sessions(i));
+			sprintf(message,
+					"Session Manager: Assigning session to queue #: %d!\n",
+					queuenum);
 			logger(LOG_INFO, message);
 		}
-
-		if (get_worker_sessions(queuenum) > get_worker_sessions(i)) {
-
-			if (i < get_workers()) {
-				queuenum = i;
-			}
-		}
-	}
-
-	if (DEBUG_SESSIONMANAGER_INSERT == true) {
-		sprintf(message,
-				"Session Manager: Assigning session to queue #: %d!\n",
-				queuenum);
-		logger(LOG_INFO, message);
-	}
-
-	newsession = calloc(1, sizeof(struct session)); // Allocate a new session.
-
-	if (newsession != NULL) { // Write data to this new session.
-		newsession->head = &sessiontable[hash]; // Pointer to the head of this list.
-		newsession->next = NULL;
-		newsession->prev = NULL;
 		newsession->client = NULL;
 		newsession->server = NULL;
 		newsession->queue = queuenum;
+		newsession->shard = shardnum;
 		newsession->larger.address = largerIP; // Assign values and initialize this session.
 		newsession->larger.port = largerIPPort;
 		//newsession->larger.accelerator = 0;
@@ -153,38 +471,57 @@ struct session *insertsession(__u32 largerIP, __u16 largerIPPort,
 		 */
 		increment_worker_sessions(queuenum);
 
+		/*
+		 * It must be in an idle timer slot before anyone can find and clear it.
+		 */
+		add_session_timer(newsession);
+
 		/* 
 		 * Lets add the new session to the session bucket.
 		 */
-		pthread_mutex_lock(&sessiontable[hash].lock); // Grab lock on the session bucket.
+		pthread_rwlock_rdlock(&shard->lock);
+		table = shard->table;
+		bucket = &table->buckets[newsession->hash & table->mask];
+		pthread_mutex_lock(&bucket->lock); // Grab lock on the session bucket.
 
 		if (DEBUG_SESSIONMANAGER_INSERT == true) {
 			sprintf(message,
 					"Session Manager: Assigning session to bucket #: %u!\n",
-					hash);
+					newsession->hash & table->mask);
 			logger(LOG_INFO, message);
 		}
 
-		if (sessiontable[hash].qlen == 0) { // Check if any session are in this bucket.
-			sessiontable[hash].next = newsession; // Session Head next will point to the new session.
-			sessiontable[hash].prev = newsession; // Session Head prev will point to the new session.
-		} else {
-			newsession->prev = sessiontable[hash].prev; // Session prev will point at the last packet in the session bucket.
-			newsession->prev->next = newsession;
-			sessiontable[hash].prev = newsession; // Make this new session the last session in the session bucket.
-		}
-
-		sessiontable[hash].qlen += 1; // Need to increase the session count in this session bucket.	
+		link_session(table, bucket, newsession);
 
 		if (DEBUG_SESSIONMANAGER_INSERT == true) {
 			sprintf(
 					message,
 					"Session Manager: There are %u sessions in this bucket now.\n",
-					sessiontable[hash].qlen);
+					bucket->qlen);
 			logger(LOG_INFO, message);
 		}
 
-		pthread_mutex_unlock(&sessiontable[hash].lock); // Lose lock on session bucket.
+		pthread_mutex_unlock(&bucket->lock); // Lose lock on session bucket.
+
+		if ((__sync_add_and_fetch(&shard->count, 1) > (table->mask + 1) * SESSIONLOADFACTOR) &&
+				(table->mask + 1 < shard->maxbuckets)) {
+			grow = true;
+		}
+		pthread_rwlock_unlock(&shard->lock);
+
+		if (grow == true) {
+
+			/*
+			 * The last table replaced might only be waiting for a reclaim pass.
+			 */
+			if (__atomic_load_n(&shard->retiringtable, __ATOMIC_ACQUIRE) != NULL) {
+				rcu_reclaim();
+			}
+
+			if (__atomic_load_n(&shard->retiringtable, __ATOMIC_ACQUIRE) == NULL) {
+				grow_sessiontable(shard);
+			}
+		}
 
 		return newsession;
 	} else {
@@ -195,31 +532,30 @@ struct session *insertsession(__u32 largerIP, __u16 largerIPPort,
 /*
  * Gets the sessionindex for the TCP session.
  * Returns NULL if hits the end of the list without a match.
+ * Takes no locks, the session stays valid until the calling thread's
+ * next quiescent state even if it is cleared meanwhile.
  */
 struct session *getsession(__u32 largerIP, __u16 largerIPPort, __u32 smallerIP,
 		__u16 smallerIPPort) {
+	struct session_table *table = NULL;
 	struct session *currentsession = NULL;
-	__u16 hash = 0;
+	__u32 hash;
+	__u32 bucket = 0;
+	int link;
 	char message[LOGSZ];
 
-	hash = sessionhash(largerIP, smallerIP, largerIPPort, smallerIPPort);
+	hash = sessionhash(largerIP, largerIPPort, smallerIP, smallerIPPort);
+	table = __atomic_load_n(&sessionshards[sessionshard(hash)].table, __ATOMIC_ACQUIRE);
+	link = table->link;
+	bucket = hash & table->mask;
 
 	if (DEBUG_SESSIONMANAGER_GET == true) {
 		sprintf(message,
 				"Session Manager: Seaching for session in bucket #: %u!\n",
-				hash);
+				bucket);
 		logger(LOG_INFO, message);
 	}
-	if (sessiontable[hash].next != NULL) { // Testing for sessions in the list.
-		currentsession = sessiontable[hash].next; // There is at least one session in the list.
-	} else { // No sessions were in this list.
-
-		if (DEBUG_SESSIONMANAGER_GET == true) {
-			sprintf(message, "Session Manager: No session was found.\n");
-			logger(LOG_INFO, message);
-		}
-		return NULL;
-	}
+	currentsession = __atomic_load_n(&table->buckets[bucket].next, __ATOMIC_ACQUIRE);
 
 	while (currentsession != NULL) { // Looking for session.
 
@@ -227,93 +563,78 @@ struct session *getsession(__u32 largerIP, __u16 largerIPPort, __u32 smallerIP,
 				(currentsession->larger.port == largerIPPort)
 				&& (currentsession->smaller.address == smallerIP)
 				&& (currentsession->smaller.port == smallerIPPort)) {
-
-			if (DEBUG_SESSIONMANAGER_GET == true) {
-				sprintf(message, "Session Manager: A session was found.\n");
-				logger(LOG_INFO, message);
-			}
-			return currentsession; // Session matched so save session.
-		} else {
-
-			if (currentsession->next != NULL) { // Not a match move to next session.
-				currentsession = currentsession->next;
-			} else { // No more sessions so no session exists.
-
-				if (DEBUG_SESSIONMANAGER_GET == true) {
-					sprintf(message, "Session Manager: No session was found.\n");
-					logger(LOG_INFO, message);
-				}
-				return NULL;
-			}
+			break; // Session matched so save session.
 		}
+		currentsession = __atomic_load_n(&currentsession->next[link], __ATOMIC_ACQUIRE);
 	}
 
-	// Something went very bad if this runs.
 	if (DEBUG_SESSIONMANAGER_GET == true) {
-		sprintf(message, "Session Manager: FATAL! No session was found.\n");
+
+		if (currentsession != NULL) {
+			sprintf(message, "Session Manager: A session was found.\n");
+		} else {
+			sprintf(message, "Session Manager: No session was found.\n");
+		}
 		logger(LOG_INFO, message);
 	}
-	return NULL;
+	return currentsession;
 }
 
 /*
  * Resets the sessionindex, and session. 
+ * The session is freed after every thread that might have it is done.
+ * Clearing a session that was already cleared does nothing.
  */
 struct session *clearsession(struct session *currentsession) {
-	__u16 hash = 0;
+	struct session_shard *shard = NULL;
+	struct session_head *bucket = NULL;
 	char message[LOGSZ];
 
 	if (currentsession != NULL) { // Make sure session is not NULL.
+		shard = &sessionshards[currentsession->shard];
+		pthread_rwlock_rdlock(&shard->lock); // Keeps head in place until the session is out.
+		bucket = currentsession->head;
+
+		if (bucket == NULL) {
+			pthread_rwlock_unlock(&shard->lock);
+			return NULL;
+		}
 
 		if (DEBUG_SESSIONMANAGER_REMOVE == true) {
-			hash = sessionhash(currentsession->larger.address,
-					currentsession->smaller.address, currentsession->larger.port,
-					currentsession->smaller.port);
 			sprintf(message,
 					"Session Manager: Removing session from bucket #: %u!\n",
-					hash);
+					currentsession->hash & shard->table->mask);
 			logger(LOG_INFO, message);
 		}
 
-		pthread_mutex_lock(&currentsession->head->lock); // Grab lock on the session bucket.
-
-		if ((currentsession->next == NULL) && (currentsession->prev == NULL)) { // This should be the only session.
-			currentsession->head->next = NULL;
-			currentsession->head->prev = NULL;
-		}
-
-		if ((currentsession->next != NULL) && (currentsession->prev == NULL)) { // This is the first session.
-			currentsession->next->prev = NULL; // Set the previous session as the last.
-			currentsession->head->next = currentsession->next; // Update the first session in head to the next.
-		}
-
-		if ((currentsession->next == NULL) && (currentsession->prev != NULL)) { // This is the last session.
-			currentsession->prev->next = NULL; // Set the previous session as the last.
-			currentsession->head->prev = currentsession->prev; // Update the last session in head to the previous.
-		}
+		pthread_mutex_lock(&bucket->lock); // Grab lock on the session bucket.
 
-		if ((currentsession->next != NULL) && (currentsession->prev != NULL)) { // This is in the middle of the list.
-			currentsession->prev->next = currentsession->next; // Sets the previous session next to the next session.
-			currentsession->next->prev = currentsession->prev; // Sets the next session previous to the previous session.
+		if (currentsession->head == NULL) { // Another thread cleared it first.
+			pthread_mutex_unlock(&bucket->lock);
+			pthread_rwlock_unlock(&shard->lock);
+			return NULL;
 		}
-
-		currentsession->head->qlen -= 1; // Need to increase the session count in this session bucket.	
-
-		pthread_mutex_unlock(&currentsession->head->lock); // Lose lock on session bucket.
+		unlink_session(shard->table, currentsession);
+		currentsession->head = NULL;
 
 		if (DEBUG_SESSIONMANAGER_REMOVE == true) {
 			sprintf(
 					message,
 					"Session Manager: There are %u sessions in this bucket now.\n",
-					currentsession->head->qlen);
+					bucket->qlen);
 			logger(LOG_INFO, message);
 		}
 
+		pthread_mutex_unlock(&bucket->lock); // Lose lock on session bucket.
+		__sync_sub_and_fetch(&shard->count, 1);
+		pthread_rwlock_unlock(&shard->lock);
+
 		/*
 		 * Decrease the counter for number of sessions assigned to this worker.
 		 */
 		decrement_worker_sessions(currentsession->queue);
-		free(currentsession);
+		remove_session_timer(currentsession);
+		call_rcu(&currentsession->rcu, free_session);
 		currentsession = NULL;
 	}
 	return currentsession;
@@ -339,42 +660,167 @@ void sort_sockets(__u32 *largerIP, __u16 *largerIPPort, __u32 *smallerIP,
 }
 
 void initialize_sessiontable() {
-	int i;
-	for (i = 0; i < SESSIONBUCKETS; i++) { // Initialize all the slots in the hashtable to NULL.
-		sessiontable[i].next = NULL;
-		sessiontable[i].prev = NULL;
+	pthread_rwlockattr_t attr;
+	__u32 numbuckets = SESSIONBUCKETS;
+	__u32 maxbuckets = SESSIONMAXBUCKETS;
+	__u32 i;
+
+	numsessionshards = get_workers();
+
+	if (numsessionshards == 0) {
+		numsessionshards = 1;
+	}
+
+	/*
+	 * All the shards together start and stop at about the same
+	 * number of buckets one table would.
+	 */
+	while ((numbuckets > SESSIONMINBUCKETS) && (numbuckets * numsessionshards > SESSIONBUCKETS)) {
+		numbuckets /= 2;
+	}
+
+	while ((maxbuckets > numbuckets) && ((__u64)maxbuckets * numsessionshards > SESSIONMAXBUCKETS)) {
+		maxbuckets /= 2;
+	}
+
+	sessionshards = calloc(numsessionshards, sizeof(struct session_shard));
+
+	if (sessionshards == NULL) {
+		logger(LOG_INFO, "Initialization: Could not allocate the session shards.\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * A thread walking the buckets holds the shards for reading and
+	 * may clear sessions meanwhile, so readers must not wait behind a waiting writer.
+	 */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_READER_NP);
+	sessionseed = new_sessionseed();
+
+	for (i = 0; i < numsessionshards; i++) {
+		pthread_rwlock_init(&sessionshards[i].lock, &attr);
+		sessionshards[i].maxbuckets = maxbuckets;
+		sessionshards[i].table = new_sessiontable(i, numbuckets, 0);
+
+		if (sessionshards[i].table == NULL) {
+			logger(LOG_INFO, "Initialization: Could not allocate the session table.\n");
+			exit(EXIT_FAILURE);
+		}
 	}
+	pthread_rwlockattr_destroy(&attr);
+	initialize_session_timers();
 }
 
 void clear_sessiontable() {
-	int i;
+	__u32 shard;
+	__u32 i;
 	char message[LOGSZ];
 
-	for (i = 0; i < SESSIONBUCKETS; i++) { // Initialize all the slots in the hashtable to NULL.
-		if (sessiontable[i].next != NULL) {
-			freemem(&sessiontable[i]);
-			sprintf(message, "Exiting: Freeing sessiontable %d!\n", i);
-			logger(LOG_INFO, message);
+	for (shard = 0; shard < numsessionshards; shard++) {
+
+		for (i = 0; i < get_sessiontable_size(shard); i++) { // Initialize all the slots in the hashtable to NULL.
+			if (getsessionhead(shard, i)->next != NULL) {
+				freemem(getsessionhead(shard, i));
+				sprintf(message, "Exiting: Freeing sessiontable %u bucket %u!\n", shard, i);
+				logger(LOG_INFO, message);
+			}
+
 		}
+	}
+}
+
+__u32 get_sessionshards() {
+	return numsessionshards;
+}
+
+/*
+ * Bucket i of a shard and the sessions after the ones in it are only valid
+ * while the table is locked, see lock_sessiontable().
+ */
+struct session_head *getsessionhead(__u32 shard, __u32 i) {
+	return &sessionshards[shard].table->buckets[i];
+}
 
+struct session *getnextsession(struct session *currentsession) {
+	return __atomic_load_n(&currentsession->next[sessionshards[currentsession->shard].table->link],
+			__ATOMIC_ACQUIRE);
+}
+
+__u32 get_sessiontable_size(__u32 shard) {
+	return sessionshards[shard].table->mask + 1;
+}
+
+/*
+ * Gives the sessions of a retired worker to another worker.
+ * Nothing may be processing packets of the retired worker's sessions,
+ * the caller has stopped its threads and the fetchers.
+ * Returns how many sessions moved.
+ */
+__u32 move_worker_sessions(__u8 from, __u8 to) {
+	struct session_head *bucket;
+	struct session *currentsession;
+	__u32 moved = 0;
+	__u32 shard;
+	__u32 i;
+
+	for (shard = 0; shard < numsessionshards; shard++) {
+		pthread_rwlock_rdlock(&sessionshards[shard].lock);
+
+		for (i = 0; i < get_sessiontable_size(shard); i++) {
+			bucket = getsessionhead(shard, i);
+			pthread_mutex_lock(&bucket->lock); // Sessions cannot be cleared while we look.
+
+			for (currentsession = bucket->next; currentsession != NULL;
+					currentsession = getnextsession(currentsession)) {
+
+				if (currentsession->queue == from) {
+					__atomic_store_n(&currentsession->queue, to, __ATOMIC_RELAXED);
+					decrement_worker_sessions(from);
+					increment_worker_sessions(to);
+					moved++;
+				}
+			}
+			pthread_mutex_unlock(&bucket->lock);
+		}
+		pthread_rwlock_unlock(&sessionshards[shard].lock);
 	}
+	return moved;
 }
 
-struct session_head *getsessionhead(int i) {
-	return &sessiontable[i];
+/*
+ * Stops the shards from growing while a thread walks the buckets.
+ * The thread must also be registered with RCU because sessions can
+ * still be cleared while it walks.
+ */
+void lock_sessiontable() {
+	__u32 i;
+
+	for (i = 0; i < numsessionshards; i++) {
+		pthread_rwlock_rdlock(&sessionshards[i].lock);
+	}
+}
+
+void unlock_sessiontable() {
+	__u32 i;
+
+	for (i = 0; i < numsessionshards; i++) {
+		pthread_rwlock_unlock(&sessionshards[i].lock);
+	}
 }
 
 struct commandresult cli_show_sessionss(int client_fd, char **parameters, int numparameters, void *data) {
 	struct session *currentsession = NULL;
 	struct commandresult result = { 0 };
 	char msg[MAX_BUFFER_SIZE] = { 0 };
-	int i;
+	__u32 shard;
+	__u32 i;
 	char temp[20];
-	char col1[10];
-	char col2[18];
-	char col3[14];
-	char col4[18];
-	char col5[14];
+	char col1[14];
+	char col2[22];
+	char col3[16];
+	char col4[22];
+	char col5[16];
 	char col6[14];
 	char end[3];
 
@@ -394,76 +840,144 @@ struct commandresult cli_show_sessionss(int client_fd, char **parameters, int nu
 	/*
 	 * Check each index of the session table for any sessions.
 	 */
-	for (i = 0; i < SESSIONBUCKETS; i++) {
+	rcu_register_thread();
+	lock_sessiontable();
 
-		/*
-		 * Skip any index of the sessiontable that has no sessions.
-		 */
-		if (sessiontable[i].next != NULL) {
-			currentsession = sessiontable[i].next;
+	for (shard = 0; shard < get_sessionshards(); shard++) {
+		for (i = 0; i < get_sessiontable_size(shard); i++) {
 
 			/*
-			 * Work through all sessions in that index and print them out.
+			 * Skip any index of the sessiontable that has no sessions.
 			 */
-			while (currentsession != NULL) {
-
-				/**
-				 * @todo:
-				 * This will only show the session if we know what IPs are client & server.
-				 * Its possible we wont know that if a session opening is not witnessed
-				 * by OpenNOP.  OpenNOP has a "recover" mechanism that allows the session
-				 * to be optimized if it detects another OpenNOP appliance.
-				 * https://sourceforge.net/p/opennop/bugs/16/
+			if (getsessionhead(shard, i)->next != NULL) {
+				currentsession = getsessionhead(shard, i)->next;
+
+				/*
+				 * Work through all sessions in that index and print them out.
 				 */
-				if ((currentsession->client != NULL) && (currentsession->server
-						!= NULL)) {
-					strcpy(msg, "");
-					sprintf(col1, "|  %-7i", i);
-					strcat(msg, col1);
-					inet_ntop(AF_INET, currentsession->client, temp,
-							INET_ADDRSTRLEN);
-					sprintf(col2, "| %-15s", temp);
-					strcat(msg, col2);
-					sprintf(col3, "|   %-10i", ntohs(
-							currentsession->larger.port));
-					strcat(msg, col3);
-					inet_ntop(AF_INET, currentsession->server, temp,
-							INET_ADDRSTRLEN);
-					sprintf(col4, "| %-15s", temp);
-					strcat(msg, col4);
-					sprintf(col5, "|   %-10i", ntohs(
-							currentsession->smaller.port));
-					strcat(msg, col5);
-
-					/*
-					if ((((currentsession->larger.accelerator == localID)
-							|| (currentsession->smaller.accelerator == localID))
-							&& ((currentsession->larger.accelerator != 0)
-									&& (currentsession->smaller.accelerator
-											!= 0))
-							&& (currentsession->larger.accelerator
-									!= currentsession->smaller.accelerator))) {
-					*/
-					if(session_accelerated(currentsession)== 1){
-						sprintf(col6, "|     Yes    ");
-					} else {
-						sprintf(col6, "|     No     ");
+				while (currentsession != NULL) {
+
+					/**
+					 * @todo:
+					 * This will only show the session if we know what IPs are client & server.
+					 * Its possible we wont know that if a session opening is not witnessed
+					 * by OpenNOP.  OpenNOP has a "recover" mechanism that allows the session
+					 * to be optimized if it detects another OpenNOP appliance.
+					 * https://sourceforge.net/p/opennop/bugs/16/
+					 */
+					if ((currentsession->client != NULL) && (currentsession->server
+							!= NULL)) {
+						strcpy(msg, "");
+						sprintf(col1, "|  %-7u", i);
+						strcat(msg, col1);
+						inet_ntop(AF_INET, currentsession->client, temp,
+								INET_ADDRSTRLEN);
+						sprintf(col2, "| %-15s", temp);
+						strcat(msg, col2);
+						sprintf(col3, "|   %-10i", ntohs(
+								currentsession->larger.port));
+						strcat(msg, col3);
+						inet_ntop(AF_INET, currentsession->server, temp,
+								INET_ADDRSTRLEN);
+						sprintf(col4, "| %-15s", temp);
+						strcat(msg, col4);
+						sprintf(col5, "|   %-10i", ntohs(
+								currentsession->smaller.port));
+						strcat(msg, col5);
+
+						/*
+						if ((((currentsession->larger.accelerator == localID)
+								|| (currentsession->smaller.accelerator == localID))
+								&& ((currentsession->larger.accelerator != 0)
+										&& (currentsession->smaller.accelerator
+												!= 0))
+								&& (currentsession->larger.accelerator
+										!= currentsession->smaller.accelerator))) {
+						*/
+						if(session_accelerated(currentsession)== 1){
+							sprintf(col6, "|     Yes    ");
+						} else {
+							sprintf(col6, "|     No     ");
+						}
+						strcat(msg, col6);
+						sprintf(end, "|\n");
+						strcat(msg, end);
+						cli_send_feedback(client_fd, msg);
+
+						binary_dump("sessionmanager.c Larger ID: ", (char*)&currentsession->larger.accelerator, OPENNOP_IPC_ID_LENGTH);
+						binary_dump("sessionmanager.c Smaller ID: ", (char*)&currentsession->smaller.accelerator, OPENNOP_IPC_ID_LENGTH);
 					}
-					strcat(msg, col6);
-					sprintf(end, "|\n");
-					strcat(msg, end);
-					cli_send_feedback(client_fd, msg);
 
-					binary_dump("sessionmanager.c Larger ID: ", (char*)&currentsession->larger.accelerator, OPENNOP_IPC_ID_LENGTH);
-					binary_dump("sessionmanager.c Smaller ID: ", (char*)&currentsession->smaller.accelerator, OPENNOP_IPC_ID_LENGTH);
+					currentsession = getnextsession(currentsession);
 				}
-
-				currentsession = currentsession->next;
 			}
+
 		}
+	}
+	unlock_sessiontable();
+	rcu_unregister_thread();
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_show_sessiontable(int client_fd, char **parameters, int numparameters, void *data) {
+	struct commandresult result = { 0 };
+	char msg[MAX_BUFFER_SIZE] = { 0 };
+	__u32 shard;
+	__u32 i;
+	__u32 buckets = 0;
+	__u32 sessions = 0;
+	__u32 usedbuckets = 0;
+	__u32 longestchain = 0;
+	__u32 resizes = 0;
+	__u32 shardsessions;
+
+	lock_sessiontable();
 
+	for (shard = 0; shard < get_sessionshards(); shard++) {
+		shardsessions = 0;
+
+		for (i = 0; i < get_sessiontable_size(shard); i++) {
+
+			if (getsessionhead(shard, i)->qlen > 0) {
+				shardsessions += getsessionhead(shard, i)->qlen;
+				usedbuckets++;
+			}
+
+			if (getsessionhead(shard, i)->qlen > longestchain) {
+				longestchain = getsessionhead(shard, i)->qlen;
+			}
+		}
+		sprintf(msg, "shard %u: buckets: %u sessions: %u resizes: %u\n", shard,
+				get_sessiontable_size(shard), shardsessions, sessionshards[shard].resizes);
+		cli_send_feedback(client_fd, msg);
+		buckets += get_sessiontable_size(shard);
+		sessions += shardsessions;
+		resizes += sessionshards[shard].resizes;
 	}
 
+	sprintf(msg, "buckets: %u sessions: %u load factor: %.2f\n", buckets,
+			sessions, (double)sessions / buckets);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg, "used buckets: %u longest chain: %u average chain: %.2f\n",
+			usedbuckets, longestchain,
+			(usedbuckets > 0) ? (double)sessions / usedbuckets : 0.0);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg, "resizes: %u maximum buckets per shard: %u\n", resizes, sessionshards[0].maxbuckets);
+	cli_send_feedback(client_fd, msg);
+	sprintf(msg, "waiting to be freed: %u\n", rcu_pending());
+	cli_send_feedback(client_fd, msg);
+	pthread_mutex_lock(&sessionslablock);
+	sprintf(msg, "session slabs: %u free sessions: %u session size: %u\n", numsessionslabs,
+			numfreesessions, (__u32)sizeof(struct session));
+	pthread_mutex_unlock(&sessionslablock);
+	cli_send_feedback(client_fd, msg);
+	unlock_sessiontable();
+
     result.finished = 0;
     result.mode = NULL;
     result.data = NULL;
@@ -551,16 +1065,147 @@ int saveacceleratorid(__u32 largerIP, __u32 acceleratorID, struct iphdr *iph, st
 */
 
 int saveacceleratorid(__u32 largerIP, char *acceleratorID, struct iphdr *iph, struct session *thissession) {
+	struct endpoint *source = NULL;
 
 	if ((largerIP != 0) && (iph != NULL) && (thissession != NULL)){
 
 		if (iph->saddr == largerIP)
 		{ // Set the Accelerator for this source.
-			save_opennopid(acceleratorID, (char*)&thissession->larger.accelerator);
+			source = &thissession->larger;
 		}else{
-			save_opennopid(acceleratorID, (char*)&thissession->smaller.accelerator);
+			source = &thissession->smaller;
+		}
+
+		/*
+		 * Roles of both directions depend on both IDs.
+		 */
+		if (compare_opennopid((char*)&source->accelerator, acceleratorID) == 0) {
+			save_opennopid(acceleratorID, (char*)&source->accelerator);
+			__atomic_store_n(&thissession->role[0], SESSION_ROLE_UNKNOWN, __ATOMIC_RELAXED);
+			__atomic_store_n(&thissession->role[1], SESSION_ROLE_UNKNOWN, __ATOMIC_RELAXED);
 		}
 		return 0;// Everything  OK.
 	}
 	return -1;// Had a problem.
 }
+
+/*
+ * Returns the role cached for packets from larger (0) or smaller (1)
+ * or SESSION_ROLE_UNKNOWN if a neighbor changed since it was worked out.
+ * Only reads the session so threads other than its worker can use it.
+ */
+int cached_direction_role(struct session *thissession, int direction) {
+	__u16 cached = __atomic_load_n(&thissession->role[direction], __ATOMIC_RELAXED);
+
+	/*
+	 * The 4 bit role shares the word with the low 12 bits of the neighbor generation.
+	 */
+	if ((cached & 0xfff0) != (__u16)(get_neighbor_generation() << 4)) {
+		return SESSION_ROLE_UNKNOWN;
+	}
+	return cached & 0x000f;
+}
+
+/*
+ * Returns the role cached for the direction of this packet
+ * or SESSION_ROLE_UNKNOWN if it has to be worked out again.
+ * Only reads the session so threads other than its worker can use it.
+ */
+int cached_session_role(__u32 largerIP, struct iphdr *iph, struct session *thissession, char *remoteID) {
+	struct endpoint *source = NULL;
+	int role;
+
+	if (iph->saddr == largerIP) {
+		source = &thissession->larger;
+		role = cached_direction_role(thissession, 0);
+	} else {
+		source = &thissession->smaller;
+		role = cached_direction_role(thissession, 1);
+	}
+
+	/*
+	 * The cached role is only trusted for packets like the one it was worked out for.
+	 */
+	switch (role) {
+	case SESSION_ROLE_OPTIMIZE:
+	case SESSION_ROLE_PASSTHROUGH:
+
+		if (remoteID == NULL) {
+			return role;
+		}
+		break;
+
+	case SESSION_ROLE_DEOPTIMIZE:
+	case SESSION_ROLE_RELAY:
+
+		if ((remoteID != NULL) && (compare_opennopid((char*)&source->accelerator, remoteID) == 1)) {
+			return role;
+		}
+		break;
+	}
+	return SESSION_ROLE_UNKNOWN;
+}
+
+/*
+ * Works out what the worker does with the packets from the source of iph
+ * the same way for every packet until an accelerator ID or a neighbor changes.
+ * remoteID is the ID the packet carries or NULL.
+ *
+ * A packet without an ID from a neighbor means this accelerator is the first one
+ * and the source gets the local ID. It is optimized if the other end has another accelerator.
+ * A packet with a neighbor's ID is deoptimized if this accelerator is the other end
+ * or just passed on to the next one.
+ */
+int session_role(__u32 largerIP, struct iphdr *iph, struct session *thissession, char *remoteID) {
+	struct endpoint *source = NULL;
+	struct endpoint *destination = NULL;
+	__u16 *role = NULL;
+	__u16 generation;
+	int resolved;
+
+	resolved = cached_session_role(largerIP, iph, thissession, remoteID);
+
+	if (resolved != SESSION_ROLE_UNKNOWN) {
+		return resolved;
+	}
+
+	if (iph->saddr == largerIP) {
+		source = &thissession->larger;
+		destination = &thissession->smaller;
+		role = &thissession->role[0];
+	} else {
+		source = &thissession->smaller;
+		destination = &thissession->larger;
+		role = &thissession->role[1];
+	}
+	generation = (__u16)(get_neighbor_generation() << 4);
+
+	if ((remoteID == NULL) || (verify_neighbor_in_domain(remoteID) == false)) {
+		saveacceleratorid(largerIP, (char*)get_opennop_id(), iph, thissession);
+
+		if ((compare_opennopid((char*)&source->accelerator, (char*)get_opennop_id()) == 1) &&
+				(check_opennopid((char*)&destination->accelerator) == 1) &&
+				(compare_opennopid((char*)&destination->accelerator, (char*)get_opennop_id()) != 1)) {
+			resolved = SESSION_ROLE_OPTIMIZE;
+		} else {
+			resolved = SESSION_ROLE_PASSTHROUGH;
+		}
+
+		/*
+		 * A foreign ID is looked up every time because only its absence is cached.
+		 */
+		if (remoteID != NULL) {
+			return resolved;
+		}
+	} else {
+		saveacceleratorid(largerIP, remoteID, iph, thissession);
+
+		if (compare_opennopid((char*)&destination->accelerator, (char*)get_opennop_id()) == 1) {
+			resolved = SESSION_ROLE_DEOPTIMIZE;
+		} else {
+			resolved = SESSION_ROLE_RELAY;
+		}
+	}
+	__atomic_store_n(role, generation | resolved, __ATOMIC_RELAXED);
+	return resolved;
+}
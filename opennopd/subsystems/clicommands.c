@@ -435,14 +435,14 @@ int cli_mode_prompt(int client_fd, struct command_head *mode) {
     return 0;
 }
 
-void bytestostringbps(char *output, __u32 count) {
-    int I = 0;
-    int D = 0;
-    int bits = 0;
+void bytestostringbps(char *output, __u64 count) {
+    __u64 I = 0;
+    __u64 D = 0;
+    __u64 bits = 0;
     bits = count * 8; // convert bytes to bps.
 
     if (bits < 1024) { // output as bits.
-        sprintf(output, "%i bps", bits);
+        sprintf(output, "%llu bps", bits);
 
         return;
     }
@@ -450,7 +450,7 @@ void bytestostringbps(char *output, __u32 count) {
     if (((bits / 1024) / 1024) >= 1024) { // output as Gbps.
         I = ((bits / 1024) / 1024) / 1024;
         D = (((bits / 1024) / 1024) % 1024) / 10;
-        sprintf(output, "%i.%i Gbps", I, D);
+        sprintf(output, "%llu.%llu Gbps", I, D);
 
         return;
     }
@@ -458,7 +458,7 @@ void bytestostringbps(char *output, __u32 count) {
     if ((bits / 1024) >= 1024) { // output as Mbps.
         I = (bits / 1024) / 1024;
         D = ((bits / 1024) % 1024) / 10;
-        sprintf(output, "%i.%i Mbps", I, D);
+        sprintf(output, "%llu.%llu Mbps", I, D);
 
         return;
     }
@@ -466,7 +466,7 @@ void bytestostringbps(char *output, __u32 count) {
     if (bits >= 1024) { // output as Kbps.
         I = bits / 1024;
         D = (bits % 1024) / 10;
-        sprintf(output, "%i.%i Kbps", I, D);
+        sprintf(output, "%llu.%llu Kbps", I, D);
 
         return;
     }
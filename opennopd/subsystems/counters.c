@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 
 #include <linux/types.h>
 
@@ -18,21 +19,26 @@ int DEBUG_COUNTERS = true;
 int DEBUG_COUNTERS_REGISTER = false;
 
 /*
- * Time in seconds before updating the counters.
+ * Time in seconds between autoscaler runs.
  */
 int UPDATECOUNTERSTIMER = 5;
 struct counter_head counters;
 
 void *counters_function(void *dummyPtr) {
 	char message[LOGSZ];
+	__u32 ticks = 0;
 
 	while (servicestate >= RUNNING) {
-		sleep(UPDATECOUNTERSTIMER); // Sleeping for a few seconds.
+		sleep(COUNTERINTERVAL);
 
 		/*
 		 * Here is the new method.
 		 */
 		execute_counters();
+
+		if (++ticks % (UPDATECOUNTERSTIMER / COUNTERINTERVAL) == 0) {
+			autoscale_workers(); // Uses the pps of the last UPDATECOUNTERSTIMER seconds.
+		}
 	}
 
 	/*
@@ -43,35 +49,6 @@ void *counters_function(void *dummyPtr) {
 	return NULL;
 }
 
-/*
- * This function calculates pps or bps.
- */
-int calculate_ppsbps(__u32 previouscount, __u32 currentcount) {
-	int ppsbps;
-	__u32 scale;
-
-	/*
-	 * Make sure previous metric is less then current.  Did they roll?
-	 */
-	if (previouscount < currentcount) {
-		ppsbps = (currentcount - previouscount) / UPDATECOUNTERSTIMER;
-	} else {
-		/*
-		 * They must have rolled if they are less.
-		 * Should we scale them by highest value of __u32?
-		 * I don't even know what the highest value of __u32 is!
-		 * Can we use sizeof() * 8bit^32???
-		 * This rolls the counters half way around so current > previous.
-		 */
-		scale = (1UL << (sizeof(__u32 ) * 8)) / 2;
-		ppsbps = ((currentcount + scale) - (previouscount + scale))
-				/ UPDATECOUNTERSTIMER;
-
-	}
-
-	return ppsbps;
-}
-
 /*
  * Other modules call this when they have metrics that need to be calculate.
  * They must include the data to where the metric data is stored and a
@@ -119,6 +96,43 @@ int register_counter(t_counterfunction handler, t_counterdata data) {
 	return 1;
 }
 
+/*
+ * Removes a counter so its handler is not called again.
+ * Threads that exit before the daemon does must do this.
+ */
+int un_register_counter(t_counterfunction handler, t_counterdata data) {
+	struct counter *currentcounter;
+	int found = 0;
+
+	pthread_mutex_lock(&counters.lock);
+	currentcounter = counters.next;
+
+	while (currentcounter != NULL) {
+
+		if ((currentcounter->handler == handler) && (currentcounter->data == data)) {
+
+			if (currentcounter->prev == NULL) {
+				counters.next = currentcounter->next;
+			} else {
+				currentcounter->prev->next = currentcounter->next;
+			}
+
+			if (currentcounter->next == NULL) {
+				counters.prev = currentcounter->prev;
+			} else {
+				currentcounter->next->prev = currentcounter->prev;
+			}
+			free(currentcounter);
+			found = 1;
+			break;
+		}
+		currentcounter = currentcounter->next;
+	}
+
+	pthread_mutex_unlock(&counters.lock);
+	return found;
+}
+
 struct counter* allocate_counter() {
 	struct counter *newcounter = (struct counter *) malloc(
 			sizeof(struct counter));
@@ -139,8 +153,8 @@ void execute_counters() {
 	 * We loop through the list and execute each counter handle
 	 * passing its data pointer too.
 	 */
-	currentcounter = counters.next;
 	pthread_mutex_lock(&counters.lock);
+	currentcounter = counters.next;
 	while (currentcounter != NULL) {
 		(currentcounter->handler)(currentcounter->data);//Call the handler function passing its data.
 		currentcounter = currentcounter->next;
@@ -148,3 +162,98 @@ void execute_counters() {
 	pthread_mutex_unlock(&counters.lock);
 }
 
+static __u64 counters_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((__u64)now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+/*
+ * Copies every counter of a set as they were at one moment.
+ * Can be called from any thread.
+ */
+void counters_snapshot(struct counters *set, struct counter_snapshot *snapshot) {
+	__u32 sequence;
+	int i;
+
+	do {
+		sequence = __atomic_load_n(&set->sequence, __ATOMIC_ACQUIRE);
+
+		for (i = 0; i < MAXCOUNTERS; i++) {
+			snapshot->values[i] = __atomic_load_n(&set->values[i], __ATOMIC_RELAXED);
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (((sequence & 1) != 0) || (sequence != __atomic_load_n(&set->sequence, __ATOMIC_RELAXED)));
+
+	snapshot->taken = counters_now();
+}
+
+/*
+ * Adds a snapshot to the history of a set.
+ * Only the counters thread calls this.
+ */
+void counters_record(struct counters *set) {
+	struct counter_snapshot snapshot;
+	__u32 slot = set->nexthistory & (COUNTERHISTORY - 1);
+
+	counters_snapshot(set, &snapshot);
+	__atomic_store_n(&set->historysequence, set->historysequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	set->history[slot] = snapshot;
+	__atomic_store_n(&set->nexthistory, set->nexthistory + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&set->historysequence, set->historysequence + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Finds the newest snapshot taken at least seconds ago,
+ * or the oldest one kept if the history does not go back that far.
+ *
+ * @return false if there is no snapshot yet.
+ */
+int counters_history(struct counters *set, __u32 seconds, struct counter_snapshot *snapshot) {
+	__u64 since = counters_now() - ((__u64)seconds * 1000000000ULL);
+	__u32 sequence, next, kept, i;
+	int found;
+
+	do {
+		sequence = __atomic_load_n(&set->historysequence, __ATOMIC_ACQUIRE);
+		next = __atomic_load_n(&set->nexthistory, __ATOMIC_RELAXED);
+		kept = (next < COUNTERHISTORY) ? next : COUNTERHISTORY;
+		found = false;
+
+		for (i = 1; i <= kept; i++) {
+			*snapshot = set->history[(next - i) & (COUNTERHISTORY - 1)];
+			found = true;
+
+			if (snapshot->taken <= since) {
+				break;
+			}
+		}
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (((sequence & 1) != 0) || (sequence != __atomic_load_n(&set->historysequence, __ATOMIC_RELAXED)));
+
+	return found;
+}
+
+__u64 counter_delta(struct counter_snapshot *older, struct counter_snapshot *newer, int counter) {
+	return newer->values[counter] - older->values[counter];
+}
+
+/*
+ * Average per second of a counter over the last seconds.
+ * The window is shorter if the history does not go back that far.
+ */
+__u64 counter_rate(struct counters *set, int counter, __u32 seconds) {
+	struct counter_snapshot older, newer;
+
+	if (counters_history(set, seconds, &older) == false) {
+		return 0;
+	}
+	counters_snapshot(set, &newer);
+
+	if (newer.taken <= older.taken) {
+		return 0;
+	}
+	return (__u64)((double)counter_delta(&older, &newer, counter) * 1000000000.0 / (newer.taken - older.taken));
+}
@@ -1,10 +1,13 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
+#include <sched.h>
 
 #include <sys/time.h>
+#include <sys/socket.h>
 
 #include <arpa/inet.h> // for getting local ip address
 #include <netinet/ip.h> // for tcpmagic and TCP options
@@ -22,21 +25,40 @@
 #include "worker.h"
 #include "memorymanager.h"
 #include "counters.h"
+#include "latency.h"
 #include "climanager.h"
 #include "ipc.h"
+#include "verdict.h"
+#include "rcu.h"
+#include "affinity.h"
 
-struct fetcher thefetcher;
+struct fetcher fetchers[MAXFETCHERS]; // One fetcher for each Netfilter Queue.
+int numfetchers = 1; // Number of Netfilter Queues starting at queue '0'.
 
 int DEBUG_FETCHER = false;
 int DEBUG_FETCHER_COUNTERS = false;
 int G_SCALEWINDOW = 7;
-
-struct nfq_handle *h;
-struct nfq_q_handle *qh;
-int fd;
+static int fetcher_batching = true; // Receive messages and send verdicts in batches.
+static int fetcherspaused = false; // Set while the worker pool is resized.
+static pthread_mutex_t pauselock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pausesignal = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Verdicts issued by the fetcher are batched when batching is enabled.
+ * They are sent after every message of the current receive batch was handled.
+ */
+static int fetcher_set_verdict(struct fetcher *me, struct nfq_q_handle *hq,
+                               u_int32_t id, u_int32_t verdict, u_int32_t data_len, unsigned char *data) {
+
+    if (fetcher_batching == true) {
+        return add_verdict(&me->verdicts, me->fd, me->queuenum, id, verdict, data_len, data, NULL);
+    }
+    return nfq_set_verdict(hq, id, verdict, data_len, data);
+}
 
 int fetcher_callback(struct nfq_q_handle *hq, struct nfgenmsg *nfmsg,
                      struct nfq_data *nfa, void *data) {
+    struct fetcher *me = (struct fetcher *) data;
     u_int32_t id = 0;
     struct iphdr *iph = NULL;
     struct tcphdr *tcph = NULL;
@@ -44,12 +66,15 @@ int fetcher_callback(struct nfq_q_handle *hq, struct nfgenmsg *nfmsg,
     struct packet *thispacket = NULL;
     struct nfqnl_msg_packet_hdr *ph;
     __u32 largerIP, smallerIP;
-    __u16 largerIPPort, smallerIPPort, mms;
+    __u16 largerIPPort, smallerIPPort;
     int ret;
+    int deoptimize;
+    int started = false; // This packet turned the bypass of its processor on.
     unsigned char *originalpacket = NULL;
     char *remoteID = NULL;
     char message[LOGSZ];
     char strIP[20];
+    __u64 received = latency_start(); // When this packet arrived, 0 if it is not timed.
     //struct packet *newpacket = NULL;
 
     ph = nfq_get_msg_packet_hdr(nfa);
@@ -63,7 +88,7 @@ int fetcher_callback(struct nfq_q_handle *hq, struct nfgenmsg *nfmsg,
     if (servicestate >= RUNNING) {
         iph = (struct iphdr *) originalpacket;
 
-        thefetcher.metrics.bytesin += ntohs(iph->tot_len);
+        counters_add(&me->metrics, FETCHERBYTESIN, ntohs(iph->tot_len));
 
         /* We need to double check that only TCP packets get accelerated. */
         /* This is because we are working from the Netfilter QUEUE. */
@@ -84,190 +109,100 @@ int fetcher_callback(struct nfq_q_handle *hq, struct nfgenmsg *nfmsg,
                 logger(LOG_INFO, message);
             }
 
-            /* Check if this a SYN packet to identify a new session. */
-            /* This packet will not be placed in a work queue, but  */
-            /* will be accepted here because it does not have any data. */
-            if ((tcph->syn == 1) && (tcph->ack == 0)) {
-                thissession = getsession(largerIP, largerIPPort, smallerIP, smallerIPPort); // Check for an outstanding syn.
-
-                if (thissession == NULL) {
-                    thissession = insertsession(largerIP, largerIPPort, smallerIP, smallerIPPort); // Insert into sessions list.
+            thissession = getsession(largerIP, largerIPPort, smallerIP, smallerIPPort);
+
+            /*
+             * SYN packets open new sessions. ACK packets from another accelerator
+             * pick up sessions whose opening was not seen.
+             * The fetcher only makes the session, its worker sets it up.
+             */
+            if ((thissession == NULL) &&
+                    (((tcph->syn == 1) && (tcph->ack == 0)) ||
+                     ((tcph->syn == 0) && (tcph->ack == 1) && (tcph->fin == 0) && (remoteID != 0)))) {
+                thissession = insertsession(largerIP, largerIPPort, smallerIP, smallerIPPort); // Insert into sessions list.
+
+                if ((thissession != NULL) && (DEBUG_FETCHER == true)) {
+                    sprintf(message, "Fetcher: The session manager created a new session.\n");
+                    logger(LOG_INFO, message);
                 }
+            }
 
-                /* We need to check for NULL to make sure */
-                /* that a record for the session was created */
-                if (thissession != NULL) {
-
-                    if (DEBUG_FETCHER == true) {
-                        sprintf(message, "Fetcher: The session manager created a new session.\n");
-                        logger(LOG_INFO, message);
-                    }
-
-                    sourceisclient(largerIP, iph, thissession);
-                    updateseq(largerIP, iph, tcph, thissession);
-
-                    if ((remoteID == NULL) || verify_neighbor_in_domain(remoteID) == false) {// Accelerator ID was not found.
-                        mms = __get_tcp_option((__u8 *)originalpacket,2);
-
-                        if (mms > 60) {
-                            __set_tcp_option((__u8 *)originalpacket,2,4,mms - 60); // Reduce the MSS.
-                            //__set_tcp_option((__u8 *)originalpacket,30,6,localID); // Add the Accelerator ID to this packet.
-                            set_nod_header_data((__u8 *)iph, ONOP, get_opennop_id(), OPENNOP_IPC_ID_LENGTH);
-                            /*
-                             * TCP Window Scale option seemed to break Win7 & Win8 Internet access.
-                             */
-                            //__set_tcp_option((__u8 *)originalpacket,3,3,G_SCALEWINDOW); // Enable window scale.
-
-                            saveacceleratorid(largerIP, (char*)get_opennop_id(), iph, thissession);
-
-                            /*
-                             * Changing anything requires the IP and TCP
-                             * checksum to need recalculated.
-                             */
-                            checksum(originalpacket);
-                        }
-
-                    } else if(verify_neighbor_in_domain(remoteID) == true) { // Accelerator ID was found and in domain.
-                        saveacceleratorid(largerIP, remoteID, iph, thissession);
-
-                    }
+            if (thissession == NULL) {
 
-                    thissession->state = TCP_SYN_SENT;
+                if (DEBUG_FETCHER == true) {
+                    sprintf(message, "Fetcher: The session manager did not find a session.\n");
+                    logger(LOG_INFO, message);
                 }
-
                 /* Before we return let increment the packets counter. */
-                thefetcher.metrics.packets++;
+                counters_add(&me->metrics, FETCHERPACKETS, 1);
+                return fetcher_set_verdict(me, hq, id, NF_ACCEPT, 0, NULL);
+            }
 
-                /* This is the last step for a SYN packet. */
-                /* accept all SYN packets. */
-                return nfq_set_verdict(hq, id, NF_ACCEPT, ntohs(iph->tot_len), (unsigned char *)originalpacket);
+            /*
+             * Every packet of the session goes to the worker that owns it,
+             * so only that worker changes the session.
+             */
+            if (DEBUG_FETCHER == true) {
+                sprintf(message, "Fetcher: Sending the packet to a queue.\n");
+                logger(LOG_INFO, message);
+            }
 
-            } else { // Packet was not a SYN packet.
-                thissession = getsession(largerIP, largerIPPort, smallerIP, smallerIPPort);
+            if (DEBUG_FETCHER == true) {
+                sprintf(message, "Fetcher: Packet ID: %u.\n", id);
+                logger(LOG_INFO, message);
+            }
+            deoptimize = (remoteID != NULL) && (verify_neighbor_in_domain(remoteID) == true);
+
+            /*
+             * The worker is backed up so pass the packet on as it is.
+             */
+            if (bypass_packet(thissession->queue, deoptimize, largerIP, iph, tcph, thissession, remoteID, &started) == true) {
+                counters_begin(&me->metrics);
+                counter_add(&me->metrics, FETCHERPACKETS, 1);
+                counter_add(&me->metrics, FETCHERBYPASSEVENTS, started);
+                counter_add(&me->metrics, FETCHERBYPASSED, 1);
+                counters_end(&me->metrics);
+                return fetcher_set_verdict(me, hq, id, NF_ACCEPT, 0, NULL);
+            }
 
-                if (thissession != NULL) {
+            if (started == true) {
+                counters_add(&me->metrics, FETCHERBYPASSEVENTS, 1);
+            }
+
+            /*
+             * The buffer comes from the node of the thread that will process it.
+             */
+            thispacket = get_freepacket_buffer_on(get_processor_node(thissession->queue, deoptimize));
 
-                    /* Identify SYN/ACK packets that are part of a new */
-                    /* session opening its connection. */
-                    if ((tcph->syn == 1) && (tcph->ack == 1)) {
-                        updateseq(largerIP, iph, tcph, thissession);
+            if (thispacket != NULL) {
+                save_packet(thispacket, me, hq, id, ret, (__u8 *)originalpacket, thissession);
+                thispacket->received = received;
 
-                        if ((remoteID == NULL) || verify_neighbor_in_domain(remoteID) == false) { // Accelerator ID was not found.
-                            mms = __get_tcp_option((__u8 *)originalpacket,2);
+                if (deoptimize == false) {
+                    optimize_packet(thissession->queue, thispacket);
 
-                            if (mms > 60) {
-                                __set_tcp_option((__u8 *)originalpacket,2,4,mms - 60); // Reduce the MSS.
-                                //__set_tcp_option((__u8 *)originalpacket,30,6,localID); // Add the Accelerator ID to this packet.
-                                set_nod_header_data((__u8 *)iph, ONOP, get_opennop_id(), OPENNOP_IPC_ID_LENGTH);
-                                /*
-                                 * TCP Window Scale option seemed to break Win7 & Win8 Internet access.
-                                 */
-                                //__set_tcp_option((__u8 *)originalpacket,3,3,G_SCALEWINDOW); // Enable window scale.
-
-                                saveacceleratorid(largerIP, (char*)get_opennop_id(), iph, thissession);
-
-                            }
-
-                        } else if(verify_neighbor_in_domain(remoteID) == true) { // Accelerator ID was found and in domain.
-                            saveacceleratorid(largerIP, remoteID, iph, thissession);
-
-                        }
-
-                        thissession->state = TCP_ESTABLISHED;
-
-                        /*
-                         * Changing anything requires the IP and TCP
-                         * checksum to need recalculated.
-                         */
-                        checksum(originalpacket);
-
-                        /* Before we return let increment the packets counter. */
-                        thefetcher.metrics.packets++;
-                        return nfq_set_verdict(hq, id, NF_ACCEPT, ntohs(iph->tot_len), (unsigned char *)originalpacket);
-                    }
-
-                    /* This is session traffic of an active session. */
-                    /* This packet will be placed in a queue to be processed */
-                    if (DEBUG_FETCHER == true) {
-                        sprintf(message, "Fetcher: Sending the packet to a queue.\n");
-                        logger(LOG_INFO, message);
-                    }
-
-                    if (DEBUG_FETCHER == true) {
-                        sprintf(message, "Fetcher: Packet ID: %u.\n", id);
-                        logger(LOG_INFO, message);
-                    }
-                    thispacket = get_freepacket_buffer();
-
-                    if (thispacket != NULL) {
-                        save_packet(thispacket,hq, id, ret, (__u8 *)originalpacket, thissession);
-
-                        if ((remoteID == NULL) || verify_neighbor_in_domain(remoteID) == false) {
-                            optimize_packet(thissession->queue, thispacket);
-
-                        } else if(verify_neighbor_in_domain(remoteID) == true) {
-                            deoptimize_packet(thissession->queue, thispacket);
-                        }
-                    } else {
-
-                        sprintf(message, "Fetcher: Failed getting packet buffer for optimization.\n");
-                        logger(LOG_INFO, message);
-                    }
-                    /* Before we return let increment the packets counter. */
-                    thefetcher.metrics.packets++;
-                    return 0;
-                } else { // Session does not exist check if it is being tracked by another Accelerator.
-
-                    if (DEBUG_FETCHER == true) {
-                        sprintf(message, "Fetcher: The session manager did not find a session.\n");
-                        logger(LOG_INFO, message);
-                    }
-
-                    /* We only want to create new sessions for active sessions. */
-                    /* This means we exclude anything accept ACK packets. */
-
-                    if ((tcph->syn == 0) && (tcph->ack == 1) && (tcph->fin == 0)) {
-
-                        if (remoteID != 0) { // Detected remote Accelerator its safe to add this session.
-                            thissession = insertsession(largerIP, largerIPPort, smallerIP, smallerIPPort); // Insert into sessions list.
-
-                            if (thissession != NULL) { // Test to make sure the session was added.
-                                thissession->state = TCP_ESTABLISHED;
-
-                                if(verify_neighbor_in_domain(remoteID) == true) {
-                                    saveacceleratorid(largerIP, remoteID, iph, thissession);
-
-                                } else {
-                                    //__set_tcp_option((__u8 *)originalpacket,30,6,localID); // Overwrite the Accelerator ID to this packet.
-                                	set_nod_header_data((__u8 *)iph, ONOP, get_opennop_id(), OPENNOP_IPC_ID_LENGTH);
-                                    saveacceleratorid(largerIP, (char*)get_opennop_id(), iph, thissession);
-                                }
-
-                                thispacket = get_freepacket_buffer();
-
-                                if (thispacket != NULL) {
-                                    save_packet(thispacket,hq, id, ret, (__u8 *)originalpacket, thissession);
-                                    deoptimize_packet(thissession->queue, thispacket);
-
-                                } else {
-                                    sprintf(message, "Fetcher: Failed getting packet buffer for deoptimization.\n");
-                                    logger(LOG_INFO, message);
-                                }
-                                /* Before we return let increment the packets counter. */
-                                thefetcher.metrics.packets++;
-                                return 0;
-                            }
-                        }
-                    }
-                    /* Before we return let increment the packets counter. */
-                    thefetcher.metrics.packets++;
-                    return nfq_set_verdict(hq, id, NF_ACCEPT, ntohs(iph->tot_len), (unsigned char *)originalpacket);
+                } else {
+                    deoptimize_packet(thissession->queue, thispacket);
                 }
+                latency_since(&me->latency, received);
+            } else {
+                /*
+                 * Out of buffers, the packet is accepted as it was queued
+                 * whichever direction it was going.
+                 */
+                sprintf(message, "Fetcher: Failed getting packet buffer for %s.\n",
+                        (deoptimize == true) ? "deoptimization" : "optimization");
+                logger(LOG_INFO, message);
+                counters_add(&me->metrics, FETCHERPACKETS, 1);
+                return fetcher_set_verdict(me, hq, id, NF_ACCEPT, 0, NULL);
             }
+            /* Before we return let increment the packets counter. */
+            counters_add(&me->metrics, FETCHERPACKETS, 1);
+            return 0;
         } else { /* Packet was not a TCP Packet or ID was 0. */
             /* Before we return let increment the packets counter. */
-            thefetcher.metrics.packets++;
-            return nfq_set_verdict(hq, id, NF_ACCEPT, 0, NULL);
+            counters_add(&me->metrics, FETCHERPACKETS, 1);
+            return fetcher_set_verdict(me, hq, id, NF_ACCEPT, 0, NULL);
         }
     } else { /* Daemon is not in a running state so return packets. */
 
@@ -276,8 +211,8 @@ int fetcher_callback(struct nfq_q_handle *hq, struct nfgenmsg *nfmsg,
             logger(LOG_INFO, message);
         }
         /* Before we return let increment the packets counter. */
-        thefetcher.metrics.packets++;
-        return nfq_set_verdict(hq, id, NF_ACCEPT, 0, NULL);
+        counters_add(&me->metrics, FETCHERPACKETS, 1);
+        return fetcher_set_verdict(me, hq, id, NF_ACCEPT, 0, NULL);
     }
     /*
      * If we get here there was a major problem.
@@ -289,25 +224,47 @@ int fetcher_callback(struct nfq_q_handle *hq, struct nfgenmsg *nfmsg,
     return 0;
 }
 
-void *fetcher_function(void *dummyPtr) {
-    long sys_pagesofmem = 0; // The pages of memory in this system.
-    long sys_pagesize = 0; // The size of each page in bytes.
-    long sys_bytesofmem = 0; // The total bytes of memory in the system.
-    long nfqneededbuffer = 0; // Store how much memory the NFQ needs.
-    long nfqlength = 0;
-    int rv = 0;
-    char buf[BUFSIZE]
-    __attribute__ ((aligned));
+/*
+ * Called after packets are received and before they go to the workers.
+ * dispatching is set before fetcherspaused is checked and pause_fetchers()
+ * sets fetcherspaused before checking dispatching so one sees the other.
+ */
+static void begin_dispatch(struct fetcher *me) {
+    __atomic_store_n(&me->dispatching, true, __ATOMIC_SEQ_CST);
+
+    while (__atomic_load_n(&fetcherspaused, __ATOMIC_SEQ_CST) == true) {
+        __atomic_store_n(&me->dispatching, false, __ATOMIC_SEQ_CST);
+        rcu_thread_offline();
+        pthread_mutex_lock(&pauselock);
+
+        while (fetcherspaused == true) {
+            pthread_cond_wait(&pausesignal, &pauselock);
+        }
+        pthread_mutex_unlock(&pauselock);
+        rcu_thread_online();
+        __atomic_store_n(&me->dispatching, true, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void end_dispatch(struct fetcher *me) {
+    __atomic_store_n(&me->dispatching, false, __ATOMIC_RELEASE);
+}
+
+/*
+ * Opens the library handle of a fetcher.
+ * Called for every fetcher before any of their threads start.
+ */
+static void open_fetcher(struct fetcher *me, int bindfamily) {
     char message[LOGSZ];
 
     if (DEBUG_FETCHER == true) {
-        sprintf(message, "Fetcher: Initialzing opening library handle.\n");
+        sprintf(message, "Fetcher: Initialzing opening library handle for queue '%u'.\n", me->queuenum);
         logger(LOG_INFO, message);
     }
 
-    h = nfq_open();
+    me->h = nfq_open();
 
-    if (!h) {
+    if (!me->h) {
 
         if (DEBUG_FETCHER == true) {
             sprintf(message,
@@ -317,47 +274,71 @@ void *fetcher_function(void *dummyPtr) {
         exit(EXIT_FAILURE);
     }
 
-    if (DEBUG_FETCHER == true) {
-        sprintf(message,
-                "Fetcher: Initializing un-binding existing nf_queue for AF_INET.\n");
-        logger(LOG_INFO, message);
-    }
-
-    if (nfq_unbind_pf(h, AF_INET) < 0) {
+    /*
+     * Binding the protocol family is global so it is done once
+     * before any queue is created. Newer kernels ignore these calls anyway.
+     */
+    if (bindfamily == true) {
 
         if (DEBUG_FETCHER == true) {
-            sprintf(message, "Fetcher: Initializing error un-binding nf_queue.\n");
+            sprintf(message,
+                    "Fetcher: Initializing un-binding existing nf_queue for AF_INET.\n");
             logger(LOG_INFO, message);
         }
-        exit(EXIT_FAILURE);
-    }
 
-    if (DEBUG_FETCHER == true) {
-        sprintf(message, "Fetcher: Initializing binding to nf_queue.\n");
-        logger(LOG_INFO, message);
-    }
+        if (nfq_unbind_pf(me->h, AF_INET) < 0) {
 
-    if (nfq_bind_pf(h, AF_INET) < 0) {
+            if (DEBUG_FETCHER == true) {
+                sprintf(message, "Fetcher: Initializing error un-binding nf_queue.\n");
+                logger(LOG_INFO, message);
+            }
+            exit(EXIT_FAILURE);
+        }
 
         if (DEBUG_FETCHER == true) {
-            sprintf(message,
-                    "Fetcher: Initializing error binding to nf_queue.\n");
+            sprintf(message, "Fetcher: Initializing binding to nf_queue.\n");
             logger(LOG_INFO, message);
         }
-        exit(EXIT_FAILURE);
+
+        if (nfq_bind_pf(me->h, AF_INET) < 0) {
+
+            if (DEBUG_FETCHER == true) {
+                sprintf(message,
+                        "Fetcher: Initializing error binding to nf_queue.\n");
+                logger(LOG_INFO, message);
+            }
+            exit(EXIT_FAILURE);
+        }
     }
+}
+
+void *fetcher_function(void *dummyPtr) {
+    struct fetcher *me = (struct fetcher *) dummyPtr;
+    long sys_pagesofmem = 0; // The pages of memory in this system.
+    long sys_pagesize = 0; // The size of each page in bytes.
+    long sys_bytesofmem = 0; // The total bytes of memory in the system.
+    long nfqneededbuffer = 0; // Store how much memory the NFQ needs.
+    long nfqlength = 0;
+    int rv = 0;
+    int i;
+    char buf[BUFSIZE]
+    __attribute__ ((aligned));
+    char *batchbuf = NULL; // Receive buffers used in batched mode.
+    struct mmsghdr msgs[FETCHERBATCH];
+    struct iovec iovecs[FETCHERBATCH];
+    char message[LOGSZ];
 
     if (DEBUG_FETCHER == true) {
-        sprintf(message, "Fetcher: Initializing binding to queue '0'.\n");
+        sprintf(message, "Fetcher: Initializing binding to queue '%u'.\n", me->queuenum);
         logger(LOG_INFO, message);
     }
-    qh = nfq_create_queue(h, 0, &fetcher_callback, NULL);
+    me->qh = nfq_create_queue(me->h, me->queuenum, &fetcher_callback, (void *) me);
 
-    if (!qh) {
+    if (!me->qh) {
 
         if (DEBUG_FETCHER == true) {
             sprintf(message,
-                    "Fetcher: Initializing error binding to queue '0'.\n");
+                    "Fetcher: Initializing error binding to queue '%u'.\n", me->queuenum);
             logger(LOG_INFO, message);
         }
         exit(EXIT_FAILURE);
@@ -368,7 +349,7 @@ void *fetcher_function(void *dummyPtr) {
         logger(LOG_INFO, message);
     }
 
-    if (nfq_set_mode(qh, NFQNL_COPY_PACKET, BUFSIZE) < 0) { // range/BUFSIZE was 0xffff
+    if (nfq_set_mode(me->qh, NFQNL_COPY_PACKET, BUFSIZE) < 0) { // range/BUFSIZE was 0xffff
 
         if (DEBUG_FETCHER == true) {
             sprintf(message, "Fetcher: Initializing error setting copy mode.\n");
@@ -405,7 +386,7 @@ void *fetcher_function(void *dummyPtr) {
     }
 
     sys_bytesofmem = (sys_pagesofmem * sys_pagesize);
-    nfqneededbuffer = (sys_bytesofmem / 100) * 10;
+    nfqneededbuffer = ((sys_bytesofmem / 100) * 10) / numfetchers; // Queues share the 10%.
 
     if (DEBUG_FETCHER == true) {
         sprintf(message, "Fetcher: NFQ needs %li bytes of memory.\n",
@@ -425,7 +406,7 @@ void *fetcher_function(void *dummyPtr) {
         logger(LOG_INFO, message);
     }
 
-    if (nfq_set_queue_maxlen(qh, nfqlength) < 0) {
+    if (nfq_set_queue_maxlen(me->qh, nfqlength) < 0) {
 
         if (DEBUG_FETCHER == true) {
             sprintf(message,
@@ -434,27 +415,106 @@ void *fetcher_function(void *dummyPtr) {
         }
         exit(EXIT_FAILURE);
     }
-    nfnl_rcvbufsiz(nfq_nfnlh(h), nfqlength * BUFSIZE);
-    fd = nfq_fd(h);
+    nfnl_rcvbufsiz(nfq_nfnlh(me->h), nfqlength * BUFSIZE);
+    me->fd = nfq_fd(me->h);
 
     register_counter(counter_updatefetchermetrics, (t_counterdata)
-                     & thefetcher.metrics);
+                     & me->metrics);
 
-    while ((servicestate >= RUNNING) && ((rv = recv(fd, buf, sizeof(buf), 0))
-                                         && rv >= 0)) {
+    /*
+     * Each receive buffer gets its own iovec so recvmmsg()
+     * can drain many netlink messages with one system call.
+     */
+    batchbuf = malloc(FETCHERBATCH * FETCHERMSGSIZE);
 
-        if (DEBUG_FETCHER == true) {
-            sprintf(message, "Fetcher: Received a packet.\n");
-            logger(LOG_INFO, message);
-        }
+    if (batchbuf == NULL) {
+        sprintf(message, "Fetcher: Couldn't allocate receive buffers.\n");
+        logger(LOG_INFO, message);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(msgs, 0, sizeof(msgs));
 
-        /*
-         * This will execute the callback_function for each ip packet
-         * that is received into the Netfilter QUEUE.
-         */
-        nfq_handle_packet(h, buf, rv);
+    for (i = 0; i < FETCHERBATCH; i++) {
+        iovecs[i].iov_base = batchbuf + (i * FETCHERMSGSIZE);
+        iovecs[i].iov_len = FETCHERMSGSIZE;
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
     }
 
+    /*
+     * Sessions found by the callback are used until the next receive.
+     * The fetcher is offline while it waits so it never holds up freeing them.
+     */
+    rcu_register_thread();
+
+    while (servicestate >= RUNNING) {
+
+        if (fetcher_batching == true) {
+            /*
+             * Wait for at least one message then take whatever else is queued.
+             */
+            rcu_thread_offline();
+            rv = recvmmsg(me->fd, msgs, FETCHERBATCH, MSG_WAITFORONE, NULL);
+            rcu_thread_online();
+
+            if (rv <= 0) {
+                break;
+            }
+
+            if (DEBUG_FETCHER == true) {
+                sprintf(message, "Fetcher: Received %i packets.\n", rv);
+                logger(LOG_INFO, message);
+            }
+            counters_begin(&me->metrics);
+            counter_add(&me->metrics, FETCHERRXBATCHES, 1);
+            counter_add(&me->metrics, FETCHERRXMESSAGES, rv);
+            counters_end(&me->metrics);
+
+            /*
+             * This will execute the callback_function for each ip packet
+             * that is received into the Netfilter QUEUE.
+             * The verdicts reference the receive buffers so they are
+             * sent before the buffers get used again.
+             */
+            begin_dispatch(me);
+
+            for (i = 0; i < rv; i++) {
+                nfq_handle_packet(me->h, (char *) iovecs[i].iov_base, msgs[i].msg_len);
+            }
+            end_dispatch(me);
+            flush_verdicts(&me->verdicts);
+
+        } else {
+            flush_verdicts(&me->verdicts); // Batching was just disabled send anything left.
+            rcu_thread_offline();
+            rv = recv(me->fd, buf, sizeof(buf), 0);
+            rcu_thread_online();
+
+            if (rv <= 0) {
+                break;
+            }
+
+            if (DEBUG_FETCHER == true) {
+                sprintf(message, "Fetcher: Received a packet.\n");
+                logger(LOG_INFO, message);
+            }
+
+            /*
+             * This will execute the callback_function for each ip packet
+             * that is received into the Netfilter QUEUE.
+             */
+            begin_dispatch(me);
+            nfq_handle_packet(me->h, buf, rv);
+            end_dispatch(me);
+        }
+    }
+
+    flush_verdicts(&me->verdicts);
+    release_packet_magazine();
+    rcu_unregister_thread();
+    free(batchbuf);
+
     /*
      * At this point the system is down.
      * If this is due to rv = -1 we need to change the state
@@ -468,80 +528,221 @@ void *fetcher_function(void *dummyPtr) {
     }
 
     if (DEBUG_FETCHER == true) {
-        sprintf(message, "Fetcher: Stopping unbinding from queue '0'.\n");
+        sprintf(message, "Fetcher: Stopping unbinding from queue '%u'.\n", me->queuenum);
         logger(LOG_INFO, message);
     }
 
-    nfq_destroy_queue(qh);
+    nfq_destroy_queue(me->qh);
 
 #ifdef INSANE
 
     if (DEBUG_FETCHER == true) {
-        sprintf(message, "Fetcher: Fatal unbinding from queue '0'.\n");
+        sprintf(message, "Fetcher: Fatal unbinding from queue '%u'.\n", me->queuenum);
         logger(LOG_INFO, message);
     }
-    nfa_unbind_pf(h, AF_INET);
+    nfa_unbind_pf(me->h, AF_INET);
 #endif
 
     //if (DEBUG_FETCHER == true)
     //{
-    sprintf(message, "Fetcher: Stopping closing library handle.\n");
+    sprintf(message, "Fetcher: Stopping closing library handle for queue '%u'.\n", me->queuenum);
     logger(LOG_INFO, message);
     //}
-    nfq_close(h);
+    nfq_close(me->h);
     return NULL;
 }
 
 void fetcher_graceful_exit() {
-    nfq_destroy_queue(qh);
-    nfq_close(h);
-    close(fd);
+    int i;
+
+    for (i = 0; i < numfetchers; i++) {
+        nfq_destroy_queue(fetchers[i].qh);
+        nfq_close(fetchers[i].h);
+        close(fetchers[i].fd);
+    }
 }
 
 void create_fetcher() {
-    pthread_create(&thefetcher.t_fetcher, NULL, fetcher_function, (void *) NULL);
+    int i;
+
+    for (i = 0; i < numfetchers; i++) {
+        fetchers[i].queuenum = i;
+        open_fetcher(&fetchers[i], (i == 0));
+    }
+
+    for (i = 0; i < numfetchers; i++) {
+        initialize_verdict_batch(&fetchers[i].verdicts, &fetchers[i].metrics,
+                FETCHERVERDICTBATCHES, FETCHERVERDICTS);
+        create_pinned_thread(&fetchers[i].t_fetcher, get_fetcher_cpu(i), fetcher_function, (void *) &fetchers[i]);
+    }
 }
 
 void rejoin_fetcher() {
-    pthread_join(thefetcher.t_fetcher, NULL);
+    int i;
+
+    for (i = 0; i < numfetchers; i++) {
+        pthread_join(fetchers[i].t_fetcher, NULL);
+    }
+}
+
+int get_fetchers(void) {
+    return numfetchers;
+}
+
+struct latency_histogram *get_fetcher_latency(int i) {
+    return &fetchers[i].latency;
+}
+
+/*
+ * Totals the bypasses the fetchers started and the packets they accepted.
+ */
+void get_fetcher_bypass_counters(__u64 *events, __u64 *packets) {
+    struct counter_snapshot snapshot;
+    int i;
+
+    *events = 0;
+    *packets = 0;
+
+    for (i = 0; i < numfetchers; i++) {
+        counters_snapshot(&fetchers[i].metrics, &snapshot);
+        *events += snapshot.values[FETCHERBYPASSEVENTS];
+        *packets += snapshot.values[FETCHERBYPASSED];
+    }
+}
+
+/*
+ * Holds every fetcher before it hands packets to the workers.
+ * Returns once no fetcher is between receiving and handing off
+ * so no packet or session is on its way to a worker.
+ * Packets wait in the Netfilter Queues meanwhile.
+ */
+void pause_fetchers(void) {
+    int i;
+
+    pthread_mutex_lock(&pauselock);
+    __atomic_store_n(&fetcherspaused, true, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pauselock);
+
+    for (i = 0; i < numfetchers; i++) {
+
+        while (__atomic_load_n(&fetchers[i].dispatching, __ATOMIC_SEQ_CST) == true) {
+            sched_yield();
+        }
+    }
+}
+
+void resume_fetchers(void) {
+    pthread_mutex_lock(&pauselock);
+    __atomic_store_n(&fetcherspaused, false, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&pausesignal);
+    pthread_mutex_unlock(&pauselock);
+}
+
+/*
+ * Must be called before create_fetcher().
+ */
+void set_fetchers(int desirednumfetchers) {
+
+    if (desirednumfetchers < 1) {
+        desirednumfetchers = 1;
+    }
+
+    if (desirednumfetchers > MAXFETCHERS) {
+        desirednumfetchers = MAXFETCHERS;
+    }
+    numfetchers = desirednumfetchers;
 }
 
 struct commandresult cli_show_fetcher(int client_fd, char **parameters, int numparameters, void *data) {
 	struct commandresult result  = { 0 };
 	char msg[MAX_BUFFER_SIZE] = { 0 };
-    __u32 ppsbps;
-    char bps[11];
-    char col1[11];
-    char col2[14];
-    char col3[3];
+    struct counter_snapshot snapshot;
+    __u64 ppsbps;
+    __u64 rxbatches = 0, rxmessages = 0;
+    __u64 batches, count;
+    __u64 verdictbatches = 0, verdicts = 0;
+    unsigned long window = COUNTERWINDOW;
+    char *end = NULL;
+    int i;
+    char bps[24];
+    char col1[12];
+    char col2[24];
+    char col3[28];
+    char col4[3];
+
+    if (numparameters == 1) {
+        window = strtoul(parameters[0], &end, 10);
+
+        if ((end == parameters[0]) || (*end != '\0') || (window < 1) ||
+                (window >= (COUNTERHISTORY * COUNTERINTERVAL))) {
+            sprintf(msg, "Usage: show fetcher [1-%u]\n", (COUNTERHISTORY * COUNTERINTERVAL) - 1);
+            cli_send_feedback(client_fd, msg);
+
+            result.finished = 0;
+            result.mode = NULL;
+            result.data = NULL;
+
+            return result;
+        }
+    }
 
-    sprintf(msg, "------------------------\n");
+    sprintf(msg, "-------------------------------\n");
     cli_send_feedback(client_fd, msg);
-    sprintf(msg, "|  5 sec  |  fetcher   |\n");
+    sprintf(msg, "| %3lu sec |       fetcher     |\n", window);
     cli_send_feedback(client_fd, msg);
-    sprintf(msg, "------------------------\n");
+    sprintf(msg, "-------------------------------\n");
     cli_send_feedback(client_fd, msg);
-    sprintf(msg, "|   pps   |     in     |\n");
+    sprintf(msg, "| queue |   pps   |     in     |\n");
     cli_send_feedback(client_fd, msg);
-    sprintf(msg, "------------------------\n");
+    sprintf(msg, "-------------------------------\n");
     cli_send_feedback(client_fd, msg);
 
-    strcpy(msg, "");
-    ppsbps = thefetcher.metrics.pps;
-    bytestostringbps(bps, ppsbps);
-    sprintf(col1, "| %-8u", ppsbps);
-    strcat(msg, col1);
+    for (i = 0; i < numfetchers; i++) {
+        strcpy(msg, "");
+        sprintf(col1, "| %-6u", fetchers[i].queuenum);
+        strcat(msg, col1);
+
+        ppsbps = counter_rate(&fetchers[i].metrics, FETCHERPACKETS, window);
+        sprintf(col2, "| %-8llu", ppsbps);
+        strcat(msg, col2);
+
+        ppsbps = counter_rate(&fetchers[i].metrics, FETCHERBYTESIN, window);
+        bytestostringbps(bps, ppsbps);
+        sprintf(col3, "| %-11s", bps);
+        strcat(msg, col3);
+
+        sprintf(col4, "|\n");
+        strcat(msg, col4);
+        cli_send_feedback(client_fd, msg);
+
+        counters_snapshot(&fetchers[i].metrics, &snapshot);
+        rxbatches += snapshot.values[FETCHERRXBATCHES];
+        rxmessages += snapshot.values[FETCHERRXMESSAGES];
+        verdictbatches += snapshot.values[FETCHERVERDICTBATCHES];
+        verdicts += snapshot.values[FETCHERVERDICTS];
+    }
 
-    ppsbps = thefetcher.metrics.bpsin;
-    bytestostringbps(bps, ppsbps);
-    sprintf(col2, "| %-11s", bps);
-    strcat(msg, col2);
+    sprintf(msg, "-------------------------------\n");
+    cli_send_feedback(client_fd, msg);
 
-    sprintf(col3, "|\n");
-    strcat(msg, col3);
+    if (fetcher_batching == true) {
+        sprintf(msg, "batching enabled\n");
+    } else {
+        sprintf(msg, "batching disabled\n");
+    }
     cli_send_feedback(client_fd, msg);
 
-    sprintf(msg, "------------------------\n");
+    sprintf(msg, "receive batches: %llu average size: %llu.%02llu\n", rxbatches,
+            (rxbatches > 0) ? rxmessages / rxbatches : 0,
+            (rxbatches > 0) ? ((rxmessages % rxbatches) * 100) / rxbatches : 0);
+    cli_send_feedback(client_fd, msg);
+
+    get_worker_verdict_counters(&batches, &count);
+    batches += verdictbatches;
+    count += verdicts;
+    sprintf(msg, "verdict batches: %llu average size: %llu.%02llu\n", batches,
+            (batches > 0) ? count / batches : 0,
+            (batches > 0) ? ((count % batches) * 100) / batches : 0);
     cli_send_feedback(client_fd, msg);
 
     result.finished = 0;
@@ -551,22 +752,48 @@ struct commandresult cli_show_fetcher(int client_fd, char **parameters, int nump
     return result;
 }
 
+struct commandresult cli_fetcher_batching_enable(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    fetcher_batching = true;
+    sprintf(msg, "batching enabled\n");
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_fetcher_batching_disable(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    fetcher_batching = false;
+    sprintf(msg, "batching disabled\n");
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+int get_fetcher_batching(void) {
+    return fetcher_batching;
+}
+
+void set_fetcher_batching(int enabled) {
+    fetcher_batching = enabled;
+}
+
 void counter_updatefetchermetrics(t_counterdata data) {
-    struct fetchercounters *metrics;
     char message[LOGSZ];
-    __u32 counter;
 
     if (DEBUG_FETCHER_COUNTERS == true) {
         sprintf(message, "Fetcher: Updating metrics!");
         logger(LOG_INFO, message);
     }
-
-    metrics = (struct fetchercounters*) data;
-    counter = metrics->packets;
-    metrics->pps = calculate_ppsbps(metrics->packetsprevious, counter);
-    metrics->packetsprevious = counter;
-
-    counter = metrics->bytesin;
-    metrics->bpsin = calculate_ppsbps(metrics->bytesinprevious, counter);
-    metrics->bytesinprevious = counter;
+    counters_record((struct counters *) data);
 }
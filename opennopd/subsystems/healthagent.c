@@ -28,7 +28,7 @@ int DEBUG_HEARTBEAT = false;
 /*
  * Create a raw netlink socket and bind
  */
-static int create_nl_socket(int protocol, int groups)
+int create_nl_socket(int protocol, int groups)
 {
         int fd;
         struct sockaddr_nl local;
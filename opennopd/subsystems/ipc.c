@@ -7,6 +7,7 @@
 #include <pthread.h> // for multi-threading
 #include <netdb.h>
 #include <time.h>
+#include <endian.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/unistd.h>
@@ -24,6 +25,9 @@
 #include <openssl/hmac.h>
 
 #include "ipc.h"
+#include "dedup.h"
+#include "codec.h"
+#include "compression.h"
 #include "clicommands.h"
 #include "logger.h"
 #include "sockets.h"
@@ -37,9 +41,10 @@ typedef int (*t_neighbor_command)(int, __u32, char *);
  * Using "static" should fix this.
  */
 static pthread_t t_ipc; // thread for cli.
-static struct neighbor_head ipchead;
+static struct neighbor_head ipchead = { NULL, NULL, PTHREAD_MUTEX_INITIALIZER }; // Lock is held to add or free neighbors and by lookups from other threads.
 static char opennop_localid[OPENNOP_IPC_ID_LENGTH]; //Local UUID.
 static char key[OPENNOP_IPC_KEY_LENGTH]; //Local key.
+static __u32 neighborgeneration = 0; // Changes when verify_neighbor_in_domain() might answer differently.
 
 
 static int DEBUG_IPC = LOGGING_OFF;
@@ -47,6 +52,18 @@ static int DEBUG_IPC = LOGGING_OFF;
 int ipc_send_message(int socket, OPENNOP_IPC_MSG_TYPE messagetype);
 int update_neighbor_timer(struct neighbor *thisneighbor);
 
+/*
+ * Sessions keep what verify_neighbor_in_domain() said
+ * until a neighbor changes its state or ID.
+ */
+static void neighbors_changed() {
+    __atomic_add_fetch(&neighborgeneration, 1, __ATOMIC_RELEASE);
+}
+
+__u32 get_neighbor_generation() {
+    return __atomic_load_n(&neighborgeneration, __ATOMIC_ACQUIRE);
+}
+
 int compare_opennopid(char *first_opennopid, char *second_opennopid){
 	__u8 i;
 
@@ -210,7 +227,11 @@ int ipc_set_neighbor_state(int fd, neighborstate state) {
     thisneighbor = find_neighbor_by_socket(fd);
 
     if(thisneighbor != NULL) {
-        thisneighbor->state = state;
+
+        if(thisneighbor->state != state) {
+            thisneighbor->state = state;
+            neighbors_changed();
+        }
         update_neighbor_timer(thisneighbor);
     }
     return 0;
@@ -292,7 +313,12 @@ int process_message(int fd, struct opennop_ipc_header *opennop_msg_header) {
     struct opennop_message_header *message_header;
     struct opennop_hello_message *hello_message;
     struct ipc_message_i_see_you *i_see_you_message;
+    struct ipc_message_dedup_map *dedup_map_message;
+    struct ipc_message_stream_restart *stream_restart_message;
     struct neighbor *this_neighbor;
+    __u32 features;
+    __u64 fingerprints[DEDUPMAPSIZE];
+    int i;
 
 
     logger2(LOGGING_DEBUG,DEBUG_IPC,"[IPC] Processing message!\n");
@@ -312,7 +338,22 @@ int process_message(int fd, struct opennop_ipc_header *opennop_msg_header) {
         	if(should_i_log(LOGGING_DEBUG, DEBUG_IPC) == 1){
         		binary_dump("ipc.c Saving neighbor ID: ", (char*)&hello_message->id, OPENNOP_IPC_ID_LENGTH);
         	}
-        	save_opennopid((char*)&hello_message->id, (char*)&this_neighbor->id);
+
+        	if(compare_opennopid((char*)&hello_message->id, (char*)&this_neighbor->id) == 0){
+        		save_opennopid((char*)&hello_message->id, (char*)&this_neighbor->id);
+        		neighbors_changed();
+        	}
+
+        	if(message_header->length >= sizeof(struct opennop_hello_message)){
+        		features = ntohl(hello_message->features);
+        	}else{
+        		features = 0;
+        	}
+
+        	if(this_neighbor->features != features){
+        		this_neighbor->features = features;
+        		neighbors_changed();
+        	}
         }
 
         break;
@@ -330,7 +371,22 @@ int process_message(int fd, struct opennop_ipc_header *opennop_msg_header) {
         	if(should_i_log(LOGGING_DEBUG, DEBUG_IPC) == 1){
         		binary_dump("ipc.c Saving neighbor ID: ", (char*)&i_see_you_message->id, OPENNOP_IPC_ID_LENGTH);
         	}
-        	save_opennopid((char*)&i_see_you_message->id, (char*)&this_neighbor->id);
+
+        	if(compare_opennopid((char*)&i_see_you_message->id, (char*)&this_neighbor->id) == 0){
+        		save_opennopid((char*)&i_see_you_message->id, (char*)&this_neighbor->id);
+        		neighbors_changed();
+        	}
+
+        	if(message_header->length >= sizeof(struct ipc_message_i_see_you)){
+        		features = ntohl(i_see_you_message->features);
+        	}else{
+        		features = 0;
+        	}
+
+        	if(this_neighbor->features != features){
+        		this_neighbor->features = features;
+        		neighbors_changed();
+        	}
         }
 
         ipc_set_neighbor_state(fd, UP);
@@ -343,6 +399,28 @@ int process_message(int fd, struct opennop_ipc_header *opennop_msg_header) {
         break;
     case OPENNOP_IPC_DEDUP_MAP:
         logger2(LOGGING_DEBUG,DEBUG_IPC,"[IPC] Message Type: OPENNOP_IPC_DEDUP_MAP.\n");
+        dedup_map_message = (struct ipc_message_dedup_map*)message_header;
+        this_neighbor = find_neighbor_by_socket(fd);
+
+        if((this_neighbor != NULL) && (dedup_map_message->count <= DEDUPMAPSIZE) &&
+        		(message_header->length >= sizeof(struct ipc_message_dedup_map) + dedup_map_message->count * sizeof(__u64))){
+
+        	for(i = 0; i < dedup_map_message->count; i++){
+        		fingerprints[i] = be64toh(dedup_map_message->fingerprints[i]);
+        	}
+        	dedup_forget((char*)&this_neighbor->id, fingerprints, dedup_map_message->count);
+        }
+        break;
+    case OPENNOP_IPC_STREAM_RESTART:
+        logger2(LOGGING_DEBUG,DEBUG_IPC,"[IPC] Message Type: OPENNOP_IPC_STREAM_RESTART.\n");
+        stream_restart_message = (struct ipc_message_stream_restart*)message_header;
+        this_neighbor = find_neighbor_by_socket(fd);
+
+        if((this_neighbor != NULL) && (stream_restart_message->count <= COMPRESSIONDESYNCS) &&
+        		(message_header->length >= sizeof(struct ipc_message_stream_restart) +
+        		stream_restart_message->count * sizeof(struct ipc_stream_id))){
+        	compression_restart(stream_restart_message->streams, stream_restart_message->count);
+        }
         break;
     default:
         logger2(LOGGING_DEBUG,DEBUG_IPC,"[IPC] Message Type: Unknown!\n");
@@ -430,10 +508,8 @@ int ipc_add_i_see_you_message(struct opennop_ipc_header *opennop_msg_header) {
     message = (char*)opennop_msg_header + opennop_msg_header->length;
     message->header.type = OPENNOP_IPC_I_SEE_YOU;
     message->header.length = sizeof(struct ipc_message_i_see_you);
-    /**
-     * There is no additional data right now.
-     */
     memcpy((void*)&message->id, (void*)&opennop_localid, (size_t)OPENNOP_IPC_ID_LENGTH);
+    message->features = htonl(get_local_features());
     opennop_msg_header->length += message->header.length;
 
     return 0;
@@ -454,11 +530,62 @@ int add_hello_message(struct opennop_ipc_header *opennop_msg_header) {
      */
     //uuid_generate_time((unsigned char*)message->uuid);
     memcpy((void*)&message->id, (void*)&opennop_localid, (size_t)OPENNOP_IPC_ID_LENGTH);
+    message->features = htonl(get_local_features());
     opennop_msg_header->length += message->header.length;
 
     return 0;
 }
 
+/**
+ * Adds the dedup chunks this neighbor referenced that were not found.
+ * Returns how many fingerprints were added.
+ */
+int add_dedup_map_message(struct opennop_ipc_header *opennop_msg_header, struct neighbor *thisneighbor) {
+    struct ipc_message_dedup_map *message;
+    int count, i;
+
+    message = (struct ipc_message_dedup_map *)((char*)opennop_msg_header + opennop_msg_header->length);
+    count = dedup_get_misses((char*)&thisneighbor->id, message->fingerprints, DEDUPMAPSIZE);
+
+    if (count == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        message->fingerprints[i] = htobe64(message->fingerprints[i]);
+    }
+    message->header.type = OPENNOP_IPC_DEDUP_MAP;
+    message->header.length = sizeof(struct ipc_message_dedup_map) + count * sizeof(__u64);
+    message->count = count;
+    message->reserved = 0;
+    opennop_msg_header->length += message->header.length;
+
+    return count;
+}
+
+/**
+ * Adds the compression streams from this neighbor that lost sync.
+ * Returns how many streams were added.
+ */
+int add_stream_restart_message(struct opennop_ipc_header *opennop_msg_header, struct neighbor *thisneighbor) {
+    struct ipc_message_stream_restart *message;
+    int count;
+
+    message = (struct ipc_message_stream_restart *)((char*)opennop_msg_header + opennop_msg_header->length);
+    count = compression_get_desyncs((char*)&thisneighbor->id, message->streams, COMPRESSIONDESYNCS);
+
+    if (count == 0) {
+        return 0;
+    }
+    message->header.type = OPENNOP_IPC_STREAM_RESTART;
+    message->header.length = sizeof(struct ipc_message_stream_restart) + count * sizeof(struct ipc_stream_id);
+    message->count = count;
+    message->reserved = 0;
+    opennop_msg_header->length += message->header.length;
+
+    return count;
+}
+
 int set_opennop_message_security(struct opennop_ipc_header *opennop_msg_header) {
     char message[LOGSZ] = {0};
 
@@ -514,6 +641,11 @@ int ipc_check_neighbor(struct epoller *this_epoller, int fd, void *buf) {
     if(thisneighbor != NULL) {
         logger2(LOGGING_DEBUG,DEBUG_IPC,"[IPC] Found a neighbor!\n");
         thisneighbor->sock = fd;
+
+        if(thisneighbor->state == UP) {
+            thisneighbor->state = ATTEMPT;
+            neighbors_changed();
+        }
         thisneighbor->state = ATTEMPT;
         update_neighbor_timer(thisneighbor);
         return 1;
@@ -613,6 +745,58 @@ int ipc_send_message(int socket, OPENNOP_IPC_MSG_TYPE messagetype) {
 
 }
 
+/**
+ * Sends the dedup chunks a neighbor referenced that were not found if there are any.
+ */
+int ipc_send_dedup_map(struct neighbor *thisneighbor) {
+    struct opennop_header_data data;
+    struct opennop_ipc_header *opennop_msg_header;
+    char buf[IPC_MAX_MESSAGE_SIZE] = {0};
+
+    opennop_msg_header = (struct opennop_ipc_header *)&buf;
+    initialize_opennop_ipc_header(opennop_msg_header);
+
+    get_header_data(opennop_msg_header, &data);
+
+    if (add_dedup_map_message(opennop_msg_header, thisneighbor) == 0) {
+        return 0;
+    }
+
+    if(opennop_msg_header->security == 1) {
+        calculate_hmac_sha256(opennop_msg_header, (char *)&key, data.securitydata);
+    }
+
+    return ipc_tx_message(thisneighbor->sock, opennop_msg_header);
+}
+
+/**
+ * Asks a neighbor to restart the streams that lost sync if there are any.
+ */
+int ipc_send_stream_restart(struct neighbor *thisneighbor) {
+    struct opennop_header_data data;
+    struct opennop_ipc_header *opennop_msg_header;
+    char buf[IPC_MAX_MESSAGE_SIZE] = {0};
+
+    opennop_msg_header = (struct opennop_ipc_header *)&buf;
+    initialize_opennop_ipc_header(opennop_msg_header);
+
+    get_header_data(opennop_msg_header, &data);
+
+    if (add_stream_restart_message(opennop_msg_header, thisneighbor) == 0) {
+        return 0;
+    }
+
+    if(opennop_msg_header->security == 1) {
+        calculate_hmac_sha256(opennop_msg_header, (char *)&key, data.securitydata);
+    }
+
+    return ipc_tx_message(thisneighbor->sock, opennop_msg_header);
+}
+
+/*
+ * Called every OPENNOP_IPC_TICK so reports reach the neighbors quickly
+ * while hello messages are still only sent every OPENNOP_IPC_HELLO.
+ */
 int hello_neighbors(struct epoller *this_epoller) {
     struct neighbor *currentneighbor = NULL;
     time_t currenttime;
@@ -665,7 +849,7 @@ int hello_neighbors(struct epoller *this_epoller) {
             	currentneighbor->state = ATTEMPT;
             }
 
-        } else if((currentneighbor->state >= ATTEMPT) && (difftime(currenttime, currentneighbor->hellotimer) >= 10)) {
+        } else if((currentneighbor->state >= ATTEMPT) && (difftime(currenttime, currentneighbor->hellotimer) >= OPENNOP_IPC_HELLO / 1000)) {
 
             if(currentneighbor->sock != 0) {
             	currentneighbor->hellotimer = currenttime;
@@ -691,12 +875,21 @@ int hello_neighbors(struct epoller *this_epoller) {
                  */
                 if (error < 0) {
                     logger2(LOGGING_DEBUG,DEBUG_IPC,"[IPC] Failed sending hello.\n");
+                    if(currentneighbor->state == UP) {
+                        currentneighbor->state = DOWN;
+                        neighbors_changed();
+                    }
                     currentneighbor->state = DOWN;
                     close(currentneighbor->sock);
                     currentneighbor->sock = 0;
                 }
             }
         }
+
+        if((currentneighbor->state == UP) && (currentneighbor->sock != 0)) {
+            ipc_send_dedup_map(currentneighbor);
+            ipc_send_stream_restart(currentneighbor);
+        }
     }
     return 0;
 }
@@ -725,7 +918,7 @@ void *ipc_thread(void *dummyPtr) {
 
     logger2(LOGGING_INFO,DEBUG_IPC, "IPC: Is starting.\n");
 
-    error = new_ip_epoll_server(&ipc_server, ipc_check_neighbor, ipc_handler, OPENNOPD_IPC_PORT, hello_neighbors, OPENNOP_IPC_HELLO);
+    error = new_ip_epoll_server(&ipc_server, ipc_check_neighbor, ipc_handler, OPENNOPD_IPC_PORT, hello_neighbors, OPENNOP_IPC_TICK);
 
     /*
      * This should not return until the epoll server is shutdown.
@@ -870,6 +1063,13 @@ int cli_display_neighbor_details(int client_fd, struct neighbor *currentneighbor
     }
     cli_send_feedback(client_fd, msg);
 
+    if(currentneighbor->codec >= 0) {
+    	sprintf(msg,"codec = %i level %i\n", currentneighbor->codec, currentneighbor->codeclevel);
+        cli_send_feedback(client_fd, msg);
+    }
+    sprintf(msg,"features = 0x%08x\n", currentneighbor->features);
+    cli_send_feedback(client_fd, msg);
+
     return 0;
 }
 
@@ -940,6 +1140,9 @@ struct neighbor* allocate_neighbor(__u32 neighborIP, char *key) {
     newneighbor->id[0] = '\0';
     newneighbor->sock = 0;
     newneighbor->key[0] = '\0';
+    newneighbor->codec = -1;
+    newneighbor->codeclevel = 0;
+    newneighbor->features = 0;
     time(&newneighbor->timer);
     time(&newneighbor->hellotimer);
 
@@ -983,6 +1186,7 @@ int add_update_neighbor(int client_fd, __u32 neighborIP, char *key) {
     currentneighbor = allocate_neighbor(neighborIP, key);
 
     if (currentneighbor != NULL) {
+        pthread_mutex_lock(&ipchead.lock);
 
         if (ipchead.next == NULL) {
             ipchead.next = currentneighbor;
@@ -993,7 +1197,7 @@ int add_update_neighbor(int client_fd, __u32 neighborIP, char *key) {
             ipchead.prev->next = currentneighbor;
             ipchead.prev = currentneighbor;
         }
-
+        pthread_mutex_unlock(&ipchead.lock);
     }
 
     return 0;
@@ -1007,6 +1211,7 @@ int del_neighbor(int client_fd, __u32 neighborIP, char *key) {
     while (currentneighbor != NULL) {
 
         if (currentneighbor->NeighborIP == neighborIP) {
+            pthread_mutex_lock(&ipchead.lock);
 
             if((currentneighbor->prev == NULL) && (currentneighbor->next == NULL)) {
                 ipchead.next = NULL;
@@ -1027,6 +1232,8 @@ int del_neighbor(int client_fd, __u32 neighborIP, char *key) {
 
             free(currentneighbor);
             currentneighbor = NULL;
+            pthread_mutex_unlock(&ipchead.lock);
+            neighbors_changed();
 
             return 0;
         }
@@ -1037,6 +1244,27 @@ int del_neighbor(int client_fd, __u32 neighborIP, char *key) {
     return 0;
 }
 
+/*
+ * Adds a neighbor that is already up with a known ID.
+ * The replay tool uses this to stand in for a remote accelerator.
+ */
+int add_static_neighbor(__u32 neighborIP, char *neighborid) {
+    struct neighbor *currentneighbor = NULL;
+
+    add_update_neighbor(0, neighborIP, NULL);
+    currentneighbor = find_neighbor_by_u32(neighborIP);
+
+    if (currentneighbor == NULL) {
+        return -1;
+    }
+    save_opennopid(neighborid, (char*)&currentneighbor->id);
+    currentneighbor->features = get_local_features(); // It stands in for an accelerator like this one.
+    currentneighbor->state = UP;
+    neighbors_changed();
+
+    return 0;
+}
+
 int validate_neighbor_input(int client_fd, char *stringip, char *key, t_neighbor_command neighbor_command) {
     int ERROR = 0;
     int keylength = 0;
@@ -1319,6 +1547,91 @@ int verify_neighbor_in_domain(char *neighborid) {
     return 0;
 }
 
+/*
+ * Sets the codec used for data sent to a neighbor.
+ * Returns -1 if the neighbor does not exist.
+ */
+int set_neighbor_codec(__u32 neighborIP, int codec, int level) {
+    struct neighbor *currentneighbor = NULL;
+
+    currentneighbor = find_neighbor_by_u32(neighborIP);
+
+    if (currentneighbor == NULL) {
+        return -1;
+    }
+    currentneighbor->codeclevel = level;
+    currentneighbor->codec = codec;
+    neighbors_changed(); // Sessions pick the codec up again.
+    return 0;
+}
+
+/*
+ * Gets the codec for data sent to the neighbor with this ID.
+ * Returns -1 if none was set for it.
+ * Workers call this so it holds the lock neighbors are freed under.
+ */
+int get_neighbor_codec(char *neighborid, int *level) {
+    struct neighbor *currentneighbor = NULL;
+    int codec = -1;
+
+    pthread_mutex_lock(&ipchead.lock);
+    currentneighbor = ipchead.next;
+
+    while (currentneighbor != NULL) {
+
+        if ((compare_opennopid((char*)&currentneighbor->id, neighborid) == 1) && (currentneighbor->codec >= 0)) {
+            *level = currentneighbor->codeclevel;
+            codec = currentneighbor->codec;
+            break;
+        }
+
+        currentneighbor = currentneighbor->next;
+    }
+    pthread_mutex_unlock(&ipchead.lock);
+    return codec;
+}
+
+/*
+ * Gets what the neighbor with this ID can decompress.
+ * Returns 0 if it is not a neighbor or did not say.
+ * Workers call this so it holds the lock neighbors are freed under.
+ */
+__u32 get_neighbor_features(char *neighborid) {
+    struct neighbor *currentneighbor = NULL;
+    __u32 features = 0;
+
+    pthread_mutex_lock(&ipchead.lock);
+    currentneighbor = ipchead.next;
+
+    while (currentneighbor != NULL) {
+
+        if (compare_opennopid((char*)&currentneighbor->id, neighborid) == 1) {
+            features = currentneighbor->features;
+            break;
+        }
+
+        currentneighbor = currentneighbor->next;
+    }
+    pthread_mutex_unlock(&ipchead.lock);
+    return features;
+}
+
+/*
+ * What this accelerator can decompress, sent to the neighbors.
+ */
+__u32 get_local_features() {
+    __u32 features = OPENNOP_FEATURE_STREAM | OPENNOP_FEATURE_DEDUP;
+    int i;
+
+    for (i = 0; i < MAXCODECS; i++) {
+
+        if (get_codec(i) != NULL) {
+            features |= OPENNOP_FEATURE_CODEC(i);
+        }
+    }
+    return features;
+}
+
 __u8 *get_opennop_id(){
 	return (__u8*)&opennop_localid;
 }
@@ -5,28 +5,81 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <linux/types.h>
+#include <linux/mempolicy.h>
 
 #include "memorymanager.h"
+#include "affinity.h"
 #include "opennopd.h"
 #include "logger.h"
+#include "climanager.h"
 
 u_int32_t allocatedpacketbuffers;
-struct packet_head freepacketbuffers;
+struct packet_head freepacketbuffers[MAXNUMANODES]; // Free packet buffers of each NUMA node.
 pthread_cond_t mysignal; // Condition signal used to wake-up thread.
 pthread_mutex_t mylock; // Lock for the memorymanager.
 
+struct packet_magazine magazines[MAXMAGAZINES]; // Packet buffers kept by each thread.
+int nummagazines = 0; // Magazine slots that have been used.
+pthread_mutex_t magazineslock = PTHREAD_MUTEX_INITIALIZER; // Lock when taking a magazine slot.
+static __thread struct packet_magazine *mymagazines[MAXNUMANODES]; // Magazines of the calling thread.
+
+struct packet_slab *packetslabs[MAXNUMANODES]; // Slabs of each node, newest first.
+u_int32_t numpacketslabs = 0; // Slabs mapped so far.
+u_int32_t numhugepageslabs = 0; // Slabs backed by huge pages.
+u_int32_t slabpacketbuffers = 0; // Packet buffers carved from all slabs.
+pthread_mutex_t slablock = PTHREAD_MUTEX_INITIALIZER; // Lock for the slab arena.
+
 int initialfreepacketbuffers = 1000;
 int minfreepacketbuffers = 500;
 int packetbufferstoallocate = 100;
+int maxpacketbuffers = 0; // Cap on packet buffers, 0 is no cap.
+int packethugepages = false; // Try to back slabs with huge pages.
 
 int DEBUG_MEMORYMANAGER = false;
 
+/*
+ * The arena has carved as many buffers as it is allowed to.
+ */
+static int packet_arena_full(void) {
+    return (maxpacketbuffers > 0) && (slabpacketbuffers >= (u_int32_t)maxpacketbuffers);
+}
+
+/*
+ * Finds a node whose pool is below the minimum and can still grow.
+ * Returns AFFINITYNONE if every pool has enough buffers.
+ */
+static int low_packet_pool(void) {
+    int node;
+    int low = AFFINITYNONE;
+
+    if (packet_arena_full() == true) {
+        return AFFINITYNONE;
+    }
+
+    for (node = 0; (node < get_numa_nodes()) && (low == AFFINITYNONE); node++) {
+        pthread_mutex_lock(&freepacketbuffers[node].lock);
+
+        if (freepacketbuffers[node].qlen < (u_int32_t)minfreepacketbuffers) {
+            low = node;
+        }
+        pthread_mutex_unlock(&freepacketbuffers[node].lock);
+    }
+    return low;
+}
+
 void *memorymanager_function(void *dummyPtr) {
     struct packet_head packetbufferstaging;
     u_int32_t newpacketbuffers;
+    int node;
+    int refillfailed = false; // The last refill got no buffers.
+    struct timespec retry;
     char message[LOGSZ];
 
     if (DEBUG_MEMORYMANAGER == true) {
@@ -44,12 +97,14 @@ void *memorymanager_function(void *dummyPtr) {
     pthread_mutex_unlock(&mylock);
 
     /*
-     * Initialize the free packet buffer pool lock and signal.
+     * Initialize the free packet buffer pool of each node.
      */
-    pthread_mutex_init(&freepacketbuffers.lock, NULL);
-    pthread_mutex_lock(&freepacketbuffers.lock);
-    freepacketbuffers.qlen = 0;
-    pthread_mutex_unlock(&freepacketbuffers.lock);
+    for (node = 0; node < get_numa_nodes(); node++) {
+        pthread_mutex_init(&freepacketbuffers[node].lock, NULL);
+        pthread_mutex_lock(&freepacketbuffers[node].lock);
+        freepacketbuffers[node].qlen = 0;
+        pthread_mutex_unlock(&freepacketbuffers[node].lock);
+    }
 
     /*
      * Initialize the staging packet buffer queue lock and signal.
@@ -61,52 +116,75 @@ void *memorymanager_function(void *dummyPtr) {
 
     /*
      * I need to initialize some packet buffers here.
-     * and move them to the freepacketbuffers pool.
+     * and move them to the freepacketbuffers pools.
      */
-    allocatefreepacketbuffers(&packetbufferstaging, initialfreepacketbuffers);
-    pthread_mutex_lock(&mylock);
-    allocatedpacketbuffers += move_queued_packets(&packetbufferstaging,
-                              &freepacketbuffers);
-    pthread_mutex_unlock(&mylock);
+    for (node = 0; node < get_numa_nodes(); node++) {
+        allocatefreepacketbuffers(&packetbufferstaging, initialfreepacketbuffers, node);
+        pthread_mutex_lock(&mylock);
+        allocatedpacketbuffers += move_queued_packets(&packetbufferstaging,
+                                  &freepacketbuffers[node]);
+        pthread_mutex_unlock(&mylock);
+    }
 
     while (servicestate >= STOPPING) {
 
         /*
          * Check if there are enough buffers.  If so then sleep.
          */
-        pthread_mutex_lock(&freepacketbuffers.lock); // Grab the free packet buffer pool lock.
+        pthread_mutex_lock(&mylock); // Grab lock.
 
-        if (freepacketbuffers.qlen >= minfreepacketbuffers) {
-            pthread_mutex_unlock(&freepacketbuffers.lock); // Lose the free packet buffer pool lock.
-            pthread_mutex_lock(&mylock); // Grab lock.
+        if (low_packet_pool() == AFFINITYNONE) {
+            refillfailed = false;
             pthread_cond_wait(&mysignal, &mylock); // If we have enough free buffers then wait.
-        } else {
-            pthread_mutex_unlock(&freepacketbuffers.lock); // Lose the free packet buffer pool lock.
+        } else if (refillfailed == true) {
+            /*
+             * Threads keep signalling while the pool is low so
+             * wait out the whole time before trying again.
+             */
+            clock_gettime(CLOCK_REALTIME, &retry);
+            retry.tv_sec += PACKETREFILLRETRY;
+
+            while (pthread_cond_timedwait(&mysignal, &mylock, &retry) != ETIMEDOUT) {
+            }
         }
+        pthread_mutex_unlock(&mylock); // Lose lock while staging new buffers.
 
         /*
-         * Something woke me up.  We allocate packet buffers now!
-         * Then move them to the freepacketbuffers pool.
+         * Something woke me up.  We allocate packet buffers now
+         * for every node that is low.
+         * Then move them to that node's freepacketbuffers pool.
          */
-        pthread_mutex_unlock(&mylock); // Lose lock while staging new buffers.
-        allocatefreepacketbuffers(&packetbufferstaging, packetbufferstoallocate);
+        while ((node = low_packet_pool()) != AFFINITYNONE) {
+            allocatefreepacketbuffers(&packetbufferstaging, packetbufferstoallocate, node);
 
-        pthread_mutex_lock(&mylock); // Grab lock again before modifying free packet buffer pool.
-        newpacketbuffers = move_queued_packets(&packetbufferstaging,
-                                               &freepacketbuffers);
-        allocatedpacketbuffers += newpacketbuffers;
+            pthread_mutex_lock(&mylock); // Grab lock again before modifying free packet buffer pool.
+            newpacketbuffers = move_queued_packets(&packetbufferstaging,
+                                                   &freepacketbuffers[node]);
+            allocatedpacketbuffers += newpacketbuffers;
 
-        if (DEBUG_MEMORYMANAGER == true) {
-            sprintf(message, "[OpenNOP]: Allocating %u new packet buffers. \n",
-                    newpacketbuffers);
-            logger(LOG_INFO, message);
+            if (DEBUG_MEMORYMANAGER == true) {
+                sprintf(message, "[OpenNOP]: Allocating %u new packet buffers on node %i. \n",
+                        newpacketbuffers, node);
+                logger(LOG_INFO, message);
+            }
+            pthread_mutex_unlock(&mylock); // Lose lock.
+
+            if (newpacketbuffers == 0) {
+
+                if (refillfailed == false) {
+                    sprintf(message, "[OpenNOP]: Could not allocate packet buffers on node %i, retrying every %i seconds. \n",
+                            node, PACKETREFILLRETRY);
+                    logger(LOG_INFO, message);
+                }
+                refillfailed = true;
+                break;
+            }
+            refillfailed = false;
         }
 
         /*
          * Ok finished allocating more packet buffers.  Lets do it again.
          */
-        pthread_mutex_unlock(&mylock); // Lose lock.
-
     }
 
     if (DEBUG_MEMORYMANAGER == true) {
@@ -122,34 +200,279 @@ void *memorymanager_function(void *dummyPtr) {
 }
 
 /*
- * This function allocates a number of free packets
- * and stores them in the specified queue.
+ * Maps the memory for a slab with every page faulted in.
+ * With more than one node the pages are bound to the node before
+ * they are touched so the slab is local to the workers that use it,
+ * MAP_POPULATE would fault them in before mbind() runs.
+ * A preferred policy is used so a full node still gets pages.
  */
-int allocatefreepacketbuffers(struct packet_head *queue, int bufferstoallocate) {
-    int i;
+static void *map_packet_slab(int flags, int node) {
+    void *region;
+    unsigned long nodemask;
+    long pagesize;
+    size_t offset;
+
+    if (get_numa_nodes() == 1) {
+        return mmap(NULL, PACKETSLABSIZE, PROT_READ | PROT_WRITE, flags | MAP_POPULATE, -1, 0);
+    }
 
-    for (i = 0; i < bufferstoallocate; i++) {
-        queue_packet(queue, newpacket());
+    region = mmap(NULL, PACKETSLABSIZE, PROT_READ | PROT_WRITE, flags, -1, 0);
+
+    if (region == MAP_FAILED) {
+        return region;
     }
+    nodemask = 1UL << node;
+    syscall(SYS_mbind, region, PACKETSLABSIZE, MPOL_PREFERRED, &nodemask,
+            sizeof(nodemask) * 8, 0);
 
-    return 0;
+#if defined(MADV_HUGEPAGE)
+    if ((flags & MAP_HUGETLB) == 0) {
+        madvise(region, PACKETSLABSIZE, MADV_HUGEPAGE); // Before the pages are faulted in.
+    }
+#endif
+    pagesize = sysconf(_SC_PAGESIZE);
+
+    for (offset = 0; offset < PACKETSLABSIZE; offset += pagesize) {
+        ((volatile char *)region)[offset] = 0;
+    }
+    return region;
 }
 
-struct packet *get_freepacket_buffer(void) {
-    struct packet *thispacket = NULL;
+/*
+ * Maps a new slab and adds it to the front of the arena.
+ * Huge pages are tried first when enabled and if none are reserved
+ * the slab uses normal pages with transparent huge pages advised.
+ * Caller must hold the slab lock.
+ */
+static struct packet_slab *new_packet_slab(int node) {
+    struct packet_slab *thisslab;
+    void *region = MAP_FAILED;
+    int hugepages = false;
     char message[LOGSZ];
 
+    thisslab = calloc(1, sizeof(struct packet_slab));
+
+    if (thisslab == NULL) {
+        return NULL;
+    }
+
+    if (packethugepages == true) {
+        region = map_packet_slab(MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, node);
+
+        if (region != MAP_FAILED) {
+            hugepages = true;
+
+        } else if (numpacketslabs == 0) {
+            sprintf(message, "[OpenNOP]: No huge pages for packet buffers using normal pages. \n");
+            logger(LOG_INFO, message);
+        }
+    }
+
+    if (region == MAP_FAILED) {
+        region = map_packet_slab(MAP_PRIVATE | MAP_ANONYMOUS, node);
+
+        if (region == MAP_FAILED) {
+            free(thisslab);
+            sprintf(message, "[OpenNOP]: Failed to map a packet buffer slab! \n");
+            logger(LOG_INFO, message);
+            return NULL;
+        }
+#if defined(MADV_HUGEPAGE)
+        madvise(region, PACKETSLABSIZE, MADV_HUGEPAGE);
+#endif
+    }
+
+    thisslab->buffers = (struct packet *)region;
+    thisslab->size = PACKETSLABSIZE;
+    thisslab->capacity = PACKETSLABSIZE / sizeof(struct packet);
+    thisslab->used = 0;
+    thisslab->hugepages = hugepages;
+    thisslab->node = node;
+    thisslab->next = packetslabs[node];
+    packetslabs[node] = thisslab;
+    numpacketslabs++;
+
+    if (hugepages == true) {
+        numhugepageslabs++;
+    }
+
     if (DEBUG_MEMORYMANAGER == true) {
-        sprintf(message, "[OpenNOP]: Requesting a packet buffer from pool. \n");
+        sprintf(message, "[OpenNOP]: Mapped packet slab of %u buffers on node %i. \n",
+                thisslab->capacity, node);
         logger(LOG_INFO, message);
     }
+
+    return thisslab;
+}
+
+/*
+ * Takes the next unused buffer from the newest slab of a node.
+ * Returns NULL when the cap is reached or no slab could be mapped.
+ * Caller must hold the slab lock.
+ */
+static struct packet *carve_packet(int node) {
+    struct packet *thispacket;
+
+    if (packet_arena_full() == true) {
+        return NULL;
+    }
+
+    if (((packetslabs[node] == NULL) || (packetslabs[node]->used >= packetslabs[node]->capacity)) &&
+            (new_packet_slab(node) == NULL)) {
+        return NULL;
+    }
+
+    thispacket = &packetslabs[node]->buffers[packetslabs[node]->used];
+    packetslabs[node]->used++;
+    slabpacketbuffers++;
+    init_packet(thispacket);
+    thispacket->node = node;
+
+    return thispacket;
+}
+
+/*
+ * This function carves a number of free packets from the slabs
+ * of a node and stores them in the specified queue.
+ * Returns how many buffers were added which can be less
+ * than requested when the cap is reached.
+ */
+int allocatefreepacketbuffers(struct packet_head *queue, int bufferstoallocate, int node) {
+    struct packet *thispacket;
+    int i;
+
+    pthread_mutex_lock(&slablock);
+
+    for (i = 0; i < bufferstoallocate; i++) {
+        thispacket = carve_packet(node);
+
+        if (thispacket == NULL) {
+            break;
+        }
+        queue_packet(queue, thispacket);
+    }
+
+    pthread_mutex_unlock(&slablock);
+
+    return i;
+}
+
+/*
+ * Finds the calling thread's magazine for buffers of a node.
+ * Slots of threads that have exited are used again.
+ * Returns NULL if every slot is in use.
+ */
+static struct packet_magazine *get_packet_magazine(int node) {
+    struct packet_magazine *thismagazine = NULL;
+    int i;
+
+    if (mymagazines[node] != NULL) {
+        return mymagazines[node];
+    }
+
+    pthread_mutex_lock(&magazineslock);
+
+    for (i = 0; i < nummagazines; i++) {
+
+        if (magazines[i].inuse == false) {
+            thismagazine = &magazines[i];
+            break;
+        }
+    }
+
+    if ((thismagazine == NULL) && (nummagazines < MAXMAGAZINES)) {
+        thismagazine = &magazines[nummagazines];
+        pthread_mutex_init(&thismagazine->loaded.lock, NULL);
+        pthread_mutex_init(&thismagazine->full.lock, NULL);
+        nummagazines++;
+    }
+
+    if (thismagazine != NULL) {
+        thismagazine->loaded.next = NULL;
+        thismagazine->loaded.prev = NULL;
+        thismagazine->loaded.qlen = 0;
+        thismagazine->full.next = NULL;
+        thismagazine->full.prev = NULL;
+        thismagazine->full.qlen = 0;
+        thismagazine->node = node;
+        thismagazine->inuse = true;
+    }
+
+    pthread_mutex_unlock(&magazineslock);
+
+    mymagazines[node] = thismagazine;
+    return thismagazine;
+}
+
+static void swap_packet_magazine(struct packet_magazine *thismagazine) {
+    struct packet_head temp;
+
+    temp.next = thismagazine->loaded.next;
+    temp.prev = thismagazine->loaded.prev;
+    temp.qlen = thismagazine->loaded.qlen;
+    thismagazine->loaded.next = thismagazine->full.next;
+    thismagazine->loaded.prev = thismagazine->full.prev;
+    thismagazine->loaded.qlen = thismagazine->full.qlen;
+    thismagazine->full.next = temp.next;
+    thismagazine->full.prev = temp.prev;
+    thismagazine->full.qlen = temp.qlen;
+}
+
+/*
+ * Takes a buffer from the front of the loaded magazine.
+ * Only the owning thread touches loaded so no lock is used.
+ */
+static struct packet *magazine_get_packet(struct packet_magazine *thismagazine) {
+    struct packet *thispacket;
+
+    thispacket = thismagazine->loaded.next;
+
+    if (thispacket != NULL) {
+        thismagazine->loaded.next = thispacket->next;
+        thismagazine->loaded.qlen -= 1;
+
+        if (thismagazine->loaded.qlen == 0) {
+            thismagazine->loaded.next = NULL;
+            thismagazine->loaded.prev = NULL;
+        }
+        thispacket->next = NULL;
+        thispacket->prev = NULL;
+    }
+    return thispacket;
+}
+
+/*
+ * Puts a buffer on the front of the loaded magazine
+ * so the most recently used buffer is handed out next.
+ */
+static void magazine_put_packet(struct packet_magazine *thismagazine, struct packet *thispacket) {
+
+    thispacket->prev = NULL;
+    thispacket->next = thismagazine->loaded.next;
+
+    if (thismagazine->loaded.qlen == 0) {
+        thismagazine->loaded.prev = thispacket;
+    }
+    thismagazine->loaded.next = thispacket;
+    thismagazine->loaded.qlen += 1;
+}
+
+/*
+ * Gets a buffer from a node's pool the way it was done before magazines.
+ * Used for refills that found the pool empty and for threads without a magazine.
+ */
+static struct packet *pool_get_packet(int node) {
+    struct packet_head *pool = &freepacketbuffers[node];
+    struct packet *thispacket = NULL;
+    char message[LOGSZ];
+
     /*
      * Check if any packet buffers are in the pool
      * get one if there are or allocate a new buffer if not.
      */
-    pthread_mutex_lock(&freepacketbuffers.lock); // Grab packet buffer pool lock.
+    pthread_mutex_lock(&pool->lock); // Grab packet buffer pool lock.
 
-    if (freepacketbuffers.qlen > 0) {
+    if (pool->qlen > 0) {
 
         if (DEBUG_MEMORYMANAGER == true) {
             sprintf(message,
@@ -157,7 +480,7 @@ struct packet *get_freepacket_buffer(void) {
             logger(LOG_INFO, message);
         }
 
-        if (freepacketbuffers.qlen < minfreepacketbuffers) {
+        if (pool->qlen < minfreepacketbuffers) {
 
             if (DEBUG_MEMORYMANAGER == true) {
                 sprintf(message, "[OpenNOP]: Packet buffer pool is low. \n");
@@ -165,8 +488,8 @@ struct packet *get_freepacket_buffer(void) {
             }
             pthread_cond_signal(&mysignal); // Free packet buffers are low!
         }
-        pthread_mutex_unlock(&freepacketbuffers.lock); // Lose packet buffer pool lock.
-        thispacket = dequeue_packet(&freepacketbuffers, false); // This uses its own lock.
+        pthread_mutex_unlock(&pool->lock); // Lose packet buffer pool lock.
+        thispacket = dequeue_packet(pool, false); // This uses its own lock.
 
         if (DEBUG_MEMORYMANAGER == true) {
             sprintf(message,
@@ -180,16 +503,80 @@ struct packet *get_freepacket_buffer(void) {
             sprintf(message, "[OpenNOP]: Packet buffer pool is empty! \n");
             logger(LOG_INFO, message);
         }
-        pthread_mutex_unlock(&freepacketbuffers.lock); // Lose packet buffer pool lock.
+        pthread_mutex_unlock(&pool->lock); // Lose packet buffer pool lock.
         pthread_cond_signal(&mysignal); // Free packet buffers are low!
-        thispacket = newpacket(); // Try to allocate a packet for the requester.
-        pthread_mutex_lock(&mylock); // Grab lock.
-        allocatedpacketbuffers++;
-        pthread_mutex_unlock(&mylock); // Lose lock.
+        pthread_mutex_lock(&slablock);
+        thispacket = carve_packet(node); // Try to allocate a packet for the requester.
+        pthread_mutex_unlock(&slablock);
+
+        if (thispacket != NULL) {
+            pthread_mutex_lock(&mylock); // Grab lock.
+            allocatedpacketbuffers++;
+            pthread_mutex_unlock(&mylock); // Lose lock.
+        }
+    }
+
+    return thispacket;
+}
+
+struct packet *get_freepacket_buffer(void) {
+    return get_freepacket_buffer_on(get_local_node());
+}
+
+/*
+ * Gets a buffer from a node's slabs.
+ * The fetcher asks for the node of the worker that will process the packet.
+ */
+struct packet *get_freepacket_buffer_on(int node) {
+    struct packet_magazine *thismagazine;
+    struct packet *thispacket = NULL;
+    char message[LOGSZ];
+
+    if (DEBUG_MEMORYMANAGER == true) {
+        sprintf(message, "[OpenNOP]: Requesting a packet buffer from pool. \n");
+        logger(LOG_INFO, message);
+    }
+
+    if ((node < 0) || (node >= get_numa_nodes())) {
+        node = 0;
+    }
+    thismagazine = get_packet_magazine(node);
+
+    if (thismagazine == NULL) {
+        thispacket = pool_get_packet(node);
+
+    } else {
+
+        if ((thismagazine->loaded.qlen == 0) && (thismagazine->full.qlen > 0)) {
+            swap_packet_magazine(thismagazine);
+        }
+        thispacket = magazine_get_packet(thismagazine);
+
+        if (thispacket != NULL) {
+            thismagazine->hits++;
+
+        } else {
+            /*
+             * Both magazines are empty so take a magazine worth
+             * of buffers from the pool with one lock.
+             */
+            thismagazine->misses++;
+
+            if (move_some_queued_packets(&freepacketbuffers[node], &thismagazine->loaded, MAGAZINESIZE) > 0) {
+                thismagazine->refills++;
+                thispacket = magazine_get_packet(thismagazine);
+
+                if (freepacketbuffers[node].qlen < minfreepacketbuffers) {
+                    pthread_cond_signal(&mysignal); // Free packet buffers are low!
+                }
+            } else {
+                thispacket = pool_get_packet(node);
+            }
+        }
     }
 
     if (thispacket != NULL) {
-        memset(thispacket, 0, sizeof(struct packet));
+        init_packet(thispacket); // Leaves the node the buffer was carved on.
     } else {
         sprintf(message, "[OpenNOP]: Failed to allocate packet! \n");
         logger(LOG_INFO, message);
@@ -204,6 +591,7 @@ struct packet *get_freepacket_buffer(void) {
 }
 
 int put_freepacket_buffer(struct packet *thispacket) {
+    struct packet_magazine *thismagazine;
     int result;
     char message[LOGSZ];
 
@@ -211,7 +599,36 @@ int put_freepacket_buffer(struct packet *thispacket) {
         sprintf(message, "[OpenNOP]: Returning a packet buffer to the pool. \n");
         logger(LOG_INFO, message);
     }
-    result = queue_packet(&freepacketbuffers, thispacket);
+
+    if (thispacket == NULL) {
+        return -1;
+    }
+
+    /*
+     * Buffers always go back to the node they were carved on.
+     */
+    thismagazine = get_packet_magazine(thispacket->node);
+
+    if (thismagazine == NULL) {
+        result = queue_packet(&freepacketbuffers[thispacket->node], thispacket);
+
+    } else {
+
+        if (thismagazine->loaded.qlen >= MAGAZINESIZE) {
+
+            if (thismagazine->full.qlen > 0) {
+                /*
+                 * Both magazines are full so return a magazine worth
+                 * of buffers to the pool with one lock.
+                 */
+                move_queued_packets(&thismagazine->full, &freepacketbuffers[thismagazine->node]);
+                thismagazine->spills++;
+            }
+            swap_packet_magazine(thismagazine);
+        }
+        magazine_put_packet(thismagazine, thispacket);
+        result = 0;
+    }
 
     if (DEBUG_MEMORYMANAGER == true) {
 
@@ -227,3 +644,103 @@ int put_freepacket_buffer(struct packet *thispacket) {
     return result;
 }
 
+/*
+ * Returns the buffers of the calling thread to the pool.
+ * Threads call this before they exit so the buffers are not lost.
+ */
+void release_packet_magazine(void) {
+    struct packet_magazine *thismagazine;
+    int node;
+
+    for (node = 0; node < MAXNUMANODES; node++) {
+        thismagazine = mymagazines[node];
+
+        if (thismagazine == NULL) {
+            continue;
+        }
+
+        if (thismagazine->loaded.qlen > 0) {
+            move_queued_packets(&thismagazine->loaded, &freepacketbuffers[node]);
+        }
+
+        if (thismagazine->full.qlen > 0) {
+            move_queued_packets(&thismagazine->full, &freepacketbuffers[node]);
+        }
+
+        pthread_mutex_lock(&magazineslock);
+        thismagazine->inuse = false;
+        pthread_mutex_unlock(&magazineslock);
+        mymagazines[node] = NULL;
+    }
+}
+
+void set_maxpacketbuffers(int desiredmaxpacketbuffers) {
+
+    if (desiredmaxpacketbuffers > 0) {
+        maxpacketbuffers = desiredmaxpacketbuffers;
+    } else {
+        maxpacketbuffers = 0;
+    }
+}
+
+void set_packethugepages(int enabled) {
+    packethugepages = enabled;
+}
+
+struct commandresult cli_show_packetbuffers(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result  = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    u_int32_t freebuffers = 0;
+    int i;
+
+    for (i = 0; i < get_numa_nodes(); i++) {
+        freebuffers += freepacketbuffers[i].qlen;
+    }
+
+    sprintf(msg, "allocated: %u free: %u\n", allocatedpacketbuffers, freebuffers);
+    cli_send_feedback(client_fd, msg);
+
+    if (get_numa_nodes() > 1) {
+
+        for (i = 0; i < get_numa_nodes(); i++) {
+            sprintf(msg, "node %i free: %u\n", i, freepacketbuffers[i].qlen);
+            cli_send_feedback(client_fd, msg);
+        }
+    }
+
+    if (maxpacketbuffers > 0) {
+        sprintf(msg, "slabs: %u hugepage slabs: %u carved: %u max: %i\n",
+                numpacketslabs, numhugepageslabs, slabpacketbuffers, maxpacketbuffers);
+    } else {
+        sprintf(msg, "slabs: %u hugepage slabs: %u carved: %u max: none\n",
+                numpacketslabs, numhugepageslabs, slabpacketbuffers);
+    }
+    cli_send_feedback(client_fd, msg);
+
+    sprintf(msg, "-------------------------------------------------------------------------\n");
+    cli_send_feedback(client_fd, msg);
+    sprintf(msg, "| magazine | node | buffers  |    hits    |   misses   | refill | spill  |\n");
+    cli_send_feedback(client_fd, msg);
+    sprintf(msg, "-------------------------------------------------------------------------\n");
+    cli_send_feedback(client_fd, msg);
+
+    for (i = 0; i < nummagazines; i++) {
+
+        if (magazines[i].inuse == true) {
+            sprintf(msg, "| %-9i| %-5i| %-9u| %-11u| %-11u| %-7u| %-7u|\n", i,
+                    magazines[i].node, magazines[i].loaded.qlen + magazines[i].full.qlen,
+                    magazines[i].hits, magazines[i].misses,
+                    magazines[i].refills, magazines[i].spills);
+            cli_send_feedback(client_fd, msg);
+        }
+    }
+
+    sprintf(msg, "-------------------------------------------------------------------------\n");
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
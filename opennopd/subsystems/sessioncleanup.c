@@ -1,10 +1,13 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
 #include <unistd.h> // for sleep function
+#include <time.h>
 
 #include <sys/time.h> 
+#include <sys/socket.h> // for sendmmsg
 
 #include <netinet/ip.h> // for tcpmagic and TCP options
 #include <netinet/tcp.h> // for tcpmagic and TCP options
@@ -19,6 +22,7 @@
 #include "csum.h"
 #include "logger.h"
 #include "climanager.h"
+#include "rcu.h"
 
 static int rawsock = 0; // Used to send keep-alive messages.
 static int dead_session_detection = true; //Detect dead sessions by default.
@@ -29,18 +33,40 @@ static int DEBUG_SESSION_TRACKING = LOGGING_WARN;
 static pthread_t t_cleanup; // thread for cleaning up dead sessions.
 
 /*
- * This sends a keep alive message to the specified IP.
+ * Each session sits in the slot for the second it is next checked in,
+ * cleanup_timer seconds after it was last checked.  Workers do not move
+ * sessions, the sequence numbers and deadcounter they already update
+ * show whether a session was idle when its slot comes up.
+ * So each second only the sessions due then are visited.
+ */
+static struct session_timer_slot sessiontimers[SESSIONTIMERSLOTS];
+static __u32 sessiontimertick = 0; // Second the cleanup thread handles next.
+static __u64 sessionschecked = 0; // Sessions whose slot came up.
+static __u64 keepalivessent = 0;
+static __u64 deadsessions = 0; // Sessions removed for not answering keepalives.
+
+/*
+ * Keepalives are queued while a slot is locked and sent after.
+ */
+static char keepalives[KEEPALIVEBATCH][KEEPALIVESIZE];
+static struct sockaddr_in keepalivedestinations[KEEPALIVEBATCH];
+static struct mmsghdr keepalivemsgs[KEEPALIVEBATCH];
+static struct iovec keepaliveiovecs[KEEPALIVEBATCH];
+static int numkeepalives = 0;
+
+/*
+ * Builds a keep alive message to the specified IP in packet.
  * It does not tag the packet with the Accelerator ID this
  * prevents the keepalive messages from recreating dead sessions
  * in remote Accelerators.
  */
-void sendkeepalive
-(__u32 saddr, __u16 source, __u32 seq,
+static void buildkeepalive
+(char *packet, struct sockaddr_in *din,
+__u32 saddr, __u16 source, __u32 seq,
 __u32 daddr, __u16 dest, __u32 ack_seq){
-	char packet[BUFSIZE];
 	struct iphdr *iph = NULL;
 	struct tcphdr *tcph = NULL;
-	struct sockaddr_in sin, din;
+	struct sockaddr_in sin;
 	__u16 tcplen;
 	char message[LOGSZ];
 
@@ -53,13 +79,13 @@ __u32 daddr, __u16 dest, __u32 ack_seq){
 	memset(packet, 0, BUFSIZE);
 
 	sin.sin_family = AF_INET;
-	din.sin_family = AF_INET;
+	din->sin_family = AF_INET;
 	
 	sin.sin_port = source;
-	din.sin_port = dest;
+	din->sin_port = dest;
 	
 	sin.sin_addr.s_addr = saddr;
-	din.sin_addr.s_addr = daddr;
+	din->sin_addr.s_addr = daddr;
 
 	iph = (struct iphdr *)packet;
 	iph->ihl = 5; // IP header length.
@@ -103,92 +129,244 @@ __u32 daddr, __u16 dest, __u32 ack_seq){
  	iph->check = ip_sum_calc(iph->ihl*4,
 		(unsigned short *)iph);
 	
-	
-	if(sendto(rawsock, packet, ntohs(iph->tot_len), 0, (struct sockaddr *)&din, sizeof(din)) < 0){
+	return;
+}
+
+/*
+ * This sends a keep alive message to the specified IP right away.
+ */
+void sendkeepalive
+(__u32 saddr, __u16 source, __u32 seq,
+__u32 daddr, __u16 dest, __u32 ack_seq){
+	char packet[BUFSIZE];
+	struct sockaddr_in din;
+	char message[LOGSZ];
+
+	buildkeepalive(packet, &din, saddr, source, seq, daddr, dest, ack_seq);
+
+	if(sendto(rawsock, packet, ntohs(((struct iphdr *)packet)->tot_len), 0, (struct sockaddr *)&din, sizeof(din)) < 0){
 	    sprintf(message, "Failed sending keepalive.\n");
 	    logger2(LOGGING_ERROR,DEBUG_SESSION_TRACKING,message);
 	}
-	
-	return;
 }
 
 /*
- * This function goes through All the session of a single list
- * looking for idle sessions.  When it locates one it
- * send a keepalive message to both client/server.  If they
- * fail to respond to the keepalive messages twice the session
- * is removed from its list. 
+ * Sends the queued keepalives.
  */
-void cleanuplist (struct session_head *currentlist){
-	struct session *currentsession = NULL;
+static void flushkeepalives(){
+	int sent = 0;
+	int result;
 	char message[LOGSZ];
-	
-	if (currentlist->next != NULL){ // Make sure there is something in the list.
-		currentsession = currentlist->next; // Make the first session of the list the current.
+
+	while (sent < numkeepalives){
+		result = sendmmsg(rawsock, &keepalivemsgs[sent], numkeepalives - sent, 0);
+
+		if (result <= 0){
+		    sprintf(message, "Failed sending %d keepalives.\n", numkeepalives - sent);
+		    logger2(LOGGING_ERROR,DEBUG_SESSION_TRACKING,message);
+		    break;
+		}
+		sent += result;
 	}
-	else{ // No sessions in this list.
-		return; 
+	keepalivessent += sent;
+	numkeepalives = 0;
+}
+
+/*
+ * Queues a keepalive, only the cleanup thread calls this.
+ * The caller sends the batch before it is full.
+ */
+static void queuekeepalive
+(__u32 saddr, __u16 source, __u32 seq,
+__u32 daddr, __u16 dest, __u32 ack_seq){
+	char packet[BUFSIZE];
+	__u16 length;
+
+	buildkeepalive(packet, &keepalivedestinations[numkeepalives], saddr, source, seq, daddr, dest, ack_seq);
+	length = ntohs(((struct iphdr *)packet)->tot_len);
+
+	if (length > KEEPALIVESIZE){
+		return;
 	}
-	
-	if (currentsession != NULL){ // Make sure there is a session to work on.
-	
-		while (currentsession != NULL){ // Do this for all the sessions in the list.
-			
-			if (currentsession->deadcounter > 2){ // This session has failed to respond it is dead.
-				
-				if (currentsession->next != NULL){ // Check that next sessions isnt NULL;
-					currentsession = currentsession->next; // Advance to the next session.
-					clearsession(currentsession->prev); // Clear the previous session.
-				}
-				else{ // This was the last session of the list.
-					clearsession(currentsession);
-					currentsession = NULL;
-				}
-			    sprintf(message, "Dead session removed.\n");
-			    logger2(LOGGING_INFO,DEBUG_SESSION_TRACKING,message);
-			}
-			else{ // Session needs checked for idle time.
-				
-				if(currentsession->larger.sequence == currentsession->larger.previoussequence){
-					sendkeepalive(currentsession->smaller.address, currentsession->smaller.port, currentsession->smaller.sequence,
-									currentsession->larger.address, currentsession->larger.port, currentsession->larger.sequence);
-
-					currentsession->deadcounter++;
-
-				}else if(currentsession->smaller.sequence == currentsession->smaller.previoussequence){
-					sendkeepalive(currentsession->larger.address, currentsession->larger.port, currentsession->larger.sequence,
-									currentsession->smaller.address, currentsession->smaller.port, currentsession->smaller.sequence);
-
-					currentsession->deadcounter++;
-				}else{
-					currentsession->deadcounter = 0;
-				}
-
-				currentsession->larger.previoussequence = currentsession->larger.sequence;
-				currentsession->smaller.previoussequence = currentsession->smaller.sequence;
-
-
-				if (currentsession->next != NULL){ // Check if there are more sessions.
-					currentsession = currentsession->next; // Advance to the next session.
-				}
-				else{ // Reached end of the session list.
-					currentsession = NULL;
-				}
-			}	
+	memcpy(keepalives[numkeepalives], packet, length);
+	keepaliveiovecs[numkeepalives].iov_base = keepalives[numkeepalives];
+	keepaliveiovecs[numkeepalives].iov_len = length;
+	memset(&keepalivemsgs[numkeepalives], 0, sizeof(struct mmsghdr));
+	keepalivemsgs[numkeepalives].msg_hdr.msg_name = &keepalivedestinations[numkeepalives];
+	keepalivemsgs[numkeepalives].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+	keepalivemsgs[numkeepalives].msg_hdr.msg_iov = &keepaliveiovecs[numkeepalives];
+	keepalivemsgs[numkeepalives].msg_hdr.msg_iovlen = 1;
+	numkeepalives++;
+}
+
+void initialize_session_timers(){
+	int i;
+
+	for (i = 0; i < SESSIONTIMERSLOTS; i++){
+		sessiontimers[i].next = NULL;
+		pthread_mutex_init(&sessiontimers[i].lock, NULL);
+	}
+}
+
+/*
+ * Caller holds the lock of the slot.
+ */
+static void link_session_timer(__u32 slot, struct session *thissession){
+	thissession->timerprev = NULL;
+	thissession->timernext = sessiontimers[slot].next;
+
+	if (thissession->timernext != NULL){
+		thissession->timernext->timerprev = thissession;
+	}
+	sessiontimers[slot].next = thissession;
+	__atomic_store_n(&thissession->timerslot, slot, __ATOMIC_RELEASE);
+}
+
+/*
+ * Caller holds the lock of the slot the session is in.
+ * timerslot is left alone so a thread removing the session
+ * waits for the slot lock instead of taking it as already gone.
+ */
+static void unlink_session_timer(struct session *thissession){
+
+	if (thissession->timerprev != NULL){
+		thissession->timerprev->timernext = thissession->timernext;
+	}else{
+		sessiontimers[thissession->timerslot].next = thissession->timernext;
+	}
+
+	if (thissession->timernext != NULL){
+		thissession->timernext->timerprev = thissession->timerprev;
+	}
+}
+
+/*
+ * Slot a session checked now should be checked in next.
+ */
+static __u32 next_session_timer(){
+	int timer = cleanup_timer;
+
+	if (timer < 1){
+		timer = 1;
+	}else if (timer >= SESSIONTIMERSLOTS){
+		timer = SESSIONTIMERSLOTS - 1;
+	}
+	return (__atomic_load_n(&sessiontimertick, __ATOMIC_RELAXED) + timer) & (SESSIONTIMERSLOTS - 1);
+}
+
+/*
+ * New sessions are first checked cleanup_timer seconds from now.
+ */
+void add_session_timer(struct session *thissession){
+	__u32 slot = next_session_timer();
+
+	pthread_mutex_lock(&sessiontimers[slot].lock);
+	link_session_timer(slot, thissession);
+	pthread_mutex_unlock(&sessiontimers[slot].lock);
+}
+
+/*
+ * The cleanup thread can move the session to another slot
+ * until the lock of the slot it is in is held.
+ */
+void remove_session_timer(struct session *thissession){
+	__u32 slot;
+
+	while ((slot = __atomic_load_n(&thissession->timerslot, __ATOMIC_ACQUIRE)) != SESSIONTIMERNONE){
+		pthread_mutex_lock(&sessiontimers[slot].lock);
+
+		if (thissession->timerslot == slot){
+			unlink_session_timer(thissession);
+			__atomic_store_n(&thissession->timerslot, SESSIONTIMERNONE, __ATOMIC_RELEASE);
+			pthread_mutex_unlock(&sessiontimers[slot].lock);
+			return;
 		}
+		pthread_mutex_unlock(&sessiontimers[slot].lock);
 	}
 }
 
 /*
- * This function runs every 5 or so minuets.
- * It checks each bucket for idle sessions, and
- * will remove the dead ones using the previous function.
+ * Checks the sessions in one slot for idle time.
+ * An idle session gets a keepalive sent to the side that was quiet.
+ * If they fail to respond to the keepalive messages twice the session
+ * is removed.  The others move to the slot cleanup_timer seconds ahead.
+ * Only the cleanup thread takes two slot locks, so it cannot deadlock
+ * with a session being removed.
+ */
+static void checksessiontimers(__u32 slot){
+	struct session *currentsession = NULL;
+	struct session *deadlist = NULL;
+	__u32 nextslot;
+	char message[LOGSZ];
+
+	nextslot = next_session_timer();
+	pthread_mutex_lock(&sessiontimers[slot].lock);
+
+	while ((currentsession = sessiontimers[slot].next) != NULL){
+
+		if (numkeepalives == KEEPALIVEBATCH){ // Send them without holding up workers.
+			pthread_mutex_unlock(&sessiontimers[slot].lock);
+			flushkeepalives();
+			pthread_mutex_lock(&sessiontimers[slot].lock);
+			continue;
+		}
+		unlink_session_timer(currentsession);
+		sessionschecked++;
+
+		if (currentsession->deadcounter > 2){ // This session has failed to respond it is dead.
+			__atomic_store_n(&currentsession->timerslot, SESSIONTIMERNONE, __ATOMIC_RELEASE);
+			currentsession->timernext = deadlist; // Cleared once the slot is unlocked.
+			deadlist = currentsession;
+			continue;
+		}
+
+		if(currentsession->larger.sequence == currentsession->larger.previoussequence){
+			queuekeepalive(currentsession->smaller.address, currentsession->smaller.port, currentsession->smaller.sequence,
+							currentsession->larger.address, currentsession->larger.port, currentsession->larger.sequence);
+
+			currentsession->deadcounter++;
+
+		}else if(currentsession->smaller.sequence == currentsession->smaller.previoussequence){
+			queuekeepalive(currentsession->larger.address, currentsession->larger.port, currentsession->larger.sequence,
+							currentsession->smaller.address, currentsession->smaller.port, currentsession->smaller.sequence);
+
+			currentsession->deadcounter++;
+		}else{
+			currentsession->deadcounter = 0;
+		}
+
+		currentsession->larger.previoussequence = currentsession->larger.sequence;
+		currentsession->smaller.previoussequence = currentsession->smaller.sequence;
+
+		pthread_mutex_lock(&sessiontimers[nextslot].lock);
+		link_session_timer(nextslot, currentsession);
+		pthread_mutex_unlock(&sessiontimers[nextslot].lock);
+	}
+	pthread_mutex_unlock(&sessiontimers[slot].lock);
+	flushkeepalives();
+
+	while (deadlist != NULL){
+		currentsession = deadlist;
+		deadlist = deadlist->timernext; // Read before the session is cleared.
+		clearsession(currentsession);
+		deadsessions++;
+	    sprintf(message, "Dead session removed.\n");
+	    logger2(LOGGING_INFO,DEBUG_SESSION_TRACKING,message);
+	}
+}
+
+/*
+ * This function runs every second.
+ * It checks the sessions whose slot came up for idle time,
+ * catching up on any seconds it slept through.
  */
 void *cleanup_function(void *data){
 	int one = 1;
 	const int *val = &one;
 	char message [LOGSZ];
-	__u32 i = 0;
+	struct timespec start, now;
+	__u32 elapsed = 0;
+	__u32 tick = 0;
 	
 	rawsock = socket(PF_INET, SOCK_RAW, IPPROTO_TCP);
 	
@@ -204,27 +382,38 @@ void *cleanup_function(void *data){
 		exit(EXIT_FAILURE);
 	}
 	
+	rcu_register_thread();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	tick = __atomic_load_n(&sessiontimertick, __ATOMIC_RELAXED);
+
 	while (servicestate >= STOPPING) {
-		sleep(cleanup_timer); // Sleeping for 5 minuets.
-
-		if(dead_session_detection == true){
-		
-			for (i = 0; i < SESSIONBUCKETS; i++){  // Process each bucket.
-		
-				if (getsessionhead(i)->next != NULL){
-    				cleanuplist(getsessionhead(i));
-    			}
-			}
-		}else{
-		    sprintf(message, "Skipping dead session detection.\n");
-		    logger2(LOGGING_INFO,DEBUG_SESSION_TRACKING,message);
+		rcu_thread_offline();
+		sleep(1);
+		rcu_thread_online();
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = now.tv_sec - start.tv_sec;
+
+		if (elapsed - tick > SESSIONTIMERSLOTS){ // Every slot is due, no need to go round twice.
+			tick = elapsed - SESSIONTIMERSLOTS;
 		}
 
+		while ((__s32)(elapsed - tick) > 0){
+
+			if(dead_session_detection == true){
+				checksessiontimers(tick & (SESSIONTIMERSLOTS - 1));
+			}
+			tick++;
+			__atomic_store_n(&sessiontimertick, tick, __ATOMIC_RELAXED);
+		}
+		rcu_quiescent_state();
+		rcu_reclaim(); // Free what was cleared.
 	}
 	
 	/*
 	 * Free any allocated resources before exiting
 	 */
+	rcu_unregister_thread();
 	close(rawsock); // close the socket used for sending keepalives.
 	rawsock = 0;
         
@@ -242,6 +431,12 @@ struct commandresult cli_show_dead_session_detection(int client_fd, char **param
 	}
 	cli_send_feedback(client_fd, msg);
 
+	sprintf(msg, "sessions checked: %llu\nkeepalives sent: %llu\ndead sessions removed: %llu\n",
+			(unsigned long long) sessionschecked,
+			(unsigned long long) keepalivessent,
+			(unsigned long long) deadsessions);
+	cli_send_feedback(client_fd, msg);
+
     result.finished = 0;
     result.mode = NULL;
     result.data = NULL;
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stdbool.h>
 #include <pthread.h> // for multi-threading
 #include <netinet/ip.h> // for tcpmagic and TCP options
@@ -12,39 +13,278 @@
 #include "opennopd.h"
 #include "packet.h"
 #include "compression.h"
+#include "dedup.h"
 #include "csum.h"
 #include "sessionmanager.h"
 #include "tcpoptions.h"
 #include "logger.h"
-#include "quicklz.h"
 #include "memorymanager.h"
 #include "counters.h"
+#include "latency.h"
 #include "climanager.h"
 #include "ipc.h"
+#include "verdict.h"
+#include "fetcher.h"
+#include "rcu.h"
+#include "affinity.h"
+#include "flowoffload.h"
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
 
 struct worker workers[MAXWORKERS]; // setup slots for the max number of workers.
 unsigned char numworkers = 0; // sets number of worker threads. 0 = auto detect.
+static unsigned char startworkers = 0; // Workers started with, the default autoscale maximum.
+static pthread_mutex_t resizelock = PTHREAD_MUTEX_INITIALIZER; // Held while workers are added or retired.
+
+/*
+ * The autoscaler runs after the counters are updated.
+ * Workers are added as soon as they are needed but only
+ * removed after the load stayed low for a while.
+ */
+static int workerautoscale = false;
+static unsigned char autoscalemin = 1;
+static unsigned char autoscalemax = 0; // 0 is the number of workers started with.
+static __u32 autoscaleuppps = WORKERSCALEUPPPS;
+static __u32 autoscaledownpps = WORKERSCALEDOWNPPS;
+static int autoscalequiet = 0; // Checks in a row the load was low.
+static int workerbypass = true; // Fail open when a processor falls behind.
+static u_int32_t bypasshigh = WORKERBYPASSHIGH;
+static u_int32_t bypasslow = WORKERBYPASSLOW;
 int DEBUG_WORKER = false;
 int DEBUG_WORKER_CLI = false;
 int DEBUG_WORKER_COUNTERS = false;
 
+/*
+ * Takes the next batch of packets for this processor.
+ * The rings are always emptied before the packet_head queue is used
+ * so packets of a session that spilled into it stay in order.
+ */
+static u_int32_t refill_processor_batch(struct processor *me) {
+    int i, ring;
+
+    me->batchnext = 0;
+    me->batchlen = 0;
+
+    for (i = 0; (i < me->numrings) && (me->batchlen < WORKERBATCH); i++) {
+        ring = (me->nextring + i) % me->numrings;
+        me->batchlen += ring_dequeue_packets(&me->rings[ring],
+                                             &me->batch[me->batchlen], WORKERBATCH - me->batchlen);
+    }
+
+    if (me->numrings > 0) {
+        me->nextring = (me->nextring + 1) % me->numrings;
+    }
+
+    /*
+     * Only this thread removes packets so qlen cannot drop to 0 under us.
+     */
+    while ((me->batchlen == 0) && (me->queue.qlen > 0)) {
+        me->batch[0] = dequeue_packet(&me->queue, false);
+
+        if (me->batch[0] != NULL) {
+            me->batchlen = 1;
+        }
+    }
+
+    return me->batchlen;
+}
+
+static u_int32_t processor_rings_qlen(struct processor *me) {
+    u_int32_t qlen = 0;
+    int i;
+
+    for (i = 0; i < me->numrings; i++) {
+        qlen += ring_qlen(&me->rings[i]);
+    }
+    return qlen;
+}
+
+/*
+ * Waits on the queue signal until a producer wakes us.
+ * sleeping is set before checking the rings again and the producers
+ * check sleeping after adding a packet so one of us always sees the other.
+ */
+static void sleep_processor(struct processor *me) {
+    pthread_mutex_lock(&me->queue.lock);
+    __atomic_store_n(&me->sleeping, true, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    /*
+     * A stopping processor is signalled under this lock after its state changes.
+     */
+    if ((processor_rings_qlen(me) == 0) && (me->queue.qlen == 0) && (me->state == RUNNING)) {
+        rcu_thread_offline(); // Sessions are not held while sleeping.
+        pthread_cond_wait(&me->queue.signal, &me->queue.lock);
+        rcu_thread_online();
+    }
+
+    __atomic_store_n(&me->sleeping, false, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&me->queue.lock);
+}
+
+static void wake_processor(struct processor *thisprocessor) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&thisprocessor->sleeping, __ATOMIC_RELAXED) == true) {
+        pthread_mutex_lock(&thisprocessor->queue.lock);
+        pthread_cond_signal(&thisprocessor->queue.signal);
+        pthread_mutex_unlock(&thisprocessor->queue.lock);
+    }
+}
+
+/*
+ * Gets the next packet for this processor.
+ * When there is no work the rings are polled for a while before sleeping.
+ * The polling time grows when it finds work and shrinks when it does not.
+ * Can return NULL when woken without work.
+ */
+static struct packet *get_processor_packet(struct processor *me) {
+    u_int32_t spins;
+
+    if (me->batchnext < me->batchlen) {
+        return me->batch[me->batchnext++];
+    }
+
+    if (refill_processor_batch(me) == 0) {
+        /*
+         * Nothing else is waiting so send the verdicts before we wait.
+         */
+        flush_verdicts(&me->verdicts);
+
+        for (spins = 0; spins < me->spin; spins++) {
+
+            if (refill_processor_batch(me) > 0) {
+                break;
+            }
+            cpu_relax();
+        }
+
+        if (me->batchlen > 0) {
+
+            if (me->spin < WORKERSPINMAX) {
+                me->spin *= 2;
+            }
+        } else {
+
+            if (me->spin > WORKERSPINMIN) {
+                me->spin /= 2;
+            }
+            sleep_processor(me);
+            refill_processor_batch(me);
+        }
+    }
+
+    if (me->batchnext < me->batchlen) {
+        return me->batch[me->batchnext++];
+    }
+    return NULL;
+}
+
+/*
+ * Fetchers each own a ring to this processor so it has one producer.
+ * Packets use the packet_head queue when their ring is full or while
+ * older packets are still waiting in it.
+ */
+static int processor_queue_packet(struct processor *thisprocessor, struct packet *thispacket) {
+
+    if ((thispacket != NULL) && (thispacket->fetcher != NULL) &&
+            (thispacket->fetcher->queuenum < thisprocessor->numrings) &&
+            (thisprocessor->queue.qlen == 0)) {
+
+        if (ring_queue_packet(&thisprocessor->rings[thispacket->fetcher->queuenum], thispacket) == 0) {
+            wake_processor(thisprocessor);
+            return 0;
+        }
+    }
+    return queue_packet(&thisprocessor->queue, thispacket);
+}
+
+/*
+ * SYN and SYN/ACK packets set up the session and carry no data to optimize.
+ * Without an accelerator ID in domain this is the first accelerator,
+ * it makes room for its options and tags the packet.
+ */
+static void open_session(__u32 largerIP, struct iphdr *iph, struct tcphdr *tcph,
+                         struct session *thissession, char *remoteID) {
+    __u16 mms;
+
+    if (tcph->ack == 0) {
+        sourceisclient(largerIP, iph, thissession);
+    }
+    updateseq(largerIP, iph, tcph, thissession);
+
+    if ((remoteID == NULL) || verify_neighbor_in_domain(remoteID) == false) { // Accelerator ID was not found.
+        mms = __get_tcp_option((__u8 *)iph,2);
+
+        if (mms > 60) {
+            __set_tcp_option((__u8 *)iph,2,4,mms - 60); // Reduce the MSS.
+            set_nod_header_data((__u8 *)iph, ONOP, get_opennop_id(), OPENNOP_IPC_ID_LENGTH);
+            /*
+             * TCP Window Scale option seemed to break Win7 & Win8 Internet access.
+             */
+            //__set_tcp_option((__u8 *)iph,3,3,G_SCALEWINDOW); // Enable window scale.
+
+            saveacceleratorid(largerIP, (char*)get_opennop_id(), iph, thissession);
+        }
+
+    } else { // Accelerator ID was found and in domain.
+        saveacceleratorid(largerIP, remoteID, iph, thissession);
+    }
+
+    if (tcph->ack == 0) {
+        thissession->state = TCP_SYN_SENT;
+    } else {
+        thissession->state = TCP_ESTABLISHED;
+    }
+}
+
+/*
+ * Another accelerator is optimizing a session this one did not see open.
+ * A packet tagged by an accelerator outside the domain is tagged with this one's ID.
+ */
+static void pick_up_session(__u32 largerIP, struct iphdr *iph, struct session *thissession, char *remoteID) {
+
+    thissession->state = TCP_ESTABLISHED;
+
+    if (verify_neighbor_in_domain(remoteID) == true) {
+        saveacceleratorid(largerIP, remoteID, iph, thissession);
+
+    } else {
+        set_nod_header_data((__u8 *)iph, ONOP, get_opennop_id(), OPENNOP_IPC_ID_LENGTH);
+        saveacceleratorid(largerIP, (char*)get_opennop_id(), iph, thissession);
+    }
+}
+
 void *worker_thread(void *dummyPtr) {
     struct processor *me = NULL;
     struct packet *thispacket = NULL;
     struct session *thissession = NULL;
     struct iphdr *iph = NULL;
     struct tcphdr *tcph = NULL;
+    struct endpoint *source = NULL;
+    struct endpoint *destination = NULL;
+    int resync;
+    int role;
+    int offloaded; // The kernel passes the packets after this one.
     __u32 largerIP, smallerIP;
     __u16 largerIPPort, smallerIPPort;
+    __u16 datalength; // Length of the TCP data before it was optimized.
+    __u64 received, dequeued, started; // Stage timestamps, 0 if the packet is not timed.
     char *remoteID = NULL;
     char message[LOGSZ];
-    qlz_state_compress *state_compress = (qlz_state_compress *) malloc(
-                                             sizeof(qlz_state_compress));
-    qlz_state_decompress *state_decompress = (qlz_state_decompress *) malloc(
-                sizeof(qlz_state_decompress));
+    struct compression_context context;
     me = (struct processor*) dummyPtr;
+    memset(&context, 0, sizeof(context));
 
-    me->lzbuffer = calloc(1, BUFSIZE + 400);
+    /*
+     * Allocated here rather than in create_worker() so a pinned
+     * worker first touches its buffer on its own node.
+     */
+    me->lzbuffer = calloc(1, LZBUFSIZE);
     /* Sharwan J: QuickLZ buffer needs (original data size + 400 bytes) buffer */
 
     if (me->lzbuffer == NULL) {
@@ -57,23 +297,33 @@ void *worker_thread(void *dummyPtr) {
      * Register the worker threads metrics so they get updated.
      */
     register_counter(counter_updateworkermetrics, (t_counterdata) & me->metrics);
+    rcu_register_thread();
 
     if (me->lzbuffer != NULL) {
 
         while (me->state >= STOPPING) {
-
-            thispacket = dequeue_packet(&me->queue, true);
+            /*
+             * The session of the last packet is not used any more
+             * once the verdicts that release it were sent.
+             */
+            if (me->verdicts.count == 0) {
+                rcu_quiescent_state();
+            }
+            thispacket = get_processor_packet(me);
 
             if (thispacket != NULL) { // If a packet was taken from the queue.
+                received = thispacket->received;
+                dequeued = latency_since(&me->latency.stages[LATENCYQUEUE], received);
                 iph = (struct iphdr *) thispacket->data;
                 tcph = (struct tcphdr *) (((u_int32_t *) iph) + iph->ihl);
+                datalength = ntohs(iph->tot_len) - iph->ihl * 4 - tcph->doff * 4;
 
                 if (DEBUG_WORKER == true) {
                     sprintf(message, "Worker: IP Packet length is: %u\n",
                             ntohs(iph->tot_len));
                     logger(LOG_INFO, message);
                 }
-                me->metrics.bytesin += ntohs(iph->tot_len);
+                counters_add(&me->metrics, WORKERBYTESIN, ntohs(iph->tot_len));
 
                 //remoteID = (__u32) __get_tcp_option((__u8 *)iph,30);/* Check what IP address is larger. */
                 remoteID = get_nod_header_data((__u8 *)iph, ONOP).data;
@@ -88,6 +338,14 @@ void *worker_thread(void *dummyPtr) {
 
                 thissession = getsession(largerIP, largerIPPort, smallerIP,smallerIPPort);
 
+                /*
+                 * The session the fetcher counted the packet on is only
+                 * known to be valid if it is still the one in the table.
+                 */
+                if (thispacket->session != thissession) {
+                    thispacket->session = NULL;
+                }
+
                 if (thissession != NULL) {
 
                     if (DEBUG_WORKER == true) {
@@ -95,39 +353,29 @@ void *worker_thread(void *dummyPtr) {
                         logger(LOG_INFO, message);
                     }
 
+                    if (tcph->syn == 1) {
+                        open_session(largerIP, iph, tcph, thissession, remoteID);
+
+                    } else if ((thissession->state == 0) && (tcph->ack == 1) &&
+                               (tcph->fin == 0) && (remoteID != NULL)) {
+                        pick_up_session(largerIP, iph, thissession, remoteID);
+                        remoteID = (char *)get_nod_header_data((__u8 *)iph, ONOP).data;
+                    }
+
                     if ((tcph->syn == 0) && (tcph->ack == 1) && (tcph->fin == 0)) {
+                        role = session_role(largerIP, iph, thissession, remoteID);
 
-                        if ((remoteID == NULL) || verify_neighbor_in_domain(remoteID) == false) {
+                        if ((role == SESSION_ROLE_OPTIMIZE) || (role == SESSION_ROLE_PASSTHROUGH)) {
                             /*
                              * An accelerator ID was NOT found.
                              * This is the first accelerator in the traffic path.
-                             * This will soon be tested against a list of opennop neighbors.
                              * Traffic is sent through the optimize functions.
                              */
 
-                            saveacceleratorid(largerIP, (char*)get_opennop_id(), iph, thissession);
-
-                            //binary_dump("worker.c IP Packet: ", (char*)iph, ntohs(iph->tot_len));
                             //__set_tcp_option((__u8 *)iph,30,6,localID); // Add the Accelerator ID to this packet.
                             set_nod_header_data((__u8 *)iph, ONOP, get_opennop_id(), OPENNOP_IPC_ID_LENGTH);
-                            //binary_dump("worker.c IP Packet: ", (char*)iph, ntohs(iph->tot_len));
-
-                            if ((((iph->saddr == largerIP) &&
-                                    //(thissession->larger.accelerator == localID) &&
-                            		(compare_opennopid((char*)&thissession->larger.accelerator, (char*)get_opennop_id()) == 1) &&
-                                    //(thissession->smaller.accelerator != 0) &&
-                            		(check_opennopid((char*)&thissession->smaller.accelerator) == 1) &&
-                                    //(thissession->smaller.accelerator != localID)) ||
-                            		(compare_opennopid((char*)&thissession->smaller.accelerator, (char*)get_opennop_id()) != 1))
-                            		||
-                                    ((iph->saddr == smallerIP) &&
-                                     //(thissession->smaller.accelerator == localID) &&
-                                    (compare_opennopid((char*)&thissession->smaller.accelerator, (char*)get_opennop_id()) == 1) &&
-                                     //(thissession->larger.accelerator != 0) &&
-                                    (check_opennopid((char*)&thissession->larger.accelerator) == 1) &&
-                                     //(thissession->larger.accelerator != localID))) &&
-                                    (compare_opennopid((char*)&thissession->larger.accelerator, (char*)get_opennop_id()) != 1))) &&
-                                    (thissession->state == TCP_ESTABLISHED)) {
+
+                            if ((role == SESSION_ROLE_OPTIMIZE) && (thissession->state == TCP_ESTABLISHED)) {
 
                                 /*
                                  * Do some acceleration!
@@ -137,8 +385,24 @@ void *worker_thread(void *dummyPtr) {
                                     sprintf(message, "Worker: Compressing packet.\n");
                                     logger(LOG_INFO, message);
                                 }
+                                /*
+                                 * A segment that is not the next one expected is a
+                                 * retransmission so the peer may be missing stream data.
+                                 */
+                                source = (iph->saddr == largerIP) ? &thissession->larger : &thissession->smaller;
+                                destination = (iph->saddr == largerIP) ? &thissession->smaller : &thissession->larger;
+                                resync = (ntohl(tcph->seq) != source->nextsequence);
                                 updateseq(largerIP, iph, tcph, thissession);
-                                tcp_compress((__u8 *)iph, me->lzbuffer,state_compress);
+                                started = (dequeued != 0) ? latency_now() : 0;
+
+                                /*
+                                 * Only peers that said they decode it are sent deduplicated data.
+                                 */
+                                if ((get_compression_peer(&context, thissession, source)->features & OPENNOP_FEATURE_DEDUP) != 0) {
+                                    dedup_encode((__u8 *)iph, me->lzbuffer, destination->accelerator, resync);
+                                }
+                                tcp_compress((__u8 *)iph, me->lzbuffer, &context, thissession, source, resync);
+                                latency_since(&me->latency.stages[LATENCYCODEC], started);
                             } else {
 
                             	 updateseq(largerIP, iph, tcph, thissession);
@@ -151,38 +415,37 @@ void *worker_thread(void *dummyPtr) {
                             /*
                              * End of what should be the optimize function.
                              */
-                        } else if(verify_neighbor_in_domain(remoteID) == true) {
+                        } else {
                             /*
                              * An accelerator ID WAS found.
                              * Traffic is sent through the de-optimize functions.
                              */
 
-                            saveacceleratorid(largerIP, remoteID, iph, thissession);
-
-                            if (__get_tcp_option((__u8 *)iph,31) != 0) { // Packet is flagged as compressed.
+                            if ((__get_tcp_option((__u8 *)iph,31) != 0) ||
+                                    (__get_tcp_option((__u8 *)iph,DEDUPOPTION) != 0)) { // Packet is flagged as compressed or deduplicated.
 
                                 if (DEBUG_WORKER == true) {
                                     sprintf(message, "Worker: Packet is compressed.\n");
                                     logger(LOG_INFO, message);
                                 }
 
-                                if (((iph->saddr == largerIP) &&
-                                        //(thissession->smaller.accelerator == localID)) ||
-                                		(compare_opennopid((char*)&thissession->smaller.accelerator, (char*)get_opennop_id()) == 1))||
-                                        ((iph->saddr == smallerIP) &&
-                                         //(thissession->larger.accelerator == localID))) {
-                                        (compare_opennopid((char*)&thissession->larger.accelerator, (char*)get_opennop_id()) == 1))) {
+                                if (role == SESSION_ROLE_DEOPTIMIZE) {
 
                                     /*
                                      * Decompress this packet!
                                      */
-                                    if (tcp_decompress((__u8 *)iph, me->lzbuffer, state_decompress) == 0) { // Decompression failed if 0.
-                                        nfq_set_verdict(thispacket->hq, thispacket->id, NF_DROP, 0, NULL); // Decompression failed drop.
-                                        put_freepacket_buffer(thispacket);
+                                    source = (iph->saddr == largerIP) ? &thissession->larger : &thissession->smaller;
+                                    started = (dequeued != 0) ? latency_now() : 0;
+
+                                    if (((__get_tcp_option((__u8 *)iph,31) != 0) &&
+                                            (tcp_decompress((__u8 *)iph, me->lzbuffer, &context, thissession, source) == 0)) ||
+                                            (dedup_decode((__u8 *)iph, me->lzbuffer, source->accelerator) == 0)) { // Decompression failed if 0.
+                                        set_packet_verdict(&me->verdicts, thispacket, NF_DROP, 0, NULL); // Decompression failed drop.
                                         thispacket = NULL;
                                     }else{
                                     	updateseq(largerIP, iph, tcph, thissession); // Only update the sequence after decompression.
                                     }
+                                    latency_since(&me->latency.stages[LATENCYCODEC], started);
                                 }
                             }else{
                             	updateseq(largerIP, iph, tcph, thissession); // Also update sequences if packet is not optimized.
@@ -207,33 +470,62 @@ void *worker_thread(void *dummyPtr) {
                         thissession = closingsession(tcph, thissession);
                     }
 
+                    /*
+                     * Neither end has an accelerator so the kernel module
+                     * can pass the rest of the session without queuing it.
+                     * This packet is the only one of the session still waiting
+                     * so its verdict is sent right away.
+                     */
+                    offloaded = (thissession != NULL) && (tcph->syn == 0) && (tcph->fin == 0) &&
+                            (tcph->rst == 0) &&
+                            (offload_session(thissession, ((thispacket != NULL) &&
+                            (thispacket->session == thissession)) ? 1 : 0) == true);
+
+                    if (offloaded == true) {
+                        thissession = clearsession(thissession);
+                    }
+
                     if (thispacket != NULL) {
                         /*
-                         * Changing anything requires the IP and TCP
-                         * checksum to need recalculated.
+                         * Header edits update the checksums as they are made.
+                         * Compression and dedup always change the length of
+                         * the TCP data they rewrite so only then are the
+                         * checksums recalculated.
                          */
-                        checksum(thispacket->data);
-                        me->metrics.bytesout += ntohs(iph->tot_len);
-                        nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, ntohs(iph->tot_len), (unsigned char *)thispacket->data);
-                        put_freepacket_buffer(thispacket);
+                        if ((ntohs(iph->tot_len) - iph->ihl * 4 - tcph->doff * 4) != datalength) {
+                            checksum(thispacket->data);
+                        }
+                        counters_add(&me->metrics, WORKERBYTESOUT, ntohs(iph->tot_len));
+                        set_packet_verdict(&me->verdicts, thispacket, NF_ACCEPT, ntohs(iph->tot_len), (unsigned char *)thispacket->data);
                         thispacket = NULL;
+
+                        if (offloaded == true) {
+                            flush_verdicts(&me->verdicts);
+                        }
                     }
 
                 } /* End NULL session check. */
                 else { /* Session was NULL. */
-                    me->metrics.bytesout += ntohs(iph->tot_len);
-                    nfq_set_verdict(thispacket->hq, thispacket->id, NF_ACCEPT, 0, NULL);
-                    put_freepacket_buffer(thispacket);
+                    counters_add(&me->metrics, WORKERBYTESOUT, ntohs(iph->tot_len));
+                    set_packet_verdict(&me->verdicts, thispacket, NF_ACCEPT, 0, NULL);
                     thispacket = NULL;
                 }
-                me->metrics.packets++;
+                counters_add(&me->metrics, WORKERPACKETS, 1);
+
+                if (dequeued != 0) {
+                    latency_record(&me->latency.stages[LATENCYTOTAL],
+                                   latency_since(&me->latency.stages[LATENCYPROCESS], dequeued) - received);
+                }
             } /* End NULL packet check. */
         } /* End working loop. */
+        flush_verdicts(&me->verdicts);
+        release_packet_magazine();
+        un_register_counter(counter_updateworkermetrics, (t_counterdata) & me->metrics);
         free(me->lzbuffer);
-        free(state_compress);
-        free(state_decompress);
+        release_compression_context(&context);
         me->lzbuffer = NULL;
     }
+    rcu_unregister_thread();
     return NULL;
 }
 
@@ -241,34 +533,53 @@ void *worker_thread(void *dummyPtr) {
  * Returns how many workers should be running.
  */
 unsigned char get_workers(void) {
-    return numworkers;
+    return __atomic_load_n(&numworkers, __ATOMIC_ACQUIRE);
 }
 
 /*
- * Sets how many workers should be running.
+ * Sets how many workers should be running at startup.
+ * Use resize_workers() once they are running.
  */
 void set_workers(unsigned char desirednumworkers) {
     numworkers = desirednumworkers;
+    startworkers = desirednumworkers;
+}
+
+/*
+ * Totals the verdict batches sent by all the workers.
+ */
+void get_worker_verdict_counters(__u64 *batches, __u64 *verdicts) {
+    struct counter_snapshot optimization, deoptimization;
+    int i;
+
+    *batches = 0;
+    *verdicts = 0;
+
+    for (i = 0; i < get_workers(); i++) {
+        counters_snapshot(&workers[i].optimization.metrics, &optimization);
+        counters_snapshot(&workers[i].deoptimization.metrics, &deoptimization);
+        *batches += optimization.values[WORKERVERDICTBATCHES] + deoptimization.values[WORKERVERDICTBATCHES];
+        *verdicts += optimization.values[WORKERVERDICTS] + deoptimization.values[WORKERVERDICTS];
+    }
 }
 
+/*
+ * The session counters are only statistics now that
+ * the session hash picks the worker.
+ */
 u_int32_t get_worker_sessions(int i) {
-    u_int32_t sessions;
-    pthread_mutex_lock(&workers[i].lock);
-    sessions = workers[i].sessions;
-    pthread_mutex_unlock(&workers[i].lock);
-    return sessions;
+    return __atomic_load_n(&workers[i].sessions, __ATOMIC_RELAXED);
 }
 
-void increment_worker_sessions(int i) {
+struct latency_stats *get_processor_latency(int worker, int deoptimization) {
+    return (deoptimization == true) ? &workers[worker].deoptimization.latency : &workers[worker].optimization.latency;
+}
 
-    pthread_mutex_lock(&workers[i].lock); // Grab lock on worker.
-    workers[i].sessions += 1;
-    pthread_mutex_unlock(&workers[i].lock); // Lose lock on worker.
+void increment_worker_sessions(int i) {
+    __atomic_add_fetch(&workers[i].sessions, 1, __ATOMIC_RELAXED);
 }
 void decrement_worker_sessions(int i) {
-    pthread_mutex_lock(&workers[i].lock); // Grab lock on worker.
-    workers[i].sessions -= 1;
-    pthread_mutex_unlock(&workers[i].lock); // Lose lock on worker.
+    __atomic_sub_fetch(&workers[i].sessions, 1, __ATOMIC_RELAXED);
 }
 
 void create_worker(int i) {
@@ -278,11 +589,251 @@ void create_worker(int i) {
     pthread_mutex_lock(&workers[i].lock);
     workers[i].sessions = 0;
     pthread_mutex_unlock(&workers[i].lock);
-    pthread_create(&workers[i].optimization.t_processor, NULL, worker_thread,
-                   (void *) &workers[i].optimization);
-    pthread_create(&workers[i].deoptimization.t_processor, NULL, worker_thread,
-                   (void *) &workers[i].deoptimization);
-    set_worker_state_running(&workers[i]);
+    set_worker_state_running(&workers[i]); // A slot of a retired worker is still stopped.
+    create_pinned_thread(&workers[i].optimization.t_processor, get_processor_cpu(i, false),
+                         worker_thread, (void *) &workers[i].optimization);
+    create_pinned_thread(&workers[i].deoptimization.t_processor, get_processor_cpu(i, true),
+                         worker_thread, (void *) &workers[i].deoptimization);
+}
+
+/*
+ * Gives the packets a stopped processor did not get to
+ * to another processor in the order they arrived.
+ * Packets in the rings are older than those in the queue.
+ */
+static u_int32_t hand_over_packets(struct processor *from, struct processor *to) {
+    struct packet *packets[WORKERBATCH];
+    u_int32_t count, moved = 0;
+    u_int32_t i;
+    int ring;
+
+    while (from->batchnext < from->batchlen) {
+        queue_packet(&to->queue, from->batch[from->batchnext++]);
+        moved++;
+    }
+
+    for (ring = 0; ring < from->numrings; ring++) {
+
+        while ((count = ring_dequeue_packets(&from->rings[ring], packets, WORKERBATCH)) > 0) {
+
+            for (i = 0; i < count; i++) {
+                queue_packet(&to->queue, packets[i]);
+            }
+            moved += count;
+        }
+    }
+    moved += move_queued_packets(&from->queue, &to->queue);
+    wake_processor(to);
+
+    return moved;
+}
+
+/*
+ * Stops the thread of a processor that is being retired
+ * and hands what is left in its rings and queue to successor.
+ */
+static u_int32_t retire_worker_processor(struct processor *thisprocessor, struct processor *successor) {
+    u_int32_t moved;
+
+    pthread_mutex_lock(&thisprocessor->queue.lock);
+    pthread_cond_signal(&thisprocessor->queue.signal);
+    pthread_mutex_unlock(&thisprocessor->queue.lock);
+    pthread_join(thisprocessor->t_processor, NULL);
+    moved = hand_over_packets(thisprocessor, successor);
+    free(thisprocessor->rings);
+    thisprocessor->rings = NULL;
+    thisprocessor->numrings = 0;
+
+    return moved;
+}
+
+/*
+ * Grows or shrinks the worker pool while packets are flowing.
+ * New workers start taking new sessions once they are running.
+ * To retire a worker the fetchers are held so nothing new reaches it,
+ * its threads stop and its waiting packets and sessions go to a worker
+ * that stays, so a session is still only changed by one thread at a time.
+ * Returns the number of workers now running.
+ */
+unsigned char resize_workers(unsigned char desirednumworkers) {
+    unsigned char current;
+    unsigned char successor;
+    u_int32_t packets = 0, sessions = 0;
+    int i;
+    char message[LOGSZ];
+
+    if (desirednumworkers < 1) {
+        desirednumworkers = 1;
+    }
+
+    pthread_mutex_lock(&resizelock);
+    current = get_workers();
+
+    if (desirednumworkers > current) {
+
+        for (i = current; i < desirednumworkers; i++) {
+            create_worker(i);
+        }
+        __atomic_store_n(&numworkers, desirednumworkers, __ATOMIC_RELEASE);
+
+    } else if (desirednumworkers < current) {
+        pause_fetchers();
+        __atomic_store_n(&numworkers, desirednumworkers, __ATOMIC_RELEASE); // New sessions skip the retiring workers.
+
+        for (i = desirednumworkers; i < current; i++) {
+            successor = i % desirednumworkers;
+            set_worker_state_stopped(&workers[i]);
+            packets += retire_worker_processor(&workers[i].optimization, &workers[successor].optimization);
+            packets += retire_worker_processor(&workers[i].deoptimization, &workers[successor].deoptimization);
+            sessions += move_worker_sessions(i, successor);
+        }
+        resume_fetchers();
+    }
+
+    if (desirednumworkers != current) {
+        sprintf(message, "Worker: Resized from %u to %u workers, moved %u sessions and %u packets.\n",
+                current, desirednumworkers, sessions, packets);
+        logger(LOG_INFO, message);
+    }
+    pthread_mutex_unlock(&resizelock);
+
+    return desirednumworkers;
+}
+
+/*
+ * Adds workers when the average pps of a worker or the packets waiting
+ * for any processor are over the limits and removes one when the
+ * average stayed under the lower limit for WORKERSCALEQUIETCHECKS checks.
+ * Called by the counters thread after the pps are updated.
+ */
+void autoscale_workers(void) {
+    unsigned char current, desired, maximum;
+    __u64 totalpps = 0, workerpps;
+    u_int32_t waiting, mostwaiting = 0;
+    int i;
+
+    if (workerautoscale == false) {
+        autoscalequiet = 0;
+        return;
+    }
+
+    current = get_workers();
+    maximum = (autoscalemax > 0) ? autoscalemax : startworkers;
+
+    if (maximum < autoscalemin) {
+        maximum = autoscalemin;
+    }
+
+    for (i = 0; i < current; i++) {
+        totalpps += counter_rate(&workers[i].optimization.metrics, WORKERPACKETS, COUNTERWINDOW) +
+                    counter_rate(&workers[i].deoptimization.metrics, WORKERPACKETS, COUNTERWINDOW);
+        waiting = processor_rings_qlen(&workers[i].optimization) + workers[i].optimization.queue.qlen;
+
+        if (waiting > mostwaiting) {
+            mostwaiting = waiting;
+        }
+        waiting = processor_rings_qlen(&workers[i].deoptimization) + workers[i].deoptimization.queue.qlen;
+
+        if (waiting > mostwaiting) {
+            mostwaiting = waiting;
+        }
+    }
+    workerpps = (current > 0) ? totalpps / current : 0;
+    desired = current;
+
+    if (current < autoscalemin) {
+        desired = autoscalemin;
+
+    } else if ((current < maximum) && ((workerpps > autoscaleuppps) || (mostwaiting > WORKERSCALEQLEN))) {
+        desired = current + 1;
+
+        if ((autoscaleuppps > 0) && (totalpps / autoscaleuppps + 1 > desired)) {
+            desired = (totalpps / autoscaleuppps + 1 > maximum) ? maximum : totalpps / autoscaleuppps + 1;
+        }
+        autoscalequiet = 0;
+
+    } else if ((current > autoscalemin) && (workerpps < autoscaledownpps)) {
+        autoscalequiet++;
+
+        if (autoscalequiet >= WORKERSCALEQUIETCHECKS) {
+            desired = current - 1;
+            autoscalequiet = 0;
+        }
+    } else {
+        autoscalequiet = 0;
+    }
+
+    if (desired != current) {
+        resize_workers(desired);
+    }
+}
+
+/*
+ * Fails open when a processor falls behind.
+ * Once its backlog passes the high mark the fetchers accept the data
+ * packets the worker would pass on unchanged instead of queueing them,
+ * until the backlog is back under the low mark.
+ * Packets of sessions this accelerator compresses or decompresses still
+ * go to the worker so the streams on both ends stay in step.
+ * Passthrough packets only miss the accelerator tag no neighbor reads.
+ * Sessions with packets still waiting for the worker or their verdict
+ * keep queueing so a bypassed packet never overtakes one of them.
+ * started is set if this call turned the bypass on, the fetchers
+ * count that and the packets they accepted in their own counters.
+ * Returns true if the fetcher should accept the packet as it is.
+ */
+int bypass_packet(__u8 queue, int deoptimize, __u32 largerIP, struct iphdr *iph,
+                  struct tcphdr *tcph, struct session *thissession, char *remoteID, int *started) {
+    struct processor *thisprocessor;
+    u_int32_t backlog;
+
+    if (workerbypass == false) {
+        return false;
+    }
+
+    thisprocessor = (deoptimize == true) ? &workers[queue].deoptimization : &workers[queue].optimization;
+    backlog = processor_rings_qlen(thisprocessor) + thisprocessor->queue.qlen;
+
+    if (__atomic_load_n(&thisprocessor->bypassing, __ATOMIC_RELAXED) == false) {
+
+        if (backlog < bypasshigh) {
+            return false;
+        }
+
+        if (__atomic_exchange_n(&thisprocessor->bypassing, true, __ATOMIC_RELAXED) == false) {
+            *started = true;
+        }
+
+    } else if (backlog <= bypasslow) {
+        __atomic_store_n(&thisprocessor->bypassing, false, __ATOMIC_RELAXED);
+        return false;
+    }
+
+    if ((tcph->syn == 1) || (tcph->fin == 1) || (tcph->rst == 1) || (tcph->ack == 0) ||
+            (thissession->state != TCP_ESTABLISHED) ||
+            (ntohs(iph->tot_len) - iph->ihl * 4 - tcph->doff * 4 == 0) ||
+            (__atomic_load_n(&thissession->queued, __ATOMIC_ACQUIRE) != 0)) {
+        return false;
+    }
+
+    switch (cached_session_role(largerIP, iph, thissession, remoteID)) {
+    case SESSION_ROLE_PASSTHROUGH:
+    case SESSION_ROLE_RELAY:
+        break;
+
+    case SESSION_ROLE_DEOPTIMIZE:
+
+        if ((__get_tcp_option((__u8 *)iph,31) != 0) ||
+                (__get_tcp_option((__u8 *)iph,DEDUPOPTION) != 0)) {
+            return false;
+        }
+        break;
+
+    default:
+        return false;
+    }
+
+    return true;
 }
 
 void shutdown_workers() {
@@ -300,6 +851,8 @@ void rejoin_worker(int i) {
 }
 
 void initialize_worker_processor(struct processor *thisprocessor) {
+    int i;
+
     pthread_cond_init(&thisprocessor->queue.signal, NULL); // Initialize the thread signal.
     pthread_mutex_init(&thisprocessor->queue.lock, NULL); // Initialize the queue lock.
     pthread_mutex_lock(&thisprocessor->queue.lock);
@@ -307,6 +860,28 @@ void initialize_worker_processor(struct processor *thisprocessor) {
     thisprocessor->queue.prev = NULL;
     thisprocessor->queue.qlen = 0;
     pthread_mutex_unlock(&thisprocessor->queue.lock);
+    initialize_verdict_batch(&thisprocessor->verdicts, &thisprocessor->metrics,
+            WORKERVERDICTBATCHES, WORKERVERDICTS);
+
+    thisprocessor->sleeping = false;
+    thisprocessor->bypassing = false;
+    thisprocessor->spin = WORKERSPINMIN;
+    thisprocessor->batchlen = 0;
+    thisprocessor->batchnext = 0;
+    thisprocessor->nextring = 0;
+    thisprocessor->numrings = 0;
+    thisprocessor->rings = NULL;
+
+    if (posix_memalign((void **) &thisprocessor->rings, 64,
+                       get_fetchers() * sizeof(struct packet_ring)) == 0) {
+
+        for (i = 0; i < get_fetchers(); i++) {
+            initialize_packet_ring(&thisprocessor->rings[i]);
+        }
+        thisprocessor->numrings = get_fetchers();
+    } else {
+        thisprocessor->rings = NULL; // Every packet will use the packet_head queue.
+    }
 }
 
 void joining_worker_processor(struct processor *thisprocessor) {
@@ -314,6 +889,9 @@ void joining_worker_processor(struct processor *thisprocessor) {
     pthread_cond_signal(&thisprocessor->queue.signal);
     pthread_mutex_unlock(&thisprocessor->queue.lock);
     pthread_join(thisprocessor->t_processor, NULL);
+    free(thisprocessor->rings);
+    thisprocessor->rings = NULL;
+    thisprocessor->numrings = 0;
 }
 
 void set_worker_state_running(struct worker *thisworker) {
@@ -331,35 +909,52 @@ void set_worker_state_stopped(struct worker *thisworker) {
 }
 
 int optimize_packet(__u8 queue, struct packet *thispacket) {
-    return queue_packet(&workers[queue].optimization.queue, thispacket);
+    return processor_queue_packet(&workers[queue].optimization, thispacket);
 }
 
 int deoptimize_packet(__u8 queue, struct packet *thispacket) {
-    return queue_packet(&workers[queue].deoptimization.queue, thispacket);
+    return processor_queue_packet(&workers[queue].deoptimization, thispacket);
+}
+
+/*
+ * Reads a CLI parameter that must be a whole number from 1 to max.
+ * Returns 0 if it is not.
+ */
+static unsigned long parse_worker_parameter(char *parameter, unsigned long max) {
+    char *end = NULL;
+    unsigned long value;
+
+    value = strtoul(parameter, &end, 10);
+
+    if ((end == parameter) || (*end != '\0') || (value > max)) {
+        return 0;
+    }
+    return value;
 }
 
 struct commandresult cli_show_workers(int client_fd, char **parameters, int numparameters, void *data) {
     int i;
-    __u32 ppsbps;
-    __u32 total_optimization_pps = 0, total_optimization_bpsin = 0,
+    __u64 ppsbps;
+    __u64 total_optimization_pps = 0, total_optimization_bpsin = 0,
                                    total_optimization_bpsout = 0;
-    __u32 total_deoptimization_pps = 0, total_deoptimization_bpsin = 0,
+    __u64 total_deoptimization_pps = 0, total_deoptimization_bpsin = 0,
                                      total_deoptimization_bpsout = 0;
+    unsigned long window = COUNTERWINDOW;
     struct commandresult result  = { 0 };
     char msg[MAX_BUFFER_SIZE] = { 0 };
     char message[LOGSZ];
-    char bps[11];
-    char optimizationbpsin[9];
-    char optimizationbpsout[9];
-    char deoptimizationbpsin[9];
-    char deoptimizationbpsout[9];
+    char bps[24];
+    char optimizationbpsin[24];
+    char optimizationbpsout[24];
+    char deoptimizationbpsin[24];
+    char deoptimizationbpsout[24];
     char col1[11];
-    char col2[9];
-    char col3[14];
-    char col4[14];
-    char col5[9];
-    char col6[14];
-    char col7[14];
+    char col2[24];
+    char col3[28];
+    char col4[28];
+    char col5[24];
+    char col6[28];
+    char col7[28];
     char col8[3];
 
     if (DEBUG_WORKER_CLI == true) {
@@ -367,13 +962,28 @@ struct commandresult cli_show_workers(int client_fd, char **parameters, int nump
         logger(LOG_INFO, message);
     }
 
+    if (numparameters == 1) {
+        window = parse_worker_parameter(parameters[0], (COUNTERHISTORY * COUNTERINTERVAL) - 1);
+    }
+
+    if ((numparameters > 1) || (window == 0)) {
+        sprintf(msg, "Usage: show workers [1-%u]\n", (COUNTERHISTORY * COUNTERINTERVAL) - 1);
+        cli_send_feedback(client_fd, msg);
+
+        result.finished = 0;
+        result.mode = NULL;
+        result.data = NULL;
+
+        return result;
+    }
+
     sprintf(
         msg,
         "-------------------------------------------------------------------------------\n");
     cli_send_feedback(client_fd, msg);
     sprintf(
         msg,
-        "|  5 sec  |          optimization           |          deoptimization         |\n");
+        "| %3lu sec |          optimization           |          deoptimization         |\n", window);
     cli_send_feedback(client_fd, msg);
     sprintf(
         msg,
@@ -395,35 +1005,35 @@ struct commandresult cli_show_workers(int client_fd, char **parameters, int nump
         sprintf(col1, "|    %-5i", i);
         strcat(msg, col1);
 
-        ppsbps = workers[i].optimization.metrics.pps;
+        ppsbps = counter_rate(&workers[i].optimization.metrics, WORKERPACKETS, window);
         total_optimization_pps += ppsbps;
-        sprintf(col2, "| %-6u", ppsbps);
+        sprintf(col2, "| %-6llu", ppsbps);
         strcat(msg, col2);
 
-        ppsbps = workers[i].optimization.metrics.bpsin;
+        ppsbps = counter_rate(&workers[i].optimization.metrics, WORKERBYTESIN, window);
         total_optimization_bpsin += ppsbps;
         bytestostringbps(bps, ppsbps);
         sprintf(col3, "| %-11s", bps);
         strcat(msg, col3);
 
-        ppsbps = workers[i].optimization.metrics.bpsout;
+        ppsbps = counter_rate(&workers[i].optimization.metrics, WORKERBYTESOUT, window);
         total_optimization_bpsout += ppsbps;
         bytestostringbps(bps, ppsbps);
         sprintf(col4, "| %-11s", bps);
         strcat(msg, col4);
 
-        ppsbps = workers[i].deoptimization.metrics.pps;
+        ppsbps = counter_rate(&workers[i].deoptimization.metrics, WORKERPACKETS, window);
         total_deoptimization_pps += ppsbps;
-        sprintf(col5, "| %-6u", ppsbps);
+        sprintf(col5, "| %-6llu", ppsbps);
         strcat(msg, col5);
 
-        ppsbps = workers[i].deoptimization.metrics.bpsin;
+        ppsbps = counter_rate(&workers[i].deoptimization.metrics, WORKERBYTESIN, window);
         total_deoptimization_bpsin += ppsbps;
         bytestostringbps(bps, ppsbps);
         sprintf(col6, "| %-11s", bps);
         strcat(msg, col6);
 
-        ppsbps = workers[i].deoptimization.metrics.bpsout;
+        ppsbps = counter_rate(&workers[i].deoptimization.metrics, WORKERBYTESOUT, window);
         total_deoptimization_bpsout += ppsbps;
         bytestostringbps(bps, ppsbps);
         sprintf(col7, "| %-11s", bps);
@@ -442,7 +1052,7 @@ struct commandresult cli_show_workers(int client_fd, char **parameters, int nump
     bytestostringbps(optimizationbpsout, total_optimization_bpsout);
     bytestostringbps(deoptimizationbpsin, total_deoptimization_bpsin);
     bytestostringbps(deoptimizationbpsout, total_deoptimization_bpsout);
-    sprintf(msg, "|  total  | %-6u| %-11s| %-11s| %-6u| %-11s| %-11s|\n",
+    sprintf(msg, "|  total  | %-6llu| %-11s| %-11s| %-6llu| %-11s| %-11s|\n",
             total_optimization_pps, optimizationbpsin, optimizationbpsout,
             total_deoptimization_pps, deoptimizationbpsin, deoptimizationbpsout);
     cli_send_feedback(client_fd, msg);
@@ -459,29 +1069,259 @@ struct commandresult cli_show_workers(int client_fd, char **parameters, int nump
     return result;
 }
 
+struct commandresult cli_worker_count(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    unsigned long count = 0;
+
+    if (numparameters == 1) {
+        count = parse_worker_parameter(parameters[0], MAXWORKERS);
+    }
+
+    if (count > 0) {
+        sprintf(msg, "workers %u\n", resize_workers(count));
+    } else {
+        sprintf(msg, "Usage: worker count <1-%u>\n", MAXWORKERS);
+    }
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_worker_autoscale_enable(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    workerautoscale = true;
+    sprintf(msg, "worker autoscale enabled\n");
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_worker_autoscale_disable(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    workerautoscale = false;
+    sprintf(msg, "worker autoscale disabled\n");
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+/*
+ * Sets the fewest and most workers the autoscaler runs.
+ *
+ * @param numparameters [in] Should be 2, the minimum then the maximum.
+ */
+struct commandresult cli_worker_autoscale_range(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    unsigned long minimum = 0, maximum = 0;
+
+    if (numparameters == 2) {
+        minimum = parse_worker_parameter(parameters[0], MAXWORKERS);
+        maximum = parse_worker_parameter(parameters[1], MAXWORKERS);
+    }
+
+    if ((minimum > 0) && (maximum >= minimum)) {
+        autoscalemin = minimum;
+        autoscalemax = maximum;
+        sprintf(msg, "worker autoscale range %lu %lu\n", minimum, maximum);
+    } else {
+        sprintf(msg, "Usage: worker autoscale range <minimum> <maximum>\n");
+    }
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+/*
+ * Sets the average pps of a worker that adds a worker and the one that removes one.
+ *
+ * @param numparameters [in] Should be 2, the upper then the lower limit.
+ */
+struct commandresult cli_worker_autoscale_pps(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    unsigned long up = 0, down = 0;
+
+    if (numparameters == 2) {
+        up = parse_worker_parameter(parameters[0], 0xffffffffUL);
+        down = parse_worker_parameter(parameters[1], 0xffffffffUL);
+    }
+
+    if ((up > 0) && (down > 0) && (down < up)) {
+        autoscaleuppps = up;
+        autoscaledownpps = down;
+        sprintf(msg, "worker autoscale pps %lu %lu\n", up, down);
+    } else {
+        sprintf(msg, "Usage: worker autoscale pps <add above> <remove below>\n");
+    }
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_show_worker_autoscale(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+
+    sprintf(msg, "autoscale: %s\n", (workerautoscale == true) ? "enabled" : "disabled");
+    cli_send_feedback(client_fd, msg);
+    sprintf(msg, "workers: %u started with: %u\n", get_workers(), startworkers);
+    cli_send_feedback(client_fd, msg);
+    sprintf(msg, "range: %u to %u\n", autoscalemin,
+            (autoscalemax > 0) ? autoscalemax : startworkers);
+    cli_send_feedback(client_fd, msg);
+    sprintf(msg, "add above: %u pps or %u waiting packets\n", autoscaleuppps, WORKERSCALEQLEN);
+    cli_send_feedback(client_fd, msg);
+    sprintf(msg, "remove below: %u pps for %u updates\n", autoscaledownpps, WORKERSCALEQUIETCHECKS);
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_worker_bypass_enable(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    workerbypass = true;
+    sprintf(msg, "worker bypass enabled\n");
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_worker_bypass_disable(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    int i;
+
+    workerbypass = false;
+
+    for (i = 0; i < get_workers(); i++) {
+        workers[i].optimization.bypassing = false;
+        workers[i].deoptimization.bypassing = false;
+    }
+    sprintf(msg, "worker bypass disabled\n");
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+/*
+ * Sets the backlog of a processor that starts and ends the bypass.
+ *
+ * @param numparameters [in] Should be 2, the high then the low mark.
+ */
+struct commandresult cli_worker_bypass_watermarks(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    unsigned long high = 0, low = 0;
+
+    if (numparameters == 2) {
+        high = parse_worker_parameter(parameters[0], 0xffffffffUL);
+        low = parse_worker_parameter(parameters[1], 0xffffffffUL);
+    }
+
+    if ((high > 0) && (low > 0) && (low < high)) {
+        bypasshigh = high;
+        bypasslow = low;
+        sprintf(msg, "worker bypass watermarks %lu %lu\n", high, low);
+    } else {
+        sprintf(msg, "Usage: worker bypass watermarks <high> <low>\n");
+    }
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
+struct commandresult cli_show_worker_bypass(int client_fd, char **parameters, int numparameters, void *data) {
+    struct commandresult result = { 0 };
+    char msg[MAX_BUFFER_SIZE] = { 0 };
+    struct processor *thisprocessor;
+    __u64 events, packets;
+    int i;
+
+    sprintf(msg, "bypass: %s high: %u low: %u\n", (workerbypass == true) ? "enabled" : "disabled",
+            bypasshigh, bypasslow);
+    cli_send_feedback(client_fd, msg);
+    sprintf(msg, "--------------------------------------------\n");
+    cli_send_feedback(client_fd, msg);
+    sprintf(msg, "| worker |  processor   | waiting | bypass |\n");
+    cli_send_feedback(client_fd, msg);
+    sprintf(msg, "--------------------------------------------\n");
+    cli_send_feedback(client_fd, msg);
+
+    for (i = 0; i < get_workers(); i++) {
+        thisprocessor = &workers[i].optimization;
+        sprintf(msg, "| %-7i| optimize     | %-8u| %-7s|\n", i,
+                processor_rings_qlen(thisprocessor) + thisprocessor->queue.qlen,
+                (thisprocessor->bypassing == true) ? "on" : "off");
+        cli_send_feedback(client_fd, msg);
+        thisprocessor = &workers[i].deoptimization;
+        sprintf(msg, "| %-7i| deoptimize   | %-8u| %-7s|\n", i,
+                processor_rings_qlen(thisprocessor) + thisprocessor->queue.qlen,
+                (thisprocessor->bypassing == true) ? "on" : "off");
+        cli_send_feedback(client_fd, msg);
+    }
+    sprintf(msg, "--------------------------------------------\n");
+    cli_send_feedback(client_fd, msg);
+
+    get_fetcher_bypass_counters(&events, &packets);
+    sprintf(msg, "bypass events: %llu packets: %llu\n", events, packets);
+    cli_send_feedback(client_fd, msg);
+
+    result.finished = 0;
+    result.mode = NULL;
+    result.data = NULL;
+
+    return result;
+}
+
 void counter_updateworkermetrics(t_counterdata data) {
-    struct workercounters *metrics;
     char message[LOGSZ];
-    __u32 counter;
 
     if (DEBUG_WORKER_COUNTERS == true) {
         sprintf(message, "Worker: Updating metrics!");
         logger(LOG_INFO, message);
     }
-
-    metrics = (struct workercounters*) data;
-    counter = metrics->packets;
-    metrics->pps = calculate_ppsbps(metrics->packetsprevious, counter);
-    metrics->packetsprevious = counter;
-
-    counter = metrics->bytesin;
-    metrics->bpsin = calculate_ppsbps(metrics->bytesinprevious, counter);
-    metrics->bytesinprevious = counter;
-
-    counter = metrics->bytesout;
-    metrics->bpsout = calculate_ppsbps(metrics->bytesoutprevious, counter);
-    metrics->bytesoutprevious = counter;
-
+    counters_record((struct counters *) data);
 }
 
 struct session *closingsession(struct tcphdr *tcph, struct session *thissession) {
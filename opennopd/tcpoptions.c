@@ -9,6 +9,7 @@
 #include "tcpoptions.h"
 #include "logger.h"
 #include "ipc.h"
+#include "csum.h"
 
 #define	NOD	33 //* TCP Option # used by Network Optimization Detection.
 #define NOD_MIN_LENGTH 2
@@ -500,7 +501,7 @@ struct hdrdata get_nod_header_data(__u8 *ippacket, const char *id){
 	return hdrdta;
 }
 
-void set_nod_header_data(__u8 *ippacket, const char *id, __u8 *header_data, __u8 header_data_length){
+static void write_nod_header_data(__u8 *ippacket, const char *id, __u8 *header_data, __u8 header_data_length){
 	struct iphdr *iph;
 	struct tcphdr *tcph;
 	struct nodhdr *nodh;
@@ -655,7 +656,7 @@ __u64 __get_tcp_option(__u8 *ippacket, __u8 tcpoptnum){
 						count--;
 						
 						//if ((count) != 0) {
-							tcpoptdata += (opt[i+bytefield] << 8 * count);
+							tcpoptdata += ((__u64)opt[i+bytefield] << 8 * count);
 						//}
 						//else {
 						//	tcpoptdata += opt[i+bytefield];
@@ -677,7 +678,7 @@ __u64 __get_tcp_option(__u8 *ippacket, __u8 tcpoptnum){
  * skb, option number, option length in byte, and
  * any data into the tcp segment.
  */
-int __set_tcp_option(__u8 *ippacket, unsigned int tcpoptnum,
+static int write_tcp_option(__u8 *ippacket, unsigned int tcpoptnum,
  unsigned int tcpoptlen, u_int64_t tcpoptdata){
 	struct tcphdr *tcph;
 	struct iphdr *iph;
@@ -852,3 +853,30 @@ int __set_tcp_option(__u8 *ippacket, unsigned int tcpoptnum,
 	}
 
 }
+
+/*
+ * Adds or updates the data of a NOD header.
+ * The checksums are updated for the edit instead of recalculated.
+ */
+void set_nod_header_data(__u8 *ippacket, const char *id, __u8 *header_data, __u8 header_data_length){
+	struct header_edit edit;
+
+	begin_header_edit(ippacket, &edit);
+	write_nod_header_data(ippacket, id, header_data, header_data_length);
+	end_header_edit(ippacket, &edit);
+}
+
+/*
+ * Adds or updates a TCP option.
+ * The checksums are updated for the edit instead of recalculated.
+ */
+int __set_tcp_option(__u8 *ippacket, unsigned int tcpoptnum,
+ unsigned int tcpoptlen, u_int64_t tcpoptdata){
+	struct header_edit edit;
+	int result;
+
+	begin_header_edit(ippacket, &edit);
+	result = write_tcp_option(ippacket, tcpoptnum, tcpoptlen, tcpoptdata);
+	end_header_edit(ippacket, &edit);
+	return result;
+}
@@ -0,0 +1,223 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <arpa/inet.h>
+#include <linux/types.h>
+#include <linux/netlink.h>
+#include <libnetfilter_queue/libnetfilter_queue.h> // for access to Netfilter Queue
+
+#include "verdict.h"
+#include "fetcher.h"
+#include "packet.h"
+#include "memorymanager.h"
+#include "logger.h"
+
+static unsigned char verdictpad[NLMSG_ALIGNTO] = { 0 }; // Padding after a payload, never written.
+
+int DEBUG_VERDICT = false;
+
+void initialize_verdict_batch(struct verdict_batch *batch, struct counters *metrics,
+		int batchescounter, int verdictscounter) {
+	memset(batch, 0, sizeof(struct verdict_batch));
+	batch->fd = -1;
+	batch->metrics = metrics;
+	batch->batchescounter = batchescounter;
+	batch->verdictscounter = verdictscounter;
+}
+
+/*
+ * Sends the verdicts from first up to but not including last with one sendmsg().
+ */
+static ssize_t send_verdicts(struct verdict_batch *batch, u_int32_t first, u_int32_t last) {
+	struct sockaddr_nl peer;
+	struct msghdr msg;
+	u_int32_t endiov;
+	ssize_t sent;
+
+	endiov = (last < batch->count) ? batch->firstiov[last] : batch->iovlen;
+
+	memset(&peer, 0, sizeof(peer));
+	peer.nl_family = AF_NETLINK;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = &peer;
+	msg.msg_namelen = sizeof(peer);
+	msg.msg_iov = &batch->iov[batch->firstiov[first]];
+	msg.msg_iovlen = endiov - batch->firstiov[first];
+
+	do {
+		sent = sendmsg(batch->fd, &msg, 0);
+	} while ((sent < 0) && (errno == EINTR));
+
+	return sent;
+}
+
+/*
+ * Sends all pending verdicts to the kernel with one sendmsg().
+ * The netlink socket processes each message in the buffer in order
+ * so this is the same as calling nfq_set_verdict() for each of them.
+ * Returns the number of verdicts sent.
+ */
+int flush_verdicts(struct verdict_batch *batch) {
+	u_int32_t i, count;
+	char message[LOGSZ];
+
+	if (batch->count == 0) {
+		return 0;
+	}
+
+	if (send_verdicts(batch, 0, batch->count) < 0) {
+		sprintf(message, "Verdict: Failed sending %u verdicts (%s), sending them one at a time.\n",
+				batch->count, strerror(errno));
+		logger(LOG_INFO, message);
+
+		/*
+		 * The whole batch did not fit in the socket buffer.
+		 * Send each verdict on its own so at most the ones
+		 * that still fail are left in the queue.
+		 */
+		for (i = 0; i < batch->count; i++) {
+
+			if (send_verdicts(batch, i, i + 1) < 0) {
+				sprintf(message, "Verdict: Failed sending verdict %u (%s).\n",
+						ntohl(batch->msgs[i].verdicthdr.id), strerror(errno));
+				logger(LOG_INFO, message);
+			}
+		}
+	}
+
+	if (DEBUG_VERDICT == true) {
+		sprintf(message, "Verdict: Sent %u verdicts.\n", batch->count);
+		logger(LOG_INFO, message);
+	}
+
+	/*
+	 * The kernel has copied the payloads so the buffers can be reused.
+	 */
+	for (i = 0; i < batch->count; i++) {
+
+		if (batch->packets[i] != NULL) {
+			release_packet_session(batch->packets[i]);
+			put_freepacket_buffer(batch->packets[i]);
+			batch->packets[i] = NULL;
+		}
+	}
+
+	count = batch->count;
+
+	if (batch->metrics != NULL) {
+		counters_begin(batch->metrics);
+		counter_add(batch->metrics, batch->batchescounter, 1);
+		counter_add(batch->metrics, batch->verdictscounter, count);
+		counters_end(batch->metrics);
+	}
+	batch->count = 0;
+	batch->iovlen = 0;
+
+	return count;
+}
+
+/*
+ * Adds a verdict to the batch.
+ * The payload is not copied so data must stay valid until the batch is flushed.
+ * If thispacket is not NULL it is returned to the free pool after the flush.
+ */
+int add_verdict(struct verdict_batch *batch, int fd, u_int16_t queuenum,
+		u_int32_t id, u_int32_t verdict, u_int32_t data_len,
+		unsigned char *data, struct packet *thispacket) {
+	struct verdict_msg *vmsg;
+	struct iovec *iov;
+	u_int32_t pad;
+
+	/*
+	 * Verdicts must be sent on the socket that is bound to the queue.
+	 */
+	if ((batch->count > 0) && (batch->fd != fd)) {
+		flush_verdicts(batch);
+	}
+	batch->fd = fd;
+
+	vmsg = &batch->msgs[batch->count];
+	iov = &batch->iov[batch->iovlen];
+	batch->firstiov[batch->count] = batch->iovlen;
+
+	vmsg->nlh.nlmsg_len = sizeof(struct verdict_msg);
+	vmsg->nlh.nlmsg_type = (NFNL_SUBSYS_QUEUE << 8) | NFQNL_MSG_VERDICT;
+	vmsg->nlh.nlmsg_flags = NLM_F_REQUEST;
+	vmsg->nlh.nlmsg_seq = 0;
+	vmsg->nlh.nlmsg_pid = 0;
+	vmsg->nfg.nfgen_family = AF_UNSPEC;
+	vmsg->nfg.version = NFNETLINK_V0;
+	vmsg->nfg.res_id = htons(queuenum);
+	vmsg->verdictattr.nfa_len = sizeof(struct nfattr)
+			+ sizeof(struct nfqnl_msg_verdict_hdr);
+	vmsg->verdictattr.nfa_type = NFQA_VERDICT_HDR;
+	vmsg->verdicthdr.verdict = htonl(verdict);
+	vmsg->verdicthdr.id = htonl(id);
+
+	iov[0].iov_base = vmsg;
+
+	if ((data_len > 0) && (data != NULL)) {
+		vmsg->payloadattr.nfa_len = sizeof(struct nfattr) + data_len;
+		vmsg->payloadattr.nfa_type = NFQA_PAYLOAD;
+		vmsg->nlh.nlmsg_len += data_len;
+		iov[0].iov_len = sizeof(struct verdict_msg);
+		iov[1].iov_base = data;
+		iov[1].iov_len = data_len;
+		batch->iovlen += 2;
+
+		/*
+		 * The next message has to start on a 4 byte boundary.
+		 */
+		pad = NLMSG_ALIGN(data_len) - data_len;
+
+		if (pad > 0) {
+			iov[2].iov_base = verdictpad;
+			iov[2].iov_len = pad;
+			batch->iovlen += 1;
+		}
+	} else { // No payload attribute just accept/drop the original.
+		vmsg->nlh.nlmsg_len -= sizeof(struct nfattr);
+		iov[0].iov_len = sizeof(struct verdict_msg) - sizeof(struct nfattr);
+		batch->iovlen += 1;
+	}
+
+	batch->packets[batch->count] = thispacket;
+	batch->count++;
+
+	if (batch->count >= VERDICTBATCH) {
+		flush_verdicts(batch);
+	}
+
+	return 0;
+}
+
+/*
+ * Issues a verdict for a queued packet buffer.
+ * In batched mode the buffer is released when the batch is flushed
+ * otherwise the verdict is sent now and the buffer released right away.
+ */
+int set_packet_verdict(struct verdict_batch *batch, struct packet *thispacket,
+		u_int32_t verdict, u_int32_t data_len, unsigned char *data) {
+	int result;
+
+	if (get_fetcher_batching() == true) {
+		return add_verdict(batch, thispacket->fetcher->fd,
+				thispacket->fetcher->queuenum, thispacket->id, verdict,
+				data_len, data, thispacket);
+	}
+
+	flush_verdicts(batch); // Batching was just disabled send anything left.
+	result = nfq_set_verdict(thispacket->hq, thispacket->id, verdict,
+			data_len, data);
+	release_packet_session(thispacket);
+	put_freepacket_buffer(thispacket);
+	return result;
+}
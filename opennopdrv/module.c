@@ -42,6 +42,7 @@ int selectedmode = ROUTED;
 /* Debug Variables */ 
 int DEBUG_HEARTBEAT = FALSE;
 
+#include "opennop_offload.h"
 #include "opennop_netlink.h"
 
 MODULE_LICENSE("GPL");
@@ -63,6 +64,7 @@ static void daemonmonitor_function(unsigned long data){
 	 */
 	 if (tv_now.tv_sec - timespan >= tv_lasthb.tv_sec){
 	 	daemonstate = DOWN;
+	 	offload_expire(TRUE); // A restarted daemon has to see every flow again.
 	 	
 	 	if (DEBUG_HEARTBEAT == TRUE){
 	 		printk(KERN_ALERT "No heartbeat. timespan:%i now:%i, lasthb:%i \n",timespan, (unsigned int)tv_now.tv_sec, (unsigned int)tv_lasthb.tv_sec);
@@ -74,6 +76,7 @@ static void daemonmonitor_function(unsigned long data){
 	 	if (DEBUG_HEARTBEAT == TRUE){
 	 		printk(KERN_ALERT "Got a heartbeat. timespan:%i now:%i, lasthb:%i \n",timespan, (unsigned int)tv_now.tv_sec, (unsigned int)tv_lasthb.tv_sec);
 	 	}
+	 	offload_expire(FALSE);
 	 }
 	 
 mod_timer(&daemonmonitor, jiffies + (hbintervals * HBINTERVAL) * HZ); // Update the timer for the next run.
@@ -104,6 +107,7 @@ static unsigned int
 #endif
 
 	struct iphdr *iph = NULL;
+	struct sk_buff *packet = NULL;
 
 	/*
 	 * yaplej: Process the packet only,
@@ -120,11 +124,13 @@ static unsigned int
 		((*skb)->pkt_type == PACKET_HOST) && 
 		((*skb)->protocol == htons(ETH_P_IP))){
 		iph = ip_hdr((*skb)); // access ip header.
+		packet = *skb;
 	#else
 		if ((skb != NULL) && 
 		((skb)->pkt_type == PACKET_HOST) && 
 		((skb)->protocol == htons(ETH_P_IP))){
 		iph = ip_hdr((skb)); // access ip header.
+		packet = skb;
 	#endif
 
 		/*
@@ -137,6 +143,13 @@ static unsigned int
 			 * Check that the daemon is UP.
 			 */
 			 if (daemonstate == UP) {
+
+			 	/*
+			 	 * The daemon has no work for offloaded flows.
+			 	 */
+			 	if (offload_match(packet, iph) == TRUE) {
+			 		return NF_ACCEPT;
+			 	}
 			 	return NF_QUEUE;
 			 }
 		}
@@ -165,6 +178,7 @@ static int __init opennopdrv_init(void){
 	struct genl_ops *ops;
 	
 	timespan = hbintervals * HBINTERVAL;
+	offload_init();
 
 	#if (LINUX_VERSION_CODE > KERNEL_VERSION (3, 1, 2))
 		printk(KERN_ALERT "[OpenNOPDrv]: Kernel Version >= 3.1.2 \n");
@@ -232,6 +246,7 @@ static void __exit opennopdrv_exit(void){
 	genl_unregister_family(&opennop_nl_family);
 	nf_unregister_hook(&opennop_hook);
 	del_timer_sync(&daemonmonitor);
+	offload_expire(TRUE);
 }
 
 module_init(opennopdrv_init);
@@ -5,6 +5,10 @@
 enum {
 	OPENNOP_A_UNSPEC,
 	OPENNOP_A_MSG,
+	OPENNOP_A_LARGERIP,
+	OPENNOP_A_LARGERPORT,
+	OPENNOP_A_SMALLERIP,
+	OPENNOP_A_SMALLERPORT,
         __OPENNOP_A_MAX,
 };
 #define OPENNOP_A_MAX (__OPENNOP_A_MAX - 1)
@@ -14,6 +18,10 @@ enum {
  */
 static struct nla_policy opennop_nl_policy[OPENNOP_A_MAX + 1] = {
 	[OPENNOP_A_MSG] = { .type = NLA_NUL_STRING },
+	[OPENNOP_A_LARGERIP] = { .type = NLA_U32 },
+	[OPENNOP_A_LARGERPORT] = { .type = NLA_U16 },
+	[OPENNOP_A_SMALLERIP] = { .type = NLA_U32 },
+	[OPENNOP_A_SMALLERPORT] = { .type = NLA_U16 },
 };
 
 #define VERSION_NR 1
@@ -33,6 +41,7 @@ enum {
 	OPENNOP_CMD_NOOP,
 	OPENNOP_CMD_ECHO,
 	OPENNOP_CMD_HB,
+	OPENNOP_CMD_OFFLOAD,
 	__OPENNOP_CMD_MAX,
 };
 #define OPENNOP_CMD_MAX (__OPENNOP_CMD_MAX - 1)
@@ -230,6 +239,7 @@ int opennop_nl_cmd_hb(struct sk_buff *skb_2, struct genl_info *info)
 					printk(KERN_ALERT "Service is down.\n");
 				}
 				daemonstate = DOWN; // Update the Daemon state.
+				offload_expire(TRUE);
 			}
 		}
 	}
@@ -251,6 +261,32 @@ int opennop_nl_cmd_hb(struct sk_buff *skb_2, struct genl_info *info)
 }
 
 
+/*
+ * An offload command, the daemon has no work for the rest of a flow.
+ * Addresses and ports are in network byte order and sorted the way
+ * the daemon sorts them.
+ */
+int opennop_nl_cmd_offload(struct sk_buff *skb_2, struct genl_info *info)
+{
+	if ((info == NULL) ||
+		(info->attrs[OPENNOP_A_LARGERIP] == NULL) ||
+		(info->attrs[OPENNOP_A_LARGERPORT] == NULL) ||
+		(info->attrs[OPENNOP_A_SMALLERIP] == NULL) ||
+		(info->attrs[OPENNOP_A_SMALLERPORT] == NULL)){
+		return -EINVAL;
+	}
+
+	if (daemonstate != UP){
+		return 0;
+	}
+
+	return offload_add(nla_get_u32(info->attrs[OPENNOP_A_LARGERIP]),
+		nla_get_u16(info->attrs[OPENNOP_A_LARGERPORT]),
+		nla_get_u32(info->attrs[OPENNOP_A_SMALLERIP]),
+		nla_get_u16(info->attrs[OPENNOP_A_SMALLERPORT]));
+}
+
+
 /* commands: mapping between the command enumeration and the actual function*/
 static const struct genl_ops opennop_nl_ops[] = {
 	{
@@ -273,5 +309,12 @@ static const struct genl_ops opennop_nl_ops[] = {
 			.doit = opennop_nl_cmd_hb,
 			.dumpit = NULL,
 	},
+	{
+			.cmd = OPENNOP_CMD_OFFLOAD,
+			.flags = GENL_ADMIN_PERM,
+			.policy = opennop_nl_policy,
+			.doit = opennop_nl_cmd_offload,
+			.dumpit = NULL,
+	},
 };
 
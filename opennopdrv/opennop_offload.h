@@ -0,0 +1,201 @@
+/*
+ * Flows the daemon has no work for.
+ * Once the daemon sees that neither end of a session has an accelerator
+ * it adds the flow here and the rest of its packets are accepted
+ * without being queued.  A flow is removed on FIN or RST, when it has
+ * been idle for OFFLOADIDLE seconds or when the daemon goes down.
+ */
+#include <linux/jhash.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+
+#define OFFLOADBUCKETS 4096 /* Must be a power of 2. */
+#define OFFLOADMAXFLOWS 65536 /* Flows past this are still queued. */
+#define OFFLOADIDLE 60 /* Seconds a flow can be idle before it is removed. */
+
+struct offload_flow {
+	struct offload_flow *next;
+	__u32 largerIP;
+	__u32 smallerIP;
+	__u16 largerIPPort;
+	__u16 smallerIPPort;
+	unsigned long lastseen; /* jiffies of the last packet. */
+};
+
+struct offload_bucket {
+	spinlock_t lock;
+	struct offload_flow *flows;
+};
+
+static struct offload_bucket offloadtable[OFFLOADBUCKETS];
+static atomic_t offloadflows = ATOMIC_INIT(0);
+
+/*
+ * Addresses and ports are kept in the order the daemon sorts them
+ * so both directions of a flow find the same entry.
+ */
+static void offload_sort(__u32 saddr, __u16 source, __u32 daddr, __u16 dest,
+	__u32 *largerIP, __u16 *largerIPPort, __u32 *smallerIP, __u16 *smallerIPPort){
+
+	if (saddr > daddr){
+		*largerIP = saddr;
+		*largerIPPort = source;
+		*smallerIP = daddr;
+		*smallerIPPort = dest;
+	}
+	else{
+		*largerIP = daddr;
+		*largerIPPort = dest;
+		*smallerIP = saddr;
+		*smallerIPPort = source;
+	}
+}
+
+static struct offload_bucket *offload_bucket(__u32 largerIP, __u16 largerIPPort,
+	__u32 smallerIP, __u16 smallerIPPort){
+
+	return &offloadtable[jhash_3words(largerIP, smallerIP,
+		((__u32)largerIPPort << 16) | smallerIPPort, 0) & (OFFLOADBUCKETS - 1)];
+}
+
+static void offload_init(void){
+	int i;
+
+	for (i = 0; i < OFFLOADBUCKETS; i++){
+		spin_lock_init(&offloadtable[i].lock);
+		offloadtable[i].flows = NULL;
+	}
+}
+
+/*
+ * Called by the netlink handler in process context.
+ */
+static int offload_add(__u32 largerIP, __u16 largerIPPort, __u32 smallerIP, __u16 smallerIPPort){
+	struct offload_bucket *bucket;
+	struct offload_flow *flow;
+	struct offload_flow *newflow;
+
+	if (atomic_read(&offloadflows) >= OFFLOADMAXFLOWS){
+		return -ENOSPC;
+	}
+
+	newflow = kmalloc(sizeof(struct offload_flow), GFP_KERNEL);
+
+	if (newflow == NULL){
+		return -ENOMEM;
+	}
+	newflow->largerIP = largerIP;
+	newflow->largerIPPort = largerIPPort;
+	newflow->smallerIP = smallerIP;
+	newflow->smallerIPPort = smallerIPPort;
+	newflow->lastseen = jiffies;
+
+	bucket = offload_bucket(largerIP, largerIPPort, smallerIP, smallerIPPort);
+	spin_lock_bh(&bucket->lock);
+
+	for (flow = bucket->flows; flow != NULL; flow = flow->next){
+
+		if ((flow->largerIP == largerIP) && (flow->largerIPPort == largerIPPort) &&
+			(flow->smallerIP == smallerIP) && (flow->smallerIPPort == smallerIPPort)){
+			flow->lastseen = jiffies;
+			spin_unlock_bh(&bucket->lock);
+			kfree(newflow);
+			return 0;
+		}
+	}
+	newflow->next = bucket->flows;
+	bucket->flows = newflow;
+	atomic_inc(&offloadflows);
+	spin_unlock_bh(&bucket->lock);
+
+	return 0;
+}
+
+/*
+ * Checks if a TCP segment belongs to an offloaded flow.
+ * Called from the netfilter hook in softirq context.
+ * The flow is removed when the segment closes it.
+ */
+static int offload_match(struct sk_buff *skb, struct iphdr *iph){
+	struct offload_bucket *bucket;
+	struct offload_flow *flow;
+	struct offload_flow **prev;
+	struct tcphdr _tcph;
+	struct tcphdr *tcph;
+	__u32 largerIP, smallerIP;
+	__u16 largerIPPort, smallerIPPort;
+
+	if (atomic_read(&offloadflows) == 0){
+		return FALSE;
+	}
+
+	tcph = skb_header_pointer(skb, iph->ihl * 4, sizeof(_tcph), &_tcph);
+
+	if (tcph == NULL){
+		return FALSE;
+	}
+
+	offload_sort(iph->saddr, tcph->source, iph->daddr, tcph->dest,
+		&largerIP, &largerIPPort, &smallerIP, &smallerIPPort);
+	bucket = offload_bucket(largerIP, largerIPPort, smallerIP, smallerIPPort);
+	spin_lock(&bucket->lock);
+
+	for (prev = &bucket->flows; (flow = *prev) != NULL; prev = &flow->next){
+
+		if ((flow->largerIP == largerIP) && (flow->largerIPPort == largerIPPort) &&
+			(flow->smallerIP == smallerIP) && (flow->smallerIPPort == smallerIPPort)){
+
+			if ((tcph->fin == 1) || (tcph->rst == 1) || (tcph->syn == 1)){
+				*prev = flow->next;
+				atomic_dec(&offloadflows);
+				spin_unlock(&bucket->lock);
+				kfree(flow);
+
+				/*
+				 * A SYN reuses the ports for a new session
+				 * the daemon has to see.
+				 */
+				return (tcph->syn == 1) ? FALSE : TRUE;
+			}
+
+			if (flow->lastseen != jiffies){
+				flow->lastseen = jiffies;
+			}
+			spin_unlock(&bucket->lock);
+			return TRUE;
+		}
+	}
+	spin_unlock(&bucket->lock);
+
+	return FALSE;
+}
+
+/*
+ * Removes idle flows or all of them.
+ * Called from the daemon monitor timer and on unload.
+ */
+static void offload_expire(int all){
+	struct offload_bucket *bucket;
+	struct offload_flow *flow;
+	struct offload_flow **prev;
+	int i;
+
+	for (i = 0; (i < OFFLOADBUCKETS) && (atomic_read(&offloadflows) > 0); i++){
+		bucket = &offloadtable[i];
+		spin_lock_bh(&bucket->lock);
+		prev = &bucket->flows;
+
+		while ((flow = *prev) != NULL){
+
+			if ((all == TRUE) || time_after(jiffies, flow->lastseen + (OFFLOADIDLE * HZ))){
+				*prev = flow->next;
+				atomic_dec(&offloadflows);
+				kfree(flow);
+			}
+			else{
+				prev = &flow->next;
+			}
+		}
+		spin_unlock_bh(&bucket->lock);
+	}
+}
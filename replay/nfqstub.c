@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+#include <linux/types.h>
+#include <linux/netfilter.h> // for NF_ACCEPT
+#include <libnetfilter_queue/libnetfilter_queue.h>
+
+#include "replay.h"
+#include "fetcher.h"
+#include "rcu.h"
+
+/*
+ * Stands in for libnetfilter_queue.
+ * Packets are handed straight to fetcher_callback() and the
+ * verdicts the fetcher and workers send are collected here
+ * instead of going to the kernel.
+ */
+struct nfq_data {
+	struct nfqnl_msg_packet_hdr ph;
+	unsigned char *payload;
+	int len;
+};
+
+struct nfq_q_handle {
+	u_int16_t queuenum;
+};
+
+/*
+ * A packet that was handed to the pipeline.
+ * The slot is used again once its verdict arrived.
+ */
+struct replay_slot {
+	struct nfq_data nfa;
+	struct replay_record *record;
+	__u64 queued; // When fetcher_callback() was called.
+	u_int32_t len;
+	int inflight;
+	unsigned char data[BUFSIZE]; // The packet as it was queued.
+};
+
+static struct replay_slot slots[REPLAYWINDOW];
+static struct nfq_q_handle replayqueue = { 0 };
+static struct replay_results results = { 0 };
+static u_int32_t nextid = 0; // IDs start at 1, the fetcher ignores packets with ID 0.
+static FILE *replayoutput = NULL;
+static pthread_mutex_t verdictlock = PTHREAD_MUTEX_INITIALIZER;
+
+struct pcap_record_header {
+	u_int32_t tssec;
+	u_int32_t tsusec;
+	u_int32_t caplen;
+	u_int32_t len;
+};
+
+struct pcap_file_header {
+	u_int32_t magic;
+	u_int16_t major;
+	u_int16_t minor;
+	int32_t thiszone;
+	u_int32_t sigfigs;
+	u_int32_t snaplen;
+	u_int32_t linktype;
+};
+
+__u64 replay_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ((__u64)now.tv_sec * 1000000000ULL) + now.tv_nsec;
+}
+
+/*
+ * The output has raw IP packets because the workers change their length.
+ */
+void replay_initialize(__u64 numpackets, FILE *output) {
+	struct pcap_file_header header = { 0xa1b2c3d4, 2, 4, 0, 0, 65535, LINKTYPE_RAW };
+
+	memset(slots, 0, sizeof(slots));
+	memset(&results, 0, sizeof(results));
+	results.fetcherns = calloc(numpackets + 1, sizeof(__u64));
+	results.totalns = calloc(numpackets + 1, sizeof(__u64));
+
+	if ((results.fetcherns == NULL) || (results.totalns == NULL)) {
+		fprintf(stderr, "Replay: Couldn't allocate latency samples.\n");
+		exit(EXIT_FAILURE);
+	}
+	nextid = 0;
+	replayoutput = output;
+
+	if (replayoutput != NULL) {
+		fwrite(&header, sizeof(header), 1, replayoutput);
+	}
+}
+
+/*
+ * Hands one packet to the fetcher.
+ * Waits if REPLAYWINDOW packets are still waiting for a verdict.
+ */
+void replay_packet(struct fetcher *thisfetcher, struct replay_record *thisrecord) {
+	struct replay_slot *thisslot;
+	u_int32_t id;
+	__u64 start;
+
+	id = ++nextid;
+	thisslot = &slots[id % REPLAYWINDOW];
+
+	while (__atomic_load_n(&thisslot->inflight, __ATOMIC_ACQUIRE) == true) {
+		sched_yield();
+	}
+	memcpy(thisslot->data, thisrecord->data, thisrecord->len);
+	thisslot->len = thisrecord->len;
+	thisslot->record = thisrecord;
+	thisslot->nfa.ph.packet_id = htonl(id);
+	thisslot->nfa.ph.hw_protocol = htons(0x0800);
+	thisslot->nfa.payload = thisslot->data;
+	thisslot->nfa.len = thisrecord->len;
+	thisslot->inflight = true;
+	results.packets++;
+	results.bytesin += thisrecord->len;
+
+	start = replay_now();
+	thisslot->queued = start;
+	fetcher_callback(&replayqueue, NULL, &thisslot->nfa, thisfetcher);
+	results.fetcherns[id - 1] = replay_now() - start;
+
+	/*
+	 * Sessions the fetcher looked up are not used any more.
+	 */
+	rcu_quiescent_state();
+}
+
+/*
+ * Waits for the verdict of every packet.
+ */
+void replay_drain(void) {
+	int i;
+
+	for (i = 0; i < REPLAYWINDOW; i++) {
+
+		while (__atomic_load_n(&slots[i].inflight, __ATOMIC_ACQUIRE) == true) {
+			sched_yield();
+		}
+	}
+
+	if (replayoutput != NULL) {
+		fflush(replayoutput);
+	}
+}
+
+struct replay_results *replay_get_results(void) {
+	return &results;
+}
+
+struct nfqnl_msg_packet_hdr *nfq_get_msg_packet_hdr(struct nfq_data *nfad) {
+	return &nfad->ph;
+}
+
+int nfq_get_payload(struct nfq_data *nfad, unsigned char **data) {
+	*data = nfad->payload;
+	return nfad->len;
+}
+
+/*
+ * Called by the fetcher and the workers.
+ * An accepted packet without a payload goes out as it was queued.
+ */
+int nfq_set_verdict(struct nfq_q_handle *qh, u_int32_t id, u_int32_t verdict,
+		u_int32_t data_len, const unsigned char *buf) {
+	struct replay_slot *thisslot = &slots[id % REPLAYWINDOW];
+	struct pcap_record_header header;
+	__u64 now = replay_now();
+
+	(void)qh;
+	pthread_mutex_lock(&verdictlock);
+	results.totalns[id - 1] = now - thisslot->queued;
+
+	if (verdict == NF_ACCEPT) {
+		results.accepted++;
+
+		if ((data_len == 0) || (buf == NULL)) {
+			buf = thisslot->data;
+			data_len = thisslot->len;
+
+		} else if ((data_len != thisslot->len) || (memcmp(buf, thisslot->data, data_len) != 0)) {
+			results.rewritten++;
+		}
+		results.bytesout += data_len;
+
+		if (replayoutput != NULL) {
+			header.tssec = thisslot->record->tssec;
+			header.tsusec = thisslot->record->tsusec;
+			header.caplen = data_len;
+			header.len = data_len;
+			fwrite(&header, sizeof(header), 1, replayoutput);
+			fwrite(buf, data_len, 1, replayoutput);
+		}
+	} else {
+		results.dropped++;
+	}
+	pthread_mutex_unlock(&verdictlock);
+	__atomic_store_n(&thisslot->inflight, false, __ATOMIC_RELEASE);
+
+	return 0;
+}
+
+/*
+ * The fetcher thread is never started so the rest of the library is not used.
+ */
+struct nfq_handle *nfq_open(void) {
+	return NULL;
+}
+
+int nfq_close(struct nfq_handle *h) {
+	(void)h;
+	return 0;
+}
+
+int nfq_bind_pf(struct nfq_handle *h, u_int16_t pf) {
+	(void)h;
+	(void)pf;
+	return -1;
+}
+
+int nfq_unbind_pf(struct nfq_handle *h, u_int16_t pf) {
+	(void)h;
+	(void)pf;
+	return -1;
+}
+
+struct nfq_q_handle *nfq_create_queue(struct nfq_handle *h, u_int16_t num, nfq_callback *cb, void *data) {
+	(void)h;
+	(void)num;
+	(void)cb;
+	(void)data;
+	return NULL;
+}
+
+int nfq_destroy_queue(struct nfq_q_handle *qh) {
+	(void)qh;
+	return 0;
+}
+
+int nfq_fd(struct nfq_handle *h) {
+	(void)h;
+	return -1;
+}
+
+int nfq_handle_packet(struct nfq_handle *h, char *buf, int len) {
+	(void)h;
+	(void)buf;
+	(void)len;
+	return -1;
+}
+
+struct nfnl_handle *nfq_nfnlh(struct nfq_handle *h) {
+	(void)h;
+	return NULL;
+}
+
+int nfq_set_mode(struct nfq_q_handle *qh, u_int8_t mode, u_int32_t range) {
+	(void)qh;
+	(void)mode;
+	(void)range;
+	return -1;
+}
+
+int nfq_set_queue_maxlen(struct nfq_q_handle *qh, u_int32_t queuelen) {
+	(void)qh;
+	(void)queuelen;
+	return -1;
+}
+
+unsigned int nfnl_rcvbufsiz(const struct nfnl_handle *h, unsigned int size) {
+	(void)h;
+	(void)size;
+	return 0;
+}
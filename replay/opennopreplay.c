@@ -0,0 +1,412 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <arpa/inet.h>
+#include <netinet/ip.h> // for tcpmagic and TCP options
+#include <netinet/tcp.h> // for tcpmagic and TCP options
+#include <linux/types.h>
+
+#include "replay.h"
+#include "opennopd.h"
+#include "fetcher.h"
+#include "worker.h"
+#include "sessionmanager.h"
+#include "memorymanager.h"
+#include "tcpoptions.h"
+#include "verdict.h"
+#include "ipc.h"
+#include "rcu.h"
+
+#define REPLAYWORKERS 2 // Workers started unless -w says otherwise.
+#define REPLAYPEERIP "192.0.2.1" // Address of the accelerator -p pretends is there.
+#define REPLAYRESPONDERS 65536 // Must be a power of 2.
+
+/*
+ * The daemon's globals, opennopd.c is not linked in.
+ */
+int servicestate = RUNNING;
+int isdaemon = false;
+
+static char peerid[OPENNOP_IPC_ID_LENGTH] = { 'p', 'e', 'e', 'r' };
+static __u32 responders[REPLAYRESPONDERS]; // Addresses SYNs were sent to.
+
+static void print_usage(char *name) {
+	printf("Usage: %s [-w workers] [-p] [-o output.pcap] input.pcap\n", name);
+	printf("  Options:\n");
+	printf("      -w Number of workers, default %i.\n", REPLAYWORKERS);
+	printf("      -p Tag packets from the servers the SYNs went to as if\n");
+	printf("         an accelerator in front of them answered, so sessions\n");
+	printf("         are optimized instead of passed through.\n");
+	printf("      -o Write the packets that were accepted to a pcap file.\n");
+	printf("      -h Show this help screen.\n");
+	printf("\n");
+}
+
+static int is_responder(__u32 address) {
+	__u32 i = (address * 2654435761U) & (REPLAYRESPONDERS - 1);
+
+	while (responders[i] != 0) {
+
+		if (responders[i] == address) {
+			return true;
+		}
+		i = (i + 1) & (REPLAYRESPONDERS - 1);
+	}
+	return false;
+}
+
+static void add_responder(__u32 address) {
+	__u32 i = (address * 2654435761U) & (REPLAYRESPONDERS - 1);
+	__u32 probes = 0;
+
+	while ((responders[i] != 0) && (probes++ < REPLAYRESPONDERS)) {
+
+		if (responders[i] == address) {
+			return;
+		}
+		i = (i + 1) & (REPLAYRESPONDERS - 1);
+	}
+
+	if (responders[i] == 0) {
+		responders[i] = address;
+	}
+}
+
+/*
+ * Finds the IPv4 header in a captured frame.
+ * Returns -1 if the frame does not hold an IPv4 packet.
+ */
+static int ip_offset(u_int32_t linktype, const unsigned char *frame, u_int32_t caplen) {
+	int offset = 0;
+	u_int16_t ethertype = 0x0800;
+
+	switch (linktype) {
+	case LINKTYPE_ETHERNET:
+
+		if (caplen < 14) {
+			return -1;
+		}
+		ethertype = (frame[12] << 8) | frame[13];
+		offset = 14;
+
+		if (((ethertype == 0x8100) || (ethertype == 0x88a8)) && (caplen >= 18)) {
+			ethertype = (frame[16] << 8) | frame[17];
+			offset = 18;
+		}
+		break;
+
+	case LINKTYPE_LINUX_SLL:
+
+		if (caplen < 16) {
+			return -1;
+		}
+		ethertype = (frame[14] << 8) | frame[15];
+		offset = 16;
+		break;
+
+	case LINKTYPE_RAW:
+	case LINKTYPE_IPV4:
+	case 12: // Raw IP on some systems.
+	case 14:
+		break;
+
+	default:
+		return -1;
+	}
+
+	if ((ethertype != 0x0800) || (caplen < offset + sizeof(struct iphdr)) ||
+			((frame[offset] >> 4) != 4)) {
+		return -1;
+	}
+	return offset;
+}
+
+static u_int32_t swap32(u_int32_t value, int swapped) {
+	return (swapped == true) ? __builtin_bswap32(value) : value;
+}
+
+/*
+ * Reads every IPv4 packet of a capture into memory
+ * so reading the file is not part of what is measured.
+ * Returns -1 if the file could not be read.
+ */
+static int read_capture(const char *path, struct replay_record **records, __u64 *numrecords, __u64 *skipped) {
+	FILE *input;
+	u_int32_t header[6];
+	u_int32_t record[4];
+	u_int32_t linktype, caplen, len, magic;
+	unsigned char *frame;
+	struct replay_record *thisrecord;
+	struct iphdr *iph;
+	__u64 capacity = 0;
+	int swapped, nanoseconds, offset;
+	int failed = false;
+
+	*records = NULL;
+	*numrecords = 0;
+	*skipped = 0;
+	input = fopen(path, "rb");
+
+	if (input == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	if (fread(header, sizeof(header), 1, input) != 1) {
+		fprintf(stderr, "%s: Not a pcap file.\n", path);
+		fclose(input);
+		return -1;
+	}
+	magic = header[0];
+	swapped = ((magic == 0xd4c3b2a1) || (magic == 0x4d3cb2a1));
+	magic = swap32(magic, swapped);
+
+	if ((magic != 0xa1b2c3d4) && (magic != 0xa1b23c4d)) {
+		fprintf(stderr, "%s: Not a pcap file.\n", path);
+		fclose(input);
+		return -1;
+	}
+	nanoseconds = (magic == 0xa1b23c4d);
+	linktype = swap32(header[5], swapped) & 0xffff;
+	frame = malloc(65536);
+	failed = (frame == NULL);
+
+	while ((failed == false) && (fread(record, sizeof(record), 1, input) == 1)) {
+		caplen = swap32(record[2], swapped);
+		len = swap32(record[3], swapped);
+
+		if ((caplen > 65536) || (fread(frame, caplen, 1, input) != 1)) {
+			break;
+		}
+		offset = ip_offset(linktype, frame, caplen);
+
+		if (offset < 0) {
+			(*skipped)++;
+			continue;
+		}
+		iph = (struct iphdr *)(frame + offset);
+
+		/*
+		 * Truncated packets and ones that would not fit
+		 * a packet buffer with their options are left out.
+		 */
+		if ((caplen < len) || (ntohs(iph->tot_len) > caplen - offset) ||
+				(ntohs(iph->tot_len) > BUFSIZE - REPLAYHEADROOM)) {
+			(*skipped)++;
+			continue;
+		}
+
+		if (*numrecords == capacity) {
+			capacity = (capacity == 0) ? 65536 : capacity * 2;
+			*records = realloc(*records, capacity * sizeof(struct replay_record));
+
+			if (*records == NULL) {
+				failed = true;
+				break;
+			}
+		}
+		thisrecord = &(*records)[*numrecords];
+		thisrecord->tssec = swap32(record[0], swapped);
+		thisrecord->tsusec = swap32(record[1], swapped) / ((nanoseconds == true) ? 1000 : 1);
+		thisrecord->len = ntohs(iph->tot_len);
+		thisrecord->data = calloc(1, BUFSIZE);
+
+		if (thisrecord->data == NULL) {
+			failed = true;
+			break;
+		}
+		memcpy(thisrecord->data, iph, thisrecord->len);
+		(*numrecords)++;
+	}
+	free(frame);
+	fclose(input);
+
+	if (failed == true) {
+		fprintf(stderr, "%s: Couldn't allocate memory for the capture.\n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Tags the packets a remote accelerator would have tagged.
+ * The server side of a session is the address its SYN went to.
+ */
+static void tag_responders(struct replay_record *records, __u64 numrecords) {
+	struct iphdr *iph;
+	struct tcphdr *tcph;
+	__u64 i;
+
+	for (i = 0; i < numrecords; i++) {
+		iph = (struct iphdr *)records[i].data;
+
+		if ((iph->protocol != IPPROTO_TCP) || (records[i].len < (iph->ihl * 4) + sizeof(struct tcphdr))) {
+			continue;
+		}
+		tcph = (struct tcphdr *)(((u_int32_t *)iph) + iph->ihl);
+
+		if ((tcph->syn == 1) && (tcph->ack == 0) && (is_responder(iph->saddr) == false)) {
+			add_responder(iph->daddr);
+		}
+
+		if (is_responder(iph->saddr) == true) {
+			set_nod_header_data((__u8 *)iph, ONOP, (__u8 *)peerid, OPENNOP_IPC_ID_LENGTH);
+			records[i].len = ntohs(iph->tot_len);
+		}
+	}
+}
+
+static int compare_samples(const void *first, const void *second) {
+	__u64 a = *(const __u64 *)first;
+	__u64 b = *(const __u64 *)second;
+
+	return (a > b) - (a < b);
+}
+
+static void print_latency(const char *stage, __u64 *samples, __u64 count) {
+	__u64 total = 0;
+	__u64 i;
+
+	if (count == 0) {
+		return;
+	}
+	qsort(samples, count, sizeof(__u64), compare_samples);
+
+	for (i = 0; i < count; i++) {
+		total += samples[i];
+	}
+	printf("%-9s avg: %9.1f p50: %9.1f p99: %9.1f max: %9.1f us\n", stage,
+			(double)total / count / 1000.0,
+			samples[count / 2] / 1000.0,
+			samples[(count * 99) / 100] / 1000.0,
+			samples[count - 1] / 1000.0);
+}
+
+static void print_results(struct replay_results *results, __u64 skipped, __u64 elapsed) {
+	__u64 *workerns;
+	__u64 i;
+	double seconds = elapsed / 1000000000.0;
+
+	printf("packets: %llu skipped: %llu\n", (unsigned long long)results->packets,
+			(unsigned long long)skipped);
+	printf("time: %.3f s pps: %.0f\n", seconds, (seconds > 0) ? results->packets / seconds : 0);
+	printf("bytes in: %llu out: %llu ratio: %.3f\n", (unsigned long long)results->bytesin,
+			(unsigned long long)results->bytesout,
+			(results->bytesin > 0) ? (double)results->bytesout / results->bytesin : 0);
+	printf("accepted: %llu dropped: %llu rewritten: %llu\n", (unsigned long long)results->accepted,
+			(unsigned long long)results->dropped, (unsigned long long)results->rewritten);
+
+	/*
+	 * The worker stage is the queue wait and the processing.
+	 * Packets the fetcher answered itself spent no time there.
+	 */
+	workerns = malloc(results->packets * sizeof(__u64));
+
+	if (workerns != NULL) {
+
+		for (i = 0; i < results->packets; i++) {
+			workerns[i] = (results->totalns[i] > results->fetcherns[i]) ?
+					results->totalns[i] - results->fetcherns[i] : 0;
+		}
+		print_latency("fetcher", results->fetcherns, results->packets);
+		print_latency("worker", workerns, results->packets);
+		print_latency("total", results->totalns, results->packets);
+		free(workerns);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	pthread_t t_memorymanager;
+	struct fetcher replayfetcher;
+	struct replay_record *records;
+	FILE *output = NULL;
+	char *outputpath = NULL;
+	__u64 numrecords, skipped, start, i;
+	int numworkers = REPLAYWORKERS;
+	int peer = false;
+	int c;
+
+	while ((c = getopt(argc, argv, "w:po:h")) != -1) {
+		switch (c) {
+		case 'w':
+			numworkers = atoi(optarg);
+			break;
+		case 'p':
+			peer = true;
+			break;
+		case 'o':
+			outputpath = optarg;
+			break;
+		default:
+			print_usage(argv[0]);
+			exit((c == 'h') ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if ((optind != argc - 1) || (numworkers < 1) || (numworkers > MAXWORKERS)) {
+		print_usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+	if (read_capture(argv[optind], &records, &numrecords, &skipped) < 0) {
+		exit(EXIT_FAILURE);
+	}
+
+	if (outputpath != NULL) {
+		output = fopen(outputpath, "wb");
+
+		if (output == NULL) {
+			perror(outputpath);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	/*
+	 * Start the daemon the way main() in opennopd.c does
+	 * without the threads that need the kernel or the network.
+	 */
+	generate_opennopid();
+
+	if (peer == true) {
+		add_static_neighbor(inet_addr(REPLAYPEERIP), peerid);
+		tag_responders(records, numrecords);
+	}
+	set_fetcher_batching(false); // Every verdict goes through nfq_set_verdict().
+	set_workers(numworkers);
+	pthread_create(&t_memorymanager, NULL, memorymanager_function, (void *) NULL);
+	initialize_sessiontable();
+
+	for (i = 0; i < (__u64)get_workers(); i++) {
+		create_worker(i);
+	}
+
+	memset(&replayfetcher, 0, sizeof(replayfetcher));
+	replayfetcher.fd = -1;
+	replayfetcher.state = RUNNING;
+	pthread_mutex_init(&replayfetcher.lock, NULL);
+	initialize_verdict_batch(&replayfetcher.verdicts, &replayfetcher.metrics,
+			FETCHERVERDICTBATCHES, FETCHERVERDICTS);
+	rcu_register_thread();
+
+	replay_initialize(numrecords, output);
+	start = replay_now();
+
+	for (i = 0; i < numrecords; i++) {
+		replay_packet(&replayfetcher, &records[i]);
+	}
+	replay_drain();
+	print_results(replay_get_results(), skipped, replay_now() - start);
+
+	if (output != NULL) {
+		fclose(output);
+	}
+
+	/*
+	 * The workers and memory manager are not stopped, exit() ends them.
+	 */
+	exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,350 @@
+#!/bin/bash
+#
+# Two node OpenNOP benchmark that runs on one host.
+#
+# Four network namespaces are joined by veth pairs and two opennopd
+# instances accelerate the traffic between a client and a server.
+#
+#   onb-client        onb-acc1                onb-acc2        onb-server
+#   10.10.1.2 --- 10.10.1.1  10.10.12.1 --- 10.10.12.2  10.10.2.1 --- 10.10.2.2
+#
+# The accelerators route between their two links. Packets are queued to
+# the daemons by an nftables NFQUEUE rule in each accelerator namespace.
+# The opennopdrv module is not used because its state is shared by every
+# namespace, so the two daemons would drive the same hook.
+#
+# Needs root, iproute2, unshare, nsenter, nft, netperf and netserver.
+#
+
+BUILD=$(cd "$(dirname "$0")/.." && pwd)
+MODE=nft
+WORKERS=0
+FETCHERS=1
+LENGTH=20
+DELAY=0
+RRSIZE=1024,16384
+FILL=
+OUTPUT=
+BASELINE=
+THRESHOLD=10
+
+usage() {
+    echo "Usage: $0 [-m nft|none] [-w workers] [-q fetchers] [-l seconds]"
+    echo "          [-d delay_ms] [-s request,response] [-f fill_file] [-b build_dir]"
+    echo "          [-o results] [-r baseline_results] [-t percent]"
+    echo
+    echo "  -m  How packets reach the daemons, none runs without accelerators."
+    echo "  -w  Workers per daemon, 0 keeps the daemon's default."
+    echo "  -q  Fetchers per daemon."
+    echo "  -l  Seconds each workload runs."
+    echo "  -d  Delay added to the link between the accelerators."
+    echo "  -s  Request and response sizes of the request/response workloads."
+    echo "  -f  File the sent data is taken from, the default compresses well."
+    echo "  -b  Tree opennopd and opennop were built in."
+    echo "  -o  Write the results to this file."
+    echo "  -r  Compare with earlier results and fail if one got worse than"
+    echo "  -t  this many percent."
+    exit 1
+}
+
+while getopts "m:w:q:l:d:s:f:b:o:r:t:h" opt; do
+    case "$opt" in
+      m) MODE=$OPTARG ;;
+      w) WORKERS=$OPTARG ;;
+      q) FETCHERS=$OPTARG ;;
+      l) LENGTH=$OPTARG ;;
+      d) DELAY=$OPTARG ;;
+      s) RRSIZE=$OPTARG ;;
+      f) FILL=$OPTARG ;;
+      b) BUILD=$OPTARG ;;
+      o) OUTPUT=$OPTARG ;;
+      r) BASELINE=$OPTARG ;;
+      t) THRESHOLD=$OPTARG ;;
+      *) usage ;;
+    esac
+done
+
+OPENNOPD=$BUILD/opennopd/opennopd
+OPENNOP=$BUILD/opennop/opennop
+NAMESPACES="onb-client onb-acc1 onb-acc2 onb-server"
+ACCELERATORS="onb-acc1 onb-acc2"
+KEEPWORK=0
+CLK_TCK=$(getconf CLK_TCK)
+
+# The daemon logs are kept when something went wrong.
+fail() {
+    echo "$*" >&2
+    KEEPWORK=1
+    exit 1
+}
+
+case "$MODE" in
+  nft|none) ;;
+  *) usage ;;
+esac
+
+[ "$(id -u)" = 0 ] || fail "$0 must run as root."
+
+for tool in ip unshare nsenter netperf netserver awk; do
+    command -v $tool > /dev/null || fail "$tool is not installed."
+done
+
+if [ "$MODE" != none ]; then
+    [ -x "$OPENNOPD" ] || fail "$OPENNOPD is not built."
+    [ -x "$OPENNOP" ] || fail "$OPENNOP is not built."
+fi
+
+if [ "$MODE" = nft ]; then
+    command -v nft > /dev/null || fail "nft is not installed."
+fi
+
+cleanup() {
+    for ns in $NAMESPACES; do
+        if [ -e /var/run/netns/$ns ]; then
+            for pid in $(ip netns pids $ns); do
+                kill $pid 2> /dev/null
+            done
+        fi
+    done
+    sleep 1
+    for ns in $NAMESPACES; do
+        [ -e /var/run/netns/$ns ] && ip netns del $ns
+    done
+    [ "$KEEPWORK" = 0 ] && rm -rf "$WORK"
+}
+
+WORK=$(mktemp -d /tmp/opennop-bench.XXXXXX)
+trap cleanup EXIT
+
+# Runs a command in a namespace.
+in_ns() {
+    local ns=$1
+    shift
+    ip netns exec $ns "$@"
+}
+
+link() {
+    local ns1=$1 dev1=$2 ip1=$3 ns2=$4 dev2=$5 ip2=$6
+
+    ip link add $dev1 netns $ns1 type veth peer name $dev2 netns $ns2
+    in_ns $ns1 ip addr add $ip1/24 dev $dev1
+    in_ns $ns2 ip addr add $ip2/24 dev $dev2
+    in_ns $ns1 ip link set $dev1 up
+    in_ns $ns2 ip link set $dev2 up
+}
+
+build_topology() {
+    for ns in $NAMESPACES; do
+        [ -e /var/run/netns/$ns ] && fail "Namespace $ns already exists."
+        ip netns add $ns
+        in_ns $ns ip link set lo up
+    done
+
+    link onb-client c-lan 10.10.1.2 onb-acc1 a1-lan 10.10.1.1
+    link onb-acc1 a1-wan 10.10.12.1 onb-acc2 a2-wan 10.10.12.2
+    link onb-acc2 a2-lan 10.10.2.1 onb-server s-lan 10.10.2.2
+
+    in_ns onb-client ip route add default via 10.10.1.1
+    in_ns onb-server ip route add default via 10.10.2.1
+    in_ns onb-acc1 ip route add 10.10.2.0/24 via 10.10.12.2
+    in_ns onb-acc2 ip route add 10.10.1.0/24 via 10.10.12.1
+
+    for ns in $ACCELERATORS; do
+        in_ns $ns sysctl -q -w net.ipv4.ip_forward=1
+    done
+
+    if [ "$DELAY" != 0 ]; then
+        in_ns onb-acc1 tc qdisc add dev a1-wan root netem delay ${DELAY}ms
+        in_ns onb-acc2 tc qdisc add dev a2-wan root netem delay ${DELAY}ms
+    fi
+}
+
+queue_rule() {
+    local ns=$1 queues=0
+
+    [ "$FETCHERS" -gt 1 ] && queues="0-$((FETCHERS - 1))"
+    in_ns $ns nft -f - <<EOF
+table ip opennop {
+    chain forward {
+        type filter hook forward priority -300; policy accept;
+        ip protocol tcp queue num $queues
+    }
+}
+EOF
+}
+
+daemon_pid() {
+    local pid
+
+    for pid in $(ip netns pids $1); do
+        if [ "$(cat /proc/$pid/comm 2> /dev/null)" = opennopd ]; then
+            echo $pid
+            return
+        fi
+    done
+}
+
+# Sends CLI commands to the daemon in a namespace.
+cli() {
+    local pid=$(daemon_pid $1)
+    shift
+    printf '%s\n' "$@" quit | timeout 10 nsenter --target $pid --mount --net "$OPENNOP"
+}
+
+# Every daemon gets its own /tmp so their CLI sockets don't collide.
+start_daemon() {
+    local ns=$1 peer=$2 pid i
+
+    in_ns $ns unshare --mount --propagation private sh -c \
+        'mount -t tmpfs tmpfs /tmp && exec "$0" -n -q "$1"' \
+        "$OPENNOPD" "$FETCHERS" > "$WORK/$ns.log" 2>&1 &
+
+    for i in $(seq 50); do
+        pid=$(daemon_pid $ns)
+        if [ -n "$pid" ] && nsenter --target $pid --mount test -S /tmp/opennop.sock; then
+            break
+        fi
+        sleep 0.2
+    done
+    [ -n "$pid" ] || fail "opennopd did not start in $ns, see $WORK/$ns.log."
+
+    [ "$WORKERS" != 0 ] && cli $ns "worker count $WORKERS" > /dev/null
+    cli $ns "neighbor $peer" > /dev/null
+}
+
+start_accelerators() {
+    case "$MODE" in
+      nft)
+        queue_rule onb-acc1
+        queue_rule onb-acc2
+        ;;
+      none)
+        return
+        ;;
+    esac
+
+    start_daemon onb-acc1 10.10.12.2
+    start_daemon onb-acc2 10.10.12.1
+}
+
+check_accelerators() {
+    local ns
+
+    [ "$MODE" = none ] && return
+    for ns in $ACCELERATORS; do
+        [ -n "$(daemon_pid $ns)" ] || fail "opennopd in $ns died, see $WORK/$ns.log."
+    done
+}
+
+# Bytes both ways on a link.
+link_bytes() {
+    local ns=$1 dev=$2
+
+    in_ns $ns cat /sys/class/net/$dev/statistics/rx_bytes /sys/class/net/$dev/statistics/tx_bytes |
+        awk '{ sum += $1 } END { printf "%d\n", sum }'
+}
+
+# CPU ticks both daemons used.
+daemon_ticks() {
+    local ns pid sum=0
+
+    [ "$MODE" = none ] && { echo 0; return; }
+    for ns in $ACCELERATORS; do
+        pid=$(daemon_pid $ns)
+        [ -n "$pid" ] && sum=$((sum + $(awk '{ print $14 + $15 }' /proc/$pid/stat)))
+    done
+    echo $sum
+}
+
+result() {
+    printf "%-24s %s\n" "$1" "$2" | tee -a "$WORK/results"
+}
+
+# Runs one netperf test and reports what the accelerators cost.
+# Request/response goodput counts the payload of every transaction.
+run_workload() {
+    local name=$1 test=$2 options=$3 selectors=$4
+    local lan0 wan0 ticks0 start lan1 wan1 ticks1 end out
+
+    lan0=$(link_bytes onb-acc1 a1-lan)
+    wan0=$(link_bytes onb-acc1 a1-wan)
+    ticks0=$(daemon_ticks)
+    start=$(date +%s.%N)
+
+    out=$(in_ns onb-client netperf -j -P 0 -H 10.10.2.2 -t $test -l $LENGTH -F "$FILL" \
+        -- $options -o $selectors) || fail "netperf $test failed."
+
+    end=$(date +%s.%N)
+    lan1=$(link_bytes onb-acc1 a1-lan)
+    wan1=$(link_bytes onb-acc1 a1-wan)
+    ticks1=$(daemon_ticks)
+    check_accelerators
+
+    echo "$out" | tail -n 1 | awk -F, -v name=$name -v test=$test -v rrsize=$RRSIZE \
+        -v lan=$((lan1 - lan0)) -v wan=$((wan1 - wan0)) -v ticks=$((ticks1 - ticks0)) \
+        -v hz=$CLK_TCK -v secs=$(awk -v s=$start -v e=$end 'BEGIN { print e - s }') '
+    {
+        if (test == "TCP_STREAM") {
+            mbps = $1;
+        } else {
+            split(rrsize, size, ",");
+            mbps = $1 * (size[1] + size[2]) * 8 / 1000000;
+            printf "%s.tps %.1f\n", name, $1;
+            printf "%s.p50_us %.1f\n", name, $2;
+            printf "%s.p90_us %.1f\n", name, $3;
+            printf "%s.p99_us %.1f\n", name, $4;
+        }
+        cores = ticks / hz / secs;
+        printf "%s.goodput_mbps %.1f\n", name, mbps;
+        printf "%s.cpu_cores %.3f\n", name, cores;
+        printf "%s.cpu_per_gbps %.3f\n", name, (mbps > 0) ? cores / (mbps / 1000) : 0;
+        printf "%s.wan_lan_ratio %.3f\n", name, (lan > 0) ? wan / lan : 0;
+    }' | while read key value; do
+        result $key $value
+    done
+}
+
+# Higher is better for throughput, lower for latency.
+compare() {
+    awk -v threshold=$THRESHOLD '
+    FNR == NR { baseline[$1] = $2; next }
+    ($1 in baseline) && (baseline[$1] > 0) {
+        change = ($2 - baseline[$1]) * 100 / baseline[$1];
+        if ($1 ~ /(goodput_mbps|tps)$/ && change < -threshold) {
+            printf "REGRESSION %s %s -> %s (%.1f%%)\n", $1, baseline[$1], $2, change; failed = 1;
+        }
+        if ($1 ~ /_us$/ && change > threshold) {
+            printf "REGRESSION %s %s -> %s (+%.1f%%)\n", $1, baseline[$1], $2, change; failed = 1;
+        }
+    }
+    END { exit failed }' "$BASELINE" "$WORK/results"
+}
+
+if [ -z "$FILL" ]; then
+    FILL=$WORK/fill
+    seq 1 1000000 | head -c 4194304 > "$FILL"
+fi
+
+build_topology
+start_accelerators
+
+in_ns onb-server netserver -D -4 -L 10.10.2.2 > "$WORK/netserver.log" 2>&1 &
+sleep 1
+
+# Lets both daemons see traffic before anything is measured.
+in_ns onb-client netperf -P 0 -H 10.10.2.2 -t TCP_STREAM -l 2 -F "$FILL" > /dev/null ||
+    fail "No path from the client to the server."
+check_accelerators
+
+echo "mode $MODE workers $WORKERS fetchers $FETCHERS length $LENGTH delay $DELAY"
+run_workload bulk TCP_STREAM "-m 65536" THROUGHPUT
+run_workload rr TCP_RR "-r $RRSIZE" THROUGHPUT,P50_LATENCY,P90_LATENCY,P99_LATENCY
+run_workload crr TCP_CRR "-r $RRSIZE" THROUGHPUT,P50_LATENCY,P90_LATENCY,P99_LATENCY
+
+[ -n "$OUTPUT" ] && cp "$WORK/results" "$OUTPUT"
+
+if [ -n "$BASELINE" ]; then
+    compare || exit 2
+fi
+
+exit 0